@@ -0,0 +1,23 @@
+/*
+ * Benchmark UDF: element-wise sum of two input datasets
+ *
+ * Equivalent implementations are provided for each backend
+ * (bench-add.lua, bench-add.py) so that their costs can be compared.
+ */
+
+extern "C" void dynamic_dataset()
+{
+    auto ds1_data = lib.getData<int>("Dataset1");
+    auto ds2_data = lib.getData<int>("Dataset2");
+    auto udf_data = lib.getData<int>("Sum");
+    auto udf_dims = lib.getDims("Sum");
+
+    size_t n = 1;
+    for (auto dim: udf_dims)
+        n *= dim;
+
+    for (size_t i=0; i<n; ++i)
+    {
+        udf_data[i] = ds1_data[i] + ds2_data[i];
+    }
+}
@@ -0,0 +1,22 @@
+--
+-- Benchmark UDF: element-wise sum of two input datasets
+--
+-- Equivalent implementations are provided for each backend
+-- (bench-add.cpp, bench-add.py) so that their costs can be compared.
+--
+
+function dynamic_dataset()
+    local ds1_data = lib.getData("Dataset1")
+    local ds2_data = lib.getData("Dataset2")
+    local udf_data = lib.getData("Sum")
+    local udf_dims = lib.getDims("Sum")
+
+    local N = 1
+    for _, dim in ipairs(udf_dims) do
+        N = N * dim
+    end
+
+    for i=0, N-1 do
+        udf_data[i] = ds1_data[i] + ds2_data[i]
+    end
+end
@@ -0,0 +1,19 @@
+#
+# Benchmark UDF: element-wise sum of two input datasets
+#
+# Equivalent implementations are provided for each backend
+# (bench-add.cpp, bench-add.lua) so that their costs can be compared.
+#
+
+def dynamic_dataset():
+    ds1_data = lib.getData("Dataset1")
+    ds2_data = lib.getData("Dataset2")
+    udf_data = lib.getData("Sum")
+    udf_dims = lib.getDims("Sum")
+
+    n = 1
+    for dim in udf_dims:
+        n *= dim
+
+    for i in range(n):
+        udf_data[i] = ds1_data[i] + ds2_data[i]
@@ -0,0 +1,103 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: bench-create.cpp
+ *
+ * Creates the HDF5 files used by the benchmarks: two int32 input datasets,
+ * "Dataset1" and "Dataset2", plus "Materialized", which holds their sum as
+ * regular data so that reading it can be compared with reading a UDF.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <hdf5.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/* Datasets are written in slabs of this many elements to bound memory usage */
+#define SLAB_ELEMENTS (16 * 1024 * 1024)
+
+static int value(const char *name, hsize_t i)
+{
+    int base = (int) (i % 1000);
+    if (std::string(name).compare("Dataset1") == 0)
+        return base;
+    else if (std::string(name).compare("Dataset2") == 0)
+        return base * 2;
+    return base * 3;
+}
+
+static bool createDataset(hid_t file_id, const char *name, hsize_t n)
+{
+    hid_t space_id = H5Screate_simple(1, &n, NULL);
+    if (space_id < 0)
+    {
+        fprintf(stderr, "Failed to create dataspace\n");
+        return false;
+    }
+    hid_t dset_id = H5Dcreate(file_id, name, H5T_STD_I32LE, space_id,
+        H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    if (dset_id < 0)
+    {
+        fprintf(stderr, "Failed to create dataset %s\n", name);
+        H5Sclose(space_id);
+        return false;
+    }
+
+    std::vector<int> data(std::min(n, (hsize_t) SLAB_ELEMENTS));
+    bool ret = true;
+    for (hsize_t start=0; ret && start<n; start+=data.size())
+    {
+        hsize_t count = std::min(n - start, (hsize_t) data.size());
+        for (hsize_t i=0; i<count; ++i)
+            data[i] = value(name, start + i);
+
+        hid_t mem_space_id = H5Screate_simple(1, &count, NULL);
+        H5Sselect_hyperslab(space_id, H5S_SELECT_SET, &start, NULL, &count, NULL);
+        if (H5Dwrite(dset_id, H5T_NATIVE_INT, mem_space_id, space_id, H5P_DEFAULT, data.data()) < 0)
+        {
+            fprintf(stderr, "Error writing data to dataset %s\n", name);
+            ret = false;
+        }
+        H5Sclose(mem_space_id);
+    }
+
+    H5Dclose(dset_id);
+    H5Sclose(space_id);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stdout, "Syntax: %s <file.h5> <number_of_elements>\n", argv[0]);
+        return 1;
+    }
+
+    std::string hdf5_file = argv[1];
+    hsize_t n = strtoull(argv[2], NULL, 10);
+    if (n == 0)
+    {
+        fprintf(stderr, "Invalid number of elements '%s'\n", argv[2]);
+        return 1;
+    }
+
+    hid_t file_id = H5Fcreate(hdf5_file.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if (file_id < 0)
+    {
+        fprintf(stderr, "Failed to create file %s\n", hdf5_file.c_str());
+        return 1;
+    }
+
+    const char *names[] = {"Dataset1", "Dataset2", "Materialized"};
+    for (auto name: names)
+        if (! createDataset(file_id, name, n))
+        {
+            H5Fclose(file_id);
+            return 1;
+        }
+
+    H5Fclose(file_id);
+    return 0;
+}
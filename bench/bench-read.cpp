@@ -0,0 +1,118 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: bench-read.cpp
+ *
+ * Measures the cold and warm latency of H5Dread() on a dataset and prints
+ * the results as a single JSON line.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <hdf5.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Drop the file from the page cache so that the first read goes to storage */
+static void evictFromPageCache(std::string hdf5_file)
+{
+    int fd = open(hdf5_file.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4)
+    {
+        fprintf(stdout, "Syntax: %s <file.h5> <dataset> <label> [warm_reads]\n", argv[0]);
+        return 1;
+    }
+
+    std::string hdf5_file = argv[1];
+    std::string hdf5_dataset = argv[2];
+    std::string label = argv[3];
+    int warm_reads = argc > 4 ? atoi(argv[4]) : 5;
+
+    evictFromPageCache(hdf5_file);
+
+    hid_t file_id = H5Fopen(hdf5_file.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (file_id < 0)
+    {
+        fprintf(stderr, "Failed to open file %s\n", hdf5_file.c_str());
+        return 1;
+    }
+
+    // Disable the chunk cache so that every read goes through the I/O filter
+    hid_t dapl_id = H5Pcreate(H5P_DATASET_ACCESS);
+    H5Pset_chunk_cache(dapl_id, 0, 0, H5D_CHUNK_CACHE_W0_DEFAULT);
+    hid_t dataset_id = H5Dopen(file_id, hdf5_dataset.c_str(), dapl_id);
+    if (dataset_id < 0)
+    {
+        fprintf(stderr, "Failed to open dataset %s\n", hdf5_dataset.c_str());
+        return 1;
+    }
+
+    hid_t space_id = H5Dget_space(dataset_id);
+    hsize_t n = H5Sget_simple_extent_npoints(space_id);
+    H5Sclose(space_id);
+
+    std::vector<int> rdata(n);
+    std::vector<double> latencies;
+    for (int i=0; i<=warm_reads; ++i)
+    {
+        double start = now();
+        if (H5Dread(dataset_id, H5T_NATIVE_INT, H5S_ALL, H5S_ALL, H5P_DEFAULT, rdata.data()) < 0)
+        {
+            fprintf(stderr, "Failed to read dataset %s\n", hdf5_dataset.c_str());
+            return 1;
+        }
+        latencies.push_back(now() - start);
+    }
+
+    // The checksum lets the caller compare the output of the different backends
+    long long checksum = 0;
+    for (auto value: rdata)
+        checksum += value;
+
+    double cold = latencies[0];
+    std::vector<double> warm(latencies.begin() + 1, latencies.end());
+    std::sort(warm.begin(), warm.end());
+    double median = warm.size() ? warm[warm.size() / 2] : cold;
+    double bytes = n * sizeof(int);
+
+    // Peak RSS of the forked UDF processes is only known once they are reaped
+    struct rusage self_usage, children_usage;
+    getrusage(RUSAGE_SELF, &self_usage);
+    getrusage(RUSAGE_CHILDREN, &children_usage);
+
+    printf("{\"label\":\"%s\",\"dataset\":\"%s\",\"bytes\":%.0f,\"cold_seconds\":%.9f,"
+        "\"warm_reads\":%zu,\"warm_min_seconds\":%.9f,\"warm_median_seconds\":%.9f,"
+        "\"warm_max_seconds\":%.9f,\"cold_mb_per_second\":%.3f,\"warm_mb_per_second\":%.3f,"
+        "\"peak_rss_kb\":%ld,\"children_peak_rss_kb\":%ld,\"checksum\":%lld}\n",
+        label.c_str(), hdf5_dataset.c_str(), bytes, cold,
+        warm.size(), warm.size() ? warm.front() : cold, median,
+        warm.size() ? warm.back() : cold, bytes / cold / 1e6, bytes / median / 1e6,
+        self_usage.ru_maxrss, children_usage.ru_maxrss, checksum);
+
+    H5Dclose(dataset_id);
+    H5Pclose(dapl_id);
+    H5Fclose(file_id);
+    return 0;
+}
@@ -0,0 +1,141 @@
+#!/bin/sh
+#
+# HDF5-UDF: User-Defined Functions for HDF5
+#
+# File: run.sh
+#
+# Runs the benchmarks: for each dataset size, reads a materialized dataset
+# and the equivalent UDF attached with each backend. One JSON line is
+# written per measurement, followed by one line per backend and codec with
+# the fixed cost and the per-byte cost of a read, fitted by least squares.
+# UDF measurements also report the time spent decoding the bytecode, which
+# happens on the first read of each process.
+#
+# Settings are taken from the environment:
+#   SIZES       dataset sizes, in bytes, with optional K/M/G suffixes
+#   BACKENDS    UDF backends to measure (cpp lua py)
+#   CODECS      codecs the UDF bytecode is stored with (none deflate lz4 zstd)
+#   WARM_READS  number of reads after the first (cold) one
+#   OUTPUT      file the results are written to
+#   WORKDIR     directory that holds the temporary HDF5 files
+#
+
+BENCHDIR=$(cd "$(dirname "$0")" && pwd)
+SRCDIR="$BENCHDIR/../src"
+SIZES=${SIZES:-"1K 64K 1M 16M 256M"}
+BACKENDS=${BACKENDS:-"cpp lua py"}
+CODECS=${CODECS:-"none deflate lz4 zstd"}
+WARM_READS=${WARM_READS:-5}
+OUTPUT=${OUTPUT:-"$BENCHDIR/results.jsonl"}
+WORKDIR=${WORKDIR:-"$BENCHDIR"}
+
+# Use the filter from this tree and make sure that repeated reads are served
+# by the UDF rather than by the memoization cache
+export HDF5_PLUGIN_PATH="$SRCDIR"
+unset HDF5_UDF_CACHE_SIZE
+
+# UDF datasets larger than HDF5's maximum chunk size are split into chunks
+# of this many elements
+MAX_CHUNK_ELEMENTS=268435456
+
+to_bytes() {
+    case "$1" in
+        *K) echo $(( ${1%K} * 1024 )) ;;
+        *M) echo $(( ${1%M} * 1024 * 1024 )) ;;
+        *G) echo $(( ${1%G} * 1024 * 1024 * 1024 )) ;;
+        *)  echo "$1" ;;
+    esac
+}
+
+error() {
+    echo "{\"label\":\"$1\",\"bytes\":$2,\"error\":\"$3\"}" | tee -a "$OUTPUT"
+}
+
+measure() {
+    if result=$(HDF5_UDF_PROFILE="$1.profile" "$BENCHDIR/bench-read" "$1" $2 $3 $WARM_READS)
+    then
+        # Add up the time taken by the filter to decode the bytecode
+        decode=$(grep -o '"phase":"decode","seconds":[0-9.e+-]*' "$1.profile" 2>/dev/null |
+            awk -F: '{ sum += $NF } END { printf "%.9f", sum }')
+        [ -f "$1.profile" ] && result="${result%\}},\"decode_seconds\":$decode}"
+        echo "$result" | tee -a "$OUTPUT"
+    else
+        error $3 $4 "failed to read dataset $2"
+    fi
+    rm -f "$1.profile"
+}
+
+: > "$OUTPUT"
+for size in $SIZES
+do
+    bytes=$(to_bytes "$size")
+    elements=$(( bytes / 4 ))
+    [ $elements -eq 0 ] && elements=1
+    bytes=$(( elements * 4 ))
+    file="$WORKDIR/bench-$size.h5"
+
+    if ! "$BENCHDIR/bench-create" "$file" $elements
+    then
+        error materialized $bytes "failed to create $file"
+        continue
+    fi
+    measure "$file" Materialized materialized $bytes
+
+    chunk=""
+    [ $elements -gt $MAX_CHUNK_ELEMENTS ] && chunk="--chunk=$MAX_CHUNK_ELEMENTS"
+
+    for backend in $BACKENDS
+    do
+        for codec in $CODECS
+        do
+            # Each backend gets a fresh copy of the input datasets. Attaching
+            # fails when the UDF bytecode does not fit in the dataset or when
+            # the backend or the codec has not been compiled in.
+            label="$backend-$codec"
+            rm -f "$file"
+            if ! "$BENCHDIR/bench-create" "$file" $elements
+            then
+                error $label $bytes "failed to create $file"
+                continue
+            fi
+            if ! "$SRCDIR/hdf5-udf" "$file" "$BENCHDIR/bench-add.$backend" $chunk --codec=$codec > "$file.log" 2>&1
+            then
+                error $label $bytes "$( (grep -m 1 -e Error -e Codec "$file.log" || tail -n 1 "$file.log") | tr -d '"\\')"
+                continue
+            fi
+            measure "$file" Sum $label $bytes
+        done
+    done
+    rm -f "$file" "$file.log"
+done
+
+# Fit latency = fixed + bytes * per_byte for the cold and the warm reads
+awk '
+function field(name,    m) {
+    if (match($0, "\"" name "\":[^,}]*") == 0)
+        return ""
+    m = substr($0, RSTART, RLENGTH)
+    sub(/^[^:]*:/, "", m)
+    gsub(/"/, "", m)
+    return m
+}
+/"error"/ { next }
+{
+    label = field("label"); x = field("bytes")
+    n[label]++; sx[label] += x; sxx[label] += x * x
+    y = field("cold_seconds"); sc[label] += y; sxc[label] += x * y
+    y = field("warm_median_seconds"); sw[label] += y; sxw[label] += x * y
+}
+END {
+    for (label in n) {
+        d = n[label] * sxx[label] - sx[label] * sx[label]
+        if (n[label] < 2 || d == 0)
+            continue
+        cb = (n[label] * sxc[label] - sx[label] * sc[label]) / d
+        wb = (n[label] * sxw[label] - sx[label] * sw[label]) / d
+        printf "{\"label\":\"%s\",\"fit\":{\"samples\":%d,\"cold_fixed_seconds\":%.9f,\"cold_seconds_per_byte\":%.6e,\"warm_fixed_seconds\":%.9f,\"warm_seconds_per_byte\":%.6e}}\n",
+            label, n[label], (sc[label] - cb * sx[label]) / n[label], cb, (sw[label] - wb * sx[label]) / n[label], wb
+    }
+}' "$OUTPUT" > "$OUTPUT.fit"
+cat "$OUTPUT.fit" | tee -a "$OUTPUT"
+rm -f "$OUTPUT.fit"
@@ -0,0 +1,27 @@
+/*
+ * Simple example: combines data from two existing datasets on a GPU
+ *
+ * To embed it in an existing HDF5 file, run:
+ * $ make files
+ * $ hdf5-udf example-add_datasets.h5 example-add_datasets.cu
+ *
+ * Note the absence of an output Dataset name in the call to
+ * hdf5-udf: the tool determines it based on the calls to
+ * lib.getData() made by this code. The resolution and
+ * data types are determined to be the same as that of the
+ * input datasets, Dataset1 and Dataset2.
+ */
+
+extern "C" __global__ void dynamic_dataset()
+{
+    auto ds1_data = lib.getData<int>("Dataset1");
+    auto ds2_data = lib.getData<int>("Dataset2");
+    auto udf_data = lib.getData<int>("VirtualDataset");
+    auto udf_dims = lib.getDims("VirtualDataset");
+
+    // Each thread computes the elements that fall on its stride
+    for (size_t i=lib.index(); i<udf_dims[0] * udf_dims[1]; i+=lib.stride())
+    {
+        udf_data[i] = ds1_data[i] + ds2_data[i];
+    }
+}
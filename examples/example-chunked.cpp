@@ -0,0 +1,27 @@
+/*
+ * Simple example: evaluates a UDF one chunk at a time
+ *
+ * To embed it in an existing HDF5 file, run:
+ * $ make files
+ * $ hdf5-udf example-chunked.h5 example-chunked.cpp Scaled:100x50:int32 --chunk=50x50
+ *
+ * Each chunk that is read triggers a call to dynamic_dataset(). Dataset1
+ * has the same rank as the virtual dataset, so only the hyperslab that
+ * matches the chunk is given to the UDF. lib.getOffset() tells where the
+ * chunk lies within the virtual dataset.
+ */
+
+extern "C" void dynamic_dataset()
+{
+    auto ds1_data = lib.getData<int>("Dataset1");
+    auto udf_data = lib.getData<int>("Scaled");
+    auto udf_dims = lib.getDims("Scaled");
+    auto udf_offset = lib.getOffset("Scaled");
+
+    for (size_t i=0; i<udf_dims[0]; ++i)
+        for (size_t j=0; j<udf_dims[1]; ++j)
+        {
+            size_t n = i * udf_dims[1] + j;
+            udf_data[n] = ds1_data[n] * 2 + (int) udf_offset[0];
+        }
+}
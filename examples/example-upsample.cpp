@@ -0,0 +1,26 @@
+/*
+ * Simple example: produces a dataset of a different shape than its input
+ *
+ * To embed it in an existing HDF5 file, run:
+ * $ make files
+ * $ hdf5-udf example-upsample.h5 example-upsample.cpp Upsampled:200x100:int32
+ *
+ * Each element of Dataset1, a 100x50 grid, is repeated over a 2x2 block
+ * of the virtual dataset. Inputs of UDFs that are neither chunked nor
+ * streamed are read in full, whatever the resolution of the virtual
+ * dataset.
+ */
+
+extern "C" void dynamic_dataset()
+{
+    auto ds1_data = lib.getData<int>("Dataset1");
+    auto ds1_dims = lib.getDims("Dataset1");
+    auto udf_data = lib.getData<int>("Upsampled");
+    auto udf_dims = lib.getDims("Upsampled");
+
+    for (size_t i=0; i<udf_dims[0]; ++i)
+        for (size_t j=0; j<udf_dims[1]; ++j)
+        {
+            udf_data[i * udf_dims[1] + j] = ds1_data[(i / 2) * ds1_dims[1] + (j / 2)];
+        }
+}
@@ -9,31 +9,100 @@
 #define __anon_mmap_h
 
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <errno.h>
 
 class AnonymousMemoryMap {
 public:
     AnonymousMemoryMap(size_t size) :
-        mm_size(size)
+        mm(MAP_FAILED),
+        mm_size(size),
+        fd(-1),
+        offset(0),
+        shift(0),
+        shared(false)
     {
     }
 
     ~AnonymousMemoryMap()
     {
-        munmap(mm, mm_size);
+        if (mm != MAP_FAILED)
+            munmap(mm, mm_size ? : 1);
+        if (fd >= 0)
+            close(fd);
     }
 
-    bool create()
+    // Create a mapping backed by a new memory file. Huge pages are only
+    // available if the system has reserved them, so the caller should be
+    // prepared to retry without them.
+    bool create(bool huge_pages=false)
     {
-        mm = mmap(NULL, mm_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
-        if (mm == (void *) -1)
+        // The mapping is backed by a memory file so that its descriptor can be
+        // handed to processes other than our own children (e.g., pool workers)
+        fd = memfd_create("hdf5-udf", MFD_CLOEXEC | (huge_pages ? MFD_HUGETLB : 0));
+        if (fd < 0)
+        {
+            if (! huge_pages)
+                fprintf(stderr, "Failed to create memory file: %s\n", strerror(errno));
+            return false;
+        }
+        if (ftruncate(fd, mm_size) < 0)
+        {
+            if (! huge_pages)
+                fprintf(stderr, "Failed to resize memory file: %s\n", strerror(errno));
+            return false;
+        }
+        mm = mmap(NULL, mm_size ? : 1, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        shared = true;
+        if (mm == MAP_FAILED && ! huge_pages)
             fprintf(stderr, "Failed to create anonymous mapping: %s\n", strerror(errno));
-        return mm != (void *) -1;
+        return mm != MAP_FAILED;
+    }
+
+    // Map the given number of bytes of an open file, starting at file_offset.
+    // The mapping is private, so writes to it never reach the file. As mappings
+    // must start at a page boundary, the data begin at mm + shift.
+    bool createFromFile(int file_fd, off_t file_offset)
+    {
+        // Keep a descriptor of our own so that we can hand it to other processes
+        fd = fcntl(file_fd, F_DUPFD_CLOEXEC, 0);
+        if (fd < 0)
+            return false;
+
+        // Accessing pages past the end of the file would raise SIGBUS
+        struct stat statbuf;
+        if (fstat(fd, &statbuf) < 0 || file_offset + (off_t) mm_size > statbuf.st_size)
+            return false;
+
+        shift = file_offset % sysconf(_SC_PAGESIZE);
+        offset = file_offset - shift;
+        mm_size += shift;
+        mm = mmap(NULL, mm_size ? : 1, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, offset);
+        return mm != MAP_FAILED;
+    }
+
+    // Copy the first size bytes of the data held by the mapping to dest. This
+    // is how the output grid reaches HDF5: the buffer handed back by the filter
+    // is released with free(), so it can't be (or be remapped over by) memory
+    // that the UDF process shares with us, and the grid has to be copied.
+    bool transfer(void *dest, size_t size)
+    {
+        // Grids that are read straight from the mapping are already in place
+        if (dest != (char *) mm + shift)
+            memcpy(dest, (char *) mm + shift, size);
+        return true;
     }
 
     void *mm;
     size_t mm_size;
+    int fd;
+    off_t offset;       // Offset of the mapping within the file
+    size_t shift;       // Offset of the data within the mapping
+    bool shared;        // Whether writes to the mapping are seen by other processes
 };
 
-#endif /* __anon_mmap_h */
\ No newline at end of file
+#endif /* __anon_mmap_h */
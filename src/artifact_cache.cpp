@@ -0,0 +1,139 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: artifact_cache.cpp
+ *
+ * On-disk cache of compiled UDFs, indexed by the contents of the files,
+ * the options and the toolchain they were built with.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include "artifact_cache.h"
+#include "hash.h"
+
+/* Identifies the format of the cache entries */
+#define ARTIFACT_CACHE_MAGIC "H5UDFAC1"
+
+ArtifactCache::ArtifactCache()
+{
+    const char *env = getenv("HDF5_UDF_ARTIFACT_CACHE");
+    if (env && strlen(env))
+    {
+        directory = env;
+        if (mkdir(directory.c_str(), 0700) < 0 && errno != EEXIST)
+        {
+            fprintf(stderr, "Failed to create artifact cache %s: %s\n",
+                directory.c_str(), strerror(errno));
+            directory.clear();
+        }
+    }
+}
+
+bool ArtifactCache::enabled()
+{
+    return directory.size() > 0;
+}
+
+std::string ArtifactCache::getKey(const std::string &backend, const std::vector<std::string> &files,
+    const std::vector<std::string> &options, const std::string &toolchain)
+{
+    // Sizes are stored along with each string so that their boundaries are unambiguous
+    std::string key;
+    auto add = [&key](const std::string &s)
+    {
+        uint64_t size = s.size();
+        key.append((const char *) &size, sizeof(size));
+        key.append(s);
+    };
+
+    add(backend);
+    add(toolchain);
+    for (auto &option: options)
+        add(option);
+    for (auto &file: files)
+    {
+        std::ifstream data(file, std::ifstream::binary);
+        if (! data.is_open())
+            return "";
+        add(std::string((std::istreambuf_iterator<char>(data)), std::istreambuf_iterator<char>()));
+    }
+    return key;
+}
+
+std::string ArtifactCache::getPath(const std::string &key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx",
+        (unsigned long long) hash64(key.data(), key.size(), HASH_SEED));
+    return directory + "/" + name;
+}
+
+bool ArtifactCache::get(const std::string &key, std::string &artifact)
+{
+    if (! enabled() || key.size() == 0)
+        return false;
+    std::ifstream data(getPath(key), std::ifstream::binary);
+    if (! data.is_open())
+        return false;
+    std::string entry((std::istreambuf_iterator<char>(data)), std::istreambuf_iterator<char>());
+
+    // Header: magic and size of the key, followed by the key and the artifact
+    uint64_t key_size;
+    size_t header_size = sizeof(ARTIFACT_CACHE_MAGIC) - 1 + sizeof(key_size);
+    if (entry.size() < header_size ||
+        entry.compare(0, sizeof(ARTIFACT_CACHE_MAGIC) - 1, ARTIFACT_CACHE_MAGIC) != 0)
+        return false;
+    memcpy(&key_size, &entry[sizeof(ARTIFACT_CACHE_MAGIC) - 1], sizeof(key_size));
+    if (key_size != key.size() || entry.size() - header_size <= key_size ||
+        entry.compare(header_size, key_size, key) != 0)
+        return false;
+    artifact = entry.substr(header_size + key_size);
+    return true;
+}
+
+bool ArtifactCache::put(const std::string &key, const std::string &artifact)
+{
+    if (! enabled() || key.size() == 0)
+        return false;
+
+    std::string path = getPath(key);
+    std::string tmp = path + ".XXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to store artifact %s in the cache: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    uint64_t key_size = key.size();
+    std::string entry = ARTIFACT_CACHE_MAGIC;
+    entry.append((const char *) &key_size, sizeof(key_size));
+    entry.append(key);
+    entry.append(artifact);
+
+    size_t written = 0;
+    while (written < entry.size())
+    {
+        ssize_t n = write(fd, &entry[written], entry.size() - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        else if (n <= 0)
+            break;
+        written += n;
+    }
+    close(fd);
+    if (written != entry.size() || rename(tmp.c_str(), path.c_str()) < 0)
+    {
+        fprintf(stderr, "Failed to store artifact %s in the cache\n", path.c_str());
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,46 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: artifact_cache.h
+ *
+ * On-disk cache of compiled UDFs, indexed by the contents of the files,
+ * the options and the toolchain they were built with.
+ */
+#ifndef __artifact_cache_h
+#define __artifact_cache_h
+
+#include <string>
+#include <vector>
+
+class ArtifactCache {
+public:
+    // Create a cache that lives in the directory given by $HDF5_UDF_ARTIFACT_CACHE
+    ArtifactCache();
+
+    // Whether a cache directory has been given
+    bool enabled();
+
+    // Identify the artifact built by the given backend out of the given files
+    // (e.g., the UDF and its template), build options and toolchain description.
+    // Keys hold all of that, not a digest of it. Returns an empty string if any
+    // of the files can't be read.
+    std::string getKey(const std::string &backend, const std::vector<std::string> &files,
+        const std::vector<std::string> &options, const std::string &toolchain);
+
+    // Retrieve a previously stored artifact. Entries whose file names collide
+    // are told apart by the full key, which is stored along with the artifact.
+    // Returns false on a cache miss.
+    bool get(const std::string &key, std::string &artifact);
+
+    // Store an artifact. Concurrent writers of the same key are safe, as
+    // entries are renamed into place once complete.
+    bool put(const std::string &key, const std::string &artifact);
+
+private:
+    // Path to the entry of the given key
+    std::string getPath(const std::string &key);
+
+    std::string directory;
+};
+
+#endif /* __artifact_cache_h */
@@ -5,9 +5,24 @@
  *
  * Interfaces with supported code parsers and generators.
  */
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <algorithm>
 #include <fstream>
+#include <sstream>
 #include "backend.h"
+#include "anon_mmap.h"
+#include "hash.h"
+#include "profiler.h"
+#ifdef ENABLE_SANDBOX
+#include "sandbox.h"
+#endif
 #ifdef ENABLE_CPP
 #include "cpp_backend.h"
 #endif
@@ -17,6 +32,9 @@
 #ifdef ENABLE_PYTHON
 #include "python_backend.h"
 #endif
+#ifdef ENABLE_CUDA
+#include "cuda_backend.h"
+#endif
 
 std::string Backend::assembleUDF(
     std::string udf_file, std::string template_file, std::string placeholder, std::string extension)
@@ -71,10 +89,12 @@ std::string Backend::writeToDisk(const char *data, size_t size, std::string exte
     char path[PATH_MAX];
     std::ofstream tmpfile;
     snprintf(path, sizeof(path)-1, "%s/hdf5-udf-XXXXXX%s", tmp, extension.c_str());
-    if (mkstemps(path, extension.size()) < 0){
+    int fd = mkstemps(path, extension.size());
+    if (fd < 0){
         fprintf(stderr, "Error creating temporary file.\n");
         return std::string("");
     }
+    close(fd);
     tmpfile.open(path);
     tmpfile.write(data, size);
     tmpfile.flush();
@@ -82,6 +102,394 @@ std::string Backend::writeToDisk(const char *data, size_t size, std::string exte
     return std::string(path);
 }
 
+std::string Backend::writeToMemory(const char *data, size_t size, int *fd)
+{
+    *fd = memfd_create("hdf5-udf", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (*fd < 0)
+    {
+        fprintf(stderr, "Failed to create memory file: %s\n", strerror(errno));
+        return std::string("");
+    }
+
+    for (size_t written = 0; written < size; )
+    {
+        ssize_t n = write(*fd, &data[written], size - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        else if (n <= 0)
+        {
+            fprintf(stderr, "Error writing to memory file: %s\n", strerror(errno));
+            close(*fd);
+            *fd = -1;
+            return std::string("");
+        }
+        written += n;
+    }
+
+    // Prevent the contents from being changed by processes that inherit the file
+    fcntl(*fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path)-1, "/proc/self/fd/%d", *fd);
+    return std::string(path);
+}
+
+std::shared_ptr<AnonymousMemoryMap> createOutputMapping(const DatasetInfo &output_dataset)
+{
+    size_t room_size = output_dataset.getGridSize() * output_dataset.getStorageSize();
+    auto mm = std::make_shared<AnonymousMemoryMap>(room_size);
+    if (! mm->create())
+        mm.reset();
+    return mm;
+}
+
+/*
+ * Number of workers that lib.parallel_for() spreads work across. This is
+ * read when the filter is loaded, as the UDF process can't query the number
+ * of CPUs once sandboxed.
+ */
+static size_t readParallelism()
+{
+    const char *env = getenv("HDF5_UDF_THREADS");
+    if (! env)
+        return 1;
+    long n = strtol(env, NULL, 10);
+    if (n <= 0)
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+/* Processes forked by forkSlices() that the calling thread has to wait for */
+static thread_local std::vector<pid_t> slice_pids;
+
+size_t getParallelism()
+{
+    // Other static objects (e.g., the filter's scheduler) may ask first
+    static size_t parallelism = readParallelism();
+    return parallelism;
+}
+
+static size_t parallelism_at_load = getParallelism();
+
+int forkSlices(size_t n, size_t *begin, size_t *end)
+{
+    size_t count = std::max((size_t) 1, std::min(getParallelism(), n));
+    slice_pids.clear();
+
+    /*
+     * Children take the first slices. The caller takes whatever is left,
+     * which is just the last slice unless fork() fails.
+     */
+    size_t slice = 0;
+    for (; slice + 1 < count; ++slice)
+    {
+        fflush(stdout);
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            *begin = slice * n / count;
+            *end = (slice + 1) * n / count;
+            return 1;
+        }
+        else if (pid < 0)
+        {
+            fprintf(stderr, "Failed to fork parallel_for worker: %s\n", strerror(errno));
+            break;
+        }
+        slice_pids.push_back(pid);
+    }
+    *begin = slice * n / count;
+    *end = n;
+    return 0;
+}
+
+bool joinSlices(int is_child, bool ok)
+{
+    if (is_child)
+    {
+        fflush(stdout);
+        fflush(stderr);
+        _exit(ok ? 0 : 1);
+    }
+
+    for (auto pid: slice_pids)
+    {
+        int status;
+        if (waitpid(pid, &status, 0) < 0 || ! WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            ok = false;
+    }
+    slice_pids.clear();
+    return ok;
+}
+
+bool Backend::run(
+    const std::string filterpath,
+    const std::vector<DatasetInfo> input_datasets,
+    const DatasetInfo output_dataset,
+    const char *output_cast_datatype,
+    const char *udf_blob,
+    size_t udf_blob_size)
+{
+    /*
+     * We want to make the output dataset writeable by the UDF. Because
+     * the UDF is run under a separate process we have to use a shared
+     * memory segment which both processes can read and write to, and
+     * copy the grid to the output buffer at the end. Callers that want
+     * to hold on to that segment may provide it.
+     */
+    size_t room_size = output_dataset.getGridSize() * output_dataset.getStorageSize();
+    auto mm = output_dataset.mapping ? output_dataset.mapping : createOutputMapping(output_dataset);
+    if (! mm)
+        return false;
+
+    /* Reusable resources are prepared here so that they outlive the child */
+    if (! preload(filterpath, udf_blob, udf_blob_size))
+        return false;
+#ifdef ENABLE_SANDBOX
+    if (! Sandbox::preload(filterpath))
+        return false;
+#endif
+
+    /*
+     * Execute the user-defined-function under a separate process so that
+     * seccomp can kill it (if needed) without crashing the entire program
+     */
+    RemoteTimings *timings = NULL;
+    if (profiler.enabled())
+    {
+        void *mm = mmap(NULL, sizeof(RemoteTimings), PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+        timings = mm == MAP_FAILED ? NULL : (RemoteTimings *) mm;
+    }
+
+    bool ret = false;
+    ProfileTimer fork_timer;
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        /* Let output_dataset.data point to the shared memory segment */
+        DatasetInfo output_dataset_copy = output_dataset;
+        output_dataset_copy.data = mm->mm;
+
+        /* Populate vector of dataset names, sizes, and types */
+        std::vector<DatasetInfo> dataset_info;
+        dataset_info.push_back(output_dataset_copy);
+        dataset_info.insert(
+            dataset_info.end(), input_datasets.begin(), input_datasets.end());
+
+        /* Prepare the sandbox if needed and run the UDF */
+        profiler.clear();
+        ProfileTimer load_timer;
+        bool ready = load(filterpath, udf_blob, udf_blob_size);
+        profiler.record("load", load_timer.elapsed(), udf_blob_size);
+#ifdef ENABLE_SANDBOX
+        ProfileTimer sandbox_timer;
+        Sandbox sandbox;
+        ready = ready && sandbox.init(filterpath, getParallelism() > 1 ? SANDBOX_PARALLEL : 0);
+        profiler.record("sandbox", sandbox_timer.elapsed());
+#endif
+        if (ready)
+        {
+            ProfileTimer execute_timer;
+            ready = execute(dataset_info);
+            profiler.record("execute", execute_timer.elapsed(), room_size);
+        }
+#ifdef ENABLE_SANDBOX
+        sandbox.profile();
+#endif
+        if (timings)
+            profiler.exportTo(timings);
+
+        /* Exit the process without invoking any callbacks registered with atexit() */
+        _exit(ready ? 0 : 1);
+    }
+    else if (pid > 0)
+    {
+        profiler.record("fork", fork_timer.elapsed());
+        int status;
+        waitpid(pid, &status, 0);
+        ret = WIFEXITED(status) ? WEXITSTATUS(status) == 0 : false;
+        if (timings)
+            profiler.importFrom(timings);
+
+        /* Update output HDF5 dataset with data from shared memory segment */
+        if (ret)
+        {
+            ProfileTimer output_timer;
+            ret = mm->transfer(output_dataset.data, room_size);
+            profiler.record("output", output_timer.elapsed(), room_size);
+        }
+    }
+    else
+        fprintf(stderr, "Failed to fork UDF process: %s\n", strerror(errno));
+    if (timings)
+        munmap(timings, sizeof(RemoteTimings));
+    return ret;
+}
+
+bool Backend::runInProcess(
+    const std::string filterpath,
+    const std::vector<DatasetInfo> &input_datasets,
+    const DatasetInfo &output_dataset,
+    const char *udf_blob,
+    size_t udf_blob_size)
+{
+    if (! supportsInProcess())
+    {
+        fprintf(stderr, "The %s backend can't run UDFs in-process\n", name().c_str());
+        return false;
+    }
+
+    ProfileTimer load_timer;
+    if (! load(filterpath, udf_blob, udf_blob_size))
+        return false;
+    profiler.record("load", load_timer.elapsed(), udf_blob_size);
+
+    size_t room_size = output_dataset.getGridSize() * output_dataset.getStorageSize();
+    auto &mm = output_dataset.mapping;
+    std::vector<DatasetInfo> dataset_info;
+    dataset_info.push_back(output_dataset);
+    if (mm)
+        dataset_info[0].data = (char *) mm->mm + mm->shift;
+    dataset_info.insert(dataset_info.end(), input_datasets.begin(), input_datasets.end());
+
+    ProfileTimer execute_timer;
+    bool ret = execute(dataset_info);
+    profiler.record("execute", execute_timer.elapsed(), room_size);
+    if (ret && mm)
+    {
+        ProfileTimer output_timer;
+        ret = mm->transfer(output_dataset.data, room_size);
+        profiler.record("output", output_timer.elapsed(), room_size);
+    }
+    return ret;
+}
+
+/* Run a command and return its standard output */
+std::string Backend::captureOutput(const std::vector<std::string> &args)
+{
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0)
+    {
+        fprintf(stderr, "Failed to create pipe\n");
+        return "";
+    }
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // Child: runs the command, outputs to pipe
+        dup2(pipefd[1], STDOUT_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        std::vector<char *> cmd;
+        for (auto &arg: args)
+            cmd.push_back((char *) arg.c_str());
+        cmd.push_back(NULL);
+        execvp(cmd[0], cmd.data());
+        _exit(1);
+    }
+    else if (pid < 0)
+    {
+        fprintf(stderr, "Failed to execute %s\n", args[0].c_str());
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return "";
+    }
+
+    // Parent: reads from pipe. Our copy of the write end is closed first so
+    // that we get EOF once the command exits, rather than losing whatever it
+    // wrote last.
+    std::string output;
+    close(pipefd[1]);
+    while (true)
+    {
+        char buf[8192];
+        ssize_t n = read(pipefd[0], buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        else if (n <= 0)
+            break;
+        output.append(buf, n);
+    }
+    close(pipefd[0]);
+
+    int exit_status;
+    if (waitpid(pid, &exit_status, 0) < 0 || ! WIFEXITED(exit_status) || WEXITSTATUS(exit_status) != 0)
+        return "";
+    return output;
+}
+
+/* Describe the headers included by a C-like source file */
+std::string Backend::describeHeaders(std::vector<std::string> args, std::string source_file)
+{
+    args.push_back(source_file);
+    auto rule = captureOutput(args);
+    if (rule.size() == 0)
+        return "";
+
+    // The preprocessor prints a Makefile rule: the target, a colon and the
+    // dependencies, with lines continued by backslashes and spaces in file
+    // names escaped by them
+    std::vector<std::string> paths;
+    std::string path;
+    bool target = true;
+    for (size_t i = 0; i <= rule.size(); ++i)
+    {
+        char c = i < rule.size() ? rule[i] : ' ';
+        if (c == '\\' && i + 1 < rule.size() && rule[i+1] != '\n')
+            path += rule[++i];
+        else if (c == '\\' || c == ' ' || c == '\n' || c == '\t')
+        {
+            if (path.size() && target && path.back() == ':')
+                target = false;
+            else if (path.size() && ! target && path.compare(source_file) != 0)
+                paths.push_back(path);
+            path.clear();
+        }
+        else
+            path += c;
+    }
+
+    std::string description;
+    for (auto &header: paths)
+    {
+        std::ifstream data(header, std::ifstream::binary);
+        std::string contents((std::istreambuf_iterator<char>(data)), std::istreambuf_iterator<char>());
+        char info[64];
+        snprintf(info, sizeof(info), " %zu %016llx\n", contents.size(),
+            (unsigned long long) hash64(contents.data(), contents.size(), HASH_SEED));
+        description += header + info;
+    }
+    return description;
+}
+
+/* Scan a C-like UDF file for references to HDF5 dataset names */
+std::vector<std::string> Backend::scanDatasetNames(std::string udf_file)
+{
+    std::vector<std::string> output;
+
+    // Invoke GCC's preprocessor to get rid of comments and identify calls to our API
+    auto input = captureOutput({"g++", "-x", "c++", "-fpreprocessed", "-dD", "-E", udf_file});
+
+    // Go through the output of the preprocessor one line at a time
+    std::string line;
+    std::istringstream iss(input);
+    while (std::getline(iss, line))
+    {
+        size_t n = line.find("lib.getData");
+        if (n != std::string::npos)
+        {
+            auto start = line.substr(n).find_first_of("\"");
+            auto end = line.substr(n+start+1).find_first_of("\"");
+            auto name = line.substr(n).substr(start+1, end);
+            output.push_back(name);
+        }
+    }
+    return output;
+}
+
 // Get a backend by their name (e.g., "LuaJIT")
 Backend *getBackendByName(std::string name)
 {
@@ -96,6 +504,10 @@ Backend *getBackendByName(std::string name)
 #ifdef ENABLE_CPP
     if (name.compare("C++") == 0)
         return static_cast<Backend *>(new CppBackend());
+#endif
+#ifdef ENABLE_CUDA
+    if (name.compare("CUDA") == 0)
+        return static_cast<Backend *>(new CudaBackend());
 #endif
     return NULL;
 }
@@ -127,6 +539,10 @@ Backend *getBackendByFileExtension(std::string name)
 #ifdef ENABLE_CPP
     if (sameString(ext, ".cpp"))
         return static_cast<Backend *>(new CppBackend());
+#endif
+#ifdef ENABLE_CUDA
+    if (sameString(ext, ".cu"))
+        return static_cast<Backend *>(new CudaBackend());
 #endif
     return NULL;
 }
@@ -11,10 +11,14 @@
 #include <stdbool.h>
 #include <vector>
 #include <string>
+#include <memory>
 #include "dataset.h"
+#include "anon_mmap.h"
 
 class Backend {
 public:
+    virtual ~Backend() {}
+
     // Backend name (e.g., "LuaJIT")
     virtual std::string name() {
         return "";
@@ -30,24 +34,91 @@ public:
         return "";
     }
 
-    // Execute a user-defined-function
+    // Have compile() build the UDF for the given instruction set architectures
+    // (e.g., "x86-64-v3") rather than for the default one. The filter picks the
+    // best variant the host supports. Returns false if that is not supported.
+    virtual bool setTargetArchitectures(const std::vector<std::string> &isas) {
+        return false;
+    }
+
+    // Execute a user-defined-function under a separate process. The default
+    // implementation forks a child that calls load() and execute() below.
     virtual bool run(
         const std::string filterpath,
         const std::vector<DatasetInfo> input_datasets,
         const DatasetInfo output_dataset,
         const char *output_cast_datatype,
         const char *udf_blob,
+        size_t udf_blob_size);
+
+    // Whether UDFs of this backend can be loaded into the calling process more
+    // than once, as required by runInProcess()
+    virtual bool supportsInProcess() {
+        return false;
+    }
+
+    // Whether run() evaluates the UDF in the calling process because none of
+    // its code runs on the CPU (e.g., kernels launched on a GPU). Such UDFs
+    // bypass the worker pool, whose processes would not share the device.
+    virtual bool runsOnDevice() {
+        return false;
+    }
+
+    // Execute a user-defined-function in the calling process, without the
+    // isolation provided by run(). Meant for UDFs signed by a trusted party
+    // only. The UDF writes straight to output_dataset.data, unless a shared
+    // memory segment is given in output_dataset.mapping (e.g., so that the
+    // processes forked by lib.parallel_for() can write to it as well).
+    virtual bool runInProcess(
+        const std::string filterpath,
+        const std::vector<DatasetInfo> &input_datasets,
+        const DatasetInfo &output_dataset,
+        const char *udf_blob,
+        size_t udf_blob_size);
+
+    // Prepare resources that load() can reuse across executions (e.g., decompress
+    // a payload). This runs in the calling process, before the process that hosts
+    // the UDF is created, and must not execute any code from the UDF.
+    virtual bool preload(
+        const std::string filterpath,
+        const char *udf_blob,
+        size_t udf_blob_size)
+    {
+        return true;
+    }
+
+    // Prepare the user-defined-function for execution (e.g., boot the interpreter
+    // and load the bytecode). This runs in the process that executes the UDF,
+    // before the sandbox is configured.
+    virtual bool load(
+        const std::string filterpath,
+        const char *udf_blob,
         size_t udf_blob_size)
     {
         return false;
     }
 
+    // Run a previously loaded user-defined-function. The first entry of the
+    // datasets vector is the output dataset. May be called more than once.
+    virtual bool execute(const std::vector<DatasetInfo> &datasets)
+    {
+        return false;
+    }
+
     // Scan the UDF file for references to HDF5 dataset names.
     // We use this to store the UDF dependencies in the JSON payload.
     virtual std::vector<std::string> udfDatasetNames(std::string udf_file) {
         return std::vector<std::string>();
     }
 
+    // Describe what compile() depends on besides the UDF, its template and the
+    // target architectures: the version of the toolchain and the headers the
+    // UDF includes. The artifact cache makes this part of its keys, and is
+    // bypassed when the description is empty.
+    virtual std::string describeToolchain(std::string udf_file, std::string template_file) {
+        return "";
+    }
+
     // Helper function: combine the UDF template file and the user-defined-function
     // file into one, saving the result to a temporary file on disk that ends on the
     // on the provided extension. The user-defined-function is injected in the template
@@ -58,11 +129,47 @@ public:
         std::string placeholder,
         std::string extension);
 
+    // Helper function: scan a C-like UDF file (C++, CUDA) for calls to lib.getData()
+    // after running it through GCC's preprocessor, which gets rid of comments.
+    std::vector<std::string> scanDatasetNames(std::string udf_file);
+
+    // Helper function: run a command and return what it writes to its standard output.
+    // Returns an empty string if the command can't be run or exits with an error.
+    std::string captureOutput(const std::vector<std::string> &args);
+
+    // Helper function: list the headers a C-like source file includes, as reported by
+    // the preprocessor command given in args (e.g., g++ -M), along with the size and a
+    // hash of the contents of each one.
+    std::string describeHeaders(std::vector<std::string> args, std::string source_file);
+
     // Helper function: save a data blob to a temporary file on disk whose name ends
     // on the given extension.
     std::string writeToDisk(const char *data, size_t size, std::string extension);
+
+    // Helper function: save a data blob to a sealed, anonymous memory file. Returns
+    // a /proc/self/fd path that can be given to dlopen() and stores the descriptor
+    // in fd. The descriptor must be kept open for as long as the path is in use.
+    std::string writeToMemory(const char *data, size_t size, int *fd);
 };
 
+// Create the shared memory segment the UDF writes the output grid to. The grid
+// starts at the beginning of the segment.
+std::shared_ptr<AnonymousMemoryMap> createOutputMapping(const DatasetInfo &output_dataset);
+
+// Number of workers that lib.parallel_for() uses, given by $HDF5_UDF_THREADS
+size_t getParallelism();
+
+// Split the range [0, n) into getParallelism() slices, forking one process
+// per slice but the last, which the caller computes itself. Returns 1 in the
+// children and 0 in the caller; begin and end receive the slice bounds. Grids
+// of the datasets are shared, so the children's writes to them are kept.
+int forkSlices(size_t n, size_t *begin, size_t *end);
+
+// Conclude the slice computed by the current process. Children exit with
+// the given status; the caller waits for them and returns false if any of
+// them (or the caller itself, as given by ok) failed.
+bool joinSlices(int is_child, bool ok);
+
 // Get a backend by their name (e.g., "LuaJIT")
 Backend *getBackendByName(std::string name);
 
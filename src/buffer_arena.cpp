@@ -0,0 +1,135 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: buffer_arena.cpp
+ *
+ * Shared memory segments that hold input and scratch grids, kept across
+ * calls to the filter so that their pages are not faulted in again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <algorithm>
+#include "buffer_arena.h"
+
+/* Segments are never smaller than this */
+#define ARENA_MIN_CLASS (64 * 1024)
+
+/* Size of the huge pages backing the segments, if enabled */
+#define ARENA_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+BufferArena::BufferArena() :
+    budget(0),
+    retained(0),
+    huge_pages(false)
+{
+    // The budget is given in bytes, optionally followed by a K/M/G suffix
+    const char *env = getenv("HDF5_UDF_ARENA_SIZE");
+    if (env)
+    {
+        char *suffix = NULL;
+        budget = strtoull(env, &suffix, 10);
+        switch (toupper(*suffix))
+        {
+            case 'G': budget <<= 10; /* fall through */
+            case 'M': budget <<= 10; /* fall through */
+            case 'K': budget <<= 10;
+        }
+    }
+    env = getenv("HDF5_UDF_HUGE_PAGES");
+    huge_pages = env && atoi(env) > 0;
+}
+
+BufferArena::~BufferArena()
+{
+    for (auto &entry: free_lists)
+        for (auto mapping: entry.second)
+            delete mapping;
+}
+
+bool BufferArena::enabled()
+{
+    return budget > 0;
+}
+
+/*
+ * Round a request up to the size of the segments it is served from. Each
+ * power of two is split into four classes, so no more than a quarter of a
+ * segment goes unused. Without an arena there is nothing to share segments
+ * with, so only the page granularity applies.
+ */
+size_t BufferArena::getSizeClass(size_t size)
+{
+    size_t granule = huge_pages ? ARENA_HUGE_PAGE_SIZE : sysconf(_SC_PAGESIZE);
+    if (enabled())
+    {
+        size = std::max(size, (size_t) ARENA_MIN_CLASS);
+        size_t step = (size_t) 1 << (63 - __builtin_clzll(size) - 2);
+        size = (size + step - 1) & ~(step - 1);
+    }
+    return (size + granule - 1) / granule * granule;
+}
+
+AnonymousMemoryMap *BufferArena::create(size_t size)
+{
+    if (huge_pages)
+    {
+        auto mapping = new AnonymousMemoryMap(size);
+        if (mapping->create(true))
+            return mapping;
+        delete mapping;
+
+        // Huge pages have not been reserved; don't bother asking again
+        fprintf(stderr, "Huge pages are not available, using regular pages\n");
+        huge_pages = false;
+    }
+
+    auto mapping = new AnonymousMemoryMap(size);
+    if (! mapping->create())
+    {
+        delete mapping;
+        return NULL;
+    }
+    return mapping;
+}
+
+std::shared_ptr<AnonymousMemoryMap> BufferArena::get(size_t size, bool zeroed)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    size_t class_size = getSizeClass(size);
+
+    AnonymousMemoryMap *mapping = NULL;
+    auto it = free_lists.find(class_size);
+    if (it != free_lists.end() && it->second.size())
+    {
+        mapping = it->second.back();
+        it->second.pop_back();
+        retained -= class_size;
+
+        // Punching the pages out of the memory file makes them read as zeros on
+        // their next access, without the cost of writing to each one of them
+        if (zeroed && fallocate(mapping->fd,
+            FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, 0, mapping->mm_size) < 0)
+            memset(mapping->mm, 0, mapping->mm_size);
+    }
+    else if ((mapping = create(class_size)) == NULL)
+        return NULL;
+
+    return std::shared_ptr<AnonymousMemoryMap>(mapping,
+        [this](AnonymousMemoryMap *mapping) { release(mapping); });
+}
+
+void BufferArena::release(AnonymousMemoryMap *mapping)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (! enabled() || retained + mapping->mm_size > budget)
+    {
+        delete mapping;
+        return;
+    }
+    free_lists[mapping->mm_size].push_back(mapping);
+    retained += mapping->mm_size;
+}
@@ -0,0 +1,49 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: buffer_arena.h
+ *
+ * Shared memory segments that hold input and scratch grids, kept across
+ * calls to the filter so that their pages are not faulted in again.
+ */
+#ifndef __buffer_arena_h
+#define __buffer_arena_h
+
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <vector>
+#include "anon_mmap.h"
+
+class BufferArena {
+public:
+    // Create an arena that retains up to $HDF5_UDF_ARENA_SIZE bytes of released
+    // segments. Segments are backed by huge pages if $HDF5_UDF_HUGE_PAGES is set.
+    BufferArena();
+
+    ~BufferArena();
+
+    // Whether released segments are kept for reuse
+    bool enabled();
+
+    // Hand out a segment of at least the given size. Segments are zero-filled
+    // if requested; others may still hold the contents of a previous grid.
+    // The segment returns to the arena once the last reference is dropped.
+    std::shared_ptr<AnonymousMemoryMap> get(size_t size, bool zeroed);
+
+private:
+    void release(AnonymousMemoryMap *mapping);
+
+    AnonymousMemoryMap *create(size_t size);
+
+    size_t getSizeClass(size_t size);
+
+    std::map<size_t, std::vector<AnonymousMemoryMap *>> free_lists;
+    std::mutex lock;
+    size_t budget;          /* Upper limit of bytes held by released segments */
+    size_t retained;        /* Bytes held by released segments */
+    bool huge_pages;
+};
+
+#endif /* __buffer_arena_h */
@@ -0,0 +1,222 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: codec.cpp
+ *
+ * Codecs applied to the bytecode stored in the payload of virtual datasets.
+ * Deflate (through miniz) is always available; LZ4 and Zstandard, which
+ * decode considerably faster, are built in when their libraries are found.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <vector>
+#include <new>
+#include "codec.h"
+#include "miniz.h"
+#ifdef ENABLE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef ENABLE_ZSTD
+#include <zstd.h>
+#endif
+
+static const std::vector<std::string> codec_names = {"none", "deflate", "lz4", "zstd"};
+
+/*
+ * Upper limit of the size of decoded buffers. The size is read from the
+ * payload header, which may be corrupted, so it is checked before anything
+ * is allocated. Bytecode (even a C++ shared library) is far smaller.
+ */
+#define MAX_DECODED_SIZE (1024UL * 1024 * 1024)
+
+/* Largest ratio between decoded and encoded sizes that deflate and LZ4 can reach */
+#define DEFLATE_MAX_RATIO 1032
+#define LZ4_MAX_RATIO 255
+
+int getCodecByName(const std::string &name)
+{
+    for (size_t i=0; i<codec_names.size(); ++i)
+        if (name.compare(codec_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+const char *getCodecName(int codec)
+{
+    if (codec < 0 || codec >= (int) codec_names.size())
+        return "unknown";
+    return codec_names[codec].c_str();
+}
+
+bool codecAvailable(int codec)
+{
+    switch (codec)
+    {
+        case CODEC_NONE:
+        case CODEC_DEFLATE:
+            return true;
+#ifdef ENABLE_LZ4
+        case CODEC_LZ4:
+            return true;
+#endif
+#ifdef ENABLE_ZSTD
+        case CODEC_ZSTD:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+bool encodeBuffer(int codec, int level, const char *data, size_t size, std::string &out)
+{
+    if (codec == CODEC_NONE)
+    {
+        out.assign(data, size);
+        return true;
+    }
+    else if (codec == CODEC_DEFLATE)
+    {
+        mz_ulong csize = mz_compressBound(size);
+        out.resize(csize);
+        int status = mz_compress2((uint8_t *) &out[0], &csize, (const uint8_t *) data, size,
+            level == CODEC_DEFAULT_LEVEL ? MZ_DEFAULT_LEVEL : level);
+        if (status != MZ_OK)
+        {
+            fprintf(stderr, "Failed to compress buffer with deflate: %d\n", status);
+            return false;
+        }
+        out.resize(csize);
+        return true;
+    }
+#ifdef ENABLE_LZ4
+    else if (codec == CODEC_LZ4)
+    {
+        /*
+         * The high-compression variant decodes just as fast, so it's used unless
+         * a level of 0 is given. Bytecode is only encoded once, when attached.
+         */
+        out.resize(LZ4_compressBound(size));
+        int csize = level != 0 ?
+            LZ4_compress_HC(data, &out[0], size, out.size(),
+                level == CODEC_DEFAULT_LEVEL ? LZ4HC_CLEVEL_DEFAULT : level) :
+            LZ4_compress_default(data, &out[0], size, out.size());
+        if (csize <= 0)
+        {
+            fprintf(stderr, "Failed to compress buffer with lz4\n");
+            return false;
+        }
+        out.resize(csize);
+        return true;
+    }
+#endif
+#ifdef ENABLE_ZSTD
+    else if (codec == CODEC_ZSTD)
+    {
+        out.resize(ZSTD_compressBound(size));
+        size_t csize = ZSTD_compress(&out[0], out.size(), data, size,
+            level == CODEC_DEFAULT_LEVEL ? ZSTD_CLEVEL_DEFAULT : level);
+        if (ZSTD_isError(csize))
+        {
+            fprintf(stderr, "Failed to compress buffer with zstd: %s\n", ZSTD_getErrorName(csize));
+            return false;
+        }
+        out.resize(csize);
+        return true;
+    }
+#endif
+    fprintf(stderr, "Codec %s is not available\n", getCodecName(codec));
+    return false;
+}
+
+/* Tell whether the encoded and decoded sizes given by a payload are plausible */
+static bool validDecodedSize(int codec, const char *data, size_t size, size_t decoded_size)
+{
+    if (decoded_size > MAX_DECODED_SIZE)
+        return false;
+    else if (codec == CODEC_NONE)
+        return decoded_size == size;
+    else if (codec == CODEC_DEFLATE)
+        return decoded_size / DEFLATE_MAX_RATIO <= size;
+#ifdef ENABLE_LZ4
+    else if (codec == CODEC_LZ4)
+        return decoded_size / LZ4_MAX_RATIO <= size && size <= INT_MAX && decoded_size <= INT_MAX;
+#endif
+#ifdef ENABLE_ZSTD
+    else if (codec == CODEC_ZSTD)
+    {
+        /* Frames written by encodeBuffer() record their decoded size */
+        unsigned long long content_size = ZSTD_getFrameContentSize(data, size);
+        return content_size == ZSTD_CONTENTSIZE_UNKNOWN || content_size == decoded_size;
+    }
+#endif
+    return false;
+}
+
+bool decodeBuffer(int codec, const char *data, size_t size, size_t decoded_size, std::string &out)
+{
+    if (! codecAvailable(codec))
+    {
+        fprintf(stderr, "Codec %s is not available\n", getCodecName(codec));
+        return false;
+    }
+    if (! validDecodedSize(codec, data, size, decoded_size))
+    {
+        fprintf(stderr, "Invalid decoded size of %zu bytes for %zu bytes of %s data\n",
+            decoded_size, size, getCodecName(codec));
+        return false;
+    }
+    try
+    {
+        out.resize(decoded_size);
+    }
+    catch (const std::bad_alloc &)
+    {
+        fprintf(stderr, "Not enough memory to decode %zu bytes of %s data\n",
+            decoded_size, getCodecName(codec));
+        return false;
+    }
+    if (codec == CODEC_NONE)
+    {
+        memcpy(&out[0], data, size);
+        return true;
+    }
+    else if (codec == CODEC_DEFLATE)
+    {
+        mz_ulong usize = decoded_size;
+        int status = mz_uncompress((uint8_t *) &out[0], &usize, (const uint8_t *) data, size);
+        if (status != MZ_OK || usize != decoded_size)
+        {
+            fprintf(stderr, "Failed to decompress buffer with deflate: %d\n", status);
+            return false;
+        }
+        return true;
+    }
+#ifdef ENABLE_LZ4
+    else if (codec == CODEC_LZ4)
+    {
+        int usize = LZ4_decompress_safe(data, &out[0], size, decoded_size);
+        if (usize < 0 || (size_t) usize != decoded_size)
+        {
+            fprintf(stderr, "Failed to decompress buffer with lz4\n");
+            return false;
+        }
+        return true;
+    }
+#endif
+#ifdef ENABLE_ZSTD
+    else if (codec == CODEC_ZSTD)
+    {
+        size_t usize = ZSTD_decompress(&out[0], decoded_size, data, size);
+        if (ZSTD_isError(usize) || usize != decoded_size)
+        {
+            fprintf(stderr, "Failed to decompress buffer with zstd\n");
+            return false;
+        }
+        return true;
+    }
+#endif
+    return false;
+}
@@ -0,0 +1,47 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: codec.h
+ *
+ * Codecs applied to the bytecode stored in the payload of virtual datasets.
+ */
+#ifndef __codec_h
+#define __codec_h
+
+#include <stdint.h>
+#include <string>
+
+/* Codec identifiers, as stored in the payload header */
+#define CODEC_NONE    0
+#define CODEC_DEFLATE 1
+#define CODEC_LZ4     2
+#define CODEC_ZSTD    3
+
+/* Codec applied when none is given: LZ4, which decodes fastest, if it's built in */
+#ifdef ENABLE_LZ4
+#define CODEC_DEFAULT CODEC_LZ4
+#else
+#define CODEC_DEFAULT CODEC_DEFLATE
+#endif
+
+/* Level picked by each codec when none is given */
+#define CODEC_DEFAULT_LEVEL -1
+
+// Look a codec up by its name. Returns -1 if the name is unknown.
+int getCodecByName(const std::string &name);
+
+// Name of the given codec
+const char *getCodecName(int codec);
+
+// Whether the given codec has been compiled in
+bool codecAvailable(int codec);
+
+// Encode a buffer with the given codec. Returns false on failure.
+bool encodeBuffer(int codec, int level, const char *data, size_t size, std::string &out);
+
+// Decode a buffer with the given codec, given the size of the decoded data.
+// That size comes from the payload, so implausible ones are rejected before
+// anything is allocated. Returns false on failure.
+bool decodeBuffer(int codec, const char *data, size_t size, size_t decoded_size, std::string &out);
+
+#endif /* __codec_h */
@@ -7,6 +7,7 @@
  */
 #include <stdio.h>
 #include <dlfcn.h>
+#include <elf.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/resource.h>
@@ -22,15 +23,183 @@
 #include <sstream>
 #include <string>
 #include <algorithm>
-#include "sharedlib_manager.h"
+#include <mutex>
 #include "cpp_backend.h"
-#include "anon_mmap.h"
 #include "dataset.h"
+#include "hash.h"
+#include "profiler.h"
 #include "miniz.h"
-#ifdef ENABLE_SANDBOX
-#include "sandbox.h"
+
+/* Upper limit of shared libraries kept in memory by each process */
+#define MAX_CACHED_LIBRARIES 32
+
+/*
+ * Shared libraries decompressed by this process. They live in memory files
+ * that are inherited by the processes that dlopen() them, so consecutive
+ * reads of a dataset skip decompression and the filesystem altogether.
+ */
+struct CachedLibrary {
+    uint64_t hash;          /* Hash of the compressed payload */
+    std::string payload;    /* Copy of the compressed payload, to rule out hash collisions */
+    std::string path;       /* Path to the memory file, as given to dlopen() */
+    int fd = -1;            /* Descriptor of the memory file */
+    std::mutex lock;        /* Held by in-process runs, which share the globals of the library */
+
+    bool matches(const char *data, size_t size) const {
+        return payload.size() == size && memcmp(payload.data(), data, size) == 0;
+    }
+
+    /* Backends that use the library keep it open after it's evicted */
+    ~CachedLibrary() {
+        if (fd >= 0)
+            close(fd);
+    }
+};
+static std::vector<std::shared_ptr<CachedLibrary>> library_cache;
+
+/* Guards the cache, as UDFs may be prepared by several threads at once */
+static std::mutex library_cache_lock;
+
+static std::shared_ptr<CachedLibrary> findLibrary(const char *data, size_t size)
+{
+    std::lock_guard<std::mutex> guard(library_cache_lock);
+    uint64_t hash = hash64(data, size);
+    for (auto &entry: library_cache)
+        if (entry->hash == hash && entry->matches(data, size))
+            return entry;
+    return NULL;
+}
+
+/*
+ * Payloads built for several instruction set architectures start with this
+ * magic, followed by the number of variants, a table that describes them and
+ * the variants themselves, each a regular payload. Regular payloads start
+ * with an ELF header (or, when written by older versions, a zlib header), so
+ * the two formats can't be mistaken.
+ */
+#define MULTI_ISA_MAGIC "H5UDFISA"
+#define MULTI_ISA_NAME_LEN 16
+
+struct IsaVariant {
+    char isa[MULTI_ISA_NAME_LEN];
+    uint64_t size;
+};
+
+/* Architectures we know how to build for and to detect on the host */
+struct IsaInfo {
+    const char *name;       /* Argument given to -march */
+    const char *family;     /* Architecture the variant runs on */
+    const char *compiler;   /* Compiler used when cross-compiling */
+    int level;              /* Variants with higher levels are preferred */
+};
+
+static const std::vector<IsaInfo> known_isas = {
+    {"x86-64",    "x86_64",  "x86_64-linux-gnu-g++",  1},
+    {"x86-64-v2", "x86_64",  "x86_64-linux-gnu-g++",  2},
+    {"x86-64-v3", "x86_64",  "x86_64-linux-gnu-g++",  3},
+    {"x86-64-v4", "x86_64",  "x86_64-linux-gnu-g++",  4},
+    {"armv8-a",   "aarch64", "aarch64-linux-gnu-g++", 1},
+};
+
+#if defined(__x86_64__)
+# define HOST_ISA_FAMILY "x86_64"
+#elif defined(__aarch64__)
+# define HOST_ISA_FAMILY "aarch64"
+#else
+# define HOST_ISA_FAMILY ""
 #endif
 
+static const IsaInfo *findIsa(std::string name)
+{
+    for (auto &info: known_isas)
+        if (name.compare(info.name) == 0)
+            return &info;
+    return NULL;
+}
+
+/* Whether code built for the given architecture can run on this host */
+static bool hostSupports(const IsaInfo *info)
+{
+    if (strcmp(info->family, HOST_ISA_FAMILY) != 0)
+        return false;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (info->level >= 2 && ! (
+        __builtin_cpu_supports("sse3") && __builtin_cpu_supports("ssse3") &&
+        __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("sse4.2") &&
+        __builtin_cpu_supports("popcnt")))
+        return false;
+    if (info->level >= 3 && ! (
+        __builtin_cpu_supports("avx") && __builtin_cpu_supports("avx2") &&
+        __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2") &&
+        __builtin_cpu_supports("fma")))
+        return false;
+    if (info->level >= 4 && ! (
+        __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512cd") && __builtin_cpu_supports("avx512dq") &&
+        __builtin_cpu_supports("avx512vl")))
+        return false;
+#endif
+    return true;
+}
+
+/*
+ * Pick the variant of a payload that best suits this host. Payloads with a
+ * single variant are returned as they are.
+ */
+static bool selectVariant(const char *data, size_t size, const char **variant, size_t *variant_size)
+{
+    size_t magic_len = strlen(MULTI_ISA_MAGIC);
+    if (size < magic_len + sizeof(uint32_t) || memcmp(data, MULTI_ISA_MAGIC, magic_len) != 0)
+    {
+        *variant = data;
+        *variant_size = size;
+        return true;
+    }
+
+    uint32_t count;
+    memcpy(&count, &data[magic_len], sizeof(count));
+    size_t table_offset = magic_len + sizeof(count);
+    size_t offset = table_offset + count * sizeof(IsaVariant);
+    if (offset > size)
+    {
+        fprintf(stderr, "Malformed multi-architecture payload\n");
+        return false;
+    }
+
+    std::string available;
+    const IsaInfo *best = NULL;
+    for (uint32_t i=0; i<count; ++i)
+    {
+        IsaVariant entry;
+        memcpy(&entry, &data[table_offset + i * sizeof(IsaVariant)], sizeof(entry));
+        entry.isa[MULTI_ISA_NAME_LEN-1] = '\0';
+        if (entry.size > size - offset)
+        {
+            fprintf(stderr, "Malformed multi-architecture payload\n");
+            return false;
+        }
+
+        auto info = findIsa(entry.isa);
+        if (info && hostSupports(info) && (! best || info->level > best->level))
+        {
+            best = info;
+            *variant = &data[offset];
+            *variant_size = entry.size;
+        }
+        available += std::string(available.size() ? ", " : "") + entry.isa;
+        offset += entry.size;
+    }
+
+    if (! best)
+    {
+        fprintf(stderr, "This CPU supports none of the architectures the UDF was built for (%s)\n",
+            available.c_str());
+        return false;
+    }
+    return true;
+}
+
 /* This backend's name */
 std::string CppBackend::name()
 {
@@ -43,36 +212,25 @@ std::string CppBackend::extension()
     return ".cpp";
 }
 
-/* Compile C to a shared object using GCC. Returns the shared object as a string. */
-std::string CppBackend::compile(std::string udf_file, std::string template_file)
+/* Run the compiler on the assembled UDF file. Returns the shared object as a string. */
+static std::string buildSharedLib(std::string compiler, std::vector<std::string> flags,
+    std::string cpp_file, std::string output)
 {
-    std::string placeholder = "// user_callback_placeholder";
-    auto cpp_file = Backend::assembleUDF(udf_file, template_file, placeholder, this->extension());
-    if (cpp_file.size() == 0)
-    {
-        fprintf(stderr, "Will not be able to compile the UDF code\n");
-        return "";
-    }
+    // -fopenmp-simd lets the kernels of the template vectorize even at -Os
+    std::vector<std::string> args = {compiler, "-rdynamic", "-shared", "-fPIC", "-flto", "-pthread", "-fopenmp-simd"};
+    args.insert(args.end(), flags.begin(), flags.end());
+    args.insert(args.end(), {"-C", "-o", output, cpp_file});
 
-    std::string output = udf_file + ".so";
     pid_t pid = fork();
     if (pid == 0)
     {
         // Child process
-        char *cmd[] = {
-            (char *) "g++",
-            (char *) "-rdynamic",
-            (char *) "-shared",
-            (char *) "-fPIC",
-            (char *) "-flto",
-            (char *) "-Os",
-            (char *) "-C",
-            (char *) "-o",
-            (char *) output.c_str(),
-            (char *) cpp_file.c_str(),
-            NULL
-        };
-        execvp(cmd[0], cmd);
+        std::vector<char *> cmd;
+        for (auto &arg: args)
+            cmd.push_back((char *) arg.c_str());
+        cmd.push_back(NULL);
+        execvp(cmd[0], cmd.data());
+        _exit(1);
     }
     else if (pid > 0)
     {
@@ -89,36 +247,121 @@ std::string CppBackend::compile(std::string udf_file, std::string template_file)
             bytecode.assign(buffer.begin(), buffer.end());
             unlink(output.c_str());
         }
-        unlink(cpp_file.c_str());
-
-        // Compress the data
-        return compressBuffer(bytecode.data(), bytecode.size());
+        return bytecode;
     }
-    fprintf(stderr, "Failed to execute g++\n");
+    fprintf(stderr, "Failed to execute %s\n", compiler.c_str());
     return "";
 }
 
-/* Compress the shared library object and return the result as a string */
-std::string CppBackend::compressBuffer(const char *data, size_t usize)
+/* Compile C to a shared object using GCC. Returns the shared object as a string. */
+std::string CppBackend::compile(std::string udf_file, std::string template_file)
 {
-    uint64_t csize = mz_compressBound(usize);
-    std::string compressed;
-    compressed.resize(csize);
+    std::string placeholder = "// user_callback_placeholder";
+    auto cpp_file = Backend::assembleUDF(udf_file, template_file, placeholder, this->extension());
+    if (cpp_file.size() == 0)
+    {
+        fprintf(stderr, "Will not be able to compile the UDF code\n");
+        return "";
+    }
 
-    auto status = mz_compress(
-        (uint8_t *) compressed.data(), &csize,
-        (const uint8_t *) data, usize);
-    if (status != Z_OK)
+    // The output is named after the assembled file, which is unique, so that
+    // the same UDF can be built by several processes or threads at once
+    std::string output = cpp_file + ".so";
+    if (target_isas.size() == 0)
+    {
+        auto bytecode = buildSharedLib("g++", {"-Os"}, cpp_file, output);
+        unlink(cpp_file.c_str());
+
+        // The payload codec takes care of compressing the shared library
+        return bytecode;
+    }
+
+    // Build one optimized variant per architecture and pack them together
+    std::vector<IsaVariant> table;
+    std::string variants;
+    for (auto &isa: target_isas)
     {
-        fprintf(stderr, "Failed to compress input buffer\n");
+        auto info = findIsa(isa);
+        auto compiler = strcmp(info->family, HOST_ISA_FAMILY) == 0 ? "g++" : info->compiler;
+        auto bytecode = buildSharedLib(compiler, {"-O3", "-march=" + isa}, cpp_file, output);
+        if (bytecode.size() == 0)
+        {
+            fprintf(stderr, "Failed to build the UDF for %s\n", isa.c_str());
+            unlink(cpp_file.c_str());
+            return "";
+        }
+        printf("Built variant for %s: %zu bytes\n", isa.c_str(), bytecode.size());
+
+        IsaVariant entry;
+        memset(&entry, 0, sizeof(entry));
+        snprintf(entry.isa, sizeof(entry.isa), "%s", isa.c_str());
+        entry.size = bytecode.size();
+        table.push_back(entry);
+        variants += bytecode;
+    }
+    unlink(cpp_file.c_str());
+
+    uint32_t count = table.size();
+    std::string payload = MULTI_ISA_MAGIC;
+    payload.append((const char *) &count, sizeof(count));
+    payload.append((const char *) table.data(), table.size() * sizeof(IsaVariant));
+    return payload + variants;
+}
+
+/* Describe the compilers compile() runs and the headers they read */
+std::string CppBackend::describeToolchain(std::string udf_file, std::string template_file)
+{
+    std::vector<std::string> compilers;
+    for (auto &isa: target_isas)
+    {
+        auto info = findIsa(isa);
+        std::string compiler = strcmp(info->family, HOST_ISA_FAMILY) == 0 ? "g++" : info->compiler;
+        if (std::find(compilers.begin(), compilers.end(), compiler) == compilers.end())
+            compilers.push_back(compiler);
+    }
+    if (compilers.size() == 0)
+        compilers.push_back("g++");
+
+    std::string placeholder = "// user_callback_placeholder";
+    auto cpp_file = Backend::assembleUDF(udf_file, template_file, placeholder, this->extension());
+    if (cpp_file.size() == 0)
         return "";
+
+    // Cross-compilers come with headers of their own
+    std::string description;
+    for (auto &compiler: compilers)
+    {
+        auto version = captureOutput({compiler, "--version"});
+        auto headers = describeHeaders({compiler, "-M", "-MG", "-pthread", "-fopenmp-simd"}, cpp_file);
+        if (version.size() == 0 || headers.size() == 0)
+        {
+            unlink(cpp_file.c_str());
+            return "";
+        }
+        description += version + headers;
     }
-    memcpy(&compressed[csize], &usize, sizeof(uint64_t));
-    compressed.resize(csize + sizeof(uint64_t));
-    return compressed;
+    unlink(cpp_file.c_str());
+    return description;
 }
 
-/* Decompress the shared library object and return the result as a string */
+/* Restrict compilation to the given architectures. Returns false if any is unknown. */
+bool CppBackend::setTargetArchitectures(const std::vector<std::string> &isas)
+{
+    for (auto &isa: isas)
+        if (findIsa(isa) == NULL)
+        {
+            std::string supported;
+            for (auto &info: known_isas)
+                supported += std::string(supported.size() ? ", " : "") + info.name;
+            fprintf(stderr, "Unsupported architecture '%s' (supported: %s)\n",
+                isa.c_str(), supported.c_str());
+            return false;
+        }
+    target_isas = isas;
+    return true;
+}
+
+/* Decompress a shared library object stored by older versions and return the result as a string */
 std::string CppBackend::decompressBuffer(const char *data, size_t csize)
 {
     /* Get original file size */
@@ -140,182 +383,144 @@ std::string CppBackend::decompressBuffer(const char *data, size_t csize)
     return uncompressed;
 }
 
-/* Execute the user-defined-function embedded in the given buffer */
-bool CppBackend::run(
+/* Decompress the shared library embedded in the given buffer into a memory file */
+bool CppBackend::preload(
     const std::string filterpath,
-    const std::vector<DatasetInfo> input_datasets,
-    const DatasetInfo output_dataset,
-    const char *output_cast_datatype,
     const char *sharedlib_data,
     size_t sharedlib_data_size)
 {
-    /* Decompress the shared library */
-    std::string decompressed_shlib = decompressBuffer(sharedlib_data, sharedlib_data_size);
-    if (decompressed_shlib.size() == 0)
-    {
-        fprintf(stderr, "Will not be able to load the UDF function\n");
-        return false;
-    }
-
     /*
-     * Unfortunately we have to make a trip to disk so we can dlopen()
-     * and dlsym() the function we are looking for in a portable way.
+     * The library found by an earlier call is checked without taking the lock,
+     * as this is what load() runs into in the process forked to host the UDF
      */
-    auto ext = this->extension();
-    auto so_file = Backend::writeToDisk(decompressed_shlib.data(), decompressed_shlib.size(), ext);
-    if (so_file.size() == 0)
-    {
-        fprintf(stderr, "Will not be able to load the UDF function\n");
-        return false;
-    }
-    chmod(so_file.c_str(), 0755);
+    if (library && library->matches(sharedlib_data, sharedlib_data_size))
+        return true;
+    if ((library = findLibrary(sharedlib_data, sharedlib_data_size)))
+        return true;
 
-    /*
-     * We want to make the output dataset writeable by the UDF. Because
-     * the UDF is run under a separate process we have to use a shared
-     * memory segment which both processes can read and write to.
-     */
-    size_t room_size = output_dataset.getGridSize() * output_dataset.getStorageSize();
-    AnonymousMemoryMap mm(room_size);
-    if (! mm.create())
-    {
-        unlink(so_file.c_str());
+    ProfileTimer timer;
+    const char *variant = NULL;
+    size_t variant_size = 0;
+    if (! selectVariant(sharedlib_data, sharedlib_data_size, &variant, &variant_size))
         return false;
-    }
 
     /*
-     * Execute the user-defined-function under a separate process so that
-     * seccomp can kill it (if needed) without crashing the entire program
+     * Shared libraries are stored as-is, as the payload codec has already
+     * decoded them. Payloads written by older versions compressed them here.
      */
-    pid_t pid = fork();
-    if (pid == 0)
+    std::string decompressed_shlib;
+    if (variant_size >= strlen(ELFMAG) && memcmp(variant, ELFMAG, strlen(ELFMAG)) == 0)
+        decompressed_shlib.assign(variant, variant_size);
+    else
     {
-        SharedLibraryManager shlib;
-        if (shlib.open(so_file) == false)
+        decompressed_shlib = decompressBuffer(variant, variant_size);
+        if (decompressed_shlib.size() == 0)
+        {
+            fprintf(stderr, "Will not be able to load the UDF function\n");
             return false;
+        }
+        profiler.record("decompress", timer.elapsed(), decompressed_shlib.size());
+    }
 
-        /* Get references to the UDF and the APIs defined in our C++ template file */
-        void (*udf)(void) = (void (*)()) shlib.loadsym("dynamic_dataset");
-        auto hdf5_udf_data =
-            static_cast<std::vector<void *>*>(shlib.loadsym("hdf5_udf_data"));
-        auto hdf5_udf_names =
-            static_cast<std::vector<const char *>*>(shlib.loadsym("hdf5_udf_names"));
-        auto hdf5_udf_types =
-            static_cast<std::vector<const char *>*>(shlib.loadsym("hdf5_udf_types"));
-        auto hdf5_udf_dims =
-            static_cast<std::vector<std::vector<hsize_t>>*>(shlib.loadsym("hdf5_udf_dims"));
-        if (! udf || ! hdf5_udf_data || ! hdf5_udf_names || ! hdf5_udf_types || ! hdf5_udf_dims)
-            return false;
+    /* dlopen() accepts the /proc path of the memory file, so no trip to disk is needed */
+    auto entry = std::make_shared<CachedLibrary>();
+    entry->path = Backend::writeToMemory(decompressed_shlib.data(), decompressed_shlib.size(), &entry->fd);
+    if (entry->path.size() == 0)
+    {
+        fprintf(stderr, "Will not be able to load the UDF function\n");
+        return false;
+    }
+    entry->hash = hash64(sharedlib_data, sharedlib_data_size);
+    entry->payload.assign(sharedlib_data, sharedlib_data_size);
 
-        /* Let output_dataset.data point to the shared memory segment */
-        DatasetInfo output_dataset_copy = output_dataset;
-        output_dataset_copy.data = mm.mm;
+    std::lock_guard<std::mutex> guard(library_cache_lock);
+    if (library_cache.size() >= MAX_CACHED_LIBRARIES)
+        library_cache.erase(library_cache.begin());
+    library_cache.push_back(entry);
+    library = entry;
+    return true;
+}
 
-        /* Populate vector of dataset names, sizes, and types */
-        std::vector<DatasetInfo> dataset_info;
-        dataset_info.push_back(output_dataset_copy);
-        dataset_info.insert(
-            dataset_info.end(), input_datasets.begin(), input_datasets.end());
+/* Load the user-defined-function embedded in the given buffer */
+bool CppBackend::load(
+    const std::string filterpath,
+    const char *sharedlib_data,
+    size_t sharedlib_data_size)
+{
+    /* This is a no-op if the caller has already decompressed the library */
+    if (! preload(filterpath, sharedlib_data, sharedlib_data_size))
+        return false;
 
-        for (size_t i=0; i<dataset_info.size(); ++i)
-        {
-            hdf5_udf_data->push_back(dataset_info[i].data);
-            hdf5_udf_names->push_back(dataset_info[i].name.c_str());
-            hdf5_udf_types->push_back(dataset_info[i].getDatatype());
-            hdf5_udf_dims->push_back(dataset_info[i].dimensions);
-        }
+    if (shlib.open(library->path) == false)
+        return false;
 
-        /* Prepare the sandbox if needed and run the UDF */
-        bool ready = true;
-#ifdef ENABLE_SANDBOX
-        Sandbox sandbox;
-        ready = sandbox.init(filterpath);
-#endif
-        if (ready)
-            udf();
+    /* Get references to the UDF and the APIs defined in our C++ template file */
+    udf = (void (*)()) shlib.loadsym("dynamic_dataset");
+    hdf5_udf_data =
+        static_cast<std::vector<void *>*>(shlib.loadsym("hdf5_udf_data"));
+    hdf5_udf_names =
+        static_cast<std::vector<const char *>*>(shlib.loadsym("hdf5_udf_names"));
+    hdf5_udf_types =
+        static_cast<std::vector<const char *>*>(shlib.loadsym("hdf5_udf_types"));
+    hdf5_udf_dims =
+        static_cast<std::vector<std::vector<hsize_t>>*>(shlib.loadsym("hdf5_udf_dims"));
+    if (! udf || ! hdf5_udf_data || ! hdf5_udf_names || ! hdf5_udf_types || ! hdf5_udf_dims)
+        return false;
 
-        /* Exit the process without invoking any callbacks registered with atexit() */
-        _exit(ready ? 0 : 1);
-    }
-    else if (pid > 0)
-    {
-        /* Update output HDF5 dataset with data from shared memory segment */
-        waitpid(pid, NULL, 0);
-        memcpy(output_dataset.data, mm.mm, room_size);
-    }
+    /* UDFs compiled before chunked datasets were supported lack this symbol */
+    hdf5_udf_offsets =
+        static_cast<std::vector<std::vector<hsize_t>>*>(shlib.loadsym("hdf5_udf_offsets", false));
 
-    unlink(so_file.c_str());
-    return true;   
+    /* Likewise for UDFs compiled before lib.parallel_for() was introduced */
+    hdf5_udf_threads = static_cast<size_t *>(shlib.loadsym("hdf5_udf_threads", false));
+    return true;
 }
 
-/* Scan the UDF file for references to HDF5 dataset names */
-std::vector<std::string> CppBackend::udfDatasetNames(std::string udf_file)
+/* Execute the user-defined-function in this process, one thread at a time per library */
+bool CppBackend::runInProcess(
+    const std::string filterpath,
+    const std::vector<DatasetInfo> &input_datasets,
+    const DatasetInfo &output_dataset,
+    const char *udf_blob,
+    size_t udf_blob_size)
 {
-    std::vector<std::string> output;
+    if (! preload(filterpath, udf_blob, udf_blob_size))
+        return false;
+    auto entry = library;
+    std::lock_guard<std::mutex> guard(entry->lock);
+    return Backend::runInProcess(filterpath, input_datasets, output_dataset, udf_blob, udf_blob_size);
+}
 
-    // We already rely on GCC to build the code, so just invoke its
-    // preprocessor to get rid of comments and identify calls to our API
-    int pipefd[2];
-    if (pipe(pipefd) < 0)
-    {
-        fprintf(stderr, "Failed to create pipe\n");
-        return output;
-    }
+/* Execute the user-defined-function previously loaded */
+bool CppBackend::execute(const std::vector<DatasetInfo> &datasets)
+{
+    /* Populate vector of dataset names, sizes, and types, indexed by slot */
+    auto dataset_info = sortBySlot(datasets);
+    hdf5_udf_data->clear();
+    hdf5_udf_names->clear();
+    hdf5_udf_types->clear();
+    hdf5_udf_dims->clear();
+    if (hdf5_udf_offsets)
+        hdf5_udf_offsets->clear();
+    if (hdf5_udf_threads)
+        *hdf5_udf_threads = getParallelism();
 
-    pid_t pid = fork();
-    if (pid == 0)
+    for (size_t i=0; i<dataset_info.size(); ++i)
     {
-        // Child: runs proprocessor, outputs to pipe
-        dup2(pipefd[1], STDOUT_FILENO);
-        close(pipefd[0]);
-        close(pipefd[1]);
-        char *cmd[] = {
-            (char *) "g++",
-            (char *) "-fpreprocessed",
-            (char *) "-dD",
-            (char *) "-E",
-            (char *) udf_file.c_str(),
-            (char *) NULL
-        };
-        execvp(cmd[0], cmd);
+        hdf5_udf_data->push_back(dataset_info[i].data);
+        hdf5_udf_names->push_back(dataset_info[i].name.c_str());
+        hdf5_udf_types->push_back(dataset_info[i].getDatatype());
+        hdf5_udf_dims->push_back(dataset_info[i].dimensions);
+        if (hdf5_udf_offsets)
+            hdf5_udf_offsets->push_back(dataset_info[i].offset);
     }
-    else if (pid > 0)
-    {
-        // Parent: reads from pipe, concatenating to 'input' string
-        std::string input;
-        fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
-        while (true)
-        {
-            char buf[8192];
-            ssize_t n = read(pipefd[0], buf, sizeof(buf));
-            if (n < 0 && errno == EWOULDBLOCK)
-            {
-                if (waitpid(pid, NULL, WNOHANG) == pid)
-                    break;
-                continue;
-            }
-            else if (n <= 0)
-                break;
-            input.append(buf, n);
-        }
 
-        // Go through the output of the preprocessor one line at a time
-        std::string line;
-        std::istringstream iss(input);
-        while (std::getline(iss, line))
-        {
-            size_t n = line.find("lib.getData");
-            if (n != std::string::npos)
-            {
-                auto start = line.substr(n).find_first_of("\"");
-                auto end = line.substr(n+start+1).find_first_of("\"");
-                auto name = line.substr(n).substr(start+1, end);
-                output.push_back(name);
-            }
-        }
+    udf();
+    return true;
+}
 
-        close(pipefd[0]);
-        close(pipefd[1]);
-    }
-    return output;
+/* Scan the UDF file for references to HDF5 dataset names */
+std::vector<std::string> CppBackend::udfDatasetNames(std::string udf_file)
+{
+    return Backend::scanDatasetNames(udf_file);
 }
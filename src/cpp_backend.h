@@ -9,6 +9,9 @@
 #define __cpp_backend_h
 
 #include "backend.h"
+#include "sharedlib_manager.h"
+
+struct CachedLibrary;
 
 class CppBackend : public Backend {
 public:
@@ -21,25 +24,65 @@ public:
     // Compile an input file into executable form
     std::string compile(std::string udf_file, std::string template_file);
 
-    // Execute a user-defined-function
-    bool run(
+    // Build one variant of the shared library per architecture
+    bool setTargetArchitectures(const std::vector<std::string> &isas);
+
+    // Versions of the compilers used and the headers the UDF includes
+    std::string describeToolchain(std::string udf_file, std::string template_file);
+
+    // Shared libraries can be opened more than once
+    bool supportsInProcess() {
+        return true;
+    }
+
+    // Run the user-defined-function in this process. The template keeps the
+    // datasets in globals of the shared library, so runs of the same library
+    // are serialised.
+    bool runInProcess(
         const std::string filterpath,
-        const std::vector<DatasetInfo> input_datasets,
-        const DatasetInfo output_dataset,
-        const char *output_cast_datatype,
+        const std::vector<DatasetInfo> &input_datasets,
+        const DatasetInfo &output_dataset,
         const char *udf_blob,
         size_t udf_blob_size);
 
+    // Decompress the shared library into memory, unless already cached
+    bool preload(
+        const std::string filterpath,
+        const char *udf_blob,
+        size_t udf_blob_size);
+
+    // Load the shared library that implements the user-defined-function
+    bool load(
+        const std::string filterpath,
+        const char *udf_blob,
+        size_t udf_blob_size);
+
+    // Execute a previously loaded user-defined-function
+    bool execute(const std::vector<DatasetInfo> &datasets);
+
     // Scan the UDF file for references to HDF5 dataset names.
     // We use this to store the UDF dependencies in the JSON payload.
     std::vector<std::string> udfDatasetNames(std::string udf_file);
 
 private:
-    // Compress a data buffer
-    std::string compressBuffer(const char *data, size_t usize);
-
-    // Decompress a data buffer
+    // Decompress a data buffer compressed by older versions
     std::string decompressBuffer(const char *data, size_t csize);
+
+    // Shared library decompressed by preload(), as kept in the library cache
+    std::shared_ptr<CachedLibrary> library;
+
+    // Architectures given to setTargetArchitectures()
+    std::vector<std::string> target_isas;
+
+    // Shared library and the APIs defined in our C++ template file
+    SharedLibraryManager shlib;
+    void (*udf)(void) = NULL;
+    std::vector<void *> *hdf5_udf_data = NULL;
+    std::vector<const char *> *hdf5_udf_names = NULL;
+    std::vector<const char *> *hdf5_udf_types = NULL;
+    std::vector<std::vector<hsize_t>> *hdf5_udf_dims = NULL;
+    std::vector<std::vector<hsize_t>> *hdf5_udf_offsets = NULL;
+    size_t *hdf5_udf_threads = NULL;
 };
 
 #endif /* __cpp_backend_h */
@@ -0,0 +1,591 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: cuda_backend.cpp
+ *
+ * CUDA kernel generation and execution on GPUs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string.h>
+#include <cuda.h>
+#include <fstream>
+#include <string>
+#include <algorithm>
+#include <mutex>
+#include "cuda_backend.h"
+#include "sharedlib_manager.h"
+#include "dataset.h"
+#include "hash.h"
+#include "profiler.h"
+
+/* Upper limit of modules kept in the device context */
+#define MAX_CACHED_MODULES 32
+
+/* Size of each of the two pinned buffers that transfers are staged through */
+#define STAGING_BUFFER_SIZE (8 << 20)
+
+/* Alignment of the grids in device memory */
+#define GRID_ALIGNMENT 256
+
+/* Threads per block of the kernel launches */
+#define BLOCK_SIZE 256
+
+/* Limits of the dataset table. Must match udf_template.cu. */
+#define MAX_DATASETS 64
+#define MAX_RANK     8
+#define NAME_LEN     116
+#define TYPE_LEN     8
+
+struct DatasetEntry {
+    uint64_t data;
+    uint64_t dims[MAX_RANK];
+    uint64_t offsets[MAX_RANK];
+    uint32_t rank;
+    char name[NAME_LEN];
+    char type[TYPE_LEN];
+};
+
+/*
+ * Entry points of the CUDA driver. It is loaded at run time, so that the
+ * filter and hdf5-udf keep working on hosts without a GPU. Names are
+ * those given by cuda.h, which maps some of them to versioned symbols.
+ */
+#define STRINGIFY(name) #name
+#define SYMBOL_NAME(name) STRINGIFY(name)
+#define CUDA_ENTRY(name) decltype(&::name) name = NULL
+
+struct CudaDriver {
+    SharedLibraryManager shlib;
+    CUdevice device = 0;
+    CUcontext context = NULL;
+    int multiprocessors = 1;
+    bool ok = false;
+
+    CUDA_ENTRY(cuInit);
+    CUDA_ENTRY(cuGetErrorString);
+    CUDA_ENTRY(cuDeviceGet);
+    CUDA_ENTRY(cuDeviceGetAttribute);
+    CUDA_ENTRY(cuCtxCreate);
+    CUDA_ENTRY(cuCtxSetCurrent);
+    CUDA_ENTRY(cuModuleLoadData);
+    CUDA_ENTRY(cuModuleUnload);
+    CUDA_ENTRY(cuModuleGetFunction);
+    CUDA_ENTRY(cuModuleGetGlobal);
+    CUDA_ENTRY(cuMemAlloc);
+    CUDA_ENTRY(cuMemFree);
+    CUDA_ENTRY(cuMemHostAlloc);
+    CUDA_ENTRY(cuMemcpyHtoDAsync);
+    CUDA_ENTRY(cuMemcpyDtoHAsync);
+    CUDA_ENTRY(cuStreamCreate);
+    CUDA_ENTRY(cuStreamSynchronize);
+    CUDA_ENTRY(cuEventCreate);
+    CUDA_ENTRY(cuEventRecord);
+    CUDA_ENTRY(cuEventSynchronize);
+    CUDA_ENTRY(cuLaunchKernel);
+
+    bool check(CUresult status, const char *call)
+    {
+        if (status == CUDA_SUCCESS)
+            return true;
+        const char *message = NULL;
+        if (cuGetErrorString)
+            cuGetErrorString(status, &message);
+        fprintf(stderr, "CUDA error in %s: %s\n", call, message ? message : "unknown error");
+        return false;
+    }
+
+    // Load the driver and create a context on the device given by
+    // $HDF5_UDF_CUDA_DEVICE (0 by default), which is shared by all threads.
+    // The context is our own rather than the primary context of the device,
+    // so that the modules, allocations and faults of UDF kernels don't leak
+    // into the context that the application uses through the runtime API.
+    bool init()
+    {
+        if (! shlib.open("libcuda.so.1"))
+            return false;
+
+#define LOAD_ENTRY(name) if (! (name = (decltype(name)) shlib.loadsym(SYMBOL_NAME(name)))) return false
+        LOAD_ENTRY(cuInit);
+        LOAD_ENTRY(cuGetErrorString);
+        LOAD_ENTRY(cuDeviceGet);
+        LOAD_ENTRY(cuDeviceGetAttribute);
+        LOAD_ENTRY(cuCtxCreate);
+        LOAD_ENTRY(cuCtxSetCurrent);
+        LOAD_ENTRY(cuModuleLoadData);
+        LOAD_ENTRY(cuModuleUnload);
+        LOAD_ENTRY(cuModuleGetFunction);
+        LOAD_ENTRY(cuModuleGetGlobal);
+        LOAD_ENTRY(cuMemAlloc);
+        LOAD_ENTRY(cuMemFree);
+        LOAD_ENTRY(cuMemHostAlloc);
+        LOAD_ENTRY(cuMemcpyHtoDAsync);
+        LOAD_ENTRY(cuMemcpyDtoHAsync);
+        LOAD_ENTRY(cuStreamCreate);
+        LOAD_ENTRY(cuStreamSynchronize);
+        LOAD_ENTRY(cuEventCreate);
+        LOAD_ENTRY(cuEventRecord);
+        LOAD_ENTRY(cuEventSynchronize);
+        LOAD_ENTRY(cuLaunchKernel);
+#undef LOAD_ENTRY
+
+        const char *env = getenv("HDF5_UDF_CUDA_DEVICE");
+        int ordinal = env ? atoi(env) : 0;
+        return
+            check(cuInit(0), "cuInit") &&
+            check(cuDeviceGet(&device, ordinal), "cuDeviceGet") &&
+            check(cuDeviceGetAttribute(&multiprocessors,
+                CU_DEVICE_ATTRIBUTE_MULTIPROCESSOR_COUNT, device), "cuDeviceGetAttribute") &&
+            check(cuCtxCreate(&context, 0, device), "cuCtxCreate");
+    }
+
+    // Make the shared context current on the calling thread
+    bool bind()
+    {
+        return check(cuCtxSetCurrent(context), "cuCtxSetCurrent");
+    }
+};
+
+/*
+ * The driver is loaded once per process and never released, as the modules
+ * in the cache are unloaded by static destructors that may run after ours
+ */
+static CudaDriver *getDriver()
+{
+    static CudaDriver *driver = new CudaDriver;
+    static std::once_flag once;
+    std::call_once(once, [] { driver->ok = driver->init(); });
+    return driver->ok && driver->bind() ? driver : NULL;
+}
+
+/*
+ * Fatbins loaded into the device context. Consecutive reads of a dataset
+ * skip the module load, which is when the driver JIT-compiles PTX for
+ * GPUs that the fatbin has no machine code for.
+ */
+struct CachedModule {
+    uint64_t hash;          /* Hash of the fatbin */
+    std::string payload;    /* Copy of the fatbin, to rule out hash collisions */
+    CUmodule module = NULL;
+    CUfunction function = NULL;
+    CUdeviceptr table = 0;  /* Dataset table of the template, in constant memory */
+    CUdeviceptr count = 0;  /* Number of entries of the dataset table */
+    std::mutex lock;        /* Held by launches, which share the dataset table */
+
+    bool matches(const char *data, size_t size) const {
+        return payload.size() == size && memcmp(payload.data(), data, size) == 0;
+    }
+
+    /* Backends that use the module keep it loaded after it's evicted */
+    ~CachedModule() {
+        auto driver = getDriver();
+        if (module && driver)
+            driver->cuModuleUnload(module);
+    }
+};
+static std::vector<std::shared_ptr<CachedModule>> module_cache;
+static std::mutex module_cache_lock;
+
+/*
+ * Stream, device memory and pinned staging buffers of a launch. They are
+ * kept once the launch is over and handed to the next one, so that reads
+ * don't pay for allocating pinned and device memory.
+ */
+struct DeviceBuffers {
+    CUstream stream = NULL;
+    CUdeviceptr grids = 0;          /* Grids of the datasets, back to back */
+    size_t grids_size = 0;
+    void *staging[2] = {NULL, NULL};
+    CUevent staged[2] = {NULL, NULL}; /* Recorded once the transfer of each staging buffer is done */
+    size_t next = 0;                /* Staging buffer that the next upload goes through */
+
+    bool init(CudaDriver *driver)
+    {
+        for (int i=0; i<2; ++i)
+            if (! driver->check(driver->cuMemHostAlloc(&staging[i], STAGING_BUFFER_SIZE, 0), "cuMemHostAlloc") ||
+                ! driver->check(driver->cuEventCreate(&staged[i], CU_EVENT_DISABLE_TIMING), "cuEventCreate"))
+                return false;
+        return driver->check(driver->cuStreamCreate(&stream, CU_STREAM_NON_BLOCKING), "cuStreamCreate");
+    }
+
+    bool reserve(CudaDriver *driver, size_t size)
+    {
+        if (grids_size >= size)
+            return true;
+        if (grids)
+            driver->cuMemFree(grids);
+        grids = 0;
+        grids_size = 0;
+        if (! driver->check(driver->cuMemAlloc(&grids, size), "cuMemAlloc"))
+            return false;
+        grids_size = size;
+        return true;
+    }
+
+    // Copy to the device through the staging buffers, taking turns: one is
+    // filled while the transfer out of the other is in flight
+    bool upload(CudaDriver *driver, CUdeviceptr dst, const void *src, size_t size)
+    {
+        for (size_t done=0; done<size; )
+        {
+            size_t n = std::min((size_t) STAGING_BUFFER_SIZE, size - done);
+            size_t i = next++ % 2;
+            if (! driver->check(driver->cuEventSynchronize(staged[i]), "cuEventSynchronize"))
+                return false;
+            memcpy(staging[i], (const char *) src + done, n);
+            if (! driver->check(driver->cuMemcpyHtoDAsync(dst + done, staging[i], n, stream), "cuMemcpyHtoDAsync") ||
+                ! driver->check(driver->cuEventRecord(staged[i], stream), "cuEventRecord"))
+                return false;
+            done += n;
+        }
+        return true;
+    }
+
+    // Copy from the device through the staging buffers. The transfer of a
+    // block is in flight while the previous one is copied out.
+    bool download(CudaDriver *driver, void *dst, CUdeviceptr src, size_t size)
+    {
+        size_t blocks = (size + STAGING_BUFFER_SIZE - 1) / STAGING_BUFFER_SIZE;
+        auto length = [&](size_t block) {
+            return std::min((size_t) STAGING_BUFFER_SIZE, size - block * STAGING_BUFFER_SIZE);
+        };
+        auto issue = [&](size_t block) {
+            size_t i = block % 2, offset = block * STAGING_BUFFER_SIZE;
+            return
+                driver->check(driver->cuMemcpyDtoHAsync(staging[i], src + offset, length(block), stream),
+                    "cuMemcpyDtoHAsync") &&
+                driver->check(driver->cuEventRecord(staged[i], stream), "cuEventRecord");
+        };
+
+        if (blocks && ! issue(0))
+            return false;
+        for (size_t block=0; block<blocks; ++block)
+        {
+            size_t i = block % 2;
+            if ((block + 1 < blocks && ! issue(block + 1)) ||
+                ! driver->check(driver->cuEventSynchronize(staged[i]), "cuEventSynchronize"))
+                return false;
+            memcpy((char *) dst + block * STAGING_BUFFER_SIZE, staging[i], length(block));
+        }
+        return true;
+    }
+};
+static std::vector<std::unique_ptr<DeviceBuffers>> idle_buffers;
+static std::mutex idle_buffers_lock;
+
+/* Take the buffers of an earlier launch, or create new ones */
+static std::unique_ptr<DeviceBuffers> acquireBuffers(CudaDriver *driver)
+{
+    {
+        std::lock_guard<std::mutex> guard(idle_buffers_lock);
+        if (idle_buffers.size())
+        {
+            auto buffers = std::move(idle_buffers.back());
+            idle_buffers.pop_back();
+            return buffers;
+        }
+    }
+    std::unique_ptr<DeviceBuffers> buffers(new DeviceBuffers);
+    if (! buffers->init(driver))
+        buffers.reset();
+    return buffers;
+}
+
+static void releaseBuffers(std::unique_ptr<DeviceBuffers> buffers)
+{
+    std::lock_guard<std::mutex> guard(idle_buffers_lock);
+    idle_buffers.push_back(std::move(buffers));
+}
+
+/* This backend's name */
+std::string CudaBackend::name()
+{
+    return "CUDA";
+}
+
+/* Extension managed by this backend */
+std::string CudaBackend::extension()
+{
+    return ".cu";
+}
+
+/* Compile CUDA to a fatbin using nvcc. Returns the fatbin as a string. */
+std::string CudaBackend::compile(std::string udf_file, std::string template_file)
+{
+    std::string placeholder = "// user_callback_placeholder";
+    auto cu_file = Backend::assembleUDF(udf_file, template_file, placeholder, this->extension());
+    if (cu_file.size() == 0)
+    {
+        fprintf(stderr, "Will not be able to compile the UDF code\n");
+        return "";
+    }
+
+    /*
+     * Without target architectures, nvcc's default embeds PTX that the driver
+     * compiles for the GPU at hand. Otherwise, machine code is built for each
+     * of them, plus PTX of the newest one for the GPUs that came after it.
+     */
+    std::string output = cu_file + ".fatbin";
+    std::vector<std::string> args = {"nvcc", "--fatbin", "-O3"};
+    std::string newest;
+    for (auto &isa: target_isas)
+    {
+        auto sm = isa.substr(3);
+        args.push_back("-gencode=arch=compute_" + sm + ",code=sm_" + sm);
+        if (newest.size() == 0 || std::stoi(sm) > std::stoi(newest))
+            newest = sm;
+    }
+    if (newest.size())
+        args.push_back("-gencode=arch=compute_" + newest + ",code=compute_" + newest);
+    args.insert(args.end(), {"-o", output, cu_file});
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // Child process
+        std::vector<char *> cmd;
+        for (auto &arg: args)
+            cmd.push_back((char *) arg.c_str());
+        cmd.push_back(NULL);
+        execvp(cmd[0], cmd.data());
+        _exit(1);
+    }
+    else if (pid > 0)
+    {
+        // Parent
+        int exit_status;
+        waitpid(pid, &exit_status, 0);
+
+        // Read generated fatbin
+        struct stat statbuf;
+        std::string bytecode;
+        if (WIFEXITED(exit_status) && WEXITSTATUS(exit_status) == 0 && stat(output.c_str(), &statbuf) == 0) {
+            printf("Fatbin has %ld bytes\n", statbuf.st_size);
+            std::ifstream data(output, std::ifstream::binary);
+            std::vector<unsigned char> buffer(std::istreambuf_iterator<char>(data), {});
+            bytecode.assign(buffer.begin(), buffer.end());
+        }
+        unlink(output.c_str());
+        unlink(cu_file.c_str());
+        return bytecode;
+    }
+    fprintf(stderr, "Failed to execute nvcc\n");
+    unlink(cu_file.c_str());
+    return "";
+}
+
+/* Describe the compiler that compile() runs and the headers it reads */
+std::string CudaBackend::describeToolchain(std::string udf_file, std::string template_file)
+{
+    std::string placeholder = "// user_callback_placeholder";
+    auto cu_file = Backend::assembleUDF(udf_file, template_file, placeholder, this->extension());
+    if (cu_file.size() == 0)
+        return "";
+
+    auto version = captureOutput({"nvcc", "--version"});
+    auto headers = describeHeaders({"nvcc", "-M"}, cu_file);
+    unlink(cu_file.c_str());
+    if (version.size() == 0 || headers.size() == 0)
+        return "";
+    return version + headers;
+}
+
+/* Restrict compilation to the given GPU architectures. Returns false if any is malformed. */
+bool CudaBackend::setTargetArchitectures(const std::vector<std::string> &isas)
+{
+    for (auto &isa: isas)
+        if (isa.size() < 4 || isa.compare(0, 3, "sm_") != 0 ||
+            ! std::all_of(isa.begin() + 3, isa.end(), ::isdigit))
+        {
+            fprintf(stderr, "Unsupported architecture '%s' (expected sm_XX, e.g. sm_80)\n", isa.c_str());
+            return false;
+        }
+    target_isas = isas;
+    return true;
+}
+
+/* Load the fatbin into the device context */
+bool CudaBackend::preload(
+    const std::string filterpath,
+    const char *fatbin,
+    size_t fatbin_size)
+{
+    if (module && module->matches(fatbin, fatbin_size))
+        return true;
+
+    auto driver = getDriver();
+    if (! driver)
+    {
+        fprintf(stderr, "No CUDA device is available to run the UDF\n");
+        return false;
+    }
+
+    uint64_t hash = hash64(fatbin, fatbin_size);
+    std::lock_guard<std::mutex> guard(module_cache_lock);
+    for (auto &entry: module_cache)
+        if (entry->hash == hash && entry->matches(fatbin, fatbin_size))
+        {
+            module = entry;
+            return true;
+        }
+
+    ProfileTimer timer;
+    auto entry = std::make_shared<CachedModule>();
+    size_t table_size = 0, count_size = 0;
+    entry->hash = hash;
+    entry->payload.assign(fatbin, fatbin_size);
+    if (! driver->check(driver->cuModuleLoadData(&entry->module, entry->payload.data()), "cuModuleLoadData") ||
+        ! driver->check(driver->cuModuleGetFunction(&entry->function, entry->module, "dynamic_dataset"),
+            "cuModuleGetFunction") ||
+        ! driver->check(driver->cuModuleGetGlobal(&entry->table, &table_size, entry->module, "hdf5_udf_datasets"),
+            "cuModuleGetGlobal") ||
+        ! driver->check(driver->cuModuleGetGlobal(&entry->count, &count_size, entry->module, "hdf5_udf_count"),
+            "cuModuleGetGlobal"))
+        return false;
+    if (table_size != sizeof(DatasetEntry) * MAX_DATASETS || count_size != sizeof(uint32_t))
+    {
+        fprintf(stderr, "The UDF was built with an incompatible CUDA template\n");
+        return false;
+    }
+    profiler.record("module", timer.elapsed(), fatbin_size);
+
+    if (module_cache.size() >= MAX_CACHED_MODULES)
+        module_cache.erase(module_cache.begin());
+    module_cache.push_back(entry);
+    module = entry;
+    return true;
+}
+
+/* Kernels are launched from the calling process, so loading is the same as preloading */
+bool CudaBackend::load(
+    const std::string filterpath,
+    const char *fatbin,
+    size_t fatbin_size)
+{
+    return preload(filterpath, fatbin, fatbin_size);
+}
+
+/* Execute the user-defined-function on the GPU, from the calling process */
+bool CudaBackend::run(
+    const std::string filterpath,
+    const std::vector<DatasetInfo> input_datasets,
+    const DatasetInfo output_dataset,
+    const char *output_cast_datatype,
+    const char *fatbin,
+    size_t fatbin_size)
+{
+    return runInProcess(filterpath, input_datasets, output_dataset, fatbin, fatbin_size);
+}
+
+/* Upload the inputs, launch the kernel and download the grids it writes */
+bool CudaBackend::execute(const std::vector<DatasetInfo> &datasets)
+{
+    auto driver = getDriver();
+    if (! driver || ! module || datasets.size() == 0)
+        return false;
+
+    /* The first dataset is the output; entries of the table are indexed by slot */
+    auto dataset_info = sortBySlot(datasets);
+    if (dataset_info.size() > MAX_DATASETS)
+    {
+        fprintf(stderr, "CUDA UDFs take at most %d datasets\n", MAX_DATASETS);
+        return false;
+    }
+
+    std::vector<DatasetEntry> table(MAX_DATASETS);
+    std::vector<size_t> offsets, sizes;
+    size_t total = 0;
+    for (size_t i=0; i<dataset_info.size(); ++i)
+    {
+        auto &info = dataset_info[i];
+        auto &entry = table[i];
+        auto datatype = info.getDatatype();
+        if (info.dimensions.size() > MAX_RANK || info.name.size() >= NAME_LEN || ! datatype)
+        {
+            fprintf(stderr, "Dataset %s can't be given to a CUDA UDF\n", info.name.c_str());
+            return false;
+        }
+        entry.rank = info.dimensions.size();
+        std::copy(info.dimensions.begin(), info.dimensions.end(), entry.dims);
+        std::copy(info.offset.begin(), info.offset.end(), entry.offsets);
+        snprintf(entry.name, sizeof(entry.name), "%s", info.name.c_str());
+        snprintf(entry.type, sizeof(entry.type), "%s", datatype);
+
+        offsets.push_back(total);
+        sizes.push_back(info.getGridSize() * info.getStorageSize());
+        total += (sizes.back() + GRID_ALIGNMENT - 1) & ~((size_t) GRID_ALIGNMENT - 1);
+    }
+
+    auto buffers = acquireBuffers(driver);
+    if (! buffers || ! buffers->reserve(driver, std::max(total, (size_t) 1)))
+        return false;
+    for (size_t i=0; i<dataset_info.size(); ++i)
+        table[i].data = buffers->grids + offsets[i];
+
+    /* Inputs go to the device; the output and the scratch grids are only written there */
+    ProfileTimer upload_timer;
+    bool ok = true;
+    size_t uploaded = 0;
+    auto &output_name = datasets[0].name;
+    for (size_t i=0; ok && i<dataset_info.size(); ++i)
+    {
+        auto &info = dataset_info[i];
+        if (info.name.compare(output_name) != 0 && ! info.scratch)
+        {
+            ok = buffers->upload(driver, buffers->grids + offsets[i], info.data, sizes[i]);
+            uploaded += sizes[i];
+        }
+    }
+    profiler.record("upload", upload_timer.elapsed(), uploaded);
+
+    /*
+     * The dataset table belongs to the module, so the launch has to complete
+     * before another thread may fill the table in for a launch of its own
+     */
+    if (ok)
+    {
+        ProfileTimer kernel_timer;
+        std::lock_guard<std::mutex> guard(module->lock);
+        uint32_t count = dataset_info.size();
+        size_t n = datasets[0].getGridSize();
+        unsigned int blocks = std::max((size_t) 1, std::min(
+            (n + BLOCK_SIZE - 1) / BLOCK_SIZE, (size_t) driver->multiprocessors * 32));
+        ok =
+            driver->check(driver->cuMemcpyHtoDAsync(module->table, table.data(),
+                table.size() * sizeof(DatasetEntry), buffers->stream), "cuMemcpyHtoDAsync") &&
+            driver->check(driver->cuMemcpyHtoDAsync(module->count, &count,
+                sizeof(count), buffers->stream), "cuMemcpyHtoDAsync") &&
+            driver->check(driver->cuLaunchKernel(module->function,
+                blocks, 1, 1, BLOCK_SIZE, 1, 1, 0, buffers->stream, NULL, NULL), "cuLaunchKernel") &&
+            driver->check(driver->cuStreamSynchronize(buffers->stream), "dynamic_dataset");
+        profiler.record("kernel", kernel_timer.elapsed(), n);
+    }
+
+    ProfileTimer download_timer;
+    size_t downloaded = 0;
+    for (size_t i=0; ok && i<dataset_info.size(); ++i)
+    {
+        auto &info = dataset_info[i];
+        if (info.name.compare(output_name) == 0 || info.scratch)
+        {
+            ok = buffers->download(driver, info.data, buffers->grids + offsets[i], sizes[i]);
+            downloaded += sizes[i];
+        }
+    }
+    profiler.record("download", download_timer.elapsed(), downloaded);
+
+    /* Buffers whose transfers failed half-way may still be in use by the device */
+    if (ok || driver->cuStreamSynchronize(buffers->stream) == CUDA_SUCCESS)
+        releaseBuffers(std::move(buffers));
+    return ok;
+}
+
+/* Scan the UDF file for references to HDF5 dataset names */
+std::vector<std::string> CudaBackend::udfDatasetNames(std::string udf_file)
+{
+    return Backend::scanDatasetNames(udf_file);
+}
@@ -0,0 +1,78 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: cuda_backend.h
+ *
+ * Interfaces for CUDA kernel generation and execution on GPUs.
+ */
+#ifndef __cuda_backend_h
+#define __cuda_backend_h
+
+#include "backend.h"
+
+struct CachedModule;
+
+class CudaBackend : public Backend {
+public:
+    // Backend name
+    std::string name();
+
+    // Extension managed by this backend
+    std::string extension();
+
+    // Compile an input file into a fatbin with the kernels of the UDF
+    std::string compile(std::string udf_file, std::string template_file);
+
+    // Build the fatbin for the given GPU architectures (e.g., "sm_80")
+    bool setTargetArchitectures(const std::vector<std::string> &isas);
+
+    // Version of nvcc and the headers the UDF includes
+    std::string describeToolchain(std::string udf_file, std::string template_file);
+
+    // No code from the UDF runs on the CPU, so kernels are launched from the
+    // calling process, where the device context is kept across reads
+    bool runsOnDevice() {
+        return true;
+    }
+
+    bool supportsInProcess() {
+        return true;
+    }
+
+    // Upload the inputs, launch the kernel and download the outputs
+    bool run(
+        const std::string filterpath,
+        const std::vector<DatasetInfo> input_datasets,
+        const DatasetInfo output_dataset,
+        const char *output_cast_datatype,
+        const char *udf_blob,
+        size_t udf_blob_size);
+
+    // Load the fatbin into the device context, unless already cached
+    bool preload(
+        const std::string filterpath,
+        const char *udf_blob,
+        size_t udf_blob_size);
+
+    // Same as preload(), as there is no separate process to prepare
+    bool load(
+        const std::string filterpath,
+        const char *udf_blob,
+        size_t udf_blob_size);
+
+    // Execute a previously loaded user-defined-function
+    bool execute(const std::vector<DatasetInfo> &datasets);
+
+    // Scan the UDF file for references to HDF5 dataset names.
+    // We use this to store the UDF dependencies in the JSON payload.
+    std::vector<std::string> udfDatasetNames(std::string udf_file);
+
+private:
+    // Module loaded by preload(), as kept in the module cache
+    std::shared_ptr<CachedModule> module;
+
+    // Architectures given to setTargetArchitectures()
+    std::vector<std::string> target_isas;
+};
+
+#endif /* __cuda_backend_h */
@@ -6,6 +6,7 @@
  * High-level interfaces for information retrieval from HDF5 datasets.
  */
 
+#include <algorithm>
 #include "dataset.h"
 
 static std::vector<DatasetTypeInfo> dataset_type_info = {
@@ -21,11 +22,42 @@ static std::vector<DatasetTypeInfo> dataset_type_info = {
     {"double", "double*",   H5T_IEEE_F64LE, sizeof(double)},
 };
 
+/*
+ * Look up the type of a dataset or of a field of a compound dataset. Types
+ * stored with a different byte order resolve to the same entry as their
+ * little-endian counterparts: H5Dread() converts them to the latter.
+ */
+static const DatasetTypeInfo *findTypeInfo(hid_t hdf5_datatype)
+{
+    for (auto &info: dataset_type_info)
+        if (H5Tequal(info.hdf5_datatype_id, hdf5_datatype) > 0)
+            return &info;
+
+    H5T_class_t type_class = H5Tget_class(hdf5_datatype);
+    if (type_class != H5T_INTEGER && type_class != H5T_FLOAT)
+        return NULL;
+    for (auto &info: dataset_type_info)
+    {
+        hid_t candidate = info.hdf5_datatype_id;
+        if (H5Tget_class(candidate) != type_class ||
+            H5Tget_size(candidate) != H5Tget_size(hdf5_datatype))
+            continue;
+        if (type_class == H5T_INTEGER && H5Tget_sign(candidate) != H5Tget_sign(hdf5_datatype))
+            continue;
+        if (type_class == H5T_FLOAT && H5Tget_precision(candidate) != H5Tget_precision(hdf5_datatype))
+            continue;
+        return &info;
+    }
+    return NULL;
+}
+
 DatasetInfo::DatasetInfo() :
     name(""),
     datatype(""),
     hdf5_datatype(-1),
-    data(NULL)
+    data(NULL),
+    slot(-1),
+    scratch(false)
 {
 }
 
@@ -33,16 +65,31 @@ DatasetInfo::DatasetInfo(std::string in_name, std::vector<hsize_t> in_dims, std:
     name(in_name),
     datatype(in_datatype),
     hdf5_datatype(-1),
-    dimensions(in_dims),
-    data(NULL)
+    data(NULL),
+    slot(-1),
+    scratch(false)
 {
-    std::stringstream ss;
-    for (size_t i=0; i<dimensions.size(); ++i) {
-        ss << dimensions[i];
-        if (i < dimensions.size()-1)
-            ss << "x";
-    }
-    dimensions_str = ss.str();
+    setExtent(in_dims, std::vector<hsize_t>(in_dims.size(), 0));
+}
+
+/* Set the dimensions of the data buffer and its offset within the dataset */
+void DatasetInfo::setExtent(std::vector<hsize_t> in_dims, std::vector<hsize_t> in_offset)
+{
+    auto to_string = [](std::vector<hsize_t> &values)
+    {
+        std::stringstream ss;
+        for (size_t i=0; i<values.size(); ++i) {
+            ss << values[i];
+            if (i < values.size()-1)
+                ss << "x";
+        }
+        return ss.str();
+    };
+
+    dimensions = in_dims;
+    offset = in_offset;
+    dimensions_str = to_string(dimensions);
+    offset_str = to_string(offset);
 }
 
 size_t DatasetInfo::getGridSize() const
@@ -50,15 +97,23 @@ size_t DatasetInfo::getGridSize() const
     return std::accumulate(
         std::begin(dimensions),
         std::end(dimensions),
-        1, std::multiplies<hsize_t>());
+        (hsize_t) 1, std::multiplies<hsize_t>());
 }
 
 const char *DatasetInfo::getDatatype() const
 {
-    if (hdf5_datatype != -1)
+    // Resolve by name when possible: this runs in the processes that execute
+    // the UDF, where another thread may be holding the HDF5 library lock
+    if (datatype.size())
         for (auto &info: dataset_type_info)
-            if (H5Tequal(info.hdf5_datatype_id, hdf5_datatype))
+            if (info.datatype.compare(datatype) == 0)
                 return info.datatype.c_str();
+    if (hdf5_datatype != -1)
+    {
+        auto info = findTypeInfo(hdf5_datatype);
+        if (info)
+            return info->datatype.c_str();
+    }
     return NULL;
 }
 
@@ -96,4 +151,139 @@ void DatasetInfo::printInfo(std::string dataset_type) const
     for (size_t i=1; i<dimensions.size(); ++i)
         printf("x%lld", dimensions[i]);
     printf(", datatype=%s\n", datatype.c_str());
-}
\ No newline at end of file
+}
+
+std::vector<DatasetInfo> sortBySlot(const std::vector<DatasetInfo> &datasets)
+{
+    /* Datasets named more than once by the UDF share the same slot */
+    std::vector<DatasetInfo> out(datasets.size());
+    std::vector<bool> taken(datasets.size(), false);
+    size_t num_slots = 0;
+    for (auto &info: datasets)
+    {
+        if (info.slot < 0 || info.slot >= (int) datasets.size())
+            return datasets;
+        if (! taken[info.slot])
+        {
+            out[info.slot] = info;
+            taken[info.slot] = true;
+        }
+        num_slots = std::max(num_slots, (size_t) info.slot + 1);
+    }
+    if (std::find(taken.begin(), taken.begin() + num_slots, false) != taken.begin() + num_slots)
+        return datasets;
+    out.resize(num_slots);
+    return out;
+}
+
+/*
+ * Split "path.field" into the path of a compound dataset and the name of
+ * one of its members. Returns false if name refers to a plain dataset or
+ * if no such dataset/member pair exists.
+ */
+static bool splitField(hid_t file_id, const std::string &name, std::string &path, std::string &field)
+{
+    auto dot = name.find_last_of('.');
+    auto slash = name.find_last_of('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return false;
+    if (dot == 0 || dot == name.size()-1)
+        return false;
+
+    htri_t exists = 0;
+    H5E_BEGIN_TRY {
+        exists = H5Lexists(file_id, name.c_str(), H5P_DEFAULT);
+    } H5E_END_TRY;
+    if (exists > 0)
+        return false;
+
+    std::string candidate = name.substr(0, dot);
+    H5E_BEGIN_TRY {
+        exists = H5Lexists(file_id, candidate.c_str(), H5P_DEFAULT);
+    } H5E_END_TRY;
+    if (exists <= 0)
+        return false;
+
+    hid_t dset_id, type_id;
+    bool found = false;
+    H5E_BEGIN_TRY {
+        dset_id = H5Dopen(file_id, candidate.c_str(), H5P_DEFAULT);
+        if (dset_id >= 0)
+        {
+            type_id = H5Dget_type(dset_id);
+            if (type_id >= 0)
+            {
+                found = H5Tget_class(type_id) == H5T_COMPOUND &&
+                    H5Tget_member_index(type_id, name.c_str() + dot + 1) >= 0;
+                H5Tclose(type_id);
+            }
+            H5Dclose(dset_id);
+        }
+    } H5E_END_TRY;
+    if (! found)
+        return false;
+
+    path = candidate;
+    field = name.substr(dot + 1);
+    return true;
+}
+
+InputDataset resolveInput(hid_t file_id, const std::string &name)
+{
+    InputDataset input;
+    input.name = name;
+    if (! splitField(file_id, name, input.path, input.member))
+        input.path = name;
+    return input;
+}
+
+std::vector<InputDataset> resolveInputs(hid_t file_id, const std::vector<std::string> &names)
+{
+    std::vector<InputDataset> inputs;
+    for (auto &name: names)
+        inputs.push_back(resolveInput(file_id, name));
+    return inputs;
+}
+
+hid_t openInputDataset(hid_t file_id, const InputDataset &input, hid_t *datatype, hid_t *mem_type)
+{
+    const std::string &path = input.path, &field = input.member, &name = input.name;
+    bool is_field = ! field.empty();
+
+    hid_t dset_id = H5Dopen(file_id, path.c_str(), H5P_DEFAULT);
+    if (dset_id < 0)
+    {
+        fprintf(stderr, "Failed to open dataset %s\n", path.c_str());
+        return -1;
+    }
+
+    hid_t file_type = H5Dget_type(dset_id);
+    if (is_field)
+    {
+        /* The compound type and its member are known to exist at this point */
+        int index = H5Tget_member_index(file_type, field.c_str());
+        *datatype = H5Tget_member_type(file_type, (unsigned) index);
+        H5Tclose(file_type);
+    }
+    else
+        *datatype = file_type;
+
+    auto info = findTypeInfo(*datatype);
+    if (! info)
+    {
+        fprintf(stderr, "Unsupported datatype of input %s\n", name.c_str());
+        H5Tclose(*datatype);
+        H5Dclose(dset_id);
+        return -1;
+    }
+
+    if (is_field)
+    {
+        /* Select a single member so that H5Dread() gathers it into a dense array */
+        *mem_type = H5Tcreate(H5T_COMPOUND, info->datatype_size);
+        H5Tinsert(*mem_type, field.c_str(), 0, info->hdf5_datatype_id);
+    }
+    else
+        *mem_type = H5Tcopy(info->hdf5_datatype_id);
+    return dset_id;
+}
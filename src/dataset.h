@@ -11,9 +11,12 @@
 #include <hdf5.h>
 #include <vector>
 #include <string>
+#include <memory>
 #include <numeric>
 #include <sstream>
 
+class AnonymousMemoryMap;
+
 struct DatasetTypeInfo {
     DatasetTypeInfo(std::string dtype, std::string ddeclaration, hid_t did, hid_t dsize) :
         datatype(dtype),
@@ -38,6 +41,7 @@ public:
     size_t getHdf5Datatype() const;
     hid_t getStorageSize() const;
     const char *getCastDatatype() const;
+    void setExtent(std::vector<hsize_t> in_dims, std::vector<hsize_t> in_offset);
     void printInfo(std::string dataset_type) const;
 
     std::string name;                /* Dataset name */
@@ -45,7 +49,46 @@ public:
     std::string dimensions_str;      /* Dimensions, given as string */
     hid_t hdf5_datatype;             /* Datatype, given as HDF5 type */
     std::vector<hsize_t> dimensions; /* Dataset dimensions */
+    std::vector<hsize_t> offset;     /* Offset of the data buffer in the dataset (chunked mode) */
+    std::string offset_str;          /* Offset, given as string */
     void *data;                      /* Allocated buffer to hold dataset data */
+    int slot;                        /* Index assigned to the dataset when the UDF was compiled */
+    bool scratch;                    /* Whether the UDF writes the grid (of a sibling dataset) */
+    std::shared_ptr<AnonymousMemoryMap> mapping; /* Shared memory backing 'data', if any */
+};
+
+/*
+ * Place each dataset at the index given by its slot, so that UDF templates
+ * can look them up in constant time. The original order is kept if any
+ * dataset lacks a slot (e.g., UDFs compiled before slots were introduced).
+ */
+std::vector<DatasetInfo> sortBySlot(const std::vector<DatasetInfo> &datasets);
+
+/*
+ * Inputs are either datasets or members of datasets of compound type, which
+ * are named "path.member". Telling them apart takes a few HDF5 calls, so
+ * inputs are resolved once per read and passed along as InputDatasets.
+ */
+struct InputDataset {
+    std::string name;                /* Name the UDF refers to the input by */
+    std::string path;                /* Path of the dataset holding the input */
+    std::string member;              /* Member of the compound dataset, or empty */
 };
 
+/*
+ * Resolve input names. Names that match no compound member are taken as
+ * dataset paths, so that a missing dataset is reported when it's opened.
+ */
+InputDataset resolveInput(hid_t file_id, const std::string &name);
+std::vector<InputDataset> resolveInputs(hid_t file_id, const std::vector<std::string> &names);
+
+/*
+ * Open the dataset holding an input. On success, datatype is set to the type
+ * stored in the file (that of the member, for compound datasets) and mem_type
+ * to the type to give to H5Dread() so that the input is read as a contiguous
+ * array of the little-endian type seen by the UDF. Both types must be closed
+ * by the caller. Returns -1 on failure.
+ */
+hid_t openInputDataset(hid_t file_id, const InputDataset &input, hid_t *datatype, hid_t *mem_type);
+
 #endif /* __dataset_h */
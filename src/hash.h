@@ -0,0 +1,28 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: hash.h
+ *
+ * Non-cryptographic hash function used to index cached objects.
+ */
+#ifndef __hash_h
+#define __hash_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_SEED 0xcbf29ce484222325ULL
+
+/* 64-bit FNV-1a hash. Pass the result of a previous call to chain inputs. */
+static inline uint64_t hash64(const void *data, size_t size, uint64_t hash=HASH_SEED)
+{
+    const uint8_t *p = (const uint8_t *) data;
+    for (size_t i=0; i<size; ++i)
+    {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#endif /* __hash_h */
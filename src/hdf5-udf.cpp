@@ -5,6 +5,7 @@
  *
  * HDF5 filter callbacks and main interface with the backends.
  */
+#include <ctype.h>
 #include <dirent.h>
 #include <H5PLextern.h>
 #include <hdf5.h>
@@ -17,16 +18,202 @@
 #include <time.h>
 #include <unistd.h>
 #include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <numeric>
+#include <memory>
+#include <map>
+#include <tuple>
+#include <deque>
+#include <future>
+#include <thread>
+#include <atomic>
+#include <mutex>
 
 #include "filter_id.h"
 #include "dataset.h"
 #include "backend.h"
+#include "worker_pool.h"
+#include "memo_cache.h"
+#include "node_cache.h"
+#include "buffer_arena.h"
+#include "materialize.h"
+#include "payload.h"
+#include "codec.h"
+#include "prefetcher.h"
+#include "signature.h"
+#include "scheduler.h"
+#include "profiler.h"
+#include "anon_mmap.h"
+#include "hash.h"
 #include "debug.h"
 #include "json.hpp"
 
 using namespace std;
 using json = nlohmann::json;
 
+/* Memory set aside for sibling grids when the memoization cache is disabled */
+#define SIBLING_GRIDS_BUDGET (64 * 1024 * 1024)
+
+/* Memory set aside for unread prefetched grids when the memoization cache is disabled */
+#define PREFETCHED_GRIDS_BUDGET (256 * 1024 * 1024)
+
+/* Default memory budget for each block of a streaming UDF */
+#define STREAMING_BLOCK_BUDGET (256 * 1024 * 1024)
+
+/* Segments that hold input and scratch grids, reused across calls */
+static BufferArena buffer_arena;
+
+/* Long-lived processes that execute the UDFs */
+static WorkerPool worker_pool;
+
+/* Keys whose signatures let UDFs run in-process, given by $HDF5_UDF_TRUSTED_KEYS */
+static TrustedKeys trusted_keys;
+
+/* Grids computed by the UDFs, kept for subsequent reads */
+static MemoCache memo_cache;
+
+/* Grids of sibling datasets produced by recent UDF runs, kept until they are read */
+static MemoCache sibling_grids(SIBLING_GRIDS_BUDGET);
+
+/* Grids shared with the other processes of this node, enabled by $HDF5_UDF_NODE_CACHE */
+static NodeCache node_cache;
+
+/*
+ * Memory available to the inputs, scratch grids and output of each block a
+ * streaming UDF is evaluated on. The budget is given by $HDF5_UDF_BLOCK_SIZE
+ * in bytes, optionally followed by a K/M/G suffix.
+ */
+static size_t readBlockBudget()
+{
+    const char *env = getenv("HDF5_UDF_BLOCK_SIZE");
+    if (! env)
+        return STREAMING_BLOCK_BUDGET;
+    char *suffix = NULL;
+    size_t budget = strtoull(env, &suffix, 10);
+    switch (toupper(*suffix))
+    {
+        case 'G': budget <<= 10; /* fall through */
+        case 'M': budget <<= 10; /* fall through */
+        case 'K': budget <<= 10;
+    }
+    return budget;
+}
+
+static size_t block_budget = readBlockBudget();
+
+/* Upper limit of decoded bytecodes kept in memory */
+#define MAX_DECODED_BYTECODES 32
+
+/*
+ * Bytecode decoded by earlier reads, so that repeated reads of a dataset
+ * only pay for the codec once. The decoded bytecode is shared with the
+ * callers, so it outlives its entry when nested reads (of virtual datasets
+ * used as inputs) or other threads evict it.
+ */
+struct DecodedBytecode {
+    uint64_t hash;          /* Hash of the encoded bytecode */
+    std::string encoded;    /* Copy of the encoded bytecode, to rule out hash collisions */
+    std::shared_ptr<const std::string> decoded;    /* Bytecode as handed to the backend */
+};
+static std::deque<DecodedBytecode> decoded_bytecodes;
+static std::mutex decoded_bytecodes_lock;
+
+/*
+ * State of the inputs under which each materialized copy was last found fresh,
+ * keyed by the device and inode of the file and by the name of the copy
+ */
+static std::map<std::tuple<dev_t, ino_t, std::string>, std::string> fresh_materialized;
+
+/*
+ * Limits the UDFs evaluated at once by the filter and by the jobs started
+ * with hdf5_udf_prefetch(), so that the node is not oversubscribed
+ */
+static Scheduler scheduler;
+
+/* Chunk of a virtual dataset evaluated ahead of its read */
+struct PrefetchTask {
+    std::string key;                    /* Key of the grid, as given by getGridKey() */
+    DatasetInfo output;
+    std::vector<DatasetInfo> datasets;  /* Inputs, followed by the scratch datasets */
+    size_t size;                        /* Bytes held by the output and scratch grids */
+    bool success;
+    bool finished;                      /* Whether the UDF is done with the grids */
+    bool dropped;                       /* Whether the grids have been dropped unread */
+};
+
+/*
+ * Evaluation of a virtual dataset started by hdf5_udf_prefetch(). HDF5 calls
+ * are all made by the caller; the background thread only runs the UDF.
+ */
+struct PrefetchJob {
+    std::unique_ptr<Backend> backend;
+    std::string filterpath;
+    std::string bytecode;               /* Decoded bytecode */
+    std::string stamp;                  /* State of the inputs the job was started under */
+    std::vector<InputDataset> inputs;   /* Inputs of the UDF, resolved by the first chunk */
+    std::vector<InputDataset> scratch;
+    size_t num_inputs;
+    bool trusted;                       /* Whether the UDF runs in-process */
+    uint64_t sequence;                  /* Order in which jobs were started */
+    std::vector<PrefetchTask> tasks;
+    std::mutex lock;                    /* Guards the finished and dropped flags of the tasks */
+
+    // Declared last, so that it's destroyed first: that waits for the
+    // background thread to finish with the other members
+    std::shared_future<bool> result;
+};
+
+/* Guards the prefetch tables below, which the application may poll from any thread */
+static std::mutex prefetch_lock;
+
+/* Prefetch jobs by file and dataset name */
+static std::map<std::string, std::shared_ptr<PrefetchJob>> prefetch_jobs;
+
+/*
+ * Jobs replaced by a later prefetch of the same dataset before they finished.
+ * Destroying a job waits for its thread, so they are kept here until they are
+ * done rather than holding up the caller of hdf5_udf_prefetch().
+ */
+static std::vector<std::shared_ptr<PrefetchJob>> retired_jobs;
+
+/* Grids of prefetch jobs that have not been read yet, by their key: the job and the index of the task */
+typedef std::map<std::string, std::pair<std::shared_ptr<PrefetchJob>, size_t>> PrefetchedGrids;
+static PrefetchedGrids prefetched_grids;
+
+/* Bytes held by the grids above, and the number of jobs started so far */
+static size_t prefetched_bytes = 0;
+static uint64_t prefetch_sequence = 0;
+
+/*
+ * Upper limit of the bytes held by unread prefetched grids: the budget of the
+ * memoization cache, or a fixed amount when that cache is disabled
+ */
+static size_t getPrefetchBudget()
+{
+    return memo_cache.enabled() ? memo_cache.capacity() : PREFETCHED_GRIDS_BUDGET;
+}
+
+/*
+ * Forget an unread prefetched grid. Its memory is released right away if the
+ * UDF is done with it, or by the job once it is. Called with prefetch_lock held.
+ */
+static void dropPrefetchedGrid(PrefetchedGrids::iterator it)
+{
+    auto job = it->second.first;
+    auto &task = job->tasks[it->second.second];
+    prefetched_bytes -= task.size;
+    prefetched_grids.erase(it);
+
+    std::lock_guard<std::mutex> guard(job->lock);
+    task.dropped = true;
+    if (task.finished)
+    {
+        task.output.mapping.reset();
+        task.datasets.clear();
+    }
+}
+
 std::string getFilterPath()
 {
     std::vector<std::string> paths;
@@ -52,9 +239,166 @@ std::string getFilterPath()
     return "";
 }
 
-/* Retrieve the HDF5 file handle associated with a given dataset name */
-hid_t getDatasetHandle(std::string dataset, bool *handle_from_procfs)
+int getFileDescriptor(hid_t file_id);
+
+/*
+ * Identify the file that holds an open HDF5 object by the device and inode
+ * of its underlying file. Returns false if that file can't be reached.
+ */
+static bool getFileIdentity(hid_t obj_id, dev_t *dev, ino_t *ino)
+{
+    hid_t file_id = H5Iget_file_id(obj_id);
+    if (file_id < 0)
+        return false;
+
+    /* Files opened through drivers other than sec2 are looked up by name */
+    struct stat statbuf;
+    int file_fd = getFileDescriptor(file_id);
+    bool found = file_fd >= 0 && fstat(file_fd, &statbuf) == 0;
+    if (! found && file_fd < 0)
+    {
+        ssize_t len = H5Fget_name(file_id, NULL, 0);
+        if (len > 0)
+        {
+            std::string name(len + 1, '\0');
+            H5Fget_name(file_id, &name[0], name.size());
+            found = stat(name.c_str(), &statbuf) == 0;
+        }
+    }
+    H5Fclose(file_id);
+    if (found)
+    {
+        *dev = statbuf.st_dev;
+        *ino = statbuf.st_ino;
+    }
+    return found;
+}
+
+/*
+ * Identifiers of open datasets that have previously led us to their HDF5 file,
+ * keyed by the dataset path and by the device and inode of the file, as the
+ * same path may be open in several files at once
+ */
+typedef std::tuple<std::string, dev_t, ino_t> DatasetKey;
+static std::map<DatasetKey, hid_t> dataset_id_cache;
+
+/* Files found through /proc, along with the identity of the underlying inode */
+struct FileIdentity {
+    std::string path;
+    dev_t dev;
+    ino_t ino;
+};
+static std::map<std::string, FileIdentity> file_identity_cache;
+
+/*
+ * Retrieve the HDF5 file handle associated with a given dataset name. When
+ * several open files hold a dataset with that name, the one whose chunk at
+ * chunk_offset is stored as the given raw bytes is picked. The caller is
+ * responsible for closing the handle if close_handle is set.
+ */
+hid_t getDatasetHandle(std::string dataset, const std::vector<hsize_t> &chunk_offset,
+    const void *raw, size_t raw_size, bool *close_handle)
 {
+    auto path = dataset.size() && dataset[0] == '/' ? dataset : "/" + dataset;
+
+    /* Tell if the given identifier refers to an open dataset with that path */
+    auto isDataset = [&](hid_t id)
+    {
+        if (H5Iis_valid(id) <= 0 || H5Iget_type(id) != H5I_DATASET)
+            return false;
+        ssize_t len = H5Iget_name(id, NULL, 0);
+        if (len <= 0)
+            return false;
+        std::string name(len, '\0');
+        H5Iget_name(id, &name[0], len + 1);
+        return name.compare(path) == 0;
+    };
+
+    /*
+     * Collect the cached datasets with that path, dropping the entries whose
+     * identifiers have been closed or now refer to a dataset of another file
+     */
+    auto cachedDatasets = [&]()
+    {
+        std::vector<hid_t> out;
+        auto it = dataset_id_cache.lower_bound(DatasetKey(path, 0, 0));
+        while (it != dataset_id_cache.end() && std::get<0>(it->first) == path)
+        {
+            dev_t dev;
+            ino_t ino;
+            if (isDataset(it->second) && getFileIdentity(it->second, &dev, &ino) &&
+                dev == std::get<1>(it->first) && ino == std::get<2>(it->first))
+            {
+                out.push_back(it->second);
+                ++it;
+            }
+            else
+                it = dataset_id_cache.erase(it);
+        }
+        return out;
+    };
+
+    /*
+     * The dataset is open while the application reads from it, so the HDF5
+     * library can tell us which file it belongs to. We remember the dataset
+     * identifier so that subsequent reads don't need to look it up again;
+     * that entry is invalidated as soon as the application closes it. With
+     * more than one file open, the open datasets are enumerated again so that
+     * a dataset with the same path in another file is not overlooked.
+     */
+    auto candidates = cachedDatasets();
+    if (candidates.empty() || H5Fget_obj_count(H5F_OBJ_ALL, H5F_OBJ_FILE) > 1)
+    {
+        ssize_t count = H5Fget_obj_count(H5F_OBJ_ALL, H5F_OBJ_DATASET);
+        std::vector<hid_t> ids(count > 0 ? count : 0);
+        if (count > 0)
+            count = H5Fget_obj_ids(H5F_OBJ_ALL, H5F_OBJ_DATASET, ids.size(), ids.data());
+        for (ssize_t i=0; i<count; ++i)
+        {
+            dev_t dev;
+            ino_t ino;
+            if (isDataset(ids[i]) && getFileIdentity(ids[i], &dev, &ino))
+                dataset_id_cache[DatasetKey(path, dev, ino)] = ids[i];
+        }
+        candidates = cachedDatasets();
+    }
+
+    /* Tell if the chunk being read is the one stored by the given dataset */
+    auto storesChunk = [&](hid_t dset_id)
+    {
+        hsize_t storage_size = 0;
+        uint32_t filter_mask = 0;
+        if (H5Dget_chunk_storage_size(dset_id, chunk_offset.data(), &storage_size) < 0 ||
+            storage_size != raw_size)
+            return false;
+        std::vector<char> stored(storage_size);
+        return H5Dread_chunk(dset_id, H5P_DEFAULT, chunk_offset.data(), &filter_mask, stored.data()) >= 0 &&
+            memcmp(stored.data(), raw, raw_size) == 0;
+    };
+    if (candidates.size() > 1)
+    {
+        std::vector<hid_t> matches;
+        H5E_BEGIN_TRY {
+            std::copy_if(candidates.begin(), candidates.end(), std::back_inserter(matches), storesChunk);
+        } H5E_END_TRY;
+        if (matches.size() != 1)
+        {
+            fprintf(stderr, "Dataset %s is open in %zu files, unable to tell which one is being read\n",
+                path.c_str(), candidates.size());
+            return (hid_t) -1;
+        }
+        candidates = matches;
+    }
+    if (candidates.size() == 1)
+    {
+        hid_t file_id = H5Iget_file_id(candidates[0]);
+        if (file_id >= 0)
+        {
+            *close_handle = true;
+            return file_id;
+        }
+    }
+
     /*
      * Get a list of open files from /proc. This is a workaround for the
      * lack of an HDF5 Filter API to access the underlying file descriptor.
@@ -84,31 +428,499 @@ hid_t getDatasetHandle(std::string dataset, bool *handle_from_procfs)
         return out;
     };
 
+    auto openCandidate = [&](const std::string &fname)
+    {
+        hid_t file_id;
+        H5E_BEGIN_TRY {
+            file_id = H5Fopen(fname.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+            if (file_id >= 0 && H5Lexists(file_id, dataset.c_str(), H5P_DEFAULT) <= 0)
+            {
+                H5Fclose(file_id);
+                file_id = (hid_t) -1;
+            }
+        } H5E_END_TRY;
+        return file_id;
+    };
+
+    /* Try the file that held this dataset last time, provided it's still the same inode */
+    auto cached = file_identity_cache.find(path);
+    if (cached != file_identity_cache.end())
+    {
+        struct stat s;
+        auto &identity = cached->second;
+        if (stat(identity.path.c_str(), &s) == 0 && s.st_dev == identity.dev && s.st_ino == identity.ino)
+        {
+            hid_t file_id = openCandidate(identity.path);
+            if (file_id >= 0)
+            {
+                *close_handle = true;
+                return file_id;
+            }
+        }
+        file_identity_cache.erase(cached);
+    }
+
     for (auto &fname: getProcCandidates())
     {
-        hid_t file_id = H5Fopen(fname.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
-        if (file_id >= 0 && H5Lexists(file_id, dataset.c_str(), H5P_DEFAULT ) > 0) {
-            *handle_from_procfs = true;
+        hid_t file_id = openCandidate(fname);
+        if (file_id >= 0)
+        {
+            struct stat s;
+            if (stat(fname.c_str(), &s) == 0)
+                file_identity_cache[path] = FileIdentity{fname, s.st_dev, s.st_ino};
+            *close_handle = true;
             return file_id;
         }
-        H5Fclose(file_id);
     }
     fprintf(stderr, "Failed to identify underlying HDF5 file\n");
     return (hid_t) -1;
 }
 
+/*
+ * Retrieve the descriptor of the file underlying an HDF5 handle. That is only
+ * possible with the default (sec2) driver; -1 is returned for other drivers.
+ */
+int getFileDescriptor(hid_t file_id)
+{
+    hid_t fapl_id = H5Fget_access_plist(file_id);
+    bool sec2 = H5Pget_driver(fapl_id) == H5FD_SEC2;
+    H5Pclose(fapl_id);
+
+    /* The sec2 driver hands out a pointer to its file descriptor */
+    int *file_fd = NULL;
+    if (! sec2 || H5Fget_vfd_handle(file_id, H5P_DEFAULT, (void **) &file_fd) < 0 || ! file_fd)
+        return -1;
+    return *file_fd;
+}
+
+/*
+ * Map the raw data of a dataset that is stored contiguously, without filters,
+ * in a file accessed through the default (sec2) driver. Returns NULL if the
+ * dataset doesn't satisfy these conditions, in which case it has to be read
+ * with H5Dread().
+ */
+std::shared_ptr<AnonymousMemoryMap> mapHdf5Dataset(hid_t file_id, hid_t dset_id, size_t n_bytes)
+{
+    std::shared_ptr<AnonymousMemoryMap> mapping;
+
+    hid_t dcpl_id = H5Dget_create_plist(dset_id);
+    bool contiguous =
+        H5Pget_layout(dcpl_id) == H5D_CONTIGUOUS &&
+        H5Pget_nfilters(dcpl_id) == 0 &&
+        H5Pget_external_count(dcpl_id) == 0;
+    H5Pclose(dcpl_id);
+
+    /* Storage that has not been allocated yet reads as fill values */
+    haddr_t addr = H5Dget_offset(dset_id);
+    int file_fd = getFileDescriptor(file_id);
+    if (! contiguous || file_fd < 0 || addr == HADDR_UNDEF || n_bytes == 0 ||
+        H5Dget_storage_size(dset_id) < n_bytes)
+        return mapping;
+
+    /* Raw data written by the application may still sit in HDF5's caches */
+    unsigned intent = 0;
+    if (H5Fget_intent(file_id, &intent) >= 0 && (intent & H5F_ACC_RDWR))
+        H5Fflush(file_id, H5F_SCOPE_LOCAL);
+
+    mapping = std::make_shared<AnonymousMemoryMap>(n_bytes);
+    if (! mapping->createFromFile(file_fd, addr))
+        mapping.reset();
+    return mapping;
+}
+
+/*
+ * Files opened by MPI jobs go through the MPI-IO driver, which doesn't hand out
+ * a descriptor, so they are looked up by name instead. As they are opened
+ * read-only, every rank sees the same file under that name.
+ */
+static bool statParallelFile(hid_t file_id, struct stat *statbuf)
+{
+#ifdef H5_HAVE_PARALLEL
+    hid_t fapl_id = H5Fget_access_plist(file_id);
+    bool mpio = H5Pget_driver(fapl_id) == H5FD_MPIO;
+    H5Pclose(fapl_id);
+
+    ssize_t len = mpio ? H5Fget_name(file_id, NULL, 0) : -1;
+    if (len <= 0)
+        return false;
+    std::string name(len + 1, '\0');
+    H5Fget_name(file_id, &name[0], name.size());
+    return stat(name.c_str(), statbuf) == 0;
+#else
+    return false;
+#endif
+}
+
+/*
+ * Describe the state of the input datasets so that the memoization cache can
+ * tell whether an output computed earlier is still valid: the identity, size,
+ * and modification time of the file, along with the address and modification
+ * time of each input object. Returns false if that state can't be established
+ * reliably, in which case outputs must not be cached.
+ */
+bool getInputStamp(hid_t file_id, const std::vector<InputDataset> &inputs, std::string &stamp)
+{
+    /* The application may have written to the inputs without flushing them yet */
+    unsigned intent = 0;
+    if (H5Fget_intent(file_id, &intent) < 0 || (intent & H5F_ACC_RDWR))
+        return false;
+
+    struct stat statbuf;
+    int file_fd = getFileDescriptor(file_id);
+    if (file_fd >= 0 ? fstat(file_fd, &statbuf) < 0 : ! statParallelFile(file_id, &statbuf))
+        return false;
+
+    std::ostringstream ss;
+    ss << statbuf.st_dev << ":" << statbuf.st_ino << ":" << statbuf.st_size << ":"
+       << statbuf.st_mtim.tv_sec << "." << statbuf.st_mtim.tv_nsec;
+    for (auto &input: inputs)
+    {
+        H5O_info_t info;
+        if (H5Oget_info_by_name2(
+            file_id, input.path.c_str(), &info, H5O_INFO_BASIC | H5O_INFO_TIME, H5P_DEFAULT) < 0)
+            return false;
+        ss << ";" << input.name << "@" << info.addr << ":" << info.mtime;
+    }
+    stamp = ss.str();
+    return true;
+}
+
+/*
+ * Key under which the grid computed for a dataset (or a chunk of it) is cached:
+ * the hash and size of the bytecode, followed by the dataset name, dimensions
+ * and offset. The caches compare keys in full, so that a collision of hashes
+ * can't hand out the grid of another dataset.
+ */
+std::string getGridKey(const char *bytecode, size_t bytecode_size, const DatasetInfo &info)
+{
+    uint64_t hash = hash64(bytecode, bytecode_size);
+    uint64_t size = bytecode_size, rank = info.dimensions.size();
+    std::string key;
+    key.append((const char *) &hash, sizeof(hash));
+    key.append((const char *) &size, sizeof(size));
+    key.append(info.name.c_str(), info.name.size() + 1);
+    key.append((const char *) &rank, sizeof(rank));
+    key.append((const char *) info.dimensions.data(), info.dimensions.size() * sizeof(hsize_t));
+    key.append((const char *) info.offset.data(), info.offset.size() * sizeof(hsize_t));
+    return key;
+}
+
+/*
+ * Keep the grids that a UDF wrote to its scratch datasets, which are the
+ * outputs of the sibling datasets declared in the same UDF file. They go to
+ * the memoization cache if that's enabled; otherwise they are set aside in a
+ * smaller cache until the sibling is read.
+ */
+void keepSiblingGrids(
+    const char *bytecode,
+    size_t bytecode_size,
+    std::vector<DatasetInfo> &siblings,
+    const std::string &stamp)
+{
+    auto &cache = memo_cache.enabled() ? memo_cache : sibling_grids;
+    for (auto &info: siblings)
+    {
+        auto key = getGridKey(bytecode, bytecode_size, info);
+        size_t size = info.getGridSize() * info.getStorageSize();
+        cache.put(key, stamp, info.mapping, size);
+    }
+}
+
+/*
+ * Take the grid evaluated by hdf5_udf_prefetch() under the given key, waiting
+ * for the evaluation to finish if needed. Grids computed from inputs that
+ * have changed since are discarded. On success, siblings receives the grids
+ * written to the scratch datasets and stamp the state of the inputs.
+ */
+std::shared_ptr<AnonymousMemoryMap> takePrefetchedGrid(
+    const std::string &key,
+    hid_t file_id,
+    const std::vector<InputDataset> &inputs,
+    std::vector<DatasetInfo> &siblings,
+    std::string &stamp)
+{
+    std::shared_ptr<PrefetchJob> job;
+    size_t index = 0;
+    {
+        std::lock_guard<std::mutex> guard(prefetch_lock);
+        auto it = prefetched_grids.find(key);
+        if (it == prefetched_grids.end())
+            return NULL;
+        job = it->second.first;
+        index = it->second.second;
+        prefetched_bytes -= job->tasks[index].size;
+        prefetched_grids.erase(it);
+    }
+
+    /* Other threads may be waiting for the job as well, so we can't hold the lock */
+    ProfileTimer wait_timer;
+    job->result.wait();
+    profiler.record("prefetch", wait_timer.elapsed());
+
+    auto &task = job->tasks[index];
+    std::shared_ptr<AnonymousMemoryMap> mapping = task.output.mapping;
+    task.output.mapping.reset();
+    if (! task.success || ! getInputStamp(file_id, inputs, stamp) ||
+        stamp.compare(job->stamp) != 0)
+    {
+        task.datasets.clear();
+        return NULL;
+    }
+    siblings.assign(task.datasets.begin() + std::min(job->num_inputs, task.datasets.size()),
+        task.datasets.end());
+    task.datasets.clear();
+    return mapping;
+}
+
+/* Upper limit of chunks of a single input dataset that we schedule for prefetching */
+#define MAX_PREFETCH_CHUNKS 65536
+
+/*
+ * Schedule the file storage of an input dataset for prefetching. Only the
+ * storage that holds the given selection is considered: the chunks that
+ * intersect it or, for contiguous layouts, the extent between its first and
+ * last elements.
+ */
+void prefetchHdf5Dataset(
+    Prefetcher &prefetcher,
+    int fd,
+    hid_t dset_id,
+    std::vector<hsize_t> &dims,
+    std::vector<hsize_t> &start,
+    std::vector<hsize_t> &count)
+{
+    hsize_t n_selected = std::accumulate(
+        std::begin(count), std::end(count), (hsize_t) 1, std::multiplies<hsize_t>());
+    if (n_selected == 0)
+        return;
+
+    hid_t dcpl_id = H5Dget_create_plist(dset_id);
+    H5D_layout_t layout = H5Pget_layout(dcpl_id);
+    if (layout == H5D_CONTIGUOUS && H5Pget_external_count(dcpl_id) == 0)
+    {
+        haddr_t addr = H5Dget_offset(dset_id);
+        hid_t type_id = H5Dget_type(dset_id);
+        size_t element_size = H5Tget_size(type_id);
+        H5Tclose(type_id);
+
+        hsize_t first = 0, last = 0;
+        for (size_t i=0; i<dims.size(); ++i)
+        {
+            first = first * dims[i] + start[i];
+            last = last * dims[i] + start[i] + count[i] - 1;
+        }
+        if (addr != HADDR_UNDEF)
+            prefetcher.add(fd, addr + first * element_size, (last - first + 1) * element_size);
+    }
+#if H5_VERSION_GE(1,10,5)
+    else if (layout == H5D_CHUNKED)
+    {
+        std::vector<hsize_t> chunk(dims.size()), first(dims.size()), n_chunks(dims.size());
+        H5Pget_chunk(dcpl_id, chunk.size(), chunk.data());
+        for (size_t i=0; i<dims.size(); ++i)
+        {
+            first[i] = start[i] / chunk[i];
+            n_chunks[i] = (start[i] + count[i] - 1) / chunk[i] - first[i] + 1;
+        }
+
+        /* Visit the chunks that intersect the selection, in row-major order */
+        hsize_t total = std::accumulate(
+            std::begin(n_chunks), std::end(n_chunks), (hsize_t) 1, std::multiplies<hsize_t>());
+        std::vector<hsize_t> coords(dims.size());
+        for (hsize_t n=0; n<total && n<MAX_PREFETCH_CHUNKS; ++n)
+        {
+            hsize_t index = n;
+            for (ssize_t i=dims.size()-1; i>=0; --i)
+            {
+                coords[i] = (first[i] + index % n_chunks[i]) * chunk[i];
+                index /= n_chunks[i];
+            }
+
+            unsigned filter_mask;
+            haddr_t addr;
+            hsize_t size;
+            herr_t status;
+            H5E_BEGIN_TRY {
+                status = H5Dget_chunk_info_by_coord(dset_id, coords.data(), &filter_mask, &addr, &size);
+            } H5E_END_TRY;
+            if (status >= 0 && addr != HADDR_UNDEF)
+                prefetcher.add(fd, addr, size);
+        }
+    }
+#endif
+    H5Pclose(dcpl_id);
+}
+
+/* Retrieve the decoded bytecode of a payload. Returns NULL on failure. */
+std::shared_ptr<const std::string> decodeBytecode(const Payload &payload)
+{
+    uint64_t hash = hash64(payload.bytecode, payload.bytecode_size);
+    {
+        std::lock_guard<std::mutex> guard(decoded_bytecodes_lock);
+        for (auto &entry: decoded_bytecodes)
+            if (entry.hash == hash &&
+                entry.encoded.size() == payload.bytecode_size &&
+                memcmp(entry.encoded.data(), payload.bytecode, payload.bytecode_size) == 0)
+            {
+                return entry.decoded;
+            }
+    }
+
+    ProfileTimer timer;
+    std::string decoded;
+    if (! decodeBuffer(payload.codec, payload.bytecode, payload.bytecode_size,
+        payload.decoded_size, decoded))
+        return NULL;
+    profiler.record("decode", timer.elapsed(), decoded.size());
+
+    DecodedBytecode entry;
+    entry.hash = hash;
+    entry.encoded.assign(payload.bytecode, payload.bytecode_size);
+    entry.decoded = std::make_shared<const std::string>(std::move(decoded));
+
+    std::lock_guard<std::mutex> guard(decoded_bytecodes_lock);
+    if (decoded_bytecodes.size() >= MAX_DECODED_BYTECODES)
+        decoded_bytecodes.erase(decoded_bytecodes.begin());
+    decoded_bytecodes.push_back(entry);
+    return entry.decoded;
+}
+
+/*
+ * Whether the payload has been signed with one of the trusted keys. The
+ * signature covers the header along with the bytecode. UDFs of trusted
+ * payloads run in the calling process, without a sandbox.
+ */
+static bool isTrusted(const Payload &payload)
+{
+    if (payload.signature.size() == 0 || ! trusted_keys.enabled())
+        return false;
+    ProfileTimer timer;
+    bool trusted = trusted_keys.verify(getSignedMessage(payload), payload.signature);
+    profiler.record("verify", timer.elapsed(), payload.bytecode_size);
+    return trusted;
+}
+
+/*
+ * Whether the UDF may run with the given backend. Backends that run on a device
+ * launch their kernels from the calling process, out of reach of the sandbox,
+ * so their UDFs must be trusted, unless $HDF5_UDF_CUDA_ALLOW_UNSIGNED is set.
+ */
+static bool mayRun(Backend *backend, bool trusted)
+{
+    if (trusted || ! backend->runsOnDevice())
+        return true;
+    const char *env = getenv("HDF5_UDF_CUDA_ALLOW_UNSIGNED");
+    if (env && atoi(env) == 1)
+        return true;
+    fprintf(stderr, "Refusing to run an unsigned %s UDF, which would not be isolated; "
+        "sign it or set $HDF5_UDF_CUDA_ALLOW_UNSIGNED=1\n", backend->name().c_str());
+    return false;
+}
+
+/*
+ * Number of rows (that is, of elements along the slowest-varying dimension)
+ * of the output grid that a streaming UDF is evaluated on at a time. Blocks
+ * are sized so that the matching hyperslabs of the inputs, the scratch grids
+ * and the output fit in the block budget. Inputs with a different rank than
+ * the output are read in full for every block and are not accounted for.
+ */
+hsize_t getBlockRows(
+    hid_t file_id,
+    const std::vector<InputDataset> &inputs,
+    size_t num_scratch,
+    const DatasetInfo &output_dataset)
+{
+    auto &dims = output_dataset.dimensions;
+    hsize_t row_elements = std::accumulate(
+        std::begin(dims) + 1, std::end(dims), (hsize_t) 1, std::multiplies<hsize_t>());
+    size_t row_bytes = row_elements * output_dataset.getStorageSize() * (1 + num_scratch);
+
+    for (auto &input: inputs)
+    {
+        hid_t type_id, mem_type_id;
+        hid_t dset_id = openInputDataset(file_id, input, &type_id, &mem_type_id);
+        if (dset_id < 0)
+            continue;
+        hid_t space_id = H5Dget_space(dset_id);
+        if (H5Sget_simple_extent_ndims(space_id) == (int) dims.size())
+            row_bytes += row_elements * H5Tget_size(mem_type_id);
+        H5Tclose(mem_type_id);
+        H5Tclose(type_id);
+        H5Sclose(space_id);
+        H5Dclose(dset_id);
+    }
+
+    hsize_t rows = row_bytes ? block_budget / row_bytes : dims[0];
+    return std::max((hsize_t) 1, std::min(rows, dims[0]));
+}
+
 std::vector<DatasetInfo> readHdf5Datasets(
     hid_t file_id,
-    std::vector<std::string> &input_names,
-    std::vector<std::string> &scratch_names)
+    const std::vector<InputDataset> &inputs,
+    const std::vector<InputDataset> &scratch,
+    std::vector<hsize_t> &chunk_offset,
+    std::vector<hsize_t> &chunk_dims,
+    bool sliced,
+    Prefetcher &prefetcher)
 {
-    auto readHdf5Dataset = [&](hid_t file_id, std::string dname, bool read_data)
+    /*
+     * Returns the selection of a dataset that is needed to produce this chunk.
+     * Only chunked and streaming UDFs are evaluated on a part of the output;
+     * the others see their inputs in full, whatever their dimensions.
+     */
+    auto getSelection = [&](std::vector<hsize_t> &dims, std::vector<hsize_t> &start, std::vector<hsize_t> &count)
+    {
+        bool partial = sliced && chunk_dims.size() == dims.size() && (chunk_dims != dims ||
+            std::any_of(chunk_offset.begin(), chunk_offset.end(), [](hsize_t n) { return n != 0; }));
+        start.assign(dims.size(), 0);
+        count = dims;
+        for (size_t i=0; partial && i<dims.size(); ++i)
+        {
+            start[i] = chunk_offset[i];
+            count[i] = chunk_offset[i] >= dims[i] ? 0 :
+                std::min(chunk_dims[i], dims[i] - chunk_offset[i]);
+        }
+        return partial;
+    };
+
+    /*
+     * Input datasets are read one after another, as HDF5 calls can't be made
+     * concurrently. Their storage can be brought into the page cache in the
+     * background, though, so that the latencies of the reads overlap.
+     */
+    int fd = getFileDescriptor(file_id);
+    if (prefetcher.enabled() && fd >= 0)
+    {
+        for (auto &input: inputs)
+        {
+            hid_t dset_id = H5Dopen(file_id, input.path.c_str(), H5P_DEFAULT);
+            if (dset_id < 0)
+                continue;
+            hid_t space_id = H5Dget_space(dset_id);
+            std::vector<hsize_t> dims(H5Sget_simple_extent_ndims(space_id)), start, count;
+            H5Sget_simple_extent_dims(space_id, dims.data(), NULL);
+            getSelection(dims, start, count);
+            prefetchHdf5Dataset(prefetcher, fd, dset_id, dims, start, count);
+            H5Sclose(space_id);
+            H5Dclose(dset_id);
+        }
+        prefetcher.start();
+    }
+
+    auto readHdf5Dataset = [&](hid_t file_id, const InputDataset &input, bool read_data)
     {
         Benchmark benchmark;
+        ProfileTimer timer;
+        const char *phase = read_data ? "read" : NULL;
         DatasetInfo out;
 
-        /* Open .h5 file in read-only mode */
-        hid_t dset_id = H5Dopen(file_id, dname.data(), H5P_DEFAULT);
+        /*
+         * Open .h5 file in read-only mode. Members of compound datasets and
+         * big-endian datasets are read through a memory type that has HDF5
+         * gather and convert their values into a dense little-endian array.
+         */
+        hid_t mem_type_id;
+        hid_t dset_id = openInputDataset(file_id, input, &out.hdf5_datatype, &mem_type_id);
         if (dset_id < 0)
         {
             fprintf(stderr, "Failed to open dataset for reading\n");
@@ -116,78 +928,149 @@ std::vector<DatasetInfo> readHdf5Datasets(
         }
 
         /* Retrieve datatype */
-        out.hdf5_datatype = H5Dget_type(dset_id);
         out.datatype = out.getDatatype();
 
-        /* Retrieve number of dimensions and compute total grid size, in bytes */
+        /* Retrieve number of dimensions */
         hid_t space_id = H5Dget_space(dset_id);
-        out.dimensions.resize(H5Sget_simple_extent_ndims(space_id));
-        H5Sget_simple_extent_dims(space_id, out.dimensions.data(), NULL);
-        hsize_t n_elements = std::accumulate(
-            std::begin(out.dimensions), std::end(out.dimensions), 1, std::multiplies<hsize_t>());
+        std::vector<hsize_t> dims(H5Sget_simple_extent_ndims(space_id));
+        H5Sget_simple_extent_dims(space_id, dims.data(), NULL);
+
+        /*
+         * When the virtual dataset is chunked we only need the hyperslab of this
+         * dataset that matches the chunk being evaluated. That only makes sense
+         * for datasets with the same rank as the output; others are read in full.
+         */
+        std::vector<hsize_t> start, count;
+        bool partial = getSelection(dims, start, count);
+        if (partial)
+            out.setExtent(chunk_dims, chunk_offset);
+        else
+            out.setExtent(dims, std::vector<hsize_t>(dims.size(), 0));
+
+        /* Compute total grid size, in bytes */
+        hsize_t n_elements = out.getGridSize();
+        size_t n_bytes = n_elements * H5Tget_size(mem_type_id);
 
-        /* Allocate enough memory so we can read this dataset */
-        void *rdata = (void *) malloc(n_elements * H5Tget_size(out.hdf5_datatype));
-        if (! rdata)
+        /*
+         * Inputs stored contiguously and without filters are mapped straight
+         * from the file, so their pages are only read when touched by the UDF.
+         * That requires the file to hold them in the layout seen by the UDF.
+         */
+        std::shared_ptr<AnonymousMemoryMap> mapping;
+        if (read_data && ! partial && H5Tequal(out.hdf5_datatype, mem_type_id) > 0)
         {
-            fprintf(stderr, "Not enough memory while allocating room for dataset\n");
-            return out;
+            mapping = mapHdf5Dataset(file_id, dset_id, n_bytes);
+            if (mapping)
+            {
+                benchmark.print("Time to map dataset from disk");
+                phase = "map";
+                read_data = false;
+            }
         }
 
+        /*
+         * Otherwise, allocate enough memory so we can read this dataset. We use
+         * a shared memory segment so that the grid can be handed to worker
+         * processes. Segments come from the arena, so they only need to be
+         * cleared when the grid is not entirely overwritten by H5Dread():
+         * scratch datasets and edge chunks.
+         */
+        if (! mapping)
+        {
+            bool zeroed = ! read_data ||
+                (partial && std::accumulate(std::begin(count), std::end(count),
+                    (hsize_t) (hsize_t) 1, std::multiplies<hsize_t>()) != n_elements);
+            mapping = buffer_arena.get(n_bytes, zeroed);
+            if (! mapping)
+            {
+                fprintf(stderr, "Not enough memory while allocating room for dataset\n");
+                H5Tclose(mem_type_id);
+                H5Sclose(space_id);
+                H5Dclose(dset_id);
+                return out;
+            }
+        }
+        void *rdata = (char *) mapping->mm + mapping->shift;
+
         /* Read the dataset */
-        if (read_data)
+        if (read_data && partial)
         {
-            if (H5Dread(dset_id, out.hdf5_datatype, H5S_ALL, H5S_ALL, H5P_DEFAULT, rdata) < 0)
+            /* Edge chunks are only partially covered by the input data */
+            std::vector<hsize_t> mem_start(dims.size(), 0);
+            hsize_t n_selected = std::accumulate(
+                std::begin(count), std::end(count), (hsize_t) 1, std::multiplies<hsize_t>());
+            if (n_selected > 0)
+            {
+                hid_t mem_space_id = H5Screate_simple(chunk_dims.size(), chunk_dims.data(), NULL);
+                H5Sselect_hyperslab(
+                    space_id, H5S_SELECT_SET, chunk_offset.data(), NULL, count.data(), NULL);
+                H5Sselect_hyperslab(
+                    mem_space_id, H5S_SELECT_SET, mem_start.data(), NULL, count.data(), NULL);
+                herr_t status = H5Dread(
+                    dset_id, mem_type_id, mem_space_id, space_id, H5P_DEFAULT, rdata);
+                H5Sclose(mem_space_id);
+                if (status < 0)
+                {
+                    fprintf(stderr, "Failed to read HDF5 dataset\n");
+                    mapping.reset();
+                    rdata = NULL;
+                }
+                else
+                    benchmark.print("Time to read dataset hyperslab from disk");
+            }
+        }
+        else if (read_data)
+        {
+            if (H5Dread(dset_id, mem_type_id, H5S_ALL, H5S_ALL, H5P_DEFAULT, rdata) < 0)
             {
                 fprintf(stderr, "Failed to read HDF5 dataset\n");
-                free(rdata);
+                mapping.reset();
                 rdata = NULL;
             }
             else
                 benchmark.print("Time to read dataset from disk");
         }
-        else
-            memset(rdata, 0, n_elements * H5Tget_size(out.hdf5_datatype));
 
+        H5Tclose(mem_type_id);
         H5Sclose(space_id);
         H5Dclose(dset_id);
+        if (phase && rdata)
+            profiler.record(phase, timer.elapsed(), n_bytes, input.name);
 
-        out.name = dname;
+        out.name = input.name;
         out.data = rdata;
+        out.mapping = mapping;
         return out;
     };
 
     bool error = false;
     std::vector<DatasetInfo> out;
-    for (auto name: input_names)
+    for (auto &input: inputs)
     {
-        auto info = readHdf5Dataset(file_id, name, true);
+        auto info = readHdf5Dataset(file_id, input, true);
         if (info.data == NULL)
         {
-            fprintf(stderr, "Failed to read input dataset %s from HDF5 file\n", name.c_str());
+            fprintf(stderr, "Failed to read input dataset %s from HDF5 file\n", input.name.c_str());
             error = true;
             break;
         }
         out.push_back(info);
     }
-    for (auto name: scratch_names)
+    for (auto &input: scratch)
     {
-        auto info = readHdf5Dataset(file_id, name, false);
+        auto info = readHdf5Dataset(file_id, input, false);
         if (info.data == NULL)
         {
-            fprintf(stderr, "Failed to allocate scratch dataset for %s\n", name.c_str());
+            fprintf(stderr, "Failed to allocate scratch dataset for %s\n", input.name.c_str());
             error = true;
             break;
         }
+        info.scratch = true;
         out.push_back(info);
     }
 
     if (error)
-    {
-        for (auto &entry: out)
-            free(entry.data);
         out.clear();
-    }
     return out;
 }
 
@@ -197,25 +1080,61 @@ const unsigned int *cd_values, size_t nbytes, size_t *buf_size, void **buf)
 {
     if (flags & H5Z_FLAG_REVERSE)
     {
-        std::string json_string((const char *)*buf);
-        json jas = json::parse(json_string);
+        /* Phases of reads that fail are dropped rather than attributed to the next read */
+        ProfileScope profile_scope;
+        ProfileTimer total_timer, parse_timer;
+        Payload payload;
+        if (! readPayload(*buf, nbytes, payload))
+            return 0;
+        profiler.record("parse", parse_timer.elapsed(), payload.header_size);
+
+        /* Signatures cover the bytecode as stored, so they are checked before decoding it */
+        bool trusted = isTrusted(payload);
+
+        /* Decode the bytecode, unless it's stored as-is */
+        std::shared_ptr<const std::string> decoded;
+        if (payload.codec != CODEC_NONE)
+        {
+            decoded = decodeBytecode(payload);
+            if (! decoded)
+            {
+                fprintf(stderr, "Failed to decode the UDF bytecode\n");
+                return 0;
+            }
+            payload.bytecode = decoded->data();
+            payload.bytecode_size = decoded->size();
+        }
+
+        /* Retrieve metadata stored in the payload header */
+        auto bytecode_size = payload.bytecode_size;
+        auto &input_names = payload.input_names;
+        auto &scratch_names = payload.scratch_names;
+        auto &datatype = payload.output_datatype;
+        auto &output_name = payload.output_name;
+        auto &backend_name = payload.backend;
+        bool streaming = payload.streaming;
 
-        /* Retrieve metadata stored in the JSON payload */
-        int bytecode_size = jas["bytecode_size"].get<int>();
-        auto input_names = jas["input_datasets"].get<std::vector<std::string>>();
-        auto scratch_names = jas["scratch_datasets"].get<std::vector<std::string>>();
-        auto datatype = jas["output_datatype"].get<std::string>();
-        auto resolution = jas["output_resolution"].get<std::vector<hsize_t>>();
-        auto output_name = jas["output_dataset"].get<std::string>();
-        auto backend_name = jas["backend"].get<std::string>();
+        /* UDFs compiled before slots were introduced look datasets up by name */
+        auto &slots = payload.slots;
+        auto slotOf = [&slots](const std::string &name) -> int {
+            auto it = std::find(slots.begin(), slots.end(), name);
+            return it == slots.end() ? -1 : it - slots.begin();
+        };
 
-        auto backend = getBackendByName(backend_name);
+        /* Chunked datasets tell which chunk of the output grid we are producing */
+        auto &chunk_dims = payload.chunk_dims;
+        auto &chunk_offset = payload.chunk_offset;
+
+        std::unique_ptr<Backend> backend(getBackendByName(backend_name));
         if (! backend)
         {
             fprintf(stderr, "No backend has been found to execute %s code\n",
                 backend_name.c_str());
             return 0;
         }
+        trusted = trusted && backend->supportsInProcess();
+        if (! mayRun(backend.get(), trusted))
+            return 0;
 
         auto filterpath = getFilterPath();
         if (filterpath.size() == 0)
@@ -225,65 +1144,675 @@ const unsigned int *cd_values, size_t nbytes, size_t *buf_size, void **buf)
         }
 
         /* Workaround for lack of API to retrieve the HDF5 file handle from the filter callback */
-        bool handle_from_procfs = false;
-        hid_t file_id = getDatasetHandle(output_name, &handle_from_procfs);
+        ProfileTimer handle_timer;
+        bool close_handle = false;
+        hid_t file_id = getDatasetHandle(output_name, chunk_offset, *buf, nbytes, &close_handle);
         if (file_id == -1)
             return 0;
+        profiler.record("handle", handle_timer.elapsed());
 
-        /* Allocate input and output grids */
-        auto input_datasets = readHdf5Datasets(file_id, input_names, scratch_names);
-        DatasetInfo output_dataset(output_name, resolution, datatype);
+        /* Allocate the output grid. HDF5 takes ownership of it, releasing it with free() */
+        DatasetInfo output_dataset(output_name, chunk_dims, datatype);
+        output_dataset.setExtent(chunk_dims, chunk_offset);
         output_dataset.hdf5_datatype = output_dataset.getHdf5Datatype();
-        output_dataset.data = (void *) malloc(
-            output_dataset.getStorageSize() * output_dataset.getGridSize());
+        output_dataset.slot = slotOf(output_name);
+        size_t room_size = output_dataset.getStorageSize() * output_dataset.getGridSize();
+        output_dataset.data = malloc(room_size ? : 1);
         if (! output_dataset.data)
         {
             fprintf(stderr, "Not enough memory allocating output grid\n");
-            if (handle_from_procfs)
+            if (close_handle)
                 H5Fclose(file_id);
             return 0;
         }
 
-        /* Execute the user-defined function */
+        /*
+         * Outputs computed earlier can be served from the memoization cache
+         * (or, for sibling datasets, from the scratch grids kept aside by the
+         * last run) as long as none of the inputs have changed since then.
+         */
         Benchmark benchmark;
-        auto dtype = output_dataset.getCastDatatype();
-        char *bytecode = (char *)(((char *) *buf) + *buf_size - bytecode_size);
-        if (! backend->run(
-            filterpath, input_datasets, output_dataset, dtype, bytecode, bytecode_size))
+        char *bytecode = (char *) payload.bytecode;
+        std::string stamp;
+        std::vector<DatasetInfo> prefetched_siblings;
+        auto key = getGridKey(bytecode, bytecode_size, output_dataset);
+        auto inputs = resolveInputs(file_id, input_names);
+        auto scratch = resolveInputs(file_id, scratch_names);
+        auto prefetched = takePrefetchedGrid(key, file_id, inputs, prefetched_siblings, stamp);
+        bool stamped = prefetched ||
+            ((memo_cache.enabled() || node_cache.enabled() || scratch_names.size()) &&
+            getInputStamp(file_id, inputs, stamp));
+        std::shared_ptr<AnonymousMemoryMap> memo;
+        NodeCache::Entry node_entry;
+        if (prefetched && prefetched->mm_size - prefetched->shift >= room_size)
+        {
+            /* Grids evaluated ahead of the read are kept like the ones computed here */
+            memo = prefetched;
+            keepSiblingGrids(bytecode, bytecode_size, prefetched_siblings, stamp);
+            if (memo_cache.enabled())
+                memo_cache.put(key, stamp, memo, room_size);
+        }
+        else if (stamped)
+        {
+            memo = sibling_grids.take(key, stamp);
+            if (! memo && memo_cache.enabled())
+                memo = memo_cache.get(key, stamp);
+            if (memo && memo->mm_size - memo->shift < room_size)
+                memo.reset();
+
+            /*
+             * Other processes of the node (e.g., MPI ranks reading overlapping
+             * selections) may have computed the grid already. On a miss, they
+             * wait for us to compute it rather than compute it themselves.
+             */
+            if (! memo && node_cache.enabled())
+                memo = node_cache.get(key, stamp, room_size, node_entry);
+        }
+
+        /*
+         * Virtual datasets attached with --materialize keep a copy of their
+         * grid in the file, which is served as long as the inputs match the
+         * fingerprints recorded along with it. Checksumming the inputs takes
+         * a full read of them, so the verdict is remembered until their state
+         * changes. That state can't be established for files open for writing,
+         * whose inputs may change at any time, so the UDF runs as usual there
+         * rather than checksumming the inputs on every read.
+         */
+        unsigned intent = 0;
+        bool materialized = payload.materialized &&
+            H5Fget_intent(file_id, &intent) >= 0 && ! (intent & H5F_ACC_RDWR);
+        bool fresh = false;
+        if (materialized && ! memo)
+        {
+            ProfileTimer materialized_timer;
+            auto &materialized_name = payload.materialized_name;
+            std::string fresh_stamp;
+            dev_t dev = 0;
+            ino_t ino = 0;
+            bool known = getFileIdentity(file_id, &dev, &ino) &&
+                getInputStamp(file_id, inputs, fresh_stamp);
+            auto fresh_key = std::make_tuple(dev, ino, materialized_name);
+            if (known && fresh_materialized[fresh_key] == fresh_stamp)
+                fresh = true;
+            else
+            {
+                auto fingerprints = getStoredFingerprints(file_id, materialized_name,
+                    json::parse(payload.fingerprints, NULL, false));
+                fresh = matchFingerprints(file_id, inputs, fingerprints);
+                if (fresh && known)
+                    fresh_materialized[fresh_key] = fresh_stamp;
+            }
+            fresh = fresh && readMaterialized(file_id, materialized_name, output_dataset);
+            if (fresh)
+            {
+                profiler.record("materialized", materialized_timer.elapsed(), room_size);
+                benchmark.print("Time to read materialized grid");
+            }
+        }
+
+        bool success = false;
+        if (fresh)
+            success = true;
+        else if (memo)
+        {
+            ProfileTimer cache_timer;
+            success = memo->transfer(output_dataset.data, room_size);
+            profiler.record("cache", cache_timer.elapsed(), room_size);
+            benchmark.print("Time to retrieve grid from memoization cache");
+        }
+        else
+        {
+            /*
+             * Streaming UDFs are evaluated on blocks of consecutive rows of the
+             * output grid, one block at a time, so that only the matching
+             * hyperslabs of the inputs have to be held in memory at once.
+             */
+            hsize_t rows = chunk_dims[0];
+            bool sliced = streaming || chunk_dims != payload.resolution;
+            hsize_t block_rows = streaming ?
+                getBlockRows(file_id, inputs, scratch_names.size(), output_dataset) : rows;
+            size_t row_bytes = rows ? room_size / rows : 0;
+
+            success = true;
+            for (hsize_t row=0; success && row<rows; row+=block_rows)
+            {
+                /* The first block starts at the beginning of the output grid */
+                DatasetInfo block = output_dataset;
+                if (block_rows < rows)
+                {
+                    auto block_dims = chunk_dims;
+                    auto block_offset = chunk_offset;
+                    block_dims[0] = std::min(block_rows, rows - row);
+                    block_offset[0] += row;
+                    block.setExtent(block_dims, block_offset);
+                    block.data = (char *) output_dataset.data + row * row_bytes;
+                }
+
+                Prefetcher prefetcher;
+                auto input_datasets = readHdf5Datasets(
+                    file_id, inputs, scratch, block.offset, block.dimensions, sliced, prefetcher);
+                for (auto &info: input_datasets)
+                    info.slot = slotOf(info.name);
+
+                /*
+                 * Trusted UDFs write straight to the output grid, unless it has to
+                 * be shared: with the memoization cache, which keeps it, or with the
+                 * processes forked by lib.parallel_for(). So do UDFs that run on a
+                 * device, which never fork.
+                 */
+                bool device = backend->runsOnDevice();
+                bool direct = (trusted || device) && ! (stamped && memo_cache.enabled()) &&
+                    (device || getParallelism() == 1);
+                block.mapping = direct ? nullptr : createOutputMapping(block);
+                success = false;
+                if (input_datasets.size() == input_names.size() + scratch_names.size() &&
+                    (block.mapping || direct))
+                {
+                    /* Execute the user-defined function */
+                    auto dtype = block.getCastDatatype();
+                    SchedulerSlot slot(scheduler);
+                    success = trusted ?
+                        backend->runInProcess(
+                            filterpath, input_datasets, block, bytecode, bytecode_size) :
+                        worker_pool.enabled() && ! device ?
+                        worker_pool.run(
+                            backend.get(), filterpath, input_datasets, block, bytecode, bytecode_size) :
+                        backend->run(
+                            filterpath, input_datasets, block, dtype, bytecode, bytecode_size);
+                    benchmark.print("Call to user-defined function");
+                }
+
+                /*
+                 * The memory file that received the grid now backs the cache entry
+                 * as well. Grids written to the scratch datasets are the outputs of
+                 * sibling datasets, which are likely to be read next. Neither is
+                 * available when the grid has been produced in blocks.
+                 */
+                if (success && stamped && block_rows >= rows)
+                {
+                    std::vector<DatasetInfo> siblings(
+                        input_datasets.begin() + input_names.size(), input_datasets.end());
+                    keepSiblingGrids(bytecode, bytecode_size, siblings, stamp);
+                    if (memo_cache.enabled())
+                        memo_cache.put(key, stamp, block.mapping, room_size);
+                }
+            }
+
+            /* Hand the grid to the processes waiting on the entry, which is unlocked on failure as well */
+            if (success && node_entry.locked())
+            {
+                ProfileTimer node_timer;
+                node_cache.put(node_entry, key, stamp, output_dataset.data, room_size);
+                profiler.record("node_cache", node_timer.elapsed(), room_size);
+            }
+        }
+
+        if (! success)
         {
+            free(output_dataset.data);
             nbytes = 0;
         } 
         else 
         {
-            auto n_elements = output_dataset.getGridSize();
-            auto storage_size = output_dataset.getStorageSize();
-
             free(*buf);
             *buf = (void *) output_dataset.data;
-            *buf_size = n_elements * storage_size;
-            nbytes = n_elements * storage_size;
-            benchmark.print("Call to user-defined function");
+            *buf_size = room_size;
+            nbytes = room_size;
         }
 
-        /* Release memory used by auxiliary datasets */
-        for (size_t i=0; i<input_datasets.size(); ++i)
-            free(input_datasets[i].data);
-
-        if (handle_from_procfs)
+        if (close_handle)
             H5Fclose(file_id);
+
+        profiler.record("total", total_timer.elapsed(), nbytes);
+        profiler.flush(output_name, backend_name, chunk_offset);
     }
     else
     {
-        std::string json_string((const char *) *buf);
-        json jas = json::parse(json_string);
-        int bytecode_size = jas["bytecode_size"].get<int>();
-        nbytes = json_string.length() + bytecode_size + 1;
-        *buf_size = nbytes;
+        nbytes = getPayloadSize(*buf, nbytes);
+        if (nbytes)
+            *buf_size = nbytes;
     }
 
     return nbytes;
 }
 
+/* Key under which prefetch jobs are looked up: the file name and the dataset name */
+static std::string getPrefetchKey(hid_t file_id, const char *dataset_name)
+{
+    ssize_t len = H5Fget_name(file_id, NULL, 0);
+    if (len < 0 || dataset_name == NULL)
+        return "";
+    std::string key(len, '\0');
+    H5Fget_name(file_id, &key[0], len + 1);
+    return key + ":" + dataset_name;
+}
+
+/*
+ * Execute the UDF on each chunk of a prefetch job. Runs in the background,
+ * spreading the chunks across as many threads as the scheduler lets run at
+ * once. Each thread gets a backend object of its own.
+ */
+static bool runPrefetchJob(PrefetchJob *job)
+{
+    std::atomic<size_t> next_task(0);
+    auto runner = [job, &next_task]()
+    {
+        std::unique_ptr<Backend> backend(getBackendByName(job->backend->name()));
+        if (! backend)
+            return;
+        for (size_t i; (i = next_task++) < job->tasks.size(); )
+        {
+            auto &task = job->tasks[i];
+            ProfileTimer run_timer;
+            auto &output = task.output;
+            size_t room_size = output.getGridSize() * output.getStorageSize();
+            output.data = (char *) output.mapping->mm + output.mapping->shift;
+            {
+                SchedulerSlot slot(scheduler);
+                auto dtype = output.getCastDatatype();
+                auto bytecode = job->bytecode.data();
+                auto bytecode_size = job->bytecode.size();
+                task.success = job->trusted ?
+                    backend->runInProcess(
+                        job->filterpath, task.datasets, output, bytecode, bytecode_size) :
+                    worker_pool.enabled() && ! backend->runsOnDevice() ?
+                    worker_pool.run(
+                        backend.get(), job->filterpath, task.datasets, output, bytecode, bytecode_size) :
+                    backend->run(
+                        job->filterpath, task.datasets, output, dtype, bytecode, bytecode_size);
+            }
+            output.data = NULL;
+
+            /* Inputs are no longer needed; the scratch grids are kept for the sibling datasets */
+            for (size_t j=0; j<job->num_inputs && j<task.datasets.size(); ++j)
+                task.datasets[j].mapping.reset();
+            if (! task.success)
+                output.mapping.reset();
+
+            /* Grids dropped while the UDF ran are released here */
+            {
+                std::lock_guard<std::mutex> guard(job->lock);
+                task.finished = true;
+                if (task.dropped)
+                {
+                    output.mapping.reset();
+                    task.datasets.clear();
+                }
+            }
+
+            profiler.record("total", run_timer.elapsed(), room_size);
+            profiler.flush(output.name, backend->name(), output.offset);
+        }
+    };
+
+    size_t num_runners = std::min(job->tasks.size(), scheduler.capacity());
+    std::vector<std::thread> runners;
+    for (size_t i=1; i<num_runners; ++i)
+        runners.emplace_back(runner);
+    runner();
+    for (auto &thread: runners)
+        thread.join();
+
+    bool success = true;
+    for (auto &task: job->tasks)
+        success = success && task.success;
+    return success;
+}
+
+/*
+ * Read the payload of the chunk of a virtual dataset at the given offset.
+ * Chunks are read in their stored (filtered) form, which is the payload; the
+ * payload refers to the raw buffer, which has to outlive it.
+ */
+static bool readChunkPayload(hid_t dset_id, std::vector<hsize_t> &chunk_offset,
+    std::string &raw, Payload &payload)
+{
+    hsize_t stored_size = 0;
+    uint32_t filter_mask = 0;
+    if (H5Dget_chunk_storage_size(dset_id, chunk_offset.data(), &stored_size) < 0 || ! stored_size)
+        return false;
+    raw.resize(stored_size);
+    return H5Dread_chunk(dset_id, H5P_DEFAULT, chunk_offset.data(), &filter_mask, &raw[0]) >= 0 &&
+        readPayload(raw.data(), raw.size(), payload);
+}
+
+/*
+ * Start evaluating a virtual dataset in the background, so that a later
+ * H5Dread() of it picks up the result instead of running the UDF. The
+ * payloads and the inputs are read before returning, as HDF5 calls can't be
+ * made concurrently; the UDF then runs on a separate thread. Returns 0 on
+ * success and -1 on error.
+ */
+extern "C" int hdf5_udf_prefetch(hid_t file_id, const char *dataset_name)
+{
+    auto job_key = getPrefetchKey(file_id, dataset_name);
+    if (job_key.size() == 0)
+        return -1;
+    hid_t dset_id = H5Dopen(file_id, dataset_name, H5P_DEFAULT);
+    if (dset_id < 0)
+    {
+        fprintf(stderr, "Failed to open dataset %s\n", dataset_name);
+        return -1;
+    }
+
+    /* Virtual datasets are always chunked, even if with a single chunk */
+    hid_t space_id = H5Dget_space(dset_id);
+    hid_t dcpl_id = H5Dget_create_plist(dset_id);
+    std::vector<hsize_t> dims(H5Sget_simple_extent_ndims(space_id)), chunk(dims.size());
+    H5Sget_simple_extent_dims(space_id, dims.data(), NULL);
+    bool chunked = H5Pget_layout(dcpl_id) == H5D_CHUNKED &&
+        H5Pget_chunk(dcpl_id, chunk.size(), chunk.data()) == (int) chunk.size();
+    H5Pclose(dcpl_id);
+    H5Sclose(space_id);
+
+    auto job = std::make_shared<PrefetchJob>();
+    job->filterpath = getFilterPath();
+    bool ok = chunked && job->filterpath.size();
+    if (! ok)
+        fprintf(stderr, "Dataset %s is not a virtual dataset\n", dataset_name);
+
+    /* Read the payload and the inputs of each chunk, last dimension first */
+    std::vector<hsize_t> chunk_index(dims.size(), 0);
+    size_t job_size = 0;
+    bool done = dims.size() == 0;
+    while (ok && ! done)
+    {
+        std::vector<hsize_t> chunk_offset(dims.size());
+        for (size_t i=0; i<dims.size(); ++i)
+            chunk_offset[i] = chunk_index[i] * chunk[i];
+
+        std::string raw;
+        Payload payload;
+        ok = readChunkPayload(dset_id, chunk_offset, raw, payload);
+        if (! ok)
+        {
+            fprintf(stderr, "Failed to read the payload of dataset %s\n", dataset_name);
+            break;
+        }
+        if (payload.streaming)
+        {
+            fprintf(stderr, "Streaming UDFs can't be prefetched\n");
+            ok = false;
+            break;
+        }
+
+        /* Chunks share the bytecode and the inputs, so the first one sets up the job */
+        if (job->tasks.size() == 0)
+        {
+            job->trusted = isTrusted(payload);
+            if (payload.codec != CODEC_NONE)
+            {
+                auto decoded = decodeBytecode(payload);
+                ok = decoded != NULL;
+                if (decoded)
+                    job->bytecode = *decoded;
+            }
+            else
+                job->bytecode.assign(payload.bytecode, payload.bytecode_size);
+            job->backend.reset(getBackendByName(payload.backend));
+            job->num_inputs = payload.input_names.size();
+            if (! ok || ! job->backend)
+            {
+                fprintf(stderr, "Failed to load the UDF of dataset %s\n", dataset_name);
+                ok = false;
+                break;
+            }
+            job->trusted = job->trusted && job->backend->supportsInProcess();
+            if (! mayRun(job->backend.get(), job->trusted))
+            {
+                ok = false;
+                break;
+            }
+
+            /* The filter can only tell whether the result is still valid if the inputs can be tracked */
+            job->inputs = resolveInputs(file_id, payload.input_names);
+            job->scratch = resolveInputs(file_id, payload.scratch_names);
+            if (! getInputStamp(file_id, job->inputs, job->stamp))
+            {
+                fprintf(stderr, "Cannot prefetch %s: its inputs may change before it's read\n", dataset_name);
+                ok = false;
+                break;
+            }
+        }
+
+        auto &slots = payload.slots;
+        auto slotOf = [&slots](const std::string &name) -> int {
+            auto it = std::find(slots.begin(), slots.end(), name);
+            return it == slots.end() ? -1 : it - slots.begin();
+        };
+
+        PrefetchTask task;
+        task.success = false;
+        task.finished = false;
+        task.dropped = false;
+        task.output = DatasetInfo(payload.output_name, payload.chunk_dims, payload.output_datatype);
+        task.output.setExtent(payload.chunk_dims, payload.chunk_offset);
+        task.output.hdf5_datatype = task.output.getHdf5Datatype();
+        task.output.slot = slotOf(payload.output_name);
+        task.output.mapping = createOutputMapping(task.output);
+        task.key = getGridKey(job->bytecode.data(), job->bytecode.size(), task.output);
+
+        Prefetcher prefetcher;
+        bool sliced = payload.streaming || payload.chunk_dims != payload.resolution;
+        task.datasets = readHdf5Datasets(file_id, job->inputs, job->scratch,
+            payload.chunk_offset, payload.chunk_dims, sliced, prefetcher);
+        for (auto &info: task.datasets)
+            info.slot = slotOf(info.name);
+        ok = task.output.mapping &&
+            task.datasets.size() == payload.input_names.size() + payload.scratch_names.size();
+        if (! ok)
+        {
+            fprintf(stderr, "Failed to read the inputs of dataset %s\n", dataset_name);
+            break;
+        }
+
+        /* The output and scratch grids are held until they are read */
+        task.size = task.output.mapping->mm_size;
+        for (size_t i=job->num_inputs; i<task.datasets.size(); ++i)
+            task.size += task.datasets[i].mapping ? task.datasets[i].mapping->mm_size : 0;
+        job_size += task.size;
+        if (job_size > getPrefetchBudget())
+        {
+            fprintf(stderr, "Cannot prefetch %s: its grids take more than the %zu bytes set aside for them\n",
+                dataset_name, getPrefetchBudget());
+            ok = false;
+            break;
+        }
+        job->tasks.push_back(task);
+
+        done = true;
+        for (ssize_t i=dims.size()-1; i>=0 && done; --i)
+        {
+            if (++chunk_index[i] * chunk[i] < dims[i])
+                done = false;
+            else
+                chunk_index[i] = 0;
+        }
+    }
+    H5Dclose(dset_id);
+    if (! ok)
+        return -1;
+
+    /*
+     * Replace earlier jobs of the same dataset, dropping the grids they left
+     * unread. Jobs that are done are released once the lock is given up.
+     */
+    std::vector<std::shared_ptr<PrefetchJob>> finished;
+    {
+        std::lock_guard<std::mutex> guard(prefetch_lock);
+        auto done = std::partition(retired_jobs.begin(), retired_jobs.end(),
+            [](const std::shared_ptr<PrefetchJob> &retired) {
+                return retired->result.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+            });
+        finished.assign(done, retired_jobs.end());
+        retired_jobs.erase(done, retired_jobs.end());
+
+        job->sequence = prefetch_sequence++;
+        job->result = std::async(std::launch::async, runPrefetchJob, job.get()).share();
+        auto it = prefetch_jobs.find(job_key);
+        if (it != prefetch_jobs.end())
+        {
+            auto previous = it->second;
+            for (auto &task: previous->tasks)
+            {
+                auto grid = prefetched_grids.find(task.key);
+                if (grid != prefetched_grids.end() && grid->second.first == previous)
+                    dropPrefetchedGrid(grid);
+            }
+            if (previous->result.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+                finished.push_back(previous);
+            else
+                retired_jobs.push_back(previous);
+        }
+        prefetch_jobs[job_key] = job;
+        for (auto &task: job->tasks)
+        {
+            auto grid = prefetched_grids.find(task.key);
+            if (grid != prefetched_grids.end())
+                dropPrefetchedGrid(grid);
+        }
+
+        /* Make room for the new grids, dropping the unread grids of the oldest jobs first */
+        while (prefetched_bytes + job_size > getPrefetchBudget() && prefetched_grids.size())
+        {
+            auto oldest = std::min_element(prefetched_grids.begin(), prefetched_grids.end(),
+                [](const PrefetchedGrids::value_type &a, const PrefetchedGrids::value_type &b) {
+                    return std::make_pair(a.second.first->sequence, a.second.second) <
+                        std::make_pair(b.second.first->sequence, b.second.second);
+                });
+            dropPrefetchedGrid(oldest);
+        }
+        prefetched_bytes += job_size;
+        for (size_t i=0; i<job->tasks.size(); ++i)
+            prefetched_grids[job->tasks[i].key] = std::make_pair(job, i);
+    }
+    return 0;
+}
+
+/*
+ * Tell whether the evaluation started by hdf5_udf_prefetch() has finished.
+ * Returns 1 if it has completed successfully, 0 if it's still running, and
+ * -1 if it failed or no evaluation has been started for the dataset.
+ */
+extern "C" int hdf5_udf_poll(hid_t file_id, const char *dataset_name)
+{
+    std::shared_ptr<PrefetchJob> job;
+    {
+        std::lock_guard<std::mutex> guard(prefetch_lock);
+        auto it = prefetch_jobs.find(getPrefetchKey(file_id, dataset_name));
+        if (it == prefetch_jobs.end())
+            return -1;
+        job = it->second;
+    }
+    if (job->result.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        return 0;
+    return job->result.get() ? 1 : -1;
+}
+
+/*
+ * Wait for the evaluation started by hdf5_udf_prefetch() to finish. Returns
+ * 0 if it completed successfully and -1 otherwise.
+ */
+extern "C" int hdf5_udf_wait(hid_t file_id, const char *dataset_name)
+{
+    std::shared_ptr<PrefetchJob> job;
+    {
+        std::lock_guard<std::mutex> guard(prefetch_lock);
+        auto it = prefetch_jobs.find(getPrefetchKey(file_id, dataset_name));
+        if (it == prefetch_jobs.end())
+            return -1;
+        job = it->second;
+    }
+    return job->result.get() ? 0 : -1;
+}
+
+/*
+ * Write the materialized copy of a virtual dataset attached with
+ * --materialize=update back to the file, unless its inputs still match the
+ * copy. The file must be open for writing. The filter doesn't do that itself,
+ * as it can't create and write datasets while HDF5 is reading one. Returns 1
+ * if the copy has been written, 0 if it was up to date, and -1 on error.
+ */
+extern "C" int hdf5_udf_materialize(hid_t file_id, const char *dataset_name)
+{
+    unsigned intent = 0;
+    if (H5Fget_intent(file_id, &intent) < 0 || ! (intent & H5F_ACC_RDWR))
+    {
+        fprintf(stderr, "File must be open for writing to materialize dataset %s\n", dataset_name);
+        return -1;
+    }
+    hid_t dset_id = H5Dopen(file_id, dataset_name, H5P_DEFAULT);
+    if (dset_id < 0)
+    {
+        fprintf(stderr, "Failed to open dataset %s\n", dataset_name);
+        return -1;
+    }
+
+    /* Every chunk carries the same header, so the first one tells how the dataset was attached */
+    hid_t space_id = H5Dget_space(dset_id);
+    std::vector<hsize_t> dims(H5Sget_simple_extent_ndims(space_id)), chunk_offset(dims.size(), 0);
+    H5Sget_simple_extent_dims(space_id, dims.data(), NULL);
+    H5Sclose(space_id);
+    std::string raw;
+    Payload payload;
+    bool ok;
+    H5E_BEGIN_TRY {
+        ok = readChunkPayload(dset_id, chunk_offset, raw, payload);
+    } H5E_END_TRY;
+    if (! ok || ! payload.materialized || ! payload.materialized_update)
+    {
+        fprintf(stderr, "Dataset %s has not been attached with --materialize=update\n", dataset_name);
+        H5Dclose(dset_id);
+        return -1;
+    }
+
+    auto inputs = resolveInputs(file_id, payload.input_names);
+    auto &materialized_name = payload.materialized_name;
+    auto stored = getStoredFingerprints(file_id, materialized_name,
+        json::parse(payload.fingerprints, NULL, false));
+    json fingerprints;
+    int ret = 0;
+    if (matchFingerprints(file_id, inputs, stored) &&
+        H5Lexists(file_id, materialized_name.c_str(), H5P_DEFAULT) > 0)
+        ret = 0;
+    else if (! getFingerprints(file_id, inputs, fingerprints))
+        ret = -1;
+    else
+    {
+        /* The filter doesn't serve materialized copies of writable files, so this runs the UDF */
+        ProfileTimer materialized_timer;
+        DatasetInfo info(payload.output_name, dims, payload.output_datatype);
+        info.hdf5_datatype = info.getHdf5Datatype();
+        size_t size = info.getGridSize() * info.getStorageSize();
+        std::vector<char> grid(size);
+        info.data = grid.data();
+        ret = H5Dread(dset_id, info.hdf5_datatype, H5S_ALL, H5S_ALL, H5P_DEFAULT, info.data) >= 0 &&
+            writeMaterialized(file_id, materialized_name, info, fingerprints) ? 1 : -1;
+        info.data = NULL;
+        if (ret > 0)
+        {
+            profiler.record("materialize", materialized_timer.elapsed(), size);
+            profiler.flush(payload.output_name, payload.backend, chunk_offset);
+        }
+    }
+    H5Dclose(dset_id);
+    return ret;
+}
+
+/*
+ * Retrieve the per-phase aggregates of the reads profiled so far, as a JSON
+ * string. Works like snprintf(): returns the length of the full string, which
+ * may exceed the size of the given buffer. Profiling is enabled through
+ * $HDF5_UDF_PROFILE.
+ */
+extern "C" size_t hdf5_udf_profile(char *buffer, size_t size)
+{
+    auto summary = profiler.summary();
+    if (buffer && size)
+        snprintf(buffer, size, "%s", summary.c_str());
+    return summary.length();
+}
+
 const H5Z_class2_t H5Z_UDF_FILTER[1] = {{
     H5Z_CLASS_T_VERS,
     HDF5_UDF_FILTER_ID,
@@ -0,0 +1,257 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: kernels.cpp
+ *
+ * Vectorized elementwise kernels over the grids of user-defined-functions,
+ * exposed to the Lua template through FFI.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <limits>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "kernels.h"
+#include "backend.h"
+
+/* Elements that a kernel gives to each thread, at the least */
+#define KERNEL_GRAIN (1 << 18)
+
+/* Accumulators a reduction keeps per slice, so that they fit vector registers */
+#define KERNEL_LANES 16
+
+/* Number of slices, one per thread, as long as each gets enough elements to pay off */
+static size_t kernelSlices(size_t n)
+{
+    return std::max((size_t) 1, std::min(getParallelism(), n / KERNEL_GRAIN));
+}
+
+/* Call fn(slice, begin, end) for each slice of the range [0, n), one per thread */
+template <class F>
+static void kernelFor(size_t n, size_t slices, F fn)
+{
+    std::vector<std::thread> threads;
+    for (size_t slice=1; slice<slices; ++slice)
+        threads.push_back(std::thread(fn, slice, slice * n / slices, (slice + 1) * n / slices));
+    fn(0, 0, n / slices);
+    for (auto &thread: threads)
+        thread.join();
+}
+
+/* Call fn with a null pointer of the C type that backs the given datatype */
+template <class F>
+static bool byType(const char *datatype, F fn)
+{
+    if (! datatype)
+        return false;
+    else if (! strcmp(datatype, "int8"))   fn((int8_t *) NULL);
+    else if (! strcmp(datatype, "int16"))  fn((int16_t *) NULL);
+    else if (! strcmp(datatype, "int32"))  fn((int32_t *) NULL);
+    else if (! strcmp(datatype, "int64"))  fn((int64_t *) NULL);
+    else if (! strcmp(datatype, "uint8"))  fn((uint8_t *) NULL);
+    else if (! strcmp(datatype, "uint16")) fn((uint16_t *) NULL);
+    else if (! strcmp(datatype, "uint32")) fn((uint32_t *) NULL);
+    else if (! strcmp(datatype, "uint64")) fn((uint64_t *) NULL);
+    else if (! strcmp(datatype, "float"))  fn((float *) NULL);
+    else if (! strcmp(datatype, "double")) fn((double *) NULL);
+    else
+        return false;
+    return true;
+}
+
+/*
+ * Convert a value computed in floating point to the type of a grid. Casting
+ * values that are out of the range of an integer type is undefined, so they
+ * saturate at its limits instead, and NaN becomes 0.
+ */
+template <class T, class S>
+static inline T saturate(S v)
+{
+    typedef std::numeric_limits<T> limits;
+    if (std::is_floating_point<T>::value)
+        return static_cast<T>(v);
+    else if (v != v)
+        return 0;
+    else if (v <= static_cast<S>(limits::lowest()))
+        return limits::lowest();
+    else if (v >= static_cast<S>(limits::max()))
+        return limits::max();
+    return static_cast<T>(v);
+}
+
+/* Grids given to a kernel must hold as many elements of the same type */
+static bool compatible(const char *kernel, const DatasetInfo &out, const DatasetInfo &in)
+{
+    const char *out_type = out.getDatatype(), *in_type = in.getDatatype();
+    if (! out.data || ! in.data)
+    {
+        fprintf(stderr, "Error: %s: dataset %s has no data\n", kernel, (out.data ? in : out).name.c_str());
+        return false;
+    }
+    else if (! out_type || ! in_type || strcmp(out_type, in_type) != 0)
+    {
+        fprintf(stderr, "Error: %s: datasets %s and %s have different types\n",
+            kernel, out.name.c_str(), in.name.c_str());
+        return false;
+    }
+    else if (out.getGridSize() != in.getGridSize())
+    {
+        fprintf(stderr, "Error: %s: datasets %s and %s have different sizes\n",
+            kernel, out.name.c_str(), in.name.c_str());
+        return false;
+    }
+    return true;
+}
+
+template <class T, class F>
+static void map(T *out, const T *in, size_t n, F fn)
+{
+    kernelFor(n, kernelSlices(n), [=](size_t, size_t begin, size_t end) {
+        #pragma omp simd
+        for (size_t i=begin; i<end; ++i)
+            out[i] = fn(in[i]);
+    });
+}
+
+template <class T, class F>
+static void zip(T *out, const T *a, const T *b, size_t n, F fn)
+{
+    kernelFor(n, kernelSlices(n), [=](size_t, size_t begin, size_t end) {
+        #pragma omp simd
+        for (size_t i=begin; i<end; ++i)
+            out[i] = fn(a[i], b[i]);
+    });
+}
+
+template <class R, class T, class F>
+static R reduce(const T *in, size_t n, R init, F fn)
+{
+    size_t slices = kernelSlices(n);
+    std::vector<R> partial(slices, init);
+    kernelFor(n, slices, [&](size_t slice, size_t begin, size_t end) {
+        R acc[KERNEL_LANES];
+        std::fill(acc, acc + KERNEL_LANES, init);
+        size_t i = begin;
+        for (; i + KERNEL_LANES <= end; i += KERNEL_LANES)
+        {
+            #pragma omp simd
+            for (size_t lane=0; lane<KERNEL_LANES; ++lane)
+                acc[lane] = fn(acc[lane], static_cast<R>(in[i + lane]));
+        }
+        for (; i<end; ++i)
+            acc[0] = fn(acc[0], static_cast<R>(in[i]));
+        for (size_t lane=1; lane<KERNEL_LANES; ++lane)
+            acc[0] = fn(acc[0], acc[lane]);
+        partial[slice] = acc[0];
+    });
+
+    R result = init;
+    for (auto &value: partial)
+        result = fn(result, value);
+    return result;
+}
+
+bool mapKernel(const DatasetInfo &out, const DatasetInfo &in, const char *op, double a, double b)
+{
+    if (! compatible("lib.map", out, in))
+        return false;
+
+    bool known = true;
+    size_t n = out.getGridSize();
+    bool typed = byType(out.getDatatype(), [&](auto type) {
+        typedef typename std::remove_pointer<decltype(type)>::type T;
+        // Single precision grids are scaled in single precision, as the others would be in double
+        typedef typename std::conditional<std::is_same<T, float>::value, float, double>::type S;
+        T *o = static_cast<T *>(out.data);
+        const T *x = static_cast<const T *>(in.data);
+        S sa = a, sb = b;
+        T low = saturate<T>(a), high = saturate<T>(b);
+
+        if (! strcmp(op, "copy"))
+            map(o, x, n, [](T v) { return v; });
+        else if (! strcmp(op, "scale"))
+            map(o, x, n, [sa](T v) { return saturate<T>(v * sa); });
+        else if (! strcmp(op, "offset"))
+            map(o, x, n, [sa](T v) { return saturate<T>(v + sa); });
+        else if (! strcmp(op, "affine"))
+            map(o, x, n, [sa, sb](T v) { return saturate<T>(v * sa + sb); });
+        else if (! strcmp(op, "clamp"))
+            map(o, x, n, [low, high](T v) { return v < low ? low : (v > high ? high : v); });
+        else if (! strcmp(op, "threshold"))
+            map(o, x, n, [sa](T v) { return static_cast<T>(v >= sa ? 1 : 0); });
+        else
+            known = false;
+    });
+    if (! typed || ! known)
+        fprintf(stderr, "Error: lib.map: unsupported operation '%s' on %s\n", op, in.name.c_str());
+    return typed && known;
+}
+
+bool zipKernel(const DatasetInfo &out, const DatasetInfo &a, const DatasetInfo &b, const char *op)
+{
+    if (! compatible("lib.zip", out, a) || ! compatible("lib.zip", out, b))
+        return false;
+
+    bool known = true;
+    size_t n = out.getGridSize();
+    bool typed = byType(out.getDatatype(), [&](auto type) {
+        typedef typename std::remove_pointer<decltype(type)>::type T;
+        T *o = static_cast<T *>(out.data);
+        const T *x = static_cast<const T *>(a.data);
+        const T *y = static_cast<const T *>(b.data);
+
+        if (! strcmp(op, "add"))
+            zip(o, x, y, n, [](T v, T w) { return static_cast<T>(v + w); });
+        else if (! strcmp(op, "sub"))
+            zip(o, x, y, n, [](T v, T w) { return static_cast<T>(v - w); });
+        else if (! strcmp(op, "mul"))
+            zip(o, x, y, n, [](T v, T w) { return static_cast<T>(v * w); });
+        else if (! strcmp(op, "div") && std::is_integral<T>::value)
+            zip(o, x, y, n, [](T v, T w) { return static_cast<T>(w ? v / w : 0); });
+        else if (! strcmp(op, "div"))
+            zip(o, x, y, n, [](T v, T w) { return static_cast<T>(v / w); });
+        else if (! strcmp(op, "min"))
+            zip(o, x, y, n, [](T v, T w) { return w < v ? w : v; });
+        else if (! strcmp(op, "max"))
+            zip(o, x, y, n, [](T v, T w) { return w > v ? w : v; });
+        else
+            known = false;
+    });
+    if (! typed || ! known)
+        fprintf(stderr, "Error: lib.zip: unsupported operation '%s' on %s\n", op, a.name.c_str());
+    return typed && known;
+}
+
+bool reduceKernel(const DatasetInfo &in, const char *op, double *result)
+{
+    if (! compatible("lib.reduce", in, in))
+        return false;
+
+    bool known = true;
+    size_t n = in.getGridSize();
+    bool typed = byType(in.getDatatype(), [&](auto type) {
+        typedef typename std::remove_pointer<decltype(type)>::type T;
+        // Sums are accumulated in the widest type of their kind
+        typedef typename std::conditional<std::is_floating_point<T>::value, double,
+            typename std::conditional<std::is_signed<T>::value, int64_t, uint64_t>::type>::type R;
+        const T *x = static_cast<const T *>(in.data);
+        typedef std::numeric_limits<T> limits;
+
+        if (! strcmp(op, "sum"))
+            *result = reduce(x, n, R(0), [](R v, R w) { return v + w; });
+        else if (! strcmp(op, "min"))
+            *result = reduce(x, n, limits::has_infinity ? limits::infinity() : limits::max(),
+                [](T v, T w) { return w < v ? w : v; });
+        else if (! strcmp(op, "max"))
+            *result = reduce(x, n, limits::has_infinity ? -limits::infinity() : limits::lowest(),
+                [](T v, T w) { return w > v ? w : v; });
+        else
+            known = false;
+    });
+    if (! typed || ! known)
+        fprintf(stderr, "Error: lib.reduce: unsupported operation '%s' on %s\n", op, in.name.c_str());
+    return typed && known;
+}
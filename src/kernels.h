@@ -0,0 +1,28 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: kernels.h
+ *
+ * Vectorized elementwise kernels over the grids of user-defined-functions,
+ * exposed to the Lua template through FFI.
+ */
+#ifndef __kernels_h
+#define __kernels_h
+
+#include "dataset.h"
+
+// Store op(in[i], a, b) in out[i] for each element of the grids, which must
+// have the same type and size. Supported operations are "copy", "scale"
+// (in*a), "offset" (in+a), "affine" (in*a+b), "clamp" (to [a, b]) and
+// "threshold" (1 where in >= a, 0 elsewhere). out may be the same as in.
+bool mapKernel(const DatasetInfo &out, const DatasetInfo &in, const char *op, double a, double b);
+
+// Store op(a[i], b[i]) in out[i] for each element of the grids, which must
+// have the same type and size. Supported operations are "add", "sub", "mul",
+// "div", "min" and "max".
+bool zipKernel(const DatasetInfo &out, const DatasetInfo &a, const DatasetInfo &b, const char *op);
+
+// Fold the elements of a grid with op, which is one of "sum", "min" and "max"
+bool reduceKernel(const DatasetInfo &in, const char *op, double *result);
+
+#endif /* __kernels_h */
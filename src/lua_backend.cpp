@@ -18,90 +18,191 @@
 #include <fstream>
 #include <sstream>
 #include <algorithm>
+#include <list>
+#include <mutex>
 #include "lua_backend.h"
-#include "anon_mmap.h"
 #include "dataset.h"
+#include "kernels.h"
+#include "hash.h"
 #include "lua.hpp"
-#ifdef ENABLE_SANDBOX
-#include "sandbox.h"
-#endif
 
-/* Lua context */
-static lua_State *State;
+/* Upper limit of idle Lua states kept by each process */
+#define MAX_RESIDENT_STATES 16
 
-#define DATA_OFFSET(i)        (void *) (((char *) &State) + i)
-#define NAME_OFFSET(i)        (void *) (((char *) &State) + 100 + i)
-#define DIMS_OFFSET(i)        (void *) (((char *) &State) + 200 + i)
-#define TYPE_OFFSET(i)        (void *) (((char *) &State) + 300 + i)
-#define CAST_OFFSET(i)        (void *) (((char *) &State) + 400 + i)
+/*
+ * Lua states that have loaded a UDF and run its init callback. They are kept
+ * once the backend object that used them is gone, so that the next reads of
+ * the dataset (or of its next chunks) skip loading the bytecode and parsing
+ * the FFI declarations, and run the traces that the JIT compiled during the
+ * previous ones. Each state is used by a single backend object at a time.
+ */
+struct ResidentState {
+    uint64_t hash;          /* Hash of the bytecode */
+    std::string bytecode;   /* Copy of the bytecode, to rule out hash collisions */
+    lua_State *L;
+};
+static std::list<ResidentState> resident_states;
+
+/* Guards the list of states, as UDFs may be read by several threads at once */
+static std::mutex resident_states_lock;
+
+/*
+ * States are only kept by the process that loaded this library: the ones
+ * seen by forked processes are copies that belong to their parent, and the
+ * lock may have been held by another thread of the parent when it forked.
+ */
+static const pid_t resident_states_owner = getpid();
 
-extern "C" int index_of(const char *element)
+/* Take an idle state that has loaded the given bytecode, if any */
+static lua_State *acquireState(uint64_t hash, const char *bytecode, size_t bytecode_size)
 {
-    for (int index=0; index<100; ++index) {
-        /* Set register key to get datasets name vector */
-        lua_pushlightuserdata(State, NAME_OFFSET(index));
-        lua_gettable(State, LUA_REGISTRYINDEX);
-        const char *name = lua_tostring(State, -1);
-        if (! strcmp(name, element))
-            return index;
-        else if (strlen(name) == 0)
-            break;
+    if (getpid() != resident_states_owner)
+        return NULL;
+    std::lock_guard<std::mutex> guard(resident_states_lock);
+    for (auto it = resident_states.rbegin(); it != resident_states.rend(); ++it)
+        if (it->hash == hash && it->bytecode.size() == bytecode_size &&
+            memcmp(it->bytecode.data(), bytecode, bytecode_size) == 0)
+        {
+            lua_State *L = it->L;
+            resident_states.erase(std::next(it).base());
+            return L;
+        }
+    return NULL;
+}
+
+/* Keep a state for later reuse, evicting the least recently used one if needed */
+static void releaseState(lua_State *L, uint64_t hash, const std::string &bytecode)
+{
+    if (getpid() != resident_states_owner)
+    {
+        lua_close(L);
+        return;
     }
+    std::lock_guard<std::mutex> guard(resident_states_lock);
+    if (resident_states.size() >= MAX_RESIDENT_STATES)
+    {
+        lua_close(resident_states.front().L);
+        resident_states.pop_front();
+    }
+    resident_states.push_back({hash, bytecode, L});
+}
+
+// Dataset names, sizes, and types of the UDF being executed by this thread,
+// indexed by slot. They belong to the backend object that runs it.
+static const std::vector<DatasetInfo> no_datasets;
+static thread_local const std::vector<DatasetInfo> *dataset_info = &no_datasets;
+
+static const DatasetInfo *dataset_at(int slot)
+{
+    if (slot >= 0 && (size_t) slot < dataset_info->size())
+        return &(*dataset_info)[slot];
+    fprintf(stderr, "Error: invalid dataset slot %d\n", slot);
+    return NULL;
+}
+
+/* Functions exported to the Lua template library (udf_template.lua) */
+extern "C" int luaGetSlot(const char *element)
+{
+    for (size_t i=0; i<dataset_info->size(); ++i)
+        if ((*dataset_info)[i].name.compare(element) == 0)
+            return i;
     fprintf(stderr, "Error: dataset %s not found\n", element);
     return -1;
 }
 
-/* Functions exported to the Lua template library (udf_template.lua) */
+extern "C" void *luaGetDataAt(int slot)
+{
+    auto info = dataset_at(slot);
+    return info ? info->data : NULL;
+}
+
+extern "C" const char *luaGetTypeAt(int slot)
+{
+    auto info = dataset_at(slot);
+    return info ? info->getDatatype() : NULL;
+}
+
+extern "C" const char *luaGetCastAt(int slot)
+{
+    auto info = dataset_at(slot);
+    return info ? info->getCastDatatype() : NULL;
+}
+
+extern "C" int luaGetRankAt(int slot)
+{
+    auto info = dataset_at(slot);
+    return info ? info->dimensions.size() : 0;
+}
+
+extern "C" const hsize_t *luaGetDimsAt(int slot)
+{
+    auto info = dataset_at(slot);
+    return info ? info->dimensions.data() : NULL;
+}
+
+extern "C" const hsize_t *luaGetOffsetAt(int slot)
+{
+    auto info = dataset_at(slot);
+    return info ? info->offset.data() : NULL;
+}
+
+extern "C" int luaForkSlices(size_t n, size_t *begin, size_t *end)
+{
+    return forkSlices(n, begin, end);
+}
+
+extern "C" int luaJoinSlices(int is_child, int ok)
+{
+    return joinSlices(is_child, ok);
+}
+
+extern "C" int luaMapAt(int out_slot, int in_slot, const char *op, double a, double b)
+{
+    auto out = dataset_at(out_slot), in = dataset_at(in_slot);
+    return out && in && mapKernel(*out, *in, op, a, b);
+}
+
+extern "C" int luaZipAt(int out_slot, int a_slot, int b_slot, const char *op)
+{
+    auto out = dataset_at(out_slot), a = dataset_at(a_slot), b = dataset_at(b_slot);
+    return out && a && b && zipKernel(*out, *a, *b, op);
+}
+
+extern "C" int luaReduceAt(int slot, const char *op, double *result)
+{
+    auto in = dataset_at(slot);
+    return in && reduceKernel(*in, op, result);
+}
+
+/* Name-based interfaces, used by UDFs compiled before slots were introduced */
 extern "C" void *luaGetData(const char *element)
 {
-    int index = index_of(element);
-    if (index >= 0)
-    {
-        /* Get datasets contents */
-        lua_pushlightuserdata(State, DATA_OFFSET(index)); 
-        lua_gettable(State, LUA_REGISTRYINDEX);
-        return lua_touserdata(State, -1);
-    }
-    return NULL;
+    int slot = luaGetSlot(element);
+    return slot >= 0 ? luaGetDataAt(slot) : NULL;
 }
 
 extern "C" const char *luaGetType(const char *element)
 {
-    int index = index_of(element);
-    if (index >= 0)
-    {
-        /* Set register key to get dataset type */
-        lua_pushlightuserdata(State, TYPE_OFFSET(index));
-        lua_gettable(State, LUA_REGISTRYINDEX);
-        return lua_tostring(State, -1);
-    }
-    return NULL;
+    int slot = luaGetSlot(element);
+    return slot >= 0 ? luaGetTypeAt(slot) : NULL;
 }
 
 extern "C" const char *luaGetCast(const char *element)
 {
-    int index = index_of(element);
-    if (index >= 0)
-    {
-        /* Set register key to get dataset type */
-        lua_pushlightuserdata(State, CAST_OFFSET(index));
-        lua_gettable(State, LUA_REGISTRYINDEX);
-        return lua_tostring(State, -1);
-    }
-    return NULL;
+    int slot = luaGetSlot(element);
+    return slot >= 0 ? luaGetCastAt(slot) : NULL;
 }
 
 extern "C" const char *luaGetDims(const char *element)
 {
-    int index = index_of(element);
-    if (index >= 0)
-    {
-        /* Set register key to get dataset size */
-        lua_pushlightuserdata(State, DIMS_OFFSET(index));
-        lua_gettable(State, LUA_REGISTRYINDEX);
-        return lua_tostring(State, -1);
-    }
-    return NULL;
+    int slot = luaGetSlot(element);
+    return slot >= 0 ? (*dataset_info)[slot].dimensions_str.c_str() : NULL;
+}
+
+extern "C" const char *luaGetOffset(const char *element)
+{
+    int slot = luaGetSlot(element);
+    return slot >= 0 ? (*dataset_info)[slot].offset_str.c_str() : NULL;
 }
 
 /* This backend's name */
@@ -116,6 +217,12 @@ std::string LuaBackend::extension()
     return ".lua";
 }
 
+/* Describe the compiler that compile() runs */
+std::string LuaBackend::describeToolchain(std::string udf_file, std::string template_file)
+{
+    return captureOutput({"luajit", "-v"});
+}
+
 /* Compile Lua to bytecode using LuaJIT. Returns the bytecode as a string. */
 std::string LuaBackend::compile(std::string udf_file, std::string template_file)
 {
@@ -166,17 +273,28 @@ std::string LuaBackend::compile(std::string udf_file, std::string template_file)
     return "";
 }
 
-/* Execute the user-defined-function embedded in the given bytecode */
-bool LuaBackend::run(
+/* Load the user-defined-function embedded in the given bytecode */
+bool LuaBackend::load(
     const std::string filterpath,
-    const std::vector<DatasetInfo> input_datasets,
-    const DatasetInfo output_dataset,
-    const char *output_cast_datatype,
     const char *bytecode,
     size_t bytecode_size)
 {
+    /* Consecutive chunks evaluated by this object reuse the state as is */
+    uint64_t hash = hash64(bytecode, bytecode_size);
+    if (state && hash == bytecode_hash && this->bytecode.size() == bytecode_size &&
+        memcmp(this->bytecode.data(), bytecode, bytecode_size) == 0)
+        return true;
+
+    /* States are owned by the backend object, so that each one runs a UDF of its own */
+    if (state)
+        releaseState(state, bytecode_hash, this->bytecode);
+    state = acquireState(hash, bytecode, bytecode_size);
+    this->bytecode.assign(bytecode, bytecode_size);
+    bytecode_hash = hash;
+    if (state)
+        return true;
+
     lua_State *L = luaL_newstate();
-    State = L;
 
     lua_pushcfunction(L, luaopen_base);
     lua_call(L,0,0);
@@ -193,54 +311,6 @@ bool LuaBackend::run(
     lua_pushcfunction(L, luaopen_table);
     lua_call(L,0,0);
 
-    // We want to make the output dataset writeable by the UDF. Because
-    // the UDF is run under a separate process we have to use a shared
-    // memory segment which both processes can read and write to.
-    size_t room_size = output_dataset.getGridSize() * output_dataset.getStorageSize();
-    AnonymousMemoryMap mm(room_size);
-    if (! mm.create())
-        return false;
-
-    // Let output_dataset.data point to the shared memory segment
-    DatasetInfo output_dataset_copy = output_dataset;
-    output_dataset_copy.data = mm.mm;
-
-    DatasetInfo empty_entry;
-    std::vector<DatasetInfo> dataset_info;
-    dataset_info.push_back(output_dataset_copy);
-    dataset_info.insert(
-        dataset_info.end(), input_datasets.begin(), input_datasets.end());
-    dataset_info.push_back(empty_entry);
-
-    /* Populate vector of dataset names, sizes, and types */
-    for (size_t i=0; i<dataset_info.size(); ++i)
-    {
-        /* Grid */
-        lua_pushlightuserdata(L, DATA_OFFSET(i));
-        lua_pushlightuserdata(L, (void *) dataset_info[i].data);
-        lua_settable(L, LUA_REGISTRYINDEX);
-
-        /* Name */
-        lua_pushlightuserdata(L, NAME_OFFSET(i));
-        lua_pushstring(L, dataset_info[i].name.c_str());
-        lua_settable(L, LUA_REGISTRYINDEX);
-
-        /* Dimensions */
-        lua_pushlightuserdata(L, DIMS_OFFSET(i));
-        lua_pushstring(L, dataset_info[i].dimensions_str.c_str());
-        lua_settable(L, LUA_REGISTRYINDEX);
-
-        /* Type */
-        lua_pushlightuserdata(L, TYPE_OFFSET(i));
-        lua_pushstring(L, dataset_info[i].getDatatype());
-        lua_settable(L, LUA_REGISTRYINDEX);
-
-        /* Type, used for casting purposes */
-        lua_pushlightuserdata(L, CAST_OFFSET(i));
-        lua_pushstring(L, dataset_info[i].getCastDatatype());
-        lua_settable(L, LUA_REGISTRYINDEX);
-    }
-
     int retValue = luaL_loadbuffer(L, bytecode, bytecode_size, "hdf5_udf_bytecode");
     if (retValue != 0)
     {
@@ -255,52 +325,77 @@ bool LuaBackend::run(
         return false;
     }
 
-    // Execute the user-defined-function under a separate process so that
-    // seccomp can kill it (if needed) without crashing the entire program
-    bool ret = false;
-    pid_t pid = fork();
-    if (pid == 0)
+    // Initialize the UDF library
+    lua_getglobal(L, "init");
+    lua_pushstring(L, filterpath.c_str());
+    if (lua_pcall(L, 1, 0, 0) != 0)
     {
-        bool ready = true;
-#ifdef ENABLE_SANDBOX
-        Sandbox sandbox;
-        ready = sandbox.init(filterpath);
-#endif
-        if (ready)
+        fprintf(stderr, "Failed to invoke the init callback: %s\n", lua_tostring(L, -1));
+        lua_close(L);
+        return false;
+    }
+
+    state = L;
+    return true;
+}
+
+/* States whose last load or execution failed have been closed already */
+LuaBackend::~LuaBackend()
+{
+    if (state)
+        releaseState(state, bytecode_hash, bytecode);
+}
+
+/* Execute the user-defined-function previously loaded */
+bool LuaBackend::execute(const std::vector<DatasetInfo> &datasets)
+{
+    lua_State *L = state;
+    if (! L)
+        return false;
+
+    /* Populate vector of dataset names, sizes, and types */
+    slot_datasets = sortBySlot(datasets);
+    dataset_info = &slot_datasets;
+
+    /* Drop what the template cached about the datasets of the previous run */
+    bool ret = true;
+    lua_getglobal(L, "hdf5_udf_reset");
+    if (lua_isfunction(L, -1))
+    {
+        if (lua_pcall(L, 0, 0, 0) != 0)
         {
-            // Initialize the UDF library
-            lua_getglobal(L, "init");
-            lua_pushstring(L, filterpath.c_str());
-            if (lua_pcall(L, 1, 0, 0) != 0)
-            {
-                fprintf(stderr, "Failed to invoke the init callback: %s\n", lua_tostring(L, -1));
-                lua_close(L);
-                _exit(1);
-            }
+            fprintf(stderr, "Failed to invoke the reset callback: %s\n", lua_tostring(L, -1));
+            ret = false;
+        }
+    }
+    else
+        lua_pop(L, 1);
 
-            // Call the UDF entry point
-            lua_getglobal(L, "dynamic_dataset");
-            if (lua_pcall(L, 0, 0, 0) != 0)
-            {
-                fprintf(stderr, "Failed to invoke the dynamic_dataset callback: %s\n", lua_tostring(L, -1));
-                lua_close(L);
-                _exit(1);
-            }
+    // Call the UDF entry point
+    if (ret)
+    {
+        lua_getglobal(L, "dynamic_dataset");
+        if (lua_pcall(L, 0, 0, 0) != 0)
+        {
+            fprintf(stderr, "Failed to invoke the dynamic_dataset callback: %s\n", lua_tostring(L, -1));
+            ret = false;
         }
-        _exit(0);
     }
-    else if (pid > 0)
+    dataset_info = &no_datasets;
+
+    /*
+     * A UDF that raised an error may have left its globals (or those of the
+     * template) half updated, so the state is not handed to later reads.
+     * The next call to load() starts over with a fresh one.
+     */
+    if (! ret)
     {
-        int status;
-        waitpid(pid, &status, 0);
-        ret = WIFEXITED(status) ? WEXITSTATUS(status) == 0 : false;
-
-        // Update output HDF5 dataset with data from shared memory segment
-        memcpy(output_dataset.data, mm.mm, room_size);
+        lua_close(L);
+        state = NULL;
+        return false;
     }
-    lua_close(L);
-
-    return ret;
+    lua_settop(L, 0);
+    return true;
 }
 
 /* Scan the UDF file for references to HDF5 dataset names */
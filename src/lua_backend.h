@@ -8,10 +8,15 @@
 #ifndef __lua_backend_h
 #define __lua_backend_h
 
+#include <stdint.h>
 #include "backend.h"
 
+struct lua_State;
+
 class LuaBackend : public Backend {
 public:
+    ~LuaBackend();
+
     // Backend name
     std::string name();
 
@@ -21,21 +26,39 @@ public:
     // Compile an input file into executable form
     std::string compile(std::string udf_file, std::string template_file);
 
-    // Execute a user-defined-function
-    bool run(
+    // Version of the LuaJIT compiler
+    std::string describeToolchain(std::string udf_file, std::string template_file);
+
+    // Each backend object holds a Lua state of its own, so several UDFs (or
+    // several instances of the same one) can run in this process at once.
+    // lib.parallel_for() forks, though, which must not happen in the
+    // application's process, so UDFs run in a child when it's enabled.
+    bool supportsInProcess() {
+        return getParallelism() == 1;
+    }
+
+    // Load the bytecode that implements the user-defined-function. States
+    // that have already loaded it are reused, along with their JIT traces.
+    bool load(
         const std::string filterpath,
-        const std::vector<DatasetInfo> input_datasets,
-        const DatasetInfo output_dataset,
-        const char *output_cast_datatype,
         const char *udf_blob,
         size_t udf_blob_size);
 
+    // Execute a previously loaded user-defined-function
+    bool execute(const std::vector<DatasetInfo> &datasets);
+
     // Scan the UDF file for references to HDF5 dataset names.
     // We use this to store the UDF dependencies in the JSON payload.
     std::vector<std::string> udfDatasetNames(std::string udf_file);
 
 private:
+    // Lua state that holds the loaded UDF, and the bytecode it was loaded from
+    lua_State *state = NULL;
     std::string bytecode;
+    uint64_t bytecode_hash = 0;
+
+    // Datasets of the current execution, indexed by slot
+    std::vector<DatasetInfo> slot_datasets;
 };
 
 #endif /* __lua_backend_h */
\ No newline at end of file
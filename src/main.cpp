@@ -4,7 +4,7 @@
  * File: main.cpp
  *
  * Compiles the UDF into executable form and embeds it as a
- * HDF5 dataset.
+ * HDF5 dataset. A manifest can be given to attach several UDFs at once.
  */
 #include <map>
 #include <fstream>
@@ -15,16 +15,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <algorithm>
-#include <fstream>
+#include <atomic>
+#include <functional>
+#include <thread>
 
 #include "filter_id.h"
 #include "dataset.h"
 #include "backend.h"
+#include "materialize.h"
+#include "payload.h"
+#include "codec.h"
+#include "signature.h"
+#include "artifact_cache.h"
 #include "json.hpp"
 
 using json = nlohmann::json;
@@ -114,13 +122,30 @@ bool DatasetOptionsParser::parseDataType(std::string text, DatasetInfo &out)
     return true;
 }
 
+/* Parse a resolution string given as XRES, XRESxYRES, or XRESxYRESxZRES */
+bool parse_resolution(std::string text, std::vector<hsize_t> &out)
+{
+    std::string dim;
+    std::istringstream iss(text);
+    out.clear();
+    while (std::getline(iss, dim, 'x'))
+    {
+        if (dim.size() == 0 || dim.find_first_not_of("0123456789") != std::string::npos)
+            return false;
+        errno = 0;
+        char *end = NULL;
+        unsigned long long value = strtoull(dim.c_str(), &end, 10);
+        if (errno != 0 || *end != '\0')
+            return false;
+        out.push_back(value);
+    }
+    return out.size() >= 1 && out.size() <= 3;
+}
+
 /* Check if a dataset exist in a HDF5 file */
-bool dataset_exists(std::string filename, std::string name)
+bool dataset_exists(hid_t file_id, std::string name)
 {
-    hid_t file_id = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
-    bool exists = H5Lexists(file_id, name.c_str(), H5P_DEFAULT ) > 0;
-    H5Fclose(file_id);
-    return exists;
+    return H5Lexists(file_id, name.c_str(), H5P_DEFAULT ) > 0;
 }
 
 /* Get the template file, if one exists for the given backend */
@@ -168,125 +193,256 @@ std::string template_path(std::string backend_extension, std::string argv0)
     return "";
 }
 
-int main(int argc, char **argv)
-{
-    if(argc < 3)
-    {
-        fprintf(stdout,
-            "Syntax: %s <hdf5_file> <udf_file> [--overwrite] [virtual_dataset..]\n\n"
-            "Options:\n"
-            "  hdf5_file                      Input/output HDF5 file\n"
-            "  udf_file                       File implementing the user-defined-function\n"
-            "  virtual_dataset                Virtual dataset(s) to create. See syntax below.\n"
-            "                                 If omitted, dataset names are picked from udf_file\n"
-            "                                 and their resolutions/types are set to match the input\n"
-            "                                 datasets declared in that same file\n"
-            "  --overwrite                    Overwrite existing virtual dataset(s)\n\n"
-            "Formatting options for <virtual_dataset>:\n"
-            "  dataset_name:resolution:type   dataset_name: name of the virtual dataset\n"
-            "                                 resolution: XRES, XRESxYRES, or XRESxYRESxZRES\n"
-            "                                 type: [u]int16, [u]int32, [u]int64, float, or double\n\n"
-            "Examples:\n"
-            "%s sample.h5 simple_vector.lua Simple:500:float\n"
-            "%s sample.h5 sine_wave.lua SineWave:100x10:int32\n",
-            argv[0], argv[0], argv[0]);
-        exit(1);
-    }
-
-    /* Sanity checks */
-    if (H5Zfilter_avail(HDF5_UDF_FILTER_ID) <= 0)
-    {
-        fprintf(stderr, "Could not locate the HDF5-UDF filter\n");
-        fprintf(stderr, "Make sure to set $HDF5_PLUGIN_PATH prior to running this tool\n");
-        exit(1);
-    }
 
-    std::string hdf5_file = argv[1];
-    std::string udf_file = argv[2];
-    const int first_dataset_index = 3;
+/* A UDF to attach to the HDF5 file, along with its options and datasets */
+struct UdfRequest {
+    std::string udf_file;
+    Backend *backend = NULL;
     bool overwrite = false;
+    bool streaming = false;
+    bool materialize = false;
+    bool materialize_update = false;
+    int codec = CODEC_DEFAULT;
+    int codec_level = CODEC_DEFAULT_LEVEL;
+    std::vector<hsize_t> chunk_dims;
+    std::vector<std::string> isas;
+    std::string signing_key;                    /* Private key the bytecode is signed with */
+    std::vector<DatasetInfo> virtual_datasets;
+    std::vector<std::string> delete_list;       /* Existing datasets to overwrite */
+    std::vector<std::string> dataset_names;     /* Datasets the UDF refers to */
+    std::vector<DatasetInfo> input_datasets;
+    std::string bytecode;
+    std::string encoded_bytecode;
+    json input_fingerprints;
+};
 
-    Backend *backend = getBackendByFileExtension(udf_file);
-    if (! backend)
+/* Parse the UDF file name and the options that follow it */
+bool parse_request(const std::vector<std::string> &args, UdfRequest &req)
+{
+    req.udf_file = args[0];
+    req.backend = getBackendByFileExtension(req.udf_file);
+    if (! req.backend)
     {
-        fprintf(stderr, "Could not identify a parser for %s\n", udf_file.c_str());
-        exit(1);
+        fprintf(stderr, "Could not identify a parser for %s\n", req.udf_file.c_str());
+        return false;
     }
-    printf("Backend: %s\n", backend->name().c_str());
+    printf("Backend: %s\n", req.backend->name().c_str());
 
     /* Process virtual (output) datasets given in the command line */
-    std::vector<DatasetInfo> virtual_datasets;
-    std::vector<std::string> delete_list;
-    for (int i=first_dataset_index; i<argc; ++i)
+    for (size_t i=1; i<args.size(); ++i)
     {
+        const char *arg = args[i].c_str();
         DatasetInfo info;
         DatasetOptionsParser parser;
-        if (strcmp(argv[i], "--overwrite") == 0)
+        if (strcmp(arg, "--overwrite") == 0)
         {
-            overwrite = true;
+            req.overwrite = true;
             continue;
         }
-        if (parser.parse(argv[i], info) == false)
+        if (strcmp(arg, "--stream") == 0)
         {
-            fprintf(stderr, "Failed to parse string '%s'\n", argv[i]);
-            exit(1);
+            req.streaming = true;
+            continue;
+        }
+        if (strcmp(arg, "--materialize") == 0 || strcmp(arg, "--materialize=update") == 0)
+        {
+            req.materialize = true;
+            req.materialize_update = arg[13] == '=';
+            continue;
+        }
+        if (strncmp(arg, "--codec=", 8) == 0)
+        {
+            std::string name = &arg[8];
+            auto sep = name.find(':');
+            if (sep != std::string::npos)
+            {
+                req.codec_level = atoi(name.substr(sep + 1).c_str());
+                name = name.substr(0, sep);
+            }
+            req.codec = getCodecByName(name);
+            if (req.codec < 0 || ! codecAvailable(req.codec))
+            {
+                fprintf(stderr, "Codec '%s' is not available\n", name.c_str());
+                return false;
+            }
+            continue;
+        }
+        if (strncmp(arg, "--sign=", 7) == 0)
+        {
+            if (! signingAvailable())
+            {
+                fprintf(stderr, "Support for signatures has not been compiled in\n");
+                return false;
+            }
+            req.signing_key = &arg[7];
+            continue;
+        }
+        if (strncmp(arg, "--chunk=", 8) == 0)
+        {
+            if (parse_resolution(&arg[8], req.chunk_dims) == false)
+            {
+                fprintf(stderr, "Failed to parse chunk resolution '%s'\n", &arg[8]);
+                return false;
+            }
+            continue;
+        }
+        if (strncmp(arg, "--isa=", 6) == 0)
+        {
+            std::istringstream iss(&arg[6]);
+            std::string isa;
+            req.isas.clear();
+            while (std::getline(iss, isa, ','))
+                if (isa.size())
+                    req.isas.push_back(isa);
+            if (req.isas.size() == 0 || req.backend->setTargetArchitectures(req.isas) == false)
+            {
+                fprintf(stderr, "Failed to configure target architectures '%s' for the %s backend\n",
+                    &arg[6], req.backend->name().c_str());
+                return false;
+            }
+            continue;
         }
-        if (dataset_exists(hdf5_file, info.name))
+        if (parser.parse(arg, info) == false)
         {
-            if (overwrite)
-                delete_list.push_back(info.name);
+            fprintf(stderr, "Failed to parse string '%s'\n", arg);
+            return false;
+        }
+        req.virtual_datasets.push_back(info);
+    }
+    return true;
+}
+
+/*
+ * Parse a manifest that lists the UDFs to attach, one per line, each followed
+ * by its options as given in the command line. Empty lines and lines starting
+ * with '#' are ignored. UDF files are looked up relative to the manifest.
+ */
+bool parse_manifest(std::string manifest, std::vector<UdfRequest> &requests)
+{
+    std::ifstream ifs(manifest);
+    if (! ifs.is_open())
+    {
+        fprintf(stderr, "Failed to open %s\n", manifest.c_str());
+        return false;
+    }
+    auto sep = manifest.rfind('/');
+    std::string dirname = sep == std::string::npos ? "" : manifest.substr(0, sep + 1);
+
+    std::string line;
+    for (size_t line_number=1; std::getline(ifs, line); ++line_number)
+    {
+        std::vector<std::string> args;
+        std::istringstream iss(line);
+        std::string arg;
+        while (iss >> arg)
+            args.push_back(arg);
+        if (args.size() == 0 || args[0][0] == '#')
+            continue;
+        if (args[0][0] != '/')
+            args[0] = dirname + args[0];
+
+        requests.emplace_back();
+        if (parse_request(args, requests.back()) == false)
+        {
+            fprintf(stderr, "Error in %s, line %zu\n", manifest.c_str(), line_number);
+            return false;
+        }
+    }
+    if (requests.size() == 0)
+    {
+        fprintf(stderr, "Error: no UDFs are listed in %s\n", manifest.c_str());
+        return false;
+    }
+    return true;
+}
+
+/* Run the given task on each request, using up to 'jobs' threads. Returns false if any task fails. */
+bool run_parallel(std::vector<UdfRequest> &requests, size_t jobs, std::function<bool(UdfRequest &)> task)
+{
+    std::atomic<size_t> next(0);
+    std::atomic<bool> ok(true);
+    auto worker = [&]()
+    {
+        for (size_t i; (i = next++) < requests.size(); )
+            if (task(requests[i]) == false)
+                ok = false;
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i=1; i<std::min(jobs, requests.size()); ++i)
+        threads.emplace_back(worker);
+    worker();
+    for (auto &thread: threads)
+        thread.join();
+    return ok;
+}
+
+/*
+ * Sort the datasets the UDF refers to into inputs and virtual datasets to
+ * create. Inputs either exist in the file or are created by UDFs listed
+ * earlier in the same manifest, which are given by 'created'. Dimensions
+ * and types of virtual datasets that are not given are taken from the inputs.
+ */
+bool resolve_datasets(hid_t file_id, UdfRequest &req, std::map<std::string, DatasetInfo> &created)
+{
+    auto &virtual_datasets = req.virtual_datasets;
+    auto &input_datasets = req.input_datasets;
+    for (auto &info: virtual_datasets)
+    {
+        if (created.find(info.name) != created.end())
+        {
+            fprintf(stderr, "Error: dataset %s is created by more than one UDF\n", info.name.c_str());
+            return false;
+        }
+        if (dataset_exists(file_id, info.name))
+        {
+            if (req.overwrite)
+                req.delete_list.push_back(info.name);
             else
             {
                 fprintf(stderr, "Error: dataset %s already exists\n", info.name.c_str());
-                exit(1);
+                return false;
             }
         }
-        virtual_datasets.push_back(info);
     }
 
     /* Identify virtual dataset name(s) and input dataset(s) that the UDF code depends on */
-    std::vector<std::string> dataset_names = backend->udfDatasetNames(udf_file);
-    std::vector<DatasetInfo> input_datasets;
-    for (auto &name: dataset_names)
+    for (auto &name: req.dataset_names)
     {
         DatasetInfo info;
         info.name = name;
-        if (dataset_exists(hdf5_file, name))
+        auto input = resolveInput(file_id, name);
+        auto it = created.find(name);
+        if (it != created.end())
         {
-            /* Open HDF5 file */
-            hid_t file_id = H5Fopen(hdf5_file.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
-            if (file_id < 0)
-            {
-                fprintf(stderr, "Error opening %s\n", hdf5_file.c_str());
-                exit(1);
-            }
-
-            /* Retrieve dataset information */
-            hid_t dset_id = H5Dopen(file_id, info.name.c_str(), H5P_DEFAULT);
+            /* This is a virtual dataset created by another UDF */
+            input_datasets.push_back(it->second);
+            it->second.printInfo("Input");
+        }
+        else if (dataset_exists(file_id, input.path))
+        {
+            /*
+             * Retrieve dataset information. Inputs may also be members of
+             * compound datasets ("dataset.member"); datatypes that are not
+             * supported by our implementation are rejected at this point.
+             */
+            hid_t mem_type_id;
+            hid_t dset_id = openInputDataset(file_id, input, &info.hdf5_datatype, &mem_type_id);
             if (dset_id < 0)
             {
-                fprintf(stderr, "Error opening dataset %s from file %s\n",
-                    info.name.c_str(), hdf5_file.c_str());
-                exit(1);
+                fprintf(stderr, "Error opening dataset %s\n", info.name.c_str());
+                return false;
             }
             hid_t space_id = H5Dget_space(dset_id);
             int ndims = H5Sget_simple_extent_ndims(space_id);
             info.dimensions.resize(ndims);
-            info.hdf5_datatype = H5Dget_type(dset_id);
             H5Sget_simple_extent_dims(space_id, info.dimensions.data(), NULL);
-
-            /* Check that the input dataset's datatype is supported by our implementation */
-            auto datatype_ptr = info.getDatatype();
-            if (datatype_ptr == NULL) {
-                fprintf(stderr, "Unsupported HDF5 datatype %jd\n", info.hdf5_datatype);
-                exit(1);
-            }
-            info.datatype = datatype_ptr;
+            info.datatype = info.getDatatype();
 
             input_datasets.push_back(info);
+            H5Tclose(mem_type_id);
             H5Sclose(space_id);
             H5Dclose(dset_id);
-            H5Fclose(file_id);
             info.printInfo("Input");
         }
         else
@@ -310,9 +466,10 @@ int main(int argc, char **argv)
     if (virtual_datasets.size() == 0)
     {
         fprintf(stderr,
-            "Error: all datasets given in the UDF file already exist.\n"
-            "Please explicitly specify the virtual dataset(s) in the command line.\n");
-        exit(1);
+            "Error: all datasets given in the UDF file %s already exist.\n"
+            "Please explicitly specify the virtual dataset(s) in the command line.\n",
+            req.udf_file.c_str());
+        return false;
     }
 
     /*
@@ -331,58 +488,147 @@ int main(int argc, char **argv)
         {
             fprintf(stderr, "Cannot determine dimensions and type of virtual dataset %s. Please specify.\n",
                 info.name.c_str());
-            exit(1);
+            return false;
         }
 
         /* Require that all input datasets have the same dimensions and type */
         for (size_t i=1; i<input_datasets.size(); ++i)
         {
-            if (! H5Tequal(input_datasets[i].hdf5_datatype, input_datasets[i-1].hdf5_datatype))
+            if (input_datasets[i].datatype.compare(input_datasets[i-1].datatype) != 0)
             {
                 fprintf(stderr, "Cannot determine type of virtual dataset %s. Please specify.\n",
                     info.name.c_str());
-                exit(1);
+                return false;
             }
             if (input_datasets[i].dimensions != input_datasets[i-1].dimensions)
             {
                 fprintf(stderr, "Cannot determine dimensions of virtual dataset %s. Please specify.\n",
                     info.name.c_str());
-                exit(1);
+                return false;
             }
         }
 
-        /* We're all set: copy attributes from the first input dataset */
-        info.hdf5_datatype = input_datasets[0].hdf5_datatype;
+        /*
+         * We're all set: copy attributes from the first input dataset. The
+         * output is stored in the type seen by the UDF, which is little-endian
+         * even if the input is not.
+         */
         info.datatype = input_datasets[0].datatype;
+        info.hdf5_datatype = info.getHdf5Datatype();
         info.dimensions = input_datasets[0].dimensions;
         info.printInfo("Virtual");
     }
 
-    /* Compile the UDF source file */
-    auto template_file = template_path(backend->extension(), argv[0]);
-    auto bytecode = backend->compile(udf_file, template_file);
-    if (bytecode.size() == 0)
+    /* Chunks must fit within the dimensions of each virtual dataset */
+    for (auto &info: virtual_datasets)
     {
-        fprintf(stderr, "Failed to compile UDF file\n");
-        exit(1);
+        if (req.chunk_dims.size() == 0)
+            continue;
+        bool fits = req.chunk_dims.size() == info.dimensions.size();
+        for (size_t i=0; fits && i<req.chunk_dims.size(); ++i)
+            fits = req.chunk_dims[i] > 0 && req.chunk_dims[i] <= info.dimensions[i];
+        if (! fits)
+        {
+            fprintf(stderr, "Error: chunk resolution does not fit virtual dataset %s\n",
+                info.name.c_str());
+            return false;
+        }
     }
 
-    /* Create the virtual datasets */
     for (auto &info: virtual_datasets)
+        created[info.name] = info;
+    return true;
+}
+
+/*
+ * Compile the UDF source file and encode the bytecode, which the filter
+ * decodes once per process. Builds are looked up in the artifact cache
+ * first, keyed by the UDF, its template, the build options and the
+ * toolchain, including the headers the UDF reads.
+ */
+bool compile_request(UdfRequest &req, std::string template_file, ArtifactCache &cache)
+{
+    std::string key;
+    if (cache.enabled())
+    {
+        auto toolchain = req.backend->describeToolchain(req.udf_file, template_file);
+        if (toolchain.size())
+            key = cache.getKey(req.backend->name(), {req.udf_file, template_file}, req.isas, toolchain);
+    }
+
+    if (cache.get(key, req.bytecode))
+        printf("Using cached build of %s\n", req.udf_file.c_str());
+    else
     {
-        hid_t file_id = H5Fopen(hdf5_file.c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
-        if (file_id < 0)
+        req.bytecode = req.backend->compile(req.udf_file, template_file);
+        if (req.bytecode.size() == 0)
         {
-            fprintf(stderr, "Error opening %s\n", hdf5_file.c_str());
-            exit(1);
+            fprintf(stderr, "Failed to compile UDF file %s\n", req.udf_file.c_str());
+            return false;
         }
+        cache.put(key, req.bytecode);
+    }
+
+    if (encodeBuffer(req.codec, req.codec_level, req.bytecode.data(), req.bytecode.size(),
+        req.encoded_bytecode) == false)
+    {
+        fprintf(stderr, "Failed to encode the UDF bytecode\n");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Encode the payload described by jas. With a signing key, the signature
+ * covers the header fields as well as the bytecode, so each chunk carries
+ * a signature of its own.
+ */
+bool encode_payload(UdfRequest &req, json &jas, std::string &encoded)
+{
+    if (req.signing_key.size())
+    {
+        jas.erase("signature");
+        Payload payload;
+        std::string signature;
+        encoded = encodePayload(jas, req.encoded_bytecode);
+        if (! readPayload(encoded.data(), encoded.size(), payload) ||
+            ! signMessage(req.signing_key, getSignedMessage(payload), signature))
+            return false;
+        jas["signature"] = signature;
+    }
+    encoded = encodePayload(jas, req.encoded_bytecode);
+    return true;
+}
+
+/* Create the virtual datasets of a UDF and write their payloads */
+bool write_request(hid_t file_id, UdfRequest &req)
+{
+    auto &virtual_datasets = req.virtual_datasets;
+    auto &input_datasets = req.input_datasets;
+    auto &chunk_dims = req.chunk_dims;
 
+    /* Fingerprints of the inputs that the materialized copies are computed from */
+    if (req.materialize)
+    {
+        std::vector<std::string> names;
+        for (auto &info: input_datasets)
+            names.push_back(info.name);
+        if (getFingerprints(file_id, resolveInputs(file_id, names), req.input_fingerprints) == false)
+        {
+            fprintf(stderr, "Failed to compute the fingerprints of the input datasets\n");
+            return false;
+        }
+    }
+
+    /* Create the virtual datasets */
+    for (auto &info: virtual_datasets)
+    {
         /* Create dataspace */
         hid_t space_id = H5Screate_simple(info.dimensions.size(), info.dimensions.data(), NULL);
         if (space_id < 0)
         {
             fprintf(stderr, "Failed to create dataspace\n");
-            exit(1);
+            return false;
         }
 
         /* Create virtual dataset creation property list */
@@ -390,7 +636,7 @@ int main(int argc, char **argv)
         if (dcpl_id < 0)
         {
             fprintf(stderr, "Failed to create dataset property list\n");
-            exit(1);
+            return false;
         }
 
         herr_t status;
@@ -399,24 +645,35 @@ int main(int argc, char **argv)
         {
             fprintf(stderr, "Failed to configure dataset filter\n");
             fprintf(stderr, "Make sure to set $HDF5_PLUGIN_PATH prior to running this tool\n");
-            exit(1);
+            return false;
         }
 
-        status = H5Pset_chunk(dcpl_id, info.dimensions.size(), info.dimensions.data());
+        /* Non-chunked datasets are stored as a single chunk spanning the whole grid */
+        auto dataset_chunk_dims = chunk_dims.size() ? chunk_dims : info.dimensions;
+        status = H5Pset_chunk(dcpl_id, dataset_chunk_dims.size(), dataset_chunk_dims.data());
         if (status < 0)
         {
             fprintf(stderr, "Failed to set chunk size\n");
-            exit(1);
+            return false;
         }
 
-        if (std::find(delete_list.begin(), delete_list.end(), info.name) != delete_list.end())
+        if (std::find(req.delete_list.begin(), req.delete_list.end(), info.name) != req.delete_list.end())
         {
             /* Delete existing dataset so its contents can be overwritten */
             status = H5Ldelete(file_id, info.name.c_str(), H5P_DEFAULT);
             if (status < 0)
             {
                 fprintf(stderr, "Failed to delete existing virtual dataset %s\n", info.name.c_str());
-                exit(1);
+                return false;
+            }
+
+            /* Along with its materialized copy, which is now out of date */
+            auto materialized_name = getMaterializedName(info.name);
+            if (H5Lexists(file_id, materialized_name.c_str(), H5P_DEFAULT) > 0 &&
+                H5Ldelete(file_id, materialized_name.c_str(), H5P_DEFAULT) < 0)
+            {
+                fprintf(stderr, "Failed to delete materialized dataset %s\n", materialized_name.c_str());
+                return false;
             }
         }
 
@@ -425,10 +682,10 @@ int main(int argc, char **argv)
         if (dset_id < 0)
         {
             fprintf(stderr, "Failed to create dataset\n");
-            exit(1);
+            return false;
         }
 
-        /* Prepare data for JSON payload */
+        /* Prepare data for the payload */
         std::vector<std::string> input_dataset_names, scratch_dataset_names;
         std::transform(input_datasets.begin(), input_datasets.end(), std::back_inserter(input_dataset_names),
             [](DatasetInfo info) -> std::string { return info.name; });
@@ -437,52 +694,298 @@ int main(int argc, char **argv)
             if (other.name.compare(info.name) != 0)
                 scratch_dataset_names.push_back(other.name);
 
-        /* JSON Payload */
+        /*
+         * Each dataset the UDF refers to gets a slot: the index at which the
+         * filter hands it over to the UDF, so that lookups by name only have
+         * to be resolved once.
+         */
+        std::vector<std::string> slots;
+        for (auto &name: req.dataset_names)
+            if (std::find(slots.begin(), slots.end(), name) == slots.end())
+                slots.push_back(name);
+        for (auto &other: virtual_datasets)
+            if (std::find(slots.begin(), slots.end(), other.name) == slots.end())
+                slots.push_back(other.name);
+
+        /*
+         * The payload is described in JSON, which is what gets printed, and
+         * then encoded into the compact binary header the filter reads
+         */
         json jas;
         jas["output_dataset"] = info.name;
         jas["output_resolution"] = info.dimensions;
         jas["output_datatype"] = info.datatype;
         jas["input_datasets"] = input_dataset_names;
         jas["scratch_datasets"] = scratch_dataset_names;
-        jas["bytecode_size"] = bytecode.length();
-        jas["backend"] = backend->name();
-
-        std::string jas_str = jas.dump();
-        size_t payload_size = jas_str.length() + bytecode.size() + 1;
-        printf("%s dataset header:\n%s\n", info.name.c_str(), jas.dump(4).c_str());
-
-        /* Sanity check: the JSON and the bytecode must fit in the dataset */
-        hsize_t grid_size = std::accumulate(std::begin(info.dimensions), std::end(info.dimensions), 1, std::multiplies<hsize_t>());
-        if (payload_size > (grid_size * H5Tget_size(info.hdf5_datatype)))
+        jas["slots"] = slots;
+        jas["bytecode_size"] = req.encoded_bytecode.length();
+        jas["codec"] = getCodecName(req.codec);
+        if (req.codec_level != CODEC_DEFAULT_LEVEL)
+            jas["codec_level"] = req.codec_level;
+        jas["decoded_size"] = req.bytecode.length();
+        jas["backend"] = req.backend->name();
+        if (req.streaming)
+            jas["streaming"] = true;
+        if (req.materialize)
         {
-            /* TODO: fallback to saving a regular dataset */
-            fprintf(stderr, "Error: len(JSON+bytecode) > virtual dataset dimensions\n");
-            exit(1);
+            jas["materialized"]["dataset"] = getMaterializedName(info.name);
+            jas["materialized"]["fingerprints"] = req.input_fingerprints;
+            jas["materialized"]["update"] = req.materialize_update;
         }
 
-        /* Prepare payload data */
-        char *payload = (char *) malloc(grid_size * H5Tget_size(info.hdf5_datatype));
-        char *p = payload;
-        memcpy(p, &jas_str[0], jas_str.length());
-        p += jas_str.length();
-        *p = '\0';
-        memcpy(&p[1], &bytecode[0], bytecode.size());
+        if (chunk_dims.size() == 0)
+        {
+            std::string encoded;
+            if (! encode_payload(req, jas, encoded))
+                return false;
+            printf("%s dataset header:\n%s\n", info.name.c_str(), jas.dump(4).c_str());
+
+            /* Sanity check: the header and the bytecode must fit in the dataset */
+            hsize_t grid_size = std::accumulate(std::begin(info.dimensions), std::end(info.dimensions), (hsize_t) 1, std::multiplies<hsize_t>());
+            if (encoded.size() > (grid_size * H5Tget_size(info.hdf5_datatype)))
+            {
+                /* TODO: fallback to saving a regular dataset */
+                fprintf(stderr, "Error: len(header+bytecode) > virtual dataset dimensions\n");
+                return false;
+            }
 
-        /* Write the data to the dataset */
-        status = H5Dwrite(dset_id, info.hdf5_datatype, H5S_ALL, H5S_ALL, H5P_DEFAULT, payload);
-        if (status < 0)
+            /* Prepare payload data */
+            char *payload = (char *) calloc(grid_size, H5Tget_size(info.hdf5_datatype));
+            memcpy(payload, encoded.data(), encoded.size());
+
+            /* Write the data to the dataset */
+            status = H5Dwrite(dset_id, info.hdf5_datatype, H5S_ALL, H5S_ALL, H5P_DEFAULT, payload);
+            free(payload);
+            if (status < 0)
+            {
+                fprintf(stderr, "Failed to write to the dataset\n");
+                return false;
+            }
+        }
+        else
         {
-            fprintf(stderr, "Failed to write to the dataset\n");
-            exit(1);
+            /*
+             * Each chunk carries its own payload, which tells the filter which part
+             * of the grid it has been called to produce. Chunks are written in their
+             * final (filtered) form, so the header and the bytecode are stored as-is.
+             */
+            hsize_t chunk_size = std::accumulate(std::begin(chunk_dims), std::end(chunk_dims), (hsize_t) 1, std::multiplies<hsize_t>());
+            std::vector<hsize_t> chunk_index(chunk_dims.size(), 0);
+            size_t num_chunks = 0;
+            bool done = false;
+            while (! done)
+            {
+                std::vector<hsize_t> chunk_offset(chunk_dims.size());
+                for (size_t i=0; i<chunk_dims.size(); ++i)
+                    chunk_offset[i] = chunk_index[i] * chunk_dims[i];
+                jas["chunk_dims"] = chunk_dims;
+                jas["chunk_offset"] = chunk_offset;
+                std::string payload;
+                if (! encode_payload(req, jas, payload))
+                    return false;
+                if (num_chunks == 0)
+                    printf("%s dataset header (first chunk):\n%s\n", info.name.c_str(), jas.dump(4).c_str());
+
+                /* Sanity check: the header and the bytecode must fit in the chunk */
+                if (payload.size() > (chunk_size * H5Tget_size(info.hdf5_datatype)))
+                {
+                    fprintf(stderr, "Error: len(header+bytecode) > virtual dataset chunk dimensions\n");
+                    return false;
+                }
+
+                status = H5Dwrite_chunk(dset_id, H5P_DEFAULT, 0, chunk_offset.data(), payload.size(), payload.data());
+                if (status < 0)
+                {
+                    fprintf(stderr, "Failed to write chunk to the dataset\n");
+                    return false;
+                }
+                num_chunks++;
+
+                /* Move on to the next chunk, last dimension first */
+                done = true;
+                for (ssize_t i=chunk_dims.size()-1; i>=0 && done; --i)
+                {
+                    if (++chunk_index[i] * chunk_dims[i] < info.dimensions[i])
+                        done = false;
+                    else
+                        chunk_index[i] = 0;
+                }
+            }
+            printf("%s dataset has %zu chunks\n", info.name.c_str(), num_chunks);
         }
 
         /* Close and release resources */
         status = H5Pclose(dcpl_id);
         status = H5Dclose(dset_id);
         status = H5Sclose(space_id);
-        status = H5Fclose(file_id);
-        free(payload);
     }
-    
+    return true;
+}
+
+/* Evaluate the virtual datasets of a UDF and store their materialized copies */
+bool materialize_request(hid_t file_id, UdfRequest &req)
+{
+    for (auto &info: req.virtual_datasets)
+    {
+        hid_t dset_id = H5Dopen(file_id, info.name.c_str(), H5P_DEFAULT);
+        if (dset_id < 0)
+        {
+            fprintf(stderr, "Failed to open virtual dataset %s\n", info.name.c_str());
+            return false;
+        }
+
+        hsize_t grid_size = std::accumulate(std::begin(info.dimensions), std::end(info.dimensions), (hsize_t) 1, std::multiplies<hsize_t>());
+        std::vector<char> grid(grid_size * H5Tget_size(info.hdf5_datatype));
+        info.data = grid.data();
+        if (H5Dread(dset_id, info.hdf5_datatype, H5S_ALL, H5S_ALL, H5P_DEFAULT, info.data) < 0)
+        {
+            fprintf(stderr, "Failed to evaluate virtual dataset %s\n", info.name.c_str());
+            return false;
+        }
+        auto materialized_name = getMaterializedName(info.name);
+        bool ret = writeMaterialized(file_id, materialized_name, info, req.input_fingerprints);
+        info.data = NULL;
+        H5Dclose(dset_id);
+        if (! ret)
+            return false;
+        printf("%s dataset materialized as %s\n", info.name.c_str(), materialized_name.c_str());
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 3)
+    {
+        fprintf(stdout,
+            "Syntax: %s <hdf5_file> <udf_file> [--overwrite] [--chunk=resolution] [--stream] [--materialize[=update]] [--codec=name[:level]] [--isa=arch,..] [--sign=key.pem] [virtual_dataset..]\n"
+            "        %s <hdf5_file> --manifest=file [--jobs=N]\n\n"
+            "Options:\n"
+            "  hdf5_file                      Input/output HDF5 file\n"
+            "  udf_file                       File implementing the user-defined-function\n"
+            "  virtual_dataset                Virtual dataset(s) to create. See syntax below.\n"
+            "                                 If omitted, dataset names are picked from udf_file\n"
+            "                                 and their resolutions/types are set to match the input\n"
+            "                                 datasets declared in that same file\n"
+            "  --overwrite                    Overwrite existing virtual dataset(s)\n"
+            "  --chunk=resolution             Split the virtual dataset(s) into chunks of the given\n"
+            "                                 resolution. The UDF is then evaluated for each chunk\n"
+            "                                 that is read, taking matching hyperslabs of the inputs\n"
+            "  --stream                       Evaluate the UDF on blocks of rows of the virtual dataset,\n"
+            "                                 one at a time, so that the inputs don't have to fit in\n"
+            "                                 memory. The UDF must honor the offset of the output grid\n"
+            "  --materialize[=update]         Store a copy of the virtual dataset(s) in the file, which\n"
+            "                                 is served for as long as the input datasets don't change.\n"
+            "                                 With 'update', applications can write stale copies back\n"
+            "                                 with hdf5_udf_materialize()\n"
+            "  --codec=name[:level]           Codec applied to the UDF bytecode: none, deflate, lz4 or\n"
+            "                                 zstd. The latter two decode faster but are only available\n"
+            "                                 if built in. Defaults to lz4 if built in, else deflate\n"
+            "  --isa=arch[,arch..]            Build C++ UDFs for each of the given architectures\n"
+            "                                 (e.g., x86-64-v2,x86-64-v3,x86-64-v4). The best one\n"
+            "                                 supported by the CPU is picked at run time\n"
+            "  --sign=key.pem                 Sign the UDF payloads (header and bytecode) with the given\n"
+            "                                 private key. Signed UDFs run without isolation where the\n"
+            "                                 matching public key is listed in $HDF5_UDF_TRUSTED_KEYS\n"
+            "  --manifest=file                Attach every UDF listed in the given file, one per line,\n"
+            "                                 each followed by its options and virtual datasets\n"
+            "  --jobs=N                       Number of UDFs compiled in parallel (defaults to the\n"
+            "                                 number of CPUs)\n\n"
+            "Formatting options for <virtual_dataset>:\n"
+            "  dataset_name:resolution:type   dataset_name: name of the virtual dataset\n"
+            "                                 resolution: XRES, XRESxYRES, or XRESxYRESxZRES\n"
+            "                                 type: [u]int16, [u]int32, [u]int64, float, or double\n\n"
+            "Examples:\n"
+            "%s sample.h5 simple_vector.lua Simple:500:float\n"
+            "%s sample.h5 sine_wave.lua SineWave:100x10:int32\n"
+            "%s sample.h5 add_datasets.lua --chunk=10x10\n"
+            "%s sample.h5 --manifest=udfs.txt --jobs=8\n",
+            argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+        exit(1);
+    }
+
+    /* Sanity checks */
+    if (H5Zfilter_avail(HDF5_UDF_FILTER_ID) <= 0)
+    {
+        fprintf(stderr, "Could not locate the HDF5-UDF filter\n");
+        fprintf(stderr, "Make sure to set $HDF5_PLUGIN_PATH prior to running this tool\n");
+        exit(1);
+    }
+
+    std::string hdf5_file = argv[1];
+    std::vector<UdfRequest> requests;
+    size_t jobs = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    if (strncmp(argv[2], "--manifest=", 11) == 0)
+    {
+        for (int i=3; i<argc; ++i)
+        {
+            if (strncmp(argv[i], "--jobs=", 7) == 0 && atoi(&argv[i][7]) > 0)
+                jobs = atoi(&argv[i][7]);
+            else
+            {
+                fprintf(stderr, "Unexpected argument '%s' in manifest mode\n", argv[i]);
+                exit(1);
+            }
+        }
+        if (parse_manifest(&argv[2][11], requests) == false)
+            exit(1);
+    }
+    else
+    {
+        requests.emplace_back();
+        if (parse_request(std::vector<std::string>(&argv[2], &argv[argc]), requests.back()) == false)
+            exit(1);
+    }
+
+    /* Identify the datasets that each UDF depends on */
+    run_parallel(requests, jobs, [](UdfRequest &req)
+    {
+        req.dataset_names = req.backend->udfDatasetNames(req.udf_file);
+        return true;
+    });
+
+    /* Tell input datasets apart from the virtual datasets to be created */
+    hid_t file_id = H5Fopen(hdf5_file.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (file_id < 0)
+    {
+        fprintf(stderr, "Error opening %s\n", hdf5_file.c_str());
+        exit(1);
+    }
+    std::map<std::string, DatasetInfo> created;
+    for (auto &req: requests)
+        if (resolve_datasets(file_id, req, created) == false)
+            exit(1);
+    H5Fclose(file_id);
+
+    /* Compile the UDF source files */
+    ArtifactCache cache;
+    std::string argv0 = argv[0];
+    bool compiled = run_parallel(requests, jobs, [&](UdfRequest &req)
+    {
+        auto template_file = template_path(req.backend->extension(), argv0);
+        return compile_request(req, template_file, cache);
+    });
+    if (! compiled)
+        exit(1);
+
+    /* Create the virtual datasets, all in a single session */
+    file_id = H5Fopen(hdf5_file.c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
+    if (file_id < 0)
+    {
+        fprintf(stderr, "Error opening %s\n", hdf5_file.c_str());
+        exit(1);
+    }
+    for (auto &req: requests)
+        if (write_request(file_id, req) == false)
+            exit(1);
+
+    /* Evaluate the virtual datasets and store their materialized copies */
+    for (auto &req: requests)
+        if (req.materialize && materialize_request(file_id, req) == false)
+            exit(1);
+    H5Fclose(file_id);
+
+    for (auto &req: requests)
+        delete req.backend;
     return 0;
 }
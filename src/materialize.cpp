@@ -0,0 +1,248 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: materialize.cpp
+ *
+ * Materialized copies of virtual datasets, stored in the HDF5 file along
+ * with the fingerprints of the inputs they were computed from.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <numeric>
+#include "materialize.h"
+#include "hash.h"
+
+using json = nlohmann::json;
+
+/* Inputs are checksummed in slabs of at most this many bytes */
+#define CHECKSUM_SLAB_SIZE (16 * 1024 * 1024)
+
+/* Attribute of the materialized copy that holds the fingerprints of its inputs */
+#define FINGERPRINTS_ATTRIBUTE "hdf5_udf_fingerprints"
+
+std::string getMaterializedName(const std::string &name)
+{
+    return name + ".materialized";
+}
+
+/* Storage size and modification time of a dataset */
+static bool getDatasetStamp(hid_t file_id, const InputDataset &input, hsize_t *size, time_t *mtime)
+{
+    H5O_info_t info;
+    auto &path = input.path;
+    if (H5Oget_info_by_name2(file_id, path.c_str(), &info, H5O_INFO_TIME, H5P_DEFAULT) < 0)
+        return false;
+    hid_t dset_id = H5Dopen(file_id, path.c_str(), H5P_DEFAULT);
+    if (dset_id < 0)
+        return false;
+    *size = H5Dget_storage_size(dset_id);
+    *mtime = info.mtime;
+    H5Dclose(dset_id);
+    return true;
+}
+
+/*
+ * Checksum of the contents of a dataset, as stored in the file. The dataset
+ * is read in slabs along its first dimension so that memory usage is bounded.
+ * Members of compound datasets are covered by the checksum of the dataset.
+ */
+static bool getDatasetChecksum(hid_t file_id, const InputDataset &input, uint64_t *checksum)
+{
+    hid_t dset_id = H5Dopen(file_id, input.path.c_str(), H5P_DEFAULT);
+    if (dset_id < 0)
+        return false;
+    hid_t type_id = H5Dget_type(dset_id);
+    hid_t space_id = H5Dget_space(dset_id);
+    std::vector<hsize_t> dims(H5Sget_simple_extent_ndims(space_id));
+    H5Sget_simple_extent_dims(space_id, dims.data(), NULL);
+
+    bool ret = true;
+    uint64_t hash = HASH_SEED;
+    size_t element_size = H5Tget_size(type_id);
+    if (dims.size() == 0)
+    {
+        std::vector<char> buffer(element_size);
+        ret = H5Dread(dset_id, type_id, H5S_ALL, H5S_ALL, H5P_DEFAULT, buffer.data()) >= 0;
+        hash = hash64(buffer.data(), buffer.size(), hash);
+    }
+    else
+    {
+        hsize_t row_elements = std::accumulate(
+            std::begin(dims) + 1, std::end(dims), (hsize_t) 1, std::multiplies<hsize_t>());
+        hsize_t row_bytes = std::max((hsize_t) 1, row_elements * element_size);
+        hsize_t slab_rows = std::max((hsize_t) 1, CHECKSUM_SLAB_SIZE / row_bytes);
+        std::vector<char> buffer(std::min(slab_rows, dims[0]) * row_bytes);
+
+        std::vector<hsize_t> start(dims.size(), 0), count = dims;
+        for (hsize_t row=0; ret && row<dims[0]; row+=slab_rows)
+        {
+            start[0] = row;
+            count[0] = std::min(slab_rows, dims[0] - row);
+            hid_t mem_space_id = H5Screate_simple(count.size(), count.data(), NULL);
+            H5Sselect_hyperslab(space_id, H5S_SELECT_SET, start.data(), NULL, count.data(), NULL);
+            ret = H5Dread(dset_id, type_id, mem_space_id, space_id, H5P_DEFAULT, buffer.data()) >= 0;
+            hash = hash64(buffer.data(), count[0] * row_bytes, hash);
+            H5Sclose(mem_space_id);
+        }
+    }
+
+    if (! ret)
+        fprintf(stderr, "Failed to read dataset %s\n", input.path.c_str());
+    *checksum = hash;
+    H5Sclose(space_id);
+    H5Tclose(type_id);
+    H5Dclose(dset_id);
+    return ret;
+}
+
+bool getFingerprints(hid_t file_id, const std::vector<InputDataset> &inputs, json &fingerprints)
+{
+    fingerprints = json::array();
+    for (auto &input: inputs)
+    {
+        hsize_t size;
+        time_t mtime;
+        uint64_t checksum;
+        if (! getDatasetStamp(file_id, input, &size, &mtime) ||
+            ! getDatasetChecksum(file_id, input, &checksum))
+            return false;
+
+        json entry;
+        entry["name"] = input.name;
+        entry["size"] = size;
+        entry["mtime"] = mtime;
+        entry["checksum"] = checksum;
+        fingerprints.push_back(entry);
+    }
+    return true;
+}
+
+bool matchFingerprints(hid_t file_id, const std::vector<InputDataset> &inputs, const json &fingerprints)
+{
+    if (! fingerprints.is_array() || fingerprints.size() != inputs.size())
+        return false;
+
+    for (size_t i=0; i<inputs.size(); ++i)
+    {
+        auto &entry = fingerprints[i];
+        hsize_t size;
+        time_t mtime;
+        if (! entry.is_object() || entry.value("name", "") != inputs[i].name ||
+            ! getDatasetStamp(file_id, inputs[i], &size, &mtime) ||
+            entry.value("size", (hsize_t) 0) != size ||
+            entry.value("mtime", (time_t) 0) != mtime)
+            return false;
+    }
+
+    for (size_t i=0; i<inputs.size(); ++i)
+    {
+        uint64_t checksum;
+        if (! getDatasetChecksum(file_id, inputs[i], &checksum) ||
+            fingerprints[i].value("checksum", (uint64_t) 0) != checksum)
+            return false;
+    }
+    return true;
+}
+
+json getStoredFingerprints(hid_t file_id, const std::string &name, const json &fallback)
+{
+    json fingerprints = fallback;
+    H5E_BEGIN_TRY {
+        hid_t attr_id = H5Aopen_by_name(
+            file_id, name.c_str(), FINGERPRINTS_ATTRIBUTE, H5P_DEFAULT, H5P_DEFAULT);
+        if (attr_id >= 0)
+        {
+            hid_t type_id = H5Aget_type(attr_id);
+            std::string value(H5Tget_size(type_id), '\0');
+            if (H5Aread(attr_id, type_id, &value[0]) >= 0)
+            {
+                value.resize(strnlen(value.c_str(), value.size()));
+                fingerprints = json::parse(value, NULL, false);
+            }
+            H5Tclose(type_id);
+            H5Aclose(attr_id);
+        }
+    } H5E_END_TRY;
+    return fingerprints;
+}
+
+/* Replace the fingerprints attached to the materialized copy */
+static bool writeFingerprints(hid_t dset_id, const json &fingerprints)
+{
+    std::string value = fingerprints.dump();
+    if (H5Aexists(dset_id, FINGERPRINTS_ATTRIBUTE) > 0)
+        H5Adelete(dset_id, FINGERPRINTS_ATTRIBUTE);
+
+    hid_t type_id = H5Tcopy(H5T_C_S1);
+    H5Tset_size(type_id, value.size() + 1);
+    hid_t space_id = H5Screate(H5S_SCALAR);
+    hid_t attr_id = H5Acreate(dset_id, FINGERPRINTS_ATTRIBUTE, type_id, space_id, H5P_DEFAULT, H5P_DEFAULT);
+    bool ret = attr_id >= 0 && H5Awrite(attr_id, type_id, value.c_str()) >= 0;
+    if (attr_id >= 0)
+        H5Aclose(attr_id);
+    H5Sclose(space_id);
+    H5Tclose(type_id);
+    return ret;
+}
+
+bool writeMaterialized(hid_t file_id, const std::string &name, const DatasetInfo &info, const json &fingerprints)
+{
+    hid_t dset_id = -1;
+    if (H5Lexists(file_id, name.c_str(), H5P_DEFAULT) > 0)
+        dset_id = H5Dopen(file_id, name.c_str(), H5P_DEFAULT);
+    else
+    {
+        hid_t space_id = H5Screate_simple(info.dimensions.size(), info.dimensions.data(), NULL);
+        dset_id = H5Dcreate(file_id, name.c_str(), info.hdf5_datatype, space_id,
+            H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        H5Sclose(space_id);
+    }
+    if (dset_id < 0)
+    {
+        fprintf(stderr, "Failed to open materialized dataset %s\n", name.c_str());
+        return false;
+    }
+
+    bool ret = H5Dwrite(dset_id, info.hdf5_datatype, H5S_ALL, H5S_ALL, H5P_DEFAULT, info.data) >= 0 &&
+        writeFingerprints(dset_id, fingerprints);
+    if (! ret)
+        fprintf(stderr, "Failed to write materialized dataset %s\n", name.c_str());
+    H5Dclose(dset_id);
+    return ret;
+}
+
+bool readMaterialized(hid_t file_id, const std::string &name, const DatasetInfo &info)
+{
+    hid_t dset_id;
+    H5E_BEGIN_TRY {
+        dset_id = H5Dopen(file_id, name.c_str(), H5P_DEFAULT);
+    } H5E_END_TRY;
+    if (dset_id < 0)
+        return false;
+
+    hid_t space_id = H5Dget_space(dset_id);
+    std::vector<hsize_t> dims(H5Sget_simple_extent_ndims(space_id));
+    H5Sget_simple_extent_dims(space_id, dims.data(), NULL);
+
+    /* Edge chunks are only partially covered by the materialized grid */
+    bool ret = dims.size() == info.dimensions.size();
+    std::vector<hsize_t> mem_start(dims.size(), 0), count(dims.size());
+    for (size_t i=0; ret && i<dims.size(); ++i)
+    {
+        ret = info.offset[i] < dims[i];
+        count[i] = ret ? std::min(info.dimensions[i], dims[i] - info.offset[i]) : 0;
+    }
+    if (ret)
+    {
+        hid_t mem_space_id = H5Screate_simple(info.dimensions.size(), info.dimensions.data(), NULL);
+        H5Sselect_hyperslab(space_id, H5S_SELECT_SET, info.offset.data(), NULL, count.data(), NULL);
+        H5Sselect_hyperslab(mem_space_id, H5S_SELECT_SET, mem_start.data(), NULL, count.data(), NULL);
+        ret = H5Dread(dset_id, info.hdf5_datatype, mem_space_id, space_id, H5P_DEFAULT, info.data) >= 0;
+        H5Sclose(mem_space_id);
+    }
+
+    H5Sclose(space_id);
+    H5Dclose(dset_id);
+    return ret;
+}
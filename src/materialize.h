@@ -0,0 +1,41 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: materialize.h
+ *
+ * Materialized copies of virtual datasets, stored in the HDF5 file along
+ * with the fingerprints of the inputs they were computed from.
+ */
+#ifndef __materialize_h
+#define __materialize_h
+
+#include <hdf5.h>
+#include <string>
+#include <vector>
+#include "dataset.h"
+#include "json.hpp"
+
+// Name of the dataset that holds the materialized copy of a virtual dataset
+std::string getMaterializedName(const std::string &name);
+
+// Describe each of the given datasets by its storage size, the modification
+// time of the object and a checksum of its contents
+bool getFingerprints(hid_t file_id, const std::vector<InputDataset> &inputs, nlohmann::json &fingerprints);
+
+// Tell whether the given datasets still match their fingerprints. Checksums
+// are only computed when the sizes and modification times match.
+bool matchFingerprints(hid_t file_id, const std::vector<InputDataset> &inputs, const nlohmann::json &fingerprints);
+
+// Fingerprints of the inputs the materialized copy was last written from.
+// Copies that have never been written back report the given ones.
+nlohmann::json getStoredFingerprints(hid_t file_id, const std::string &name, const nlohmann::json &fallback);
+
+// Write the whole grid of a virtual dataset to its materialized copy, which
+// is created if needed, along with the fingerprints of its inputs
+bool writeMaterialized(hid_t file_id, const std::string &name, const DatasetInfo &info, const nlohmann::json &fingerprints);
+
+// Read the part of the materialized copy that matches the extent of the
+// given grid into its data buffer
+bool readMaterialized(hid_t file_id, const std::string &name, const DatasetInfo &info);
+
+#endif /* __materialize_h */
@@ -0,0 +1,103 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: memo_cache.cpp
+ *
+ * In-process cache of the grids computed by user-defined-functions.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "memo_cache.h"
+
+MemoCache::MemoCache() :
+    budget(0),
+    used(0),
+    sequence(0)
+{
+    // The budget is given in bytes, optionally followed by a K/M/G suffix
+    const char *env = getenv("HDF5_UDF_CACHE_SIZE");
+    if (env)
+    {
+        char *suffix = NULL;
+        budget = strtoull(env, &suffix, 10);
+        switch (toupper(*suffix))
+        {
+            case 'G': budget <<= 10; /* fall through */
+            case 'M': budget <<= 10; /* fall through */
+            case 'K': budget <<= 10;
+        }
+    }
+}
+
+MemoCache::MemoCache(size_t budget) :
+    budget(budget),
+    used(0),
+    sequence(0)
+{
+}
+
+bool MemoCache::enabled()
+{
+    return budget > 0;
+}
+
+size_t MemoCache::capacity()
+{
+    return budget;
+}
+
+void MemoCache::evict(std::map<std::string, Entry>::iterator it)
+{
+    used -= it->second.size;
+    entries.erase(it);
+}
+
+std::shared_ptr<AnonymousMemoryMap> MemoCache::get(const std::string &key, const std::string &stamp)
+{
+    auto it = entries.find(key);
+    if (it == entries.end())
+        return NULL;
+    if (it->second.stamp.compare(stamp) != 0)
+    {
+        evict(it);
+        return NULL;
+    }
+    it->second.last_used = ++sequence;
+    return it->second.mapping;
+}
+
+std::shared_ptr<AnonymousMemoryMap> MemoCache::take(const std::string &key, const std::string &stamp)
+{
+    auto mapping = get(key, stamp);
+    if (mapping)
+        evict(entries.find(key));
+    return mapping;
+}
+
+void MemoCache::put(const std::string &key, const std::string &stamp,
+    std::shared_ptr<AnonymousMemoryMap> mapping, size_t size)
+{
+    auto it = entries.find(key);
+    if (it != entries.end())
+        evict(it);
+    if (size > budget)
+        return;
+
+    while (used + size > budget)
+    {
+        auto lru = entries.begin();
+        for (auto i = entries.begin(); i != entries.end(); ++i)
+            if (i->second.last_used < lru->second.last_used)
+                lru = i;
+        evict(lru);
+    }
+
+    Entry entry;
+    entry.stamp = stamp;
+    entry.mapping = mapping;
+    entry.size = size;
+    entry.last_used = ++sequence;
+    entries[key] = entry;
+    used += size;
+}
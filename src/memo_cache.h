@@ -0,0 +1,61 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: memo_cache.h
+ *
+ * In-process cache of the grids computed by user-defined-functions.
+ */
+#ifndef __memo_cache_h
+#define __memo_cache_h
+
+#include <stdint.h>
+#include <string>
+#include <memory>
+#include <map>
+#include "anon_mmap.h"
+
+class MemoCache {
+public:
+    MemoCache();
+
+    // Create a cache with the given byte budget, ignoring $HDF5_UDF_CACHE_SIZE
+    MemoCache(size_t budget);
+
+    // Whether a byte budget has been given through $HDF5_UDF_CACHE_SIZE
+    bool enabled();
+
+    // Byte budget of the cache
+    size_t capacity();
+
+    // Retrieve a grid previously computed under the given key. Keys hold
+    // everything that identifies the grid (not a hash of it), so distinct
+    // grids never share an entry. The stamp identifies the state of the
+    // inputs; entries with a different stamp are stale and get dropped.
+    // Returns NULL on a cache miss.
+    std::shared_ptr<AnonymousMemoryMap> get(const std::string &key, const std::string &stamp);
+
+    // Same as get(), but the entry is removed from the cache
+    std::shared_ptr<AnonymousMemoryMap> take(const std::string &key, const std::string &stamp);
+
+    // Store a computed grid, evicting the least recently used entries
+    // as needed to stay within the byte budget
+    void put(const std::string &key, const std::string &stamp,
+        std::shared_ptr<AnonymousMemoryMap> mapping, size_t size);
+
+private:
+    struct Entry {
+        std::string stamp;          /* State of the inputs the grid was computed from */
+        std::shared_ptr<AnonymousMemoryMap> mapping;
+        size_t size;                /* Size of the grid, in bytes */
+        uint64_t last_used;         /* Sequence number of the last lookup */
+    };
+
+    void evict(std::map<std::string, Entry>::iterator it);
+
+    std::map<std::string, Entry> entries;
+    size_t budget;
+    size_t used;
+    uint64_t sequence;
+};
+
+#endif /* __memo_cache_h */
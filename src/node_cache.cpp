@@ -0,0 +1,300 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: node_cache.cpp
+ *
+ * Cache of the grids computed by user-defined-functions that is shared by
+ * every process of a node (e.g., the ranks of an MPI job), so that only one
+ * of them evaluates each grid.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <vector>
+#include "node_cache.h"
+#include "hash.h"
+
+#define NODE_CACHE_MAGIC "H5UDFNC2"
+
+/* Default upper limit of the bytes held by the entries of the directory */
+#define NODE_CACHE_BUDGET (1024UL * 1024 * 1024)
+
+/*
+ * Each entry is a file named after the hashes of the grid key and of the stamp
+ * of its inputs. The file starts with this header, the key and the stamp; the
+ * grid follows at a page boundary so that readers can map it in place. Writers
+ * hold an exclusive lock on the file; readers hold a shared one. Hits update
+ * the modification time of the file, which tells the least recently used
+ * entries apart when evicting.
+ */
+struct NodeCacheHeader {
+    char magic[8];              /* Written last, once the rest is in place */
+    uint64_t size;              /* Size of the grid */
+    uint64_t key_size;          /* Size of the key, which follows the header */
+    uint64_t stamp_size;        /* Size of the stamp, which follows the key */
+    uint64_t data_offset;       /* Offset of the grid within the file */
+};
+
+/*
+ * Remove the file of an entry, unless it has been replaced by another one
+ * since it was opened
+ */
+static void unlinkEntry(int fd, const std::string &path)
+{
+    struct stat opened, current;
+    if (fstat(fd, &opened) == 0 && stat(path.c_str(), &current) == 0 &&
+        opened.st_dev == current.st_dev && opened.st_ino == current.st_ino)
+        unlink(path.c_str());
+}
+
+/* Entries that are dropped without being stored would otherwise be left behind empty */
+NodeCache::Entry::~Entry()
+{
+    if (fd >= 0)
+    {
+        unlinkEntry(fd, path);
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+}
+
+NodeCache::NodeCache() :
+    budget(NODE_CACHE_BUDGET)
+{
+    const char *env = getenv("HDF5_UDF_NODE_CACHE");
+    if (! env || ! *env)
+        return;
+
+    // The budget is given in bytes, optionally followed by a K/M/G suffix
+    const char *size = getenv("HDF5_UDF_NODE_CACHE_SIZE");
+    if (size)
+    {
+        char *suffix = NULL;
+        budget = strtoull(size, &suffix, 10);
+        switch (toupper(*suffix))
+        {
+            case 'G': budget <<= 10; /* fall through */
+            case 'M': budget <<= 10; /* fall through */
+            case 'K': budget <<= 10;
+        }
+    }
+
+    /* All processes of the job race to create the directory */
+    if (mkdir(env, 0700) < 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "Failed to create node cache directory %s: %s\n", env, strerror(errno));
+        return;
+    }
+    directory = env;
+}
+
+bool NodeCache::enabled()
+{
+    return directory.size() > 0;
+}
+
+static bool preadAll(int fd, void *buf, size_t size, off_t offset)
+{
+    for (size_t done=0; done<size; )
+    {
+        ssize_t n = pread(fd, (char *) buf + done, size - done, offset + done);
+        if (n == 0 || (n < 0 && errno != EINTR))
+            return false;
+        done += n > 0 ? n : 0;
+    }
+    return true;
+}
+
+static bool pwriteAll(int fd, const void *buf, size_t size, off_t offset)
+{
+    for (size_t done=0; done<size; )
+    {
+        ssize_t n = pwrite(fd, (const char *) buf + done, size - done, offset + done);
+        if (n < 0 && errno != EINTR)
+            return false;
+        done += n > 0 ? n : 0;
+    }
+    return true;
+}
+
+std::shared_ptr<AnonymousMemoryMap> NodeCache::read(
+    int fd, const std::string &key, const std::string &stamp, size_t size)
+{
+    std::shared_ptr<AnonymousMemoryMap> mapping;
+
+    /* Files that are empty, incomplete, or that belong to other grids or inputs are misses */
+    NodeCacheHeader header;
+    std::string entry_key(key.size(), '\0'), entry_stamp(stamp.size(), '\0');
+    if (! preadAll(fd, &header, sizeof(header), 0) ||
+        memcmp(header.magic, NODE_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.size != size || header.key_size != key.size() || header.stamp_size != stamp.size() ||
+        ! preadAll(fd, &entry_key[0], key.size(), sizeof(header)) ||
+        ! preadAll(fd, &entry_stamp[0], stamp.size(), sizeof(header) + key.size()) ||
+        entry_key.compare(key) != 0 || entry_stamp.compare(stamp) != 0)
+        return mapping;
+
+    mapping = std::make_shared<AnonymousMemoryMap>(size);
+    if (! mapping->createFromFile(fd, header.data_offset))
+        mapping.reset();
+    return mapping;
+}
+
+std::shared_ptr<AnonymousMemoryMap> NodeCache::get(
+    const std::string &key, const std::string &stamp, size_t size, Entry &entry)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/%016llx-%016llx",
+        (unsigned long long) hash64(key.data(), key.size()),
+        (unsigned long long) hash64(stamp.data(), stamp.size()));
+    std::string path = directory + name;
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to open node cache entry %s: %s\n", path.c_str(), strerror(errno));
+        return NULL;
+    }
+
+    /*
+     * Look the entry up under a shared lock first. On a miss, the exclusive lock
+     * makes us wait for any other process that is busy computing the grid, so the
+     * entry has to be looked up again once we have it.
+     */
+    std::shared_ptr<AnonymousMemoryMap> mapping;
+    if (flock(fd, LOCK_SH) == 0)
+        mapping = read(fd, key, stamp, size);
+    if (! mapping && flock(fd, LOCK_EX) == 0)
+    {
+        mapping = read(fd, key, stamp, size);
+        if (! mapping)
+        {
+            entry.fd = fd;
+            entry.path = path;
+            return NULL;
+        }
+    }
+
+    /* The mapping holds a duplicate of the descriptor, which shares the lock */
+    if (mapping)
+        futimens(fd, NULL);
+    flock(fd, LOCK_UN);
+    close(fd);
+    return mapping;
+}
+
+bool NodeCache::put(Entry &entry, const std::string &key, const std::string &stamp,
+    const void *data, size_t size)
+{
+    if (! entry.locked())
+        return false;
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    NodeCacheHeader header;
+    memcpy(header.magic, NODE_CACHE_MAGIC, sizeof(header.magic));
+    header.size = size;
+    header.key_size = key.size();
+    header.stamp_size = stamp.size();
+    header.data_offset = (sizeof(header) + key.size() + stamp.size() + page_size - 1) & ~(page_size - 1);
+
+    /*
+     * Only incomplete entries and entries whose key and stamp hash to the same
+     * name get rewritten, so no other process should be mapping the file now
+     */
+    int fd = entry.fd;
+    bool ok =
+        ftruncate(fd, 0) == 0 &&
+        ftruncate(fd, header.data_offset + size) == 0 &&
+        pwriteAll(fd, key.data(), key.size(), sizeof(header)) &&
+        pwriteAll(fd, stamp.data(), stamp.size(), sizeof(header) + key.size()) &&
+        pwriteAll(fd, data, size, header.data_offset) &&
+        pwriteAll(fd, &header, sizeof(header), 0);
+    if (! ok)
+    {
+        fprintf(stderr, "Failed to write node cache entry: %s\n", strerror(errno));
+        if (ftruncate(fd, 0) < 0)
+            fprintf(stderr, "Failed to discard node cache entry: %s\n", strerror(errno));
+        unlinkEntry(fd, entry.path);
+    }
+
+    flock(fd, LOCK_UN);
+    close(fd);
+    entry.fd = -1;
+    if (ok)
+        trim(entry.path);
+    return ok;
+}
+
+void NodeCache::trim(const std::string &path)
+{
+    DIR *dir = opendir(directory.c_str());
+    if (! dir)
+        return;
+
+    /* Entry names are made of the hash of the key, a dash and the hash of the stamp */
+    std::string name = path.substr(path.find_last_of('/') + 1);
+    std::string prefix = name.substr(0, name.find('-') + 1);
+
+    struct Candidate {
+        std::string path;
+        struct timespec last_used;
+        size_t size;
+    };
+    std::vector<Candidate> candidates;
+    size_t used = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL)
+    {
+        struct stat statbuf;
+        std::string other = de->d_name;
+        std::string other_path = directory + "/" + other;
+        if (other.size() != name.size() || other.find('-') != prefix.size() - 1 ||
+            other.compare(name) == 0 || stat(other_path.c_str(), &statbuf) < 0)
+            continue;
+
+        /* Grids of the same key computed from inputs that have changed since won't be read again */
+        if (other.compare(0, prefix.size(), prefix) == 0)
+        {
+            unlink(other_path.c_str());
+            continue;
+        }
+        candidates.push_back({other_path, statbuf.st_mtim, (size_t) statbuf.st_blocks * 512});
+        used += candidates.back().size;
+    }
+    closedir(dir);
+
+    /* The entry just stored is the most recently used one, so it's evicted last */
+    struct stat statbuf;
+    if (stat(path.c_str(), &statbuf) == 0)
+        used += statbuf.st_blocks * 512;
+    if (used <= budget)
+        return;
+
+    std::sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) {
+        return a.last_used.tv_sec < b.last_used.tv_sec ||
+            (a.last_used.tv_sec == b.last_used.tv_sec && a.last_used.tv_nsec < b.last_used.tv_nsec);
+    });
+    for (auto &candidate: candidates)
+    {
+        if (used <= budget)
+            break;
+
+        /* Entries that are being written are skipped; mappings of the others remain valid */
+        int fd = open(candidate.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+        {
+            unlinkEntry(fd, candidate.path);
+            used -= candidate.size;
+            flock(fd, LOCK_UN);
+        }
+        close(fd);
+    }
+}
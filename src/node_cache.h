@@ -0,0 +1,69 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: node_cache.h
+ *
+ * Cache of the grids computed by user-defined-functions that is shared by
+ * every process of a node (e.g., the ranks of an MPI job), so that only one
+ * of them evaluates each grid.
+ */
+#ifndef __node_cache_h
+#define __node_cache_h
+
+#include <stdint.h>
+#include <string>
+#include <memory>
+#include "anon_mmap.h"
+
+class NodeCache {
+public:
+    // Entry of the cache that the caller has been asked to compute. Other
+    // processes that look it up wait until it's stored or dropped.
+    class Entry {
+    public:
+        Entry() : fd(-1) {}
+        ~Entry();
+        Entry(const Entry &) = delete;
+        Entry &operator=(const Entry &) = delete;
+
+        // Whether the entry is held by the caller
+        bool locked() { return fd >= 0; }
+
+    private:
+        friend class NodeCache;
+        int fd;
+        std::string path;
+    };
+
+    // Create a cache that lives in the directory given by $HDF5_UDF_NODE_CACHE,
+    // which should be on a memory file system such as /dev/shm. The entries of
+    // all processes are kept within the byte budget given by $HDF5_UDF_NODE_CACHE_SIZE.
+    NodeCache();
+
+    // Whether a cache directory has been given
+    bool enabled();
+
+    // Retrieve the grid computed under the given key and stamp by any process
+    // of this node. Both are stored along with the grid and compared in full.
+    // On a miss, the entry is locked on behalf of the caller, who is expected
+    // to compute it and to store it with put(); entries that are dropped
+    // instead are removed. Returns NULL on a miss.
+    std::shared_ptr<AnonymousMemoryMap> get(const std::string &key, const std::string &stamp,
+        size_t size, Entry &entry);
+
+    // Store the grid of an entry returned by a miss of get() and unlock it. Entries
+    // of the same key computed from other inputs are removed, as are the least
+    // recently used entries of the directory if the budget is exceeded.
+    bool put(Entry &entry, const std::string &key, const std::string &stamp, const void *data, size_t size);
+
+private:
+    std::shared_ptr<AnonymousMemoryMap> read(int fd, const std::string &key, const std::string &stamp, size_t size);
+
+    // Remove stale entries of the given key and evict others to stay within the budget
+    void trim(const std::string &path);
+
+    std::string directory;
+    size_t budget;
+};
+
+#endif /* __node_cache_h */
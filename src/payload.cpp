@@ -0,0 +1,328 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: payload.cpp
+ *
+ * Encoding and decoding of the payload stored in each chunk of a virtual
+ * dataset.
+ */
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include "payload.h"
+#include "codec.h"
+
+using json = nlohmann::json;
+
+/* Round up to a multiple of 8 bytes, so that the arrays that follow are aligned */
+static inline size_t align8(size_t n)
+{
+    return (n + 7) & ~((size_t) 7);
+}
+
+std::string encodePayload(const json &jas, const std::string &bytecode)
+{
+    auto resolution = jas["output_resolution"].get<std::vector<hsize_t>>();
+    auto chunk_dims = jas.contains("chunk_dims") ?
+        jas["chunk_dims"].get<std::vector<hsize_t>>() : resolution;
+    auto chunk_offset = jas.contains("chunk_offset") ?
+        jas["chunk_offset"].get<std::vector<hsize_t>>() : std::vector<hsize_t>(resolution.size(), 0);
+    auto input_names = jas["input_datasets"].get<std::vector<std::string>>();
+    auto scratch_names = jas["scratch_datasets"].get<std::vector<std::string>>();
+    auto slots = jas["slots"].get<std::vector<std::string>>();
+
+    /* Build the string table */
+    std::string strings;
+    auto addString = [&strings](const std::string &s) -> uint32_t {
+        uint32_t offset = strings.size();
+        strings.append(s);
+        strings.push_back('\0');
+        return offset;
+    };
+
+    PayloadHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PAYLOAD_MAGIC, sizeof(header.magic));
+    // Unsigned payloads are written as version 2, which older filters can read
+    header.version = jas.contains("signature") ? PAYLOAD_VERSION : 2;
+    header.bytecode_size = bytecode.size();
+    header.rank = resolution.size();
+    header.num_inputs = input_names.size();
+    header.num_scratch = scratch_names.size();
+    header.num_slots = slots.size();
+    header.backend = addString(jas["backend"].get<std::string>());
+    header.output_name = addString(jas["output_dataset"].get<std::string>());
+    header.output_datatype = addString(jas["output_datatype"].get<std::string>());
+    header.materialized_name = PAYLOAD_NO_STRING;
+    header.fingerprints = PAYLOAD_NO_STRING;
+    header.signature = PAYLOAD_NO_STRING;
+    header.codec = getCodecByName(jas.value("codec", "none"));
+    header.codec_level = jas.value("codec_level", CODEC_DEFAULT_LEVEL);
+    header.decoded_size = jas.value("decoded_size", bytecode.size());
+    if (jas.value("streaming", false))
+        header.flags |= PAYLOAD_STREAMING;
+    if (jas.contains("materialized"))
+    {
+        auto &materialized = jas["materialized"];
+        header.flags |= PAYLOAD_MATERIALIZED;
+        if (materialized.value("update", false))
+            header.flags |= PAYLOAD_MATERIALIZED_UPDATE;
+        header.materialized_name = addString(materialized["dataset"].get<std::string>());
+        header.fingerprints = addString(materialized["fingerprints"].dump());
+    }
+
+    if (jas.contains("signature"))
+        header.signature = addString(jas["signature"].get<std::string>());
+
+    std::vector<uint32_t> names;
+    for (auto list: {&input_names, &scratch_names, &slots})
+        for (auto &name: *list)
+            names.push_back(addString(name));
+
+    /* Fixed-size fields come first, then the dimensions, the names and the strings */
+    header.dims_offset = sizeof(header);
+    header.names_offset = header.dims_offset + 3 * header.rank * sizeof(hsize_t);
+    header.strings_offset = align8(header.names_offset + names.size() * sizeof(uint32_t));
+    header.header_size = align8(header.strings_offset + strings.size());
+
+    std::string payload(header.header_size, '\0');
+    memcpy(&payload[0], &header, sizeof(header));
+    char *p = &payload[header.dims_offset];
+    for (auto dims: {&resolution, &chunk_dims, &chunk_offset})
+    {
+        memcpy(p, dims->data(), header.rank * sizeof(hsize_t));
+        p += header.rank * sizeof(hsize_t);
+    }
+    memcpy(&payload[header.names_offset], names.data(), names.size() * sizeof(uint32_t));
+    memcpy(&payload[header.strings_offset], strings.data(), strings.size());
+    payload.append(bytecode);
+    return payload;
+}
+
+bool decodePayload(const void *buf, size_t buf_size, PayloadView &view)
+{
+    auto header = (const PayloadHeader *) buf;
+    if (buf_size < offsetof(PayloadHeader, flags) ||
+        memcmp(header->magic, PAYLOAD_MAGIC, sizeof(header->magic)))
+        return false;
+    if (header->version > PAYLOAD_VERSION)
+    {
+        fprintf(stderr, "Unsupported payload version %u\n", header->version);
+        return false;
+    }
+
+    /* Fields were appended to the header as new versions came along */
+    size_t fixed_size =
+        header->version >= 3 ? sizeof(PayloadHeader) :
+        header->version >= 2 ? offsetof(PayloadHeader, signature) : offsetof(PayloadHeader, codec);
+    if (buf_size < fixed_size || header->dims_offset < fixed_size)
+    {
+        fprintf(stderr, "Corrupted payload header\n");
+        return false;
+    }
+
+    /* Make sure that every offset points inside the header */
+    uint64_t num_names = (uint64_t) header->num_inputs + header->num_scratch + header->num_slots;
+    if (header->header_size > buf_size ||
+        header->bytecode_size > buf_size - header->header_size ||
+        header->dims_offset + 3 * (uint64_t) header->rank * sizeof(hsize_t) > header->header_size ||
+        header->names_offset + num_names * sizeof(uint32_t) > header->header_size ||
+        header->strings_offset >= header->header_size)
+    {
+        fprintf(stderr, "Corrupted payload header\n");
+        return false;
+    }
+
+    /* Strings are null-terminated, so the table must end with a null byte */
+    const char *base = (const char *) buf;
+    size_t strings_size = header->header_size - header->strings_offset;
+    const char *strings = base + header->strings_offset;
+    if (strings[strings_size-1] != '\0')
+    {
+        fprintf(stderr, "Corrupted payload string table\n");
+        return false;
+    }
+    const uint32_t *names = (const uint32_t *) (base + header->names_offset);
+    for (uint64_t i=0; i<num_names; ++i)
+        if (names[i] >= strings_size)
+        {
+            fprintf(stderr, "Corrupted payload name table\n");
+            return false;
+        }
+    for (auto offset: {header->backend, header->output_name, header->output_datatype,
+        header->materialized_name, header->fingerprints})
+        if (offset != PAYLOAD_NO_STRING && offset >= strings_size)
+        {
+            fprintf(stderr, "Corrupted payload string reference\n");
+            return false;
+        }
+    if (header->version >= 3 && header->signature != PAYLOAD_NO_STRING &&
+        header->signature >= strings_size)
+    {
+        fprintf(stderr, "Corrupted payload string reference\n");
+        return false;
+    }
+
+    view.header = header;
+    view.resolution = (const hsize_t *) (base + header->dims_offset);
+    view.chunk_dims = view.resolution + header->rank;
+    view.chunk_offset = view.chunk_dims + header->rank;
+    view.names = names;
+    view.strings = strings;
+    view.bytecode = base + header->header_size;
+    return true;
+}
+
+size_t getPayloadSize(const void *buf, size_t buf_size)
+{
+    PayloadView view;
+    if (decodePayload(buf, buf_size, view))
+        return view.header->header_size + view.header->bytecode_size;
+
+    /* Files written by older versions carry a JSON header */
+    const char *end = (const char *) memchr(buf, '\0', buf_size);
+    if (end == NULL)
+        return 0;
+    json jas = json::parse((const char *) buf, end, NULL, false);
+    if (jas.is_discarded() || ! jas.contains("bytecode_size"))
+        return 0;
+    return (end - (const char *) buf) + 1 + jas["bytecode_size"].get<size_t>();
+}
+
+bool readPayload(const void *buf, size_t buf_size, Payload &payload)
+{
+    PayloadView view;
+    if (decodePayload(buf, buf_size, view))
+    {
+        auto header = view.header;
+        payload.backend = view.string(header->backend);
+        payload.output_name = view.string(header->output_name);
+        payload.output_datatype = view.string(header->output_datatype);
+        payload.resolution.assign(view.resolution, view.resolution + header->rank);
+        payload.chunk_dims.assign(view.chunk_dims, view.chunk_dims + header->rank);
+        payload.chunk_offset.assign(view.chunk_offset, view.chunk_offset + header->rank);
+        payload.input_names.clear();
+        payload.input_names.reserve(header->num_inputs);
+        for (size_t i=0; i<header->num_inputs; ++i)
+            payload.input_names.push_back(view.inputName(i));
+        payload.scratch_names.clear();
+        payload.scratch_names.reserve(header->num_scratch);
+        for (size_t i=0; i<header->num_scratch; ++i)
+            payload.scratch_names.push_back(view.scratchName(i));
+        payload.slots.clear();
+        payload.slots.reserve(header->num_slots);
+        for (size_t i=0; i<header->num_slots; ++i)
+            payload.slots.push_back(view.slotName(i));
+        payload.streaming = header->flags & PAYLOAD_STREAMING;
+        payload.materialized = header->flags & PAYLOAD_MATERIALIZED;
+        payload.materialized_update = header->flags & PAYLOAD_MATERIALIZED_UPDATE;
+        payload.materialized_name = view.string(header->materialized_name);
+        payload.fingerprints = view.string(header->fingerprints);
+        payload.header_size = header->header_size;
+        payload.bytecode = view.bytecode;
+        payload.bytecode_size = header->bytecode_size;
+        payload.codec = view.codec();
+        payload.decoded_size = view.decodedSize();
+        payload.signature = view.signature();
+        return true;
+    }
+
+    /* Files written by older versions carry a JSON header */
+    const char *start = (const char *) buf;
+    const char *end = (const char *) memchr(buf, '\0', buf_size);
+    if (end == NULL)
+    {
+        fprintf(stderr, "Unrecognized UDF payload\n");
+        return false;
+    }
+    json jas = json::parse(start, end, NULL, false);
+    if (jas.is_discarded())
+    {
+        fprintf(stderr, "Failed to parse JSON payload header\n");
+        return false;
+    }
+
+    payload.backend = jas["backend"].get<std::string>();
+    payload.output_name = jas["output_dataset"].get<std::string>();
+    payload.output_datatype = jas["output_datatype"].get<std::string>();
+    payload.resolution = jas["output_resolution"].get<std::vector<hsize_t>>();
+    payload.chunk_dims = payload.resolution;
+    payload.chunk_offset.assign(payload.resolution.size(), 0);
+    if (jas.contains("chunk_dims") && jas.contains("chunk_offset"))
+    {
+        payload.chunk_dims = jas["chunk_dims"].get<std::vector<hsize_t>>();
+        payload.chunk_offset = jas["chunk_offset"].get<std::vector<hsize_t>>();
+    }
+    payload.input_names = jas["input_datasets"].get<std::vector<std::string>>();
+    payload.scratch_names = jas["scratch_datasets"].get<std::vector<std::string>>();
+    payload.slots.clear();
+    if (jas.contains("slots"))
+        payload.slots = jas["slots"].get<std::vector<std::string>>();
+    payload.streaming = jas.value("streaming", false);
+    payload.materialized = jas.contains("materialized");
+    payload.materialized_update = false;
+    payload.materialized_name.clear();
+    payload.fingerprints.clear();
+    if (payload.materialized)
+    {
+        auto &materialized = jas["materialized"];
+        payload.materialized_update = materialized.value("update", false);
+        payload.materialized_name = materialized["dataset"].get<std::string>();
+        payload.fingerprints = materialized["fingerprints"].dump();
+    }
+    payload.header_size = (end - start) + 1;
+    payload.bytecode = start + payload.header_size;
+    payload.bytecode_size = jas["bytecode_size"].get<size_t>();
+    payload.codec = CODEC_NONE;
+    payload.decoded_size = payload.bytecode_size;
+    payload.signature.clear();
+    if (payload.bytecode_size > buf_size - payload.header_size)
+    {
+        fprintf(stderr, "Corrupted payload: bytecode exceeds the chunk\n");
+        return false;
+    }
+    return true;
+}
+
+std::string getSignedMessage(const Payload &payload)
+{
+    /* Strings and arrays are prefixed by their sizes, so that their boundaries are unambiguous */
+    std::string message = PAYLOAD_MAGIC;
+    auto addNumber = [&message](uint64_t n) {
+        message.append((const char *) &n, sizeof(n));
+    };
+    auto addString = [&message, &addNumber](const std::string &s) {
+        addNumber(s.size());
+        message.append(s);
+    };
+    auto addDims = [&addNumber](const std::vector<hsize_t> &dims) {
+        addNumber(dims.size());
+        for (auto dim: dims)
+            addNumber(dim);
+    };
+    auto addNames = [&addNumber, &addString](const std::vector<std::string> &names) {
+        addNumber(names.size());
+        for (auto &name: names)
+            addString(name);
+    };
+
+    addString(payload.backend);
+    addString(payload.output_name);
+    addString(payload.output_datatype);
+    addDims(payload.resolution);
+    addDims(payload.chunk_dims);
+    addDims(payload.chunk_offset);
+    addNames(payload.input_names);
+    addNames(payload.scratch_names);
+    addNames(payload.slots);
+    addNumber(payload.streaming);
+    addNumber(payload.materialized);
+    addNumber(payload.materialized_update);
+    addString(payload.materialized_name);
+    addString(payload.fingerprints);
+    addNumber(payload.codec);
+    addNumber(payload.decoded_size);
+    addNumber(payload.bytecode_size);
+    message.append(payload.bytecode, payload.bytecode_size);
+    return message;
+}
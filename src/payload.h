@@ -0,0 +1,141 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: payload.h
+ *
+ * Layout of the payload stored in each chunk of a virtual dataset: a binary
+ * header that describes the UDF and its datasets, followed by the bytecode.
+ * Files written by older versions hold a JSON header instead, terminated by
+ * a null byte.
+ */
+#ifndef __payload_h
+#define __payload_h
+
+#include <hdf5.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "json.hpp"
+
+#define PAYLOAD_MAGIC "H5UDFHDR"
+#define PAYLOAD_VERSION 3
+
+/* Flags of the header */
+#define PAYLOAD_STREAMING           0x1
+#define PAYLOAD_MATERIALIZED        0x2
+#define PAYLOAD_MATERIALIZED_UPDATE 0x4
+
+/* Placeholder for strings that are absent */
+#define PAYLOAD_NO_STRING 0xffffffff
+
+/*
+ * Fixed-size fields at the start of the payload. Strings are given as offsets
+ * into the string table; the other offsets are relative to the start of the
+ * payload.
+ */
+struct PayloadHeader {
+    char magic[8];                  /* PAYLOAD_MAGIC */
+    uint32_t version;               /* PAYLOAD_VERSION */
+    uint32_t flags;                 /* PAYLOAD_* flags */
+    uint64_t header_size;           /* Offset of the bytecode */
+    uint64_t bytecode_size;         /* Size of the bytecode */
+    uint32_t rank;                  /* Number of dimensions of the output dataset */
+    uint32_t num_inputs;            /* Number of input datasets */
+    uint32_t num_scratch;           /* Number of scratch datasets */
+    uint32_t num_slots;             /* Number of dataset slots */
+    uint32_t backend;               /* Name of the backend */
+    uint32_t output_name;           /* Name of the output dataset */
+    uint32_t output_datatype;       /* Datatype of the output dataset */
+    uint32_t materialized_name;     /* Name of the materialized copy */
+    uint32_t fingerprints;          /* Fingerprints of the inputs, as JSON */
+    uint32_t dims_offset;           /* Resolution, chunk dimensions and chunk offset */
+    uint32_t names_offset;          /* Input, scratch and slot names */
+    uint32_t strings_offset;        /* String table */
+    uint32_t codec;                 /* Codec applied to the bytecode (since version 2) */
+    uint32_t codec_level;           /* Level the bytecode was encoded with */
+    uint64_t decoded_size;          /* Size of the bytecode once decoded */
+    uint32_t signature;             /* Signature of the bytecode, hex-encoded (since version 3) */
+    uint32_t padding;
+};
+
+/*
+ * Binary payload decoded in place. The pointers refer to the buffer the
+ * payload was decoded from.
+ */
+struct PayloadView {
+    const PayloadHeader *header;
+    const hsize_t *resolution;
+    const hsize_t *chunk_dims;
+    const hsize_t *chunk_offset;
+    const uint32_t *names;
+    const char *strings;
+    const char *bytecode;
+
+    const char *string(uint32_t offset) const {
+        return offset == PAYLOAD_NO_STRING ? "" : strings + offset;
+    }
+    const char *inputName(size_t i) const { return string(names[i]); }
+    const char *scratchName(size_t i) const { return string(names[header->num_inputs + i]); }
+    const char *slotName(size_t i) const {
+        return string(names[header->num_inputs + header->num_scratch + i]);
+    }
+
+    /* Version 1 headers predate codecs and hold the bytecode as-is */
+    uint32_t codec() const { return header->version >= 2 ? header->codec : 0; }
+    uint64_t decodedSize() const {
+        return header->version >= 2 ? header->decoded_size : header->bytecode_size;
+    }
+    const char *signature() const {
+        return header->version >= 3 ? string(header->signature) : "";
+    }
+};
+
+/*
+ * Metadata of a payload, as used by the filter. Unlike PayloadView, names are
+ * copied out of the buffer, as the dataset readers, caches and backends take
+ * them as std::string; callers that only need the header fields should use
+ * decodePayload() instead, which doesn't allocate.
+ */
+struct Payload {
+    std::string backend;
+    std::string output_name;
+    std::string output_datatype;
+    std::vector<hsize_t> resolution;
+    std::vector<hsize_t> chunk_dims;
+    std::vector<hsize_t> chunk_offset;
+    std::vector<std::string> input_names;
+    std::vector<std::string> scratch_names;
+    std::vector<std::string> slots;
+    bool streaming;
+    bool materialized;
+    bool materialized_update;
+    std::string materialized_name;
+    std::string fingerprints;       /* JSON */
+    size_t header_size;
+    const char *bytecode;
+    size_t bytecode_size;
+    int codec;
+    size_t decoded_size;
+    std::string signature;          /* Hex-encoded, empty if unsigned */
+};
+
+// Build a binary payload out of the JSON description of a UDF and its bytecode,
+// already encoded with the codec given in the description
+std::string encodePayload(const nlohmann::json &jas, const std::string &bytecode);
+
+// Decode a binary payload without copying it. Returns false if the buffer
+// doesn't hold a valid binary payload.
+bool decodePayload(const void *buf, size_t buf_size, PayloadView &view);
+
+// Size of the payload held in the buffer, either binary or JSON. Returns 0
+// if the buffer doesn't hold a valid payload.
+size_t getPayloadSize(const void *buf, size_t buf_size);
+
+// Retrieve the metadata of the payload held in the buffer, either binary or JSON
+bool readPayload(const void *buf, size_t buf_size, Payload &payload);
+
+// Canonical encoding of what the signature of a payload covers: every field of
+// the header but the signature itself, followed by the bytecode
+std::string getSignedMessage(const Payload &payload);
+
+#endif /* __payload_h */
@@ -0,0 +1,84 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: prefetcher.cpp
+ *
+ * Background threads that bring the storage of input datasets into the
+ * page cache while the filter is busy with other work.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include "prefetcher.h"
+
+/* Ranges are split into blocks of this size so that threads share the work */
+#define PREFETCH_BLOCK_SIZE (4 * 1024 * 1024)
+
+Prefetcher::Prefetcher() :
+    next(0),
+    stopped(false)
+{
+    const char *env = getenv("HDF5_UDF_READ_THREADS");
+    max_threads = env ? strtoul(env, NULL, 10) : 0;
+}
+
+Prefetcher::~Prefetcher()
+{
+    stop();
+}
+
+bool Prefetcher::enabled()
+{
+    return max_threads > 0;
+}
+
+void Prefetcher::add(int fd, off_t offset, size_t size)
+{
+    for (size_t done = 0; done < size; done += PREFETCH_BLOCK_SIZE)
+    {
+        Range range;
+        range.fd = fd;
+        range.offset = offset + done;
+        range.size = std::min((size_t) PREFETCH_BLOCK_SIZE, size - done);
+        ranges.push_back(range);
+    }
+}
+
+void Prefetcher::start()
+{
+    size_t n = std::min(max_threads, ranges.size());
+    for (size_t i=0; i<n; ++i)
+        threads.push_back(std::thread(&Prefetcher::worker, this));
+}
+
+void Prefetcher::stop()
+{
+    stopped = true;
+    for (auto &thread: threads)
+        thread.join();
+    threads.clear();
+}
+
+void Prefetcher::worker()
+{
+    // Threads only issue plain file reads: no HDF5 calls can be made from here
+    std::vector<char> buffer;
+    while (! stopped)
+    {
+        size_t index = next++;
+        if (index >= ranges.size())
+            break;
+
+        // readahead() populates the page cache without copying the data to us.
+        // Some file systems don't support it, so we fall back to pread().
+        auto &range = ranges[index];
+        if (readahead(range.fd, range.offset, range.size) < 0)
+        {
+            buffer.resize(PREFETCH_BLOCK_SIZE);
+            if (pread(range.fd, buffer.data(), range.size, range.offset) < 0)
+                break;
+        }
+    }
+}
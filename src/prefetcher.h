@@ -0,0 +1,52 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: prefetcher.h
+ *
+ * Background threads that bring the storage of input datasets into the
+ * page cache while the filter is busy with other work.
+ */
+#ifndef __prefetcher_h
+#define __prefetcher_h
+
+#include <sys/types.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+class Prefetcher {
+public:
+    // The number of threads is given by $HDF5_UDF_READ_THREADS
+    Prefetcher();
+    ~Prefetcher();
+
+    // Whether prefetching has been enabled
+    bool enabled();
+
+    // Schedule a byte range of the given file. Ranges are prefetched
+    // roughly in the order they were added.
+    void add(int fd, off_t offset, size_t size);
+
+    // Start the threads
+    void start();
+
+    // Tell the threads to stop and wait for them to finish
+    void stop();
+
+private:
+    struct Range {
+        int fd;
+        off_t offset;
+        size_t size;
+    };
+
+    void worker();
+
+    std::vector<Range> ranges;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next;
+    std::atomic<bool> stopped;
+    size_t max_threads;
+};
+
+#endif /* __prefetcher_h */
@@ -0,0 +1,156 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: profiler.cpp
+ *
+ * Per-phase timing of the reads served by the filter.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "profiler.h"
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+Profiler profiler;
+
+Profiler::Profiler()
+{
+    const char *env = getenv("HDF5_UDF_PROFILE");
+    active = env && strlen(env) && strcmp(env, "0") != 0;
+    if (active && (strcmp(env, "stderr") == 0 || strchr(env, '/') || strchr(env, '.')))
+        output = env;
+}
+
+std::vector<Profiler::Record> &Profiler::records()
+{
+    static thread_local std::vector<Record> thread_records;
+    return thread_records;
+}
+
+bool Profiler::enabled()
+{
+    return active;
+}
+
+void Profiler::record(const std::string &phase, double seconds, size_t bytes,
+    const std::string &name)
+{
+    if (! active)
+        return;
+    Record record;
+    record.phase = phase;
+    record.name = name;
+    record.seconds = seconds;
+    record.bytes = bytes;
+    record.calls = 0;
+    records().push_back(record);
+}
+
+void Profiler::count(const std::string &event, uint64_t calls)
+{
+    if (! active)
+        return;
+    Record record;
+    record.phase = event;
+    record.seconds = 0;
+    record.bytes = 0;
+    record.calls = calls;
+    records().push_back(record);
+}
+
+void Profiler::clear()
+{
+    records().clear();
+}
+
+void Profiler::exportTo(RemoteTimings *timings)
+{
+    timings->count = 0;
+    for (auto &record: records())
+    {
+        if (timings->count == MAX_REMOTE_TIMINGS)
+            break;
+        auto &entry = timings->entries[timings->count++];
+        snprintf(entry.phase, sizeof(entry.phase), "%s", record.phase.c_str());
+        entry.seconds = record.seconds;
+        entry.bytes = record.bytes;
+        entry.calls = record.calls;
+    }
+    records().clear();
+}
+
+void Profiler::importFrom(const RemoteTimings *timings)
+{
+    for (uint32_t i=0; i<timings->count && i<MAX_REMOTE_TIMINGS; ++i)
+    {
+        auto &entry = timings->entries[i];
+        std::string phase(entry.phase, strnlen(entry.phase, sizeof(entry.phase)));
+        if (entry.calls)
+            count(phase, entry.calls);
+        else
+            record(phase, entry.seconds, entry.bytes);
+    }
+}
+
+void Profiler::flush(const std::string &dataset, const std::string &backend,
+    const std::vector<hsize_t> &chunk_offset)
+{
+    if (! active)
+        return;
+
+    json line;
+    line["dataset"] = dataset;
+    line["backend"] = backend;
+    line["chunk_offset"] = chunk_offset;
+    line["phases"] = json::array();
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &record: records())
+    {
+        json entry;
+        entry["phase"] = record.phase;
+        if (record.name.size())
+            entry["name"] = record.name;
+        entry["seconds"] = record.seconds;
+        entry["bytes"] = record.bytes;
+        if (record.calls)
+            entry["calls"] = record.calls;
+        line["phases"].push_back(entry);
+
+        auto &aggregate = aggregates[record.phase];
+        aggregate.count++;
+        aggregate.seconds += record.seconds;
+        aggregate.bytes += record.bytes;
+        aggregate.calls += record.calls;
+    }
+    records().clear();
+
+    if (output.size())
+    {
+        // Files are opened in append mode so that several processes can share them
+        auto text = line.dump() + "\n";
+        FILE *fp = output.compare("stderr") == 0 ? stderr : fopen(output.c_str(), "a");
+        if (fp)
+        {
+            fwrite(text.data(), 1, text.size(), fp);
+            if (fp != stderr)
+                fclose(fp);
+        }
+    }
+}
+
+std::string Profiler::summary()
+{
+    json out = json::object();
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &entry: aggregates)
+    {
+        out[entry.first]["count"] = entry.second.count;
+        out[entry.first]["seconds"] = entry.second.seconds;
+        out[entry.first]["bytes"] = entry.second.bytes;
+        if (entry.second.calls)
+            out[entry.first]["calls"] = entry.second.calls;
+    }
+    return out.dump();
+}
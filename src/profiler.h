@@ -0,0 +1,125 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: profiler.h
+ *
+ * Per-phase timing of the reads served by the filter.
+ */
+#ifndef __profiler_h
+#define __profiler_h
+
+#include <hdf5.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+
+#define MAX_REMOTE_TIMINGS 16
+
+// Timings of the phases that run in the process that hosts the UDF. They
+// are handed back to the filter through shared memory or a socket, so this
+// is a plain structure of fixed size.
+struct RemoteTimings {
+    uint32_t count;
+    struct {
+        char phase[24];
+        double seconds;
+        uint64_t bytes;
+        uint64_t calls;
+    } entries[MAX_REMOTE_TIMINGS];
+};
+
+class Profiler {
+public:
+    // Profiling is enabled through $HDF5_UDF_PROFILE. If that holds a path
+    // (i.e., it contains a '/' or a '.') or "stderr", one JSON line is
+    // appended to it per read. Other values such as "1" only keep the
+    // aggregates returned by hdf5_udf_profile().
+    Profiler();
+
+    // Whether profiling has been enabled
+    bool enabled();
+
+    // Monotonic clock, in seconds
+    static double now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+    }
+
+    // Record the duration of a phase of the current read. The name tells
+    // which dataset the phase operated on, if any.
+    void record(const std::string &phase, double seconds, size_t bytes=0,
+        const std::string &name="");
+
+    // Record how many times an event (e.g., a system call checked by the
+    // sandbox) happened during the current read
+    void count(const std::string &event, uint64_t calls);
+
+    // Discard the phases recorded so far (e.g., those inherited from the filter)
+    void clear();
+
+    // Move the phases recorded so far to a structure that can be sent to the filter
+    void exportTo(RemoteTimings *timings);
+
+    // Record the phases received from the process that hosted the UDF
+    void importFrom(const RemoteTimings *timings);
+
+    // Conclude the current read: emit its JSON line and update the aggregates
+    void flush(const std::string &dataset, const std::string &backend,
+        const std::vector<hsize_t> &chunk_offset);
+
+    // Aggregates of all reads profiled so far, as a JSON string
+    std::string summary();
+
+private:
+    struct Record {
+        std::string phase;
+        std::string name;
+        double seconds;
+        size_t bytes;
+        uint64_t calls;
+    };
+
+    struct Aggregate {
+        uint64_t count;
+        double seconds;
+        uint64_t bytes;
+        uint64_t calls;
+    };
+
+    // Phases of the read in progress. Reads may be served by several threads
+    // at once (e.g., those started by hdf5_udf_prefetch()), so each has its own.
+    static std::vector<Record> &records();
+
+    bool active;
+    std::string output;
+    std::mutex lock;            /* Guards the aggregates and the output */
+    std::map<std::string, Aggregate> aggregates;
+};
+
+// Helper to measure the time elapsed since its creation
+class ProfileTimer {
+public:
+    ProfileTimer() : start(Profiler::now()) {}
+    double elapsed() { return Profiler::now() - start; }
+private:
+    double start;
+};
+
+extern Profiler profiler;
+
+// Discards the phases of the current read when it goes out of scope, so that
+// reads that bail out before flushing don't leak them into the next read
+class ProfileScope {
+public:
+    ProfileScope() {}
+    ~ProfileScope() { profiler.clear(); }
+    ProfileScope(const ProfileScope &) = delete;
+    ProfileScope &operator=(const ProfileScope &) = delete;
+};
+
+#endif /* __profiler_h */
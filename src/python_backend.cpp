@@ -6,6 +6,7 @@
  * Python code parser and bytecode generation/execution.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -21,50 +22,106 @@
 #include <string>
 #include <algorithm>
 #include "python_backend.h"
-#include "anon_mmap.h"
 #include "dataset.h"
-#ifdef ENABLE_SANDBOX
-#include "sandbox.h"
-#endif
 
-// Dataset names, sizes, and types
-static std::vector<DatasetInfo> dataset_info;
+// Dataset names, sizes, and types of the UDF being executed by this thread,
+// indexed by slot. They belong to the backend object that runs it.
+static const std::vector<DatasetInfo> no_datasets;
+static thread_local const std::vector<DatasetInfo> *dataset_info = &no_datasets;
+
+static const DatasetInfo *dataset_at(int slot)
+{
+    if (slot >= 0 && (size_t) slot < dataset_info->size())
+        return &(*dataset_info)[slot];
+    fprintf(stderr, "Error: invalid dataset slot %d\n", slot);
+    return NULL;
+}
 
 /* Functions exported to the Python template library (udf_template.py) */
-extern "C" void *pythonGetData(const char *element)
+extern "C" int pythonGetSlot(const char *element)
 {
-    for (size_t i=0; i<dataset_info.size(); ++i)
-        if (dataset_info[i].name.compare(element) == 0)
-            return dataset_info[i].data;
+    for (size_t i=0; i<dataset_info->size(); ++i)
+        if ((*dataset_info)[i].name.compare(element) == 0)
+            return i;
     fprintf(stderr, "%s: dataset %s not found\n", __func__, element);
-    return NULL;
+    return -1;
+}
+
+extern "C" void *pythonGetDataAt(int slot)
+{
+    auto info = dataset_at(slot);
+    return info ? info->data : NULL;
+}
+
+extern "C" const char *pythonGetTypeAt(int slot)
+{
+    auto info = dataset_at(slot);
+    return info ? info->getDatatype() : NULL;
+}
+
+extern "C" const char *pythonGetCastAt(int slot)
+{
+    auto info = dataset_at(slot);
+    return info ? info->getCastDatatype() : NULL;
+}
+
+extern "C" int pythonGetRankAt(int slot)
+{
+    auto info = dataset_at(slot);
+    return info ? info->dimensions.size() : 0;
+}
+
+extern "C" const hsize_t *pythonGetDimsAt(int slot)
+{
+    auto info = dataset_at(slot);
+    return info ? info->dimensions.data() : NULL;
+}
+
+extern "C" const hsize_t *pythonGetOffsetAt(int slot)
+{
+    auto info = dataset_at(slot);
+    return info ? info->offset.data() : NULL;
+}
+
+extern "C" int pythonForkSlices(size_t n, size_t *begin, size_t *end)
+{
+    return forkSlices(n, begin, end);
+}
+
+extern "C" int pythonJoinSlices(int is_child, int ok)
+{
+    return joinSlices(is_child, ok);
+}
+
+/* Name-based interfaces, used by UDFs compiled before slots were introduced */
+extern "C" void *pythonGetData(const char *element)
+{
+    int slot = pythonGetSlot(element);
+    return slot >= 0 ? pythonGetDataAt(slot) : NULL;
 }
 
 extern "C" const char *pythonGetType(const char *element)
 {
-    for (size_t i=0; i<dataset_info.size(); ++i)
-        if (dataset_info[i].name.compare(element) == 0)
-            return dataset_info[i].getDatatype();
-    fprintf(stderr, "%s: dataset %s not found\n", __func__, element);
-    return NULL;
+    int slot = pythonGetSlot(element);
+    return slot >= 0 ? pythonGetTypeAt(slot) : NULL;
 }
 
 extern "C" const char *pythonGetCast(const char *element)
 {
-    for (size_t i=0; i<dataset_info.size(); ++i)
-        if (dataset_info[i].name.compare(element) == 0)
-            return dataset_info[i].getCastDatatype();
-    fprintf(stderr, "%s: dataset %s not found\n", __func__, element);
-    return NULL;
+    int slot = pythonGetSlot(element);
+    return slot >= 0 ? pythonGetCastAt(slot) : NULL;
 }
 
 extern "C" const char *pythonGetDims(const char *element)
 {
-    for (size_t i=0; i<dataset_info.size(); ++i)
-        if (dataset_info[i].name.compare(element) == 0)
-            return dataset_info[i].dimensions_str.c_str();
-    fprintf(stderr, "%s: dataset %s not found\n", __func__, element);
-    return NULL;
+    int slot = pythonGetSlot(element);
+    return slot >= 0 ? (*dataset_info)[slot].dimensions_str.c_str() : NULL;
+}
+
+extern "C" const char *pythonGetOffset(const char *element)
+{
+    int slot = pythonGetSlot(element);
+    return slot >= 0 ? (*dataset_info)[slot].offset_str.c_str() : NULL;
 }
 
 /* This backend's name */
@@ -79,6 +136,12 @@ std::string PythonBackend::extension()
     return ".py";
 }
 
+/* Describe the interpreter that compile() runs */
+std::string PythonBackend::describeToolchain(std::string udf_file, std::string template_file)
+{
+    return captureOutput({"python3", "--version"});
+}
+
 /* Compile Python to a bytecode. Returns the bytecode as a string object. */
 std::string PythonBackend::compile(std::string udf_file, std::string template_file)
 {
@@ -90,6 +153,28 @@ std::string PythonBackend::compile(std::string udf_file, std::string template_fi
         return "";
     }
 
+    // compileall writes to a __pycache__ directory next to the source file.
+    // Each build gets a directory of its own so that concurrent builds don't
+    // remove that directory from under each other.
+    auto sep = py_file.find_last_of('/');
+    std::string builddir = py_file.substr(0, sep) + "/hdf5-udf-XXXXXX";
+    if (sep == std::string::npos || mkdtemp(&builddir[0]) == NULL)
+    {
+        fprintf(stderr, "Failed to create build directory: %s\n", strerror(errno));
+        unlink(py_file.c_str());
+        return "";
+    }
+    std::string filename = py_file.substr(sep + 1);
+    std::string src_file = builddir + "/" + filename;
+    if (rename(py_file.c_str(), src_file.c_str()) < 0)
+    {
+        fprintf(stderr, "Failed to move %s to the build directory: %s\n", py_file.c_str(), strerror(errno));
+        unlink(py_file.c_str());
+        rmdir(builddir.c_str());
+        return "";
+    }
+    py_file = src_file;
+
     pid_t pid = fork();
     if (pid == 0)
     {
@@ -104,6 +189,7 @@ std::string PythonBackend::compile(std::string udf_file, std::string template_fi
             (char *) NULL
         };
         execvp(cmd[0], cmd);
+        _exit(1);
     }
     else if (pid > 0)
     {
@@ -112,15 +198,6 @@ std::string PythonBackend::compile(std::string udf_file, std::string template_fi
         wait4(pid, &exit_status, 0, NULL);
 
         // Find the bytecode
-        auto sep = py_file.find_last_of('/');
-        if (sep == std::string::npos)
-        {
-            fprintf(stderr, "Failed to identify directory where assembled file was saved\n");
-            unlink(py_file.c_str());
-            return "";
-        }
-        std::string parentdir = py_file.substr(0, sep);
-        std::string filename = py_file.substr(sep + 1);
         sep = filename.find_last_of(".");
         filename = filename.substr(0, sep);
 
@@ -128,7 +205,7 @@ std::string PythonBackend::compile(std::string udf_file, std::string template_fi
         // to identify the actual path to that file.
         glob_t results;
         std::stringstream pycache, pattern;
-        pycache << parentdir << "/__pycache__";
+        pycache << builddir << "/__pycache__";
         pattern << pycache.str() << "/" << filename << ".cpython-*.pyc";
         int ret = glob(pattern.str().c_str(), GLOB_NOSORT, NULL, &results);
         if (ret != 0 || results.gl_pathc == 0)
@@ -136,6 +213,7 @@ std::string PythonBackend::compile(std::string udf_file, std::string template_fi
             fprintf(stderr, "No bytecodes were found under %s\n", pattern.str().c_str());
             unlink(py_file.c_str());
             rmdir(pycache.str().c_str());
+            rmdir(builddir.c_str());
             if (ret == 0) { globfree(&results); }
             return "";
         }
@@ -154,18 +232,18 @@ std::string PythonBackend::compile(std::string udf_file, std::string template_fi
         unlink(py_file.c_str());
         unlink(pyc_file.c_str());
         rmdir(pycache.str().c_str());
+        rmdir(builddir.c_str());
         return bytecode;
     }
     fprintf(stderr, "Failed to execute python3\n");
+    unlink(py_file.c_str());
+    rmdir(builddir.c_str());
     return "";
 }
 
-/* Execute the user-defined-function embedded in the given buffer */
-bool PythonBackend::run(
+/* Load the user-defined-function embedded in the given buffer */
+bool PythonBackend::load(
     const std::string filterpath,
-    const std::vector<DatasetInfo> input_datasets,
-    const DatasetInfo output_dataset,
-    const char *output_cast_datatype,
     const char *bytecode,
     size_t bytecode_size)
 {
@@ -175,28 +253,9 @@ bool PythonBackend::run(
         return false;
     }
 
-    /*
-     * We want to make the output dataset writeable by the UDF. Because
-     * the UDF is run under a separate process we have to use a shared
-     * memory segment which both processes can read and write to.
-     */
-    size_t room_size = output_dataset.getGridSize() * output_dataset.getStorageSize();
-    AnonymousMemoryMap mm(room_size);
-    if (! mm.create())
-        return false;
-
-    // Let output_dataset.data point to the shared memory segment
-    DatasetInfo output_dataset_copy = output_dataset;
-    output_dataset_copy.data = mm.mm;
-
-    // Populate global vector of dataset names, sizes, and types
-    dataset_info.push_back(output_dataset_copy);
-    dataset_info.insert(
-        dataset_info.end(), input_datasets.begin(), input_datasets.end());
-
     // Workaround for CFFI import errors due to missing symbols. We force libpython
     // to be loaded and for all symbols to be resolved by dlopen()
-    void *libpython = dlopen("libpython3.so", RTLD_NOW | RTLD_GLOBAL);
+    dlopen("libpython3.so", RTLD_NOW | RTLD_GLOBAL);
 
     // Init Python interpreter
     Py_Initialize();
@@ -219,101 +278,92 @@ bool PythonBackend::run(
             PyErr_Print();
         }
         PyErr_Clear();
-        Py_Finalize();
-        dlclose(libpython);
         return false;
     }
 
-    PyObject *module = PyImport_ExecCodeModule("udf_module", obj);
+    module = PyImport_ExecCodeModule("udf_module", obj);
     if (! module)
     {
         fprintf(stderr, "Failed to import code object\n");
         PyErr_Print();
-        Py_Finalize();
-        dlclose(libpython);
         return false;
     }
 
-    bool retval = false;
     PyObject *dict = PyModule_GetDict(module);
     PyObject *lib = dict ? PyDict_GetItemString(dict, "lib") : NULL;
     PyObject *loadlib = lib ? PyObject_GetAttrString(lib, "load") : NULL;
-    PyObject *udf = dict ? PyDict_GetItemString(dict, "dynamic_dataset") : NULL;
+    udf = dict ? PyDict_GetItemString(dict, "dynamic_dataset") : NULL;
     if (! lib || ! loadlib || ! udf)
+    {
         fprintf(stderr, "Failed to load required symbols from code object\n");
+        return false;
+    }
     else if (! PyCallable_Check(loadlib))
+    {
         fprintf(stderr, "Error: lib.load is not a callable function\n");
+        return false;
+    }
     else if (! PyCallable_Check(udf))
-        fprintf(stderr, "Error: dynamic_dataset is not a callable function\n");
-    else
     {
-        retval = executeUDF(loadlib, udf, filterpath);
-        if (retval == true)
-        {
-            // Update output HDF5 dataset with data from shared memory segment
-            memcpy(output_dataset.data, mm.mm, room_size);
-        }
+        fprintf(stderr, "Error: dynamic_dataset is not a callable function\n");
+        return false;
     }
 
-    Py_DECREF(module);
-    Py_DECREF(dict);
-    Py_Finalize();
-    dlclose(libpython);
-
-    return retval;
+    // Run 'lib.load(filterpath)' from our udf_template.py
+    // TODO: load the template straight from /usr/share, as
+    // the function that comes with the UDF may not be trustable.
+    PyObject *pyargs = PyTuple_New(1);
+    PyObject *pypath = Py_BuildValue("s", filterpath.c_str());
+    PyTuple_SetItem(pyargs, 0, pypath);
+    PyObject *callret = PyObject_CallObject(loadlib, pyargs);
+    Py_DECREF(pyargs);
+    Py_DECREF(loadlib);
+    if (! callret)
+    {
+        PyErr_Print();
+        PyErr_Clear();
+        return false;
+    }
+    Py_DECREF(callret);
+    return true;
 }
 
-/* Coordinate the execution of the UDF under a separate process */
-bool PythonBackend::executeUDF(PyObject *loadlib, PyObject *udf, std::string filterpath)
+/* Execute the user-defined-function previously loaded */
+bool PythonBackend::execute(const std::vector<DatasetInfo> &datasets)
 {
-    /*
-     * Execute the user-defined-function under a separate process so that
-     * seccomp can kill it (if needed) without crashing the entire program
-     */
-    pid_t pid = fork();
-    if (pid == 0)
+    // Populate vector of dataset names, sizes, and types
+    slot_datasets = sortBySlot(datasets);
+    dataset_info = &slot_datasets;
+
+    // Drop what the template cached about the datasets of the previous run.
+    // Templates that predate slots have no such method.
+    PyObject *dict = PyModule_GetDict(module);
+    PyObject *lib = dict ? PyDict_GetItemString(dict, "lib") : NULL;
+    if (lib && PyObject_HasAttrString(lib, "reset"))
     {
-        // Run 'lib.load(filterpath)' from our udf_template.py
-        // TODO: load the template straight from /usr/share, as
-        // the function that comes with the UDF may not be trustable.
-        PyObject *pyargs = PyTuple_New(1);
-        PyObject *pypath = Py_BuildValue("s", filterpath.c_str());
-        PyTuple_SetItem(pyargs, 0, pypath);
-        PyObject *callret = PyObject_CallObject(loadlib, pyargs);
-        if (callret)
-            Py_DECREF(callret);
-
-        bool ready = true;
-#ifdef ENABLE_SANDBOX
-        Sandbox sandbox;
-        ready = sandbox.init(filterpath);
-#endif
-        if (ready)
+        PyObject *resetret = PyObject_CallMethod(lib, "reset", NULL);
+        if (! resetret)
         {
-            // Run 'dynamic_dataset()' defined by the user
-            callret = PyObject_CallObject(udf, NULL);
-            if (callret)
-                Py_DECREF(callret);
-            else
-            {
-                // Function call terminated by an exception
-                PyErr_Print();
-                PyErr_Clear();
-                ready = false;
-            }
-            Py_DECREF(pypath);
-            Py_DECREF(pyargs);
+            PyErr_Print();
+            PyErr_Clear();
+            dataset_info = &no_datasets;
+            return false;
         }
-        // Exit the process without invoking any callbacks registered with atexit()
-        _exit(ready ? 0 : 1);
+        Py_DECREF(resetret);
     }
-    else if (pid > 0)
+
+    // Run 'dynamic_dataset()' defined by the user
+    PyObject *callret = PyObject_CallObject(udf, NULL);
+    dataset_info = &no_datasets;
+    if (! callret)
     {
-        int status;
-        waitpid(pid, &status, 0);
-        return WIFEXITED(status) ? WEXITSTATUS(status) == 0 : false;
+        // Function call terminated by an exception
+        PyErr_Print();
+        PyErr_Clear();
+        return false;
     }
-    return false;
+    Py_DECREF(callret);
+    return true;
 }
 
 void PythonBackend::printPyObject(PyObject *obj)
@@ -344,7 +394,8 @@ std::vector<std::string> PythonBackend::udfDatasetNames(std::string udf_file)
     while (std::getline(iss, line))
     {
         ltrim(line);
-        auto n = line.find("lib.getData");
+        /* Datasets are accessed either as flat buffers or as NumPy arrays */
+        auto n = std::min(line.find("lib.getData"), line.find("lib.getArray"));
         auto c = line.find("#");
         if (n != std::string::npos && (c == std::string::npos || c > n))
         {
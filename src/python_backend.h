@@ -23,22 +23,31 @@ public:
     // Compile an input file into executable form
     std::string compile(std::string udf_file, std::string template_file);
 
-    // Execute a user-defined-function
-    bool run(
+    // Version of the Python interpreter, which the bytecode format depends on
+    std::string describeToolchain(std::string udf_file, std::string template_file);
+
+    // Load the bytecode that implements the user-defined-function
+    bool load(
         const std::string filterpath,
-        const std::vector<DatasetInfo> input_datasets,
-        const DatasetInfo output_dataset,
-        const char *output_cast_datatype,
         const char *udf_blob,
         size_t udf_blob_size);
 
+    // Execute a previously loaded user-defined-function
+    bool execute(const std::vector<DatasetInfo> &datasets);
+
     // Scan the UDF file for references to HDF5 dataset names.
     // We use this to store the UDF dependencies in the JSON payload.
     std::vector<std::string> udfDatasetNames(std::string udf_file);
 
 private:
     void printPyObject(PyObject *obj);
-    bool executeUDF(PyObject *loadlib, PyObject *udf, std::string filterpath);
+
+    // Imported code object and its dynamic_dataset() function
+    PyObject *module = NULL;
+    PyObject *udf = NULL;
+
+    // Datasets of the current execution, indexed by slot
+    std::vector<DatasetInfo> slot_datasets;
 };
 
 #endif /* __python_backend_h */
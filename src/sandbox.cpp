@@ -14,12 +14,14 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <elf.h>
+#include <mutex>
 #include "sandbox.h"
 #include "backend.h"
+#include "profiler.h"
 
 #define SANDBOX_SECTION_NAME ".hdf5-udf-sandbox"
 
-// Declare a dummy backend so we can call Backend::saveToDisk()
+// Declare a dummy backend so we can call Backend::writeToMemory()
 class DummyBackend : public Backend {
 public:
     std::string name() { return ""; }
@@ -35,38 +37,85 @@ public:
     std::vector<std::string> udfDatasetNames(std::string udf_file) { return std::vector<std::string>(); }
 };
 
-bool Sandbox::init(std::string filterpath)
+// The sandbox library is extracted only once per process. Its memory file is
+// inherited by the processes that run the user-defined-functions.
+static std::string sandbox_filterpath;
+static std::string sandbox_path;
+static int sandbox_fd = -1;
+
+// Guards the variables above, which threads may prepare concurrently
+static std::mutex sandbox_lock;
+
+bool Sandbox::preload(std::string filterpath)
 {
+    std::lock_guard<std::mutex> guard(sandbox_lock);
+    if (sandbox_fd >= 0 && sandbox_filterpath.compare(filterpath) == 0)
+        return true;
+
     // The sandbox library is stored in a special ELF section of the filter file.
-    // We retrieve it from that section, save it to a temporary file and then
-    // dlopen() that file so we can retrieve its symbols.
-    auto so_file = extractSymbol(filterpath, SANDBOX_SECTION_NAME);
-    if (so_file.size() == 0)
+    auto payload = extractSymbol(filterpath, SANDBOX_SECTION_NAME);
+    if (payload.size() == 0)
     {
         fprintf(stderr, "Failed to extract sandbox code from shared library\n");
         return false;
     }
-    if (shlib.open(so_file) == false)
+
+    int fd;
+    DummyBackend backend;
+    auto path = backend.writeToMemory(payload.data(), payload.size(), &fd);
+    if (path.size() == 0)
     {
-        unlink(so_file.c_str());
+        fprintf(stderr, "Failed to write sandbox code to memory\n");
         return false;
     }
+    if (sandbox_fd >= 0)
+        close(sandbox_fd);
+    sandbox_filterpath = filterpath;
+    sandbox_path = path;
+    sandbox_fd = fd;
+    return true;
+}
 
-    // Note that we delete the temporary file prior to the initialization of
-    // the syscall filter, as the filter is unlikely to allow calls to unlink().
-    bool ret = false;
-    bool (*syscall_filter_init)() = (bool(*)()) shlib.loadsym("syscall_filter_init");
-    unlink(so_file.c_str());
+bool Sandbox::init(std::string filterpath, unsigned flags)
+{
+    // We dlopen() the memory file that holds the sandbox library so we can
+    // retrieve its symbols. Nothing is left behind on disk. The parent has
+    // extracted it already; its lock may have been held by another thread
+    // when we were forked, so it's not taken again.
+    if ((sandbox_fd < 0 && preload(filterpath) == false) || shlib.open(sandbox_path) == false)
+        return false;
 
+    // Looked up now, as dlsym() may issue system calls that seccomp denies
+    syscall_stats = (size_t(*)(SandboxSyscallStats *, size_t))
+        shlib.loadsym("syscall_intercept_stats", false);
+
+    bool ret = false;
+    bool (*syscall_filter_init)(unsigned) = (bool(*)(unsigned)) shlib.loadsym("syscall_filter_init");
     if (syscall_filter_init)
     {
-        ret = syscall_filter_init();
+        ret = syscall_filter_init(flags);
         if (ret == false)
             fprintf(stderr, "Failed to configure sandbox\n");
     }
     return ret;
 }
 
+void Sandbox::profile()
+{
+    if (! syscall_stats)
+        return;
+    SandboxSyscallStats stats[8];
+    size_t n = syscall_stats(stats, sizeof(stats)/sizeof(stats[0]));
+    for (size_t i=0; i<n; ++i)
+    {
+        std::string name = std::string("sandbox_") + stats[i].name;
+        if (stats[i].calls)
+            profiler.count(name, stats[i].calls);
+        if (stats[i].denied)
+            profiler.count(name + "_denied", stats[i].denied);
+    }
+}
+
 std::string Sandbox::extractSymbol(std::string elf, std::string symbol_name)
 {
     int fd = open(elf.c_str(), O_RDONLY);
@@ -116,13 +165,5 @@ std::string Sandbox::extractSymbol(std::string elf, std::string symbol_name)
     free(symbol_table);
     close(fd);
 
-    DummyBackend backend;
-    auto so_file = backend.writeToDisk(payload.data(), payload.size(), ".so");
-    if (so_file.size() == 0)
-    {
-        fprintf(stderr, "Failed to write payload to disk\n");
-        return "";
-    }
-    chmod(so_file.c_str(), 0755);
-    return so_file;
-}
\ No newline at end of file
+    return payload;
+}
@@ -10,20 +10,40 @@
 #define __sandbox_h
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <functional>
 #include <algorithm>
 #include <string>
 #include "sharedlib_manager.h"
 
+// Optional sets of system calls granted by Sandbox::init()
+#define SANDBOX_WORKER 0x1      /* Receive jobs from the worker pool (recvmsg) */
+#define SANDBOX_PARALLEL 0x2    /* Start threads and processes (clone, wait4, ...) */
+
+// Number of times a system call whose arguments are checked by the sandbox
+// library was issued, and how many of those were denied
+struct SandboxSyscallStats {
+    char name[16];
+    uint64_t calls;
+    uint64_t denied;
+};
+
 class Sandbox {
 public:
     Sandbox() {}
     ~Sandbox() {}
-    bool init(std::string filterpath);
+    bool init(std::string filterpath, unsigned flags=0);
+
+    // Extract the sandbox library into memory, unless already cached
+    static bool preload(std::string filterpath);
+
+    // Record the system calls checked since the last call in the profiler
+    void profile();
 
 private:
-    std::string extractSymbol(std::string elf, std::string symbol_name);
+    static std::string extractSymbol(std::string elf, std::string symbol_name);
     SharedLibraryManager shlib;
+    size_t (*syscall_stats)(SandboxSyscallStats *, size_t) = NULL;
 };
 
 #endif
\ No newline at end of file
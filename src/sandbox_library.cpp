@@ -17,23 +17,80 @@
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
-#include <glob.h>
+#include <fnmatch.h>
 #include <dlfcn.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sched.h>
+#include <signal.h>
 #include <seccomp.h>
 #include <syscall.h>
 #include <libsyscall_intercept_hook_point.h>
 #include <algorithm>
+#include <atomic>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <unordered_set>
+#include "sandbox.h"
 
-// List of files allowed to be accessed by the UDF. Wildcards are allowed.
-static std::vector<std::string> files_allowed {
+// List of files allowed to be accessed by the UDF. Entries that end with a
+// slash allow access to everything under that directory. Wildcards are allowed.
+static const char *files_allowed[] = {
     "/etc/resolv.conf",    
 };
 
+// The list above, compiled by syscall_intercept_init() so that checks neither
+// scan the whole list nor allocate memory. The constructor may run before the
+// C++ objects of this file are initialized, so it allocates them itself.
+static std::unordered_set<std::string_view> *exact_rules;
+static std::unordered_set<std::string_view> *directory_rules;
+static std::vector<const char *> *pattern_rules;
+
+// System calls whose paths are checked, and how many times they were issued
+// and denied since syscall_intercept_stats() was last called
+enum { CHECK_STAT, CHECK_LSTAT, CHECK_OPEN, CHECK_OPENAT, NUM_CHECKS };
+static const char *check_names[NUM_CHECKS] = { "stat", "lstat", "open", "openat" };
+static std::atomic<uint64_t> check_calls[NUM_CHECKS];
+static std::atomic<uint64_t> check_denied[NUM_CHECKS];
+
+static bool has_parent_reference(std::string_view path)
+{
+    for (size_t start = 0; start <= path.size(); )
+    {
+        size_t end = path.find('/', start);
+        if (end == std::string_view::npos)
+            end = path.size();
+        if (path.substr(start, end - start) == "..")
+            return true;
+        start = end + 1;
+    }
+    return false;
+}
+
+static bool path_allowed(const char *arg)
+{
+    if (! arg || ! exact_rules)
+        return false;
+    std::string_view path(arg);
+    if (exact_rules->count(path))
+        return true;
+
+    // Try each directory that leads to the path, provided that the path
+    // can't climb back out of it
+    if (directory_rules->size() && ! has_parent_reference(path))
+        for (size_t n = path.find('/'); n != std::string_view::npos && n+1 < path.size();
+            n = path.find('/', n+1))
+            if (directory_rules->count(path.substr(0, n+1)))
+                return true;
+
+    for (auto pattern: *pattern_rules)
+        if (fnmatch(pattern, arg, FNM_PATHNAME | FNM_PERIOD) == 0)
+            return true;
+    return false;
+}
+
 extern "C" {
 
 ////////////////////////////////
@@ -59,12 +116,12 @@ static int syscall_intercept(
     (void) arg4;
     (void) arg5;
  
-    auto test_file_ok = [&](long arg)
+    auto test_file_ok = [&](int check, long arg)
     {
-        char *path = (char *) arg;
-        for (auto &p: files_allowed)
-            if (p.compare(path) == 0)
-                return 1;
+        check_calls[check].fetch_add(1, std::memory_order_relaxed);
+        if (path_allowed((const char *) arg))
+            return 1;
+        check_denied[check].fetch_add(1, std::memory_order_relaxed);
         *ret = -EPERM;
         return 0;
     };
@@ -76,11 +133,13 @@ static int syscall_intercept(
     switch (syscall_nr)
     {
         case SYS_stat:
+            return test_file_ok(CHECK_STAT, arg0);
         case SYS_lstat:
+            return test_file_ok(CHECK_LSTAT, arg0);
         case SYS_open:
-            return test_file_ok(arg0);
+            return test_file_ok(CHECK_OPEN, arg0);
         case SYS_openat:
-            return test_file_ok(arg1);
+            return test_file_ok(CHECK_OPENAT, arg1);
         case SYS_fstat:
         default:
             return 1;
@@ -89,35 +148,51 @@ static int syscall_intercept(
 
 static __attribute__((constructor)) void syscall_intercept_init()
 {
-    std::vector<std::string> files(files_allowed.begin(), files_allowed.end());
-    files_allowed.clear();
-
-    // Resolve wildcards in files[]
-    for (auto &path: files)
+    // Sort the entries of files_allowed by the kind of match they need.
+    // Wildcards are matched when the system call is issued, so that files
+    // created after the library was loaded are covered too.
+    exact_rules = new std::unordered_set<std::string_view>();
+    directory_rules = new std::unordered_set<std::string_view>();
+    pattern_rules = new std::vector<const char *>();
+    for (auto entry: files_allowed)
     {
-        // Update list of files the program is allowed to open
-        if (path.find("*") == std::string::npos)
-            files_allowed.push_back(path);
+        std::string_view path(entry);
+        if (path.find_first_of("*?[") != std::string_view::npos)
+            pattern_rules->push_back(entry);
+        else if (path.size() && path.back() == '/')
+            directory_rules->insert(path);
         else
-        {
-            glob_t globbuf;
-            if (glob(path.c_str(), GLOB_NOSORT, NULL, &globbuf) != 0)
-                continue;
-            for (size_t n=0; n < globbuf.gl_pathc; ++n)
-                files_allowed.push_back(globbuf.gl_pathv[n]);
-            globfree(&globbuf);
-        }
+            exact_rules->insert(path);
     }
 
     // Set up our system call hook
     intercept_hook_point = &syscall_intercept;
 }
 
+// Retrieve (and reset) the counters of the system calls checked so far
+size_t syscall_intercept_stats(SandboxSyscallStats *stats, size_t max_stats)
+{
+    size_t n = std::min(max_stats, (size_t) NUM_CHECKS);
+    for (size_t i=0; i<n; ++i)
+    {
+        strncpy(stats[i].name, check_names[i], sizeof(stats[i].name) - 1);
+        stats[i].name[sizeof(stats[i].name) - 1] = '\0';
+        stats[i].calls = check_calls[i].exchange(0, std::memory_order_relaxed);
+        stats[i].denied = check_denied[i].exchange(0, std::memory_order_relaxed);
+    }
+    return n;
+}
+
 
 ////////////////////////////////////
 // System call filtering interface
 ////////////////////////////////////
 
+// Flags that glibc hands to clone() when creating a thread and when forking
+#define CLONE_THREAD_FLAGS (CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD | \
+    CLONE_SYSVSEM | CLONE_SETTLS | CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID)
+#define CLONE_FORK_FLAGS (CLONE_CHILD_SETTID | CLONE_CHILD_CLEARTID | SIGCHLD)
+
 #define ALLOW(syscall, ...) do { \
     if (seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(syscall), __VA_ARGS__) < 0) { \
         fprintf(stderr, "Failed to configure seccomp rule for '" #syscall "' syscall\n"); \
@@ -125,7 +200,7 @@ static __attribute__((constructor)) void syscall_intercept_init()
     } \
 } while (0)
 
-bool syscall_filter_init()
+bool syscall_filter_init(unsigned flags)
 {
     scmp_filter_ctx ctx = seccomp_init(SCMP_ACT_KILL_PROCESS);
 
@@ -176,6 +251,42 @@ bool syscall_filter_init()
     ALLOW(uname, 0);
     ALLOW(mprotect, 0);    
 
+    // Pool workers receive jobs, along with the descriptors of their grids,
+    // through a socket shared with the filter
+    if (flags & SANDBOX_WORKER)
+        ALLOW(recvmsg, 0);
+
+    // Threads and processes started by lib.parallel_for() and by the kernels,
+    // which are only granted when UDFs are configured to run on more than one
+    // worker. These inherit the same filter. clone() is limited to the flags
+    // of a thread (a subset of CLONE_THREAD_FLAGS that includes CLONE_THREAD)
+    // and to those of fork(), which rules out namespaces, vfork and ptrace.
+    // The arguments of clone3() can't be inspected, so it is rejected with
+    // ENOSYS, which makes glibc fall back to clone().
+    if (flags & SANDBOX_PARALLEL)
+    {
+        ALLOW(clone, 1, SCMP_A0(SCMP_CMP_MASKED_EQ,
+            ~(scmp_datum_t) CLONE_THREAD_FLAGS | CLONE_THREAD, CLONE_THREAD));
+        ALLOW(clone, 1, SCMP_A0(SCMP_CMP_EQ, CLONE_FORK_FLAGS));
+        ALLOW(exit, 0);
+        ALLOW(wait4, 0);
+        ALLOW(set_robust_list, 0);
+        ALLOW(rt_sigprocmask, 0);
+        ALLOW(madvise, 0);
+        ALLOW(sched_yield, 0);
+        ALLOW(gettid, 0);
+#ifdef __SNR_rseq
+        ALLOW(rseq, 0);
+#endif
+#ifdef __SNR_clone3
+        if (seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(clone3), 0) < 0)
+        {
+            fprintf(stderr, "Failed to configure seccomp rule for 'clone3' syscall\n");
+            return false;
+        }
+#endif
+    }
+
     // Load seccomp rules
     int ret = seccomp_load(ctx);
     seccomp_release(ctx);
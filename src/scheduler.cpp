@@ -0,0 +1,52 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: scheduler.cpp
+ *
+ * Limits the number of user-defined-functions evaluated at once, queueing
+ * the others in the order they arrive.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include "scheduler.h"
+#include "backend.h"
+
+Scheduler::Scheduler() :
+    running(0),
+    next_ticket(0),
+    admitted(0)
+{
+    /*
+     * Each evaluation takes a process of its own, plus the ones forked by
+     * lib.parallel_for(), so the CPUs are shared among evaluations.
+     */
+    const char *env = getenv("HDF5_UDF_CONCURRENCY");
+    long n = env ? strtol(env, NULL, 10) : 0;
+    if (n <= 0)
+        n = sysconf(_SC_NPROCESSORS_ONLN) / getParallelism();
+    max_running = n > 0 ? n : 1;
+}
+
+size_t Scheduler::capacity()
+{
+    return max_running;
+}
+
+void Scheduler::acquire()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    uint64_t ticket = next_ticket++;
+    changed.wait(guard, [&] { return ticket == admitted && running < max_running; });
+    admitted++;
+    running++;
+
+    /* The next caller in line may fit as well */
+    changed.notify_all();
+}
+
+void Scheduler::release()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    running--;
+    changed.notify_all();
+}
@@ -0,0 +1,55 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: scheduler.h
+ *
+ * Limits the number of user-defined-functions evaluated at once, queueing
+ * the others in the order they arrive.
+ */
+#ifndef __scheduler_h
+#define __scheduler_h
+
+#include <stdint.h>
+#include <mutex>
+#include <condition_variable>
+
+class Scheduler {
+public:
+    // Allow $HDF5_UDF_CONCURRENCY evaluations at once. By default, that is the
+    // number of CPUs divided by the processes each UDF spreads its work across.
+    Scheduler();
+
+    // Number of evaluations allowed at once
+    size_t capacity();
+
+    // Wait for an evaluation slot. Callers are served first come, first served.
+    void acquire();
+
+    // Give back a slot obtained with acquire()
+    void release();
+
+private:
+    std::mutex lock;
+    std::condition_variable changed;
+    size_t max_running;
+    size_t running;
+    uint64_t next_ticket;       /* Ticket handed to the next caller of acquire() */
+    uint64_t admitted;          /* Tickets that have been given a slot */
+};
+
+/* Evaluation slot held for the lifetime of the object */
+class SchedulerSlot {
+public:
+    SchedulerSlot(Scheduler &scheduler) : scheduler(scheduler) {
+        scheduler.acquire();
+    }
+
+    ~SchedulerSlot() {
+        scheduler.release();
+    }
+
+private:
+    Scheduler &scheduler;
+};
+
+#endif /* __scheduler_h */
@@ -26,18 +26,23 @@ public:
 
     bool open(std::string so_file)
     {
+        // A library opened earlier is only released once the new one is in,
+        // so that reopening the same file doesn't unload it in between
         (void) dlerror();
-        so_handle = dlopen(so_file.c_str(), RTLD_NOW);
-        if (! so_handle)
+        void *handle = dlopen(so_file.c_str(), RTLD_NOW);
+        if (! handle)
             fprintf(stderr, "Failed to load %s: %s\n", so_file.c_str(), dlerror());
+        if (so_handle)
+            dlclose(so_handle);
+        so_handle = handle;
         return so_handle != NULL;
     }
 
-    void *loadsym(std::string name)
+    void *loadsym(std::string name, bool required=true)
     {
         (void) dlerror();
         void *symbol = dlsym(so_handle, name.c_str());
-        if (! symbol)
+        if (! symbol && required)
             fprintf(stderr, "%s\n", dlerror());
         return symbol;
     }
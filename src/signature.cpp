@@ -0,0 +1,185 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: signature.cpp
+ *
+ * Signatures of UDF bytecode, which let the filter tell UDFs built by a
+ * trusted party apart from the others.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sstream>
+#include "signature.h"
+
+#ifdef ENABLE_SIGNING
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/err.h>
+#endif
+
+/* Upper limit of verdicts remembered by TrustedKeys::verify() */
+#define MAX_VERDICTS 16
+
+bool signingAvailable()
+{
+#ifdef ENABLE_SIGNING
+    return true;
+#else
+    return false;
+#endif
+}
+
+#ifdef ENABLE_SIGNING
+/* Ed25519 and Ed448 keys hash the message themselves; other keys use SHA-256 */
+static const EVP_MD *getDigest(EVP_PKEY *key)
+{
+    int id = EVP_PKEY_base_id(key);
+    return id == EVP_PKEY_ED25519 || id == EVP_PKEY_ED448 ? NULL : EVP_sha256();
+}
+#endif
+
+bool signMessage(const std::string &key_file, const std::string &message, std::string &signature)
+{
+#ifdef ENABLE_SIGNING
+    FILE *fp = fopen(key_file.c_str(), "r");
+    if (! fp)
+    {
+        fprintf(stderr, "Failed to open signing key %s\n", key_file.c_str());
+        return false;
+    }
+    EVP_PKEY *key = PEM_read_PrivateKey(fp, NULL, NULL, NULL);
+    fclose(fp);
+    if (! key)
+    {
+        fprintf(stderr, "Failed to read a private key from %s\n", key_file.c_str());
+        return false;
+    }
+
+    std::string raw;
+    size_t raw_size = 0;
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    bool ok = ctx &&
+        EVP_DigestSignInit(ctx, NULL, getDigest(key), NULL, key) == 1 &&
+        EVP_DigestSign(ctx, NULL, &raw_size,
+            (const unsigned char *) message.data(), message.size()) == 1;
+    if (ok)
+    {
+        raw.resize(raw_size);
+        ok = EVP_DigestSign(ctx, (unsigned char *) &raw[0], &raw_size,
+            (const unsigned char *) message.data(), message.size()) == 1;
+        raw.resize(raw_size);
+    }
+    EVP_MD_CTX_free(ctx);
+    EVP_PKEY_free(key);
+    if (! ok)
+    {
+        fprintf(stderr, "Failed to sign the UDF payload with %s\n", key_file.c_str());
+        return false;
+    }
+
+    signature.clear();
+    for (unsigned char c: raw)
+    {
+        char hex[3];
+        snprintf(hex, sizeof(hex), "%02x", c);
+        signature.append(hex);
+    }
+    return true;
+#else
+    fprintf(stderr, "Support for signatures has not been compiled in\n");
+    return false;
+#endif
+}
+
+TrustedKeys::TrustedKeys()
+{
+#ifdef ENABLE_SIGNING
+    const char *env = getenv("HDF5_UDF_TRUSTED_KEYS");
+    if (! env)
+        return;
+
+    std::string path;
+    std::istringstream iss(env);
+    while (std::getline(iss, path, ':'))
+    {
+        if (path.size() == 0)
+            continue;
+        FILE *fp = fopen(path.c_str(), "r");
+        if (! fp)
+        {
+            fprintf(stderr, "Failed to open trusted key file %s\n", path.c_str());
+            continue;
+        }
+        size_t count = keys.size();
+        EVP_PKEY *key;
+        while ((key = PEM_read_PUBKEY(fp, NULL, NULL, NULL)) != NULL)
+            keys.push_back(key);
+        fclose(fp);
+
+        /* Reading past the last key leaves an error behind */
+        ERR_clear_error();
+        if (keys.size() == count)
+            fprintf(stderr, "No public keys found in %s\n", path.c_str());
+    }
+#endif
+}
+
+TrustedKeys::~TrustedKeys()
+{
+#ifdef ENABLE_SIGNING
+    for (auto key: keys)
+        EVP_PKEY_free((EVP_PKEY *) key);
+#endif
+}
+
+bool TrustedKeys::enabled()
+{
+    return keys.size() > 0;
+}
+
+bool TrustedKeys::verify(const std::string &message, const std::string &signature)
+{
+#ifdef ENABLE_SIGNING
+    if (! enabled() || signature.size() == 0)
+        return false;
+
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &verdict: verdicts)
+        if (verdict.signature == signature && verdict.message == message)
+            return verdict.trusted;
+
+    /* Signatures are stored hex-encoded */
+    std::string raw;
+    bool trusted = signature.size() % 2 == 0;
+    for (size_t i=0; trusted && i<signature.size(); i+=2)
+    {
+        char hex[3] = {signature[i], signature[i+1], '\0'}, *end = NULL;
+        raw.push_back((char) strtoul(hex, &end, 16));
+        trusted = *end == '\0';
+    }
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    bool match = false;
+    for (size_t i=0; trusted && ctx && ! match && i<keys.size(); ++i)
+    {
+        auto key = (EVP_PKEY *) keys[i];
+        match = EVP_DigestVerifyInit(ctx, NULL, getDigest(key), NULL, key) == 1 &&
+            EVP_DigestVerify(ctx, (const unsigned char *) raw.data(), raw.size(),
+                (const unsigned char *) message.data(), message.size()) == 1;
+        EVP_MD_CTX_reset(ctx);
+    }
+    EVP_MD_CTX_free(ctx);
+    ERR_clear_error();
+    trusted = trusted && match;
+    if (! trusted)
+        fprintf(stderr, "UDF signature doesn't match any trusted key, running it isolated\n");
+
+    if (verdicts.size() >= MAX_VERDICTS)
+        verdicts.pop_front();
+    verdicts.push_back({message, signature, trusted});
+    return trusted;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,53 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: signature.h
+ *
+ * Signatures of UDF bytecode, which let the filter tell UDFs built by a
+ * trusted party apart from the others.
+ */
+#ifndef __signature_h
+#define __signature_h
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+
+// Whether signatures can be produced and checked by this build
+bool signingAvailable();
+
+// Sign a message (the header fields and the bytecode of a payload, as given by
+// getSignedMessage()) with the private key held in the given PEM file. The
+// signature is returned hex-encoded.
+bool signMessage(const std::string &key_file, const std::string &message, std::string &signature);
+
+class TrustedKeys {
+public:
+    // Load the PEM public keys held in the files listed in $HDF5_UDF_TRUSTED_KEYS,
+    // separated by colons. Each file may hold more than one key.
+    TrustedKeys();
+    ~TrustedKeys();
+
+    // Whether any key has been loaded
+    bool enabled();
+
+    // Whether the signature of the message was made with one of the trusted
+    // keys. Verdicts are remembered, so messages seen before are not checked again.
+    bool verify(const std::string &message, const std::string &signature);
+
+private:
+    // Public keys (EVP_PKEY), opaque so that this header doesn't need OpenSSL
+    std::vector<void *> keys;
+
+    // Messages verified so far, along with their signature and verdict
+    struct Verdict {
+        std::string message;
+        std::string signature;
+        bool trusted;
+    };
+    std::deque<Verdict> verdicts;
+    std::mutex lock;
+};
+
+#endif /* __signature_h */
@@ -6,7 +6,12 @@
 // HDF5 filter callbacks and main interface with the C++ API.
 //
 #include <sys/types.h>
+#include <stdint.h>
+#include <algorithm>
+#include <limits>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
 // The following variables are populated by our HDF5 filter
@@ -14,44 +19,308 @@ std::vector<void *> hdf5_udf_data;
 std::vector<const char *> hdf5_udf_names;
 std::vector<const char *> hdf5_udf_types;
 std::vector<std::vector<size_t>> hdf5_udf_dims;
+std::vector<std::vector<size_t>> hdf5_udf_offsets;
+size_t hdf5_udf_threads = 1;
+
+// Elements that a kernel gives to each thread, at the least. Smaller grids
+// are processed before extra threads would even start.
+static const size_t hdf5_udf_kernel_grain = 1 << 18;
+
+// Accumulators the kernels fold their lanes into, at the least
+static const size_t hdf5_udf_kernel_lanes = 16;
+
+// Type that sums of elements of type T are accumulated in
+template <class T>
+using hdf5_udf_accumulator = typename std::conditional<std::is_floating_point<T>::value, double,
+    typename std::conditional<std::is_signed<T>::value, int64_t, uint64_t>::type>::type;
+
+// Convert the result of a kernel to the output type. Casting floating-point
+// values that an integer type can't hold is undefined, so they saturate at
+// the limits of the type instead, and NaN becomes 0.
+template <class O, class V>
+static inline typename std::enable_if<
+    ! (std::is_integral<O>::value && std::is_floating_point<V>::value), O>::type
+hdf5_udf_saturate(V v)
+{
+    return static_cast<O>(v);
+}
+
+template <class O, class V>
+static inline typename std::enable_if<
+    std::is_integral<O>::value && std::is_floating_point<V>::value, O>::type
+hdf5_udf_saturate(V v)
+{
+    typedef std::numeric_limits<O> limits;
+    if (v != v)
+        return 0;
+    else if (v <= static_cast<V>(limits::lowest()))
+        return limits::lowest();
+    else if (v >= static_cast<V>(limits::max()))
+        return limits::max();
+    return static_cast<O>(v);
+}
 
 // This is the API that user-defined-functions use to retrieve
-// datasets they depend on.
+// datasets they depend on. Datasets are given as names or as slots,
+// the indexes assigned to them when the UDF was compiled: slots can
+// be looked up once, outside of inner loops, and then used to access
+// the datasets in constant time.
 class UserDefinedLibrary
 {
 public:
+    int getSlot(std::string name);
+
     template <class T>
     T *getData(std::string name);
-    
+
+    template <class T>
+    T *getData(int slot);
+
     const char *getType(std::string name);
-    
-    std::vector<size_t> getDims(std::string name);
+
+    const char *getType(int slot);
+
+    const std::vector<size_t> &getDims(std::string name);
+
+    const std::vector<size_t> &getDims(int slot);
+
+    const std::vector<size_t> &getOffset(std::string name);
+
+    const std::vector<size_t> &getOffset(int slot);
+
+    // Split the range [0, n) into disjoint slices and call fn(begin, end)
+    // for each of them, on as many threads as configured in the filter
+    template <class F>
+    void parallel_for(size_t n, F fn);
+
+    // Elementwise kernels over the grids returned by getData(). map() and
+    // zip() store fn(in[i]) and fn(a[i], b[i]) in out[i] for each of the n
+    // elements; out may be one of the inputs. Loops are vectorized and split
+    // across threads when the grids are large enough, so fn should be a short
+    // expression without side effects, such as a lambda.
+    template <class O, class I, class F>
+    void map(O *out, const I *in, size_t n, F fn);
+
+    template <class O, class A, class B, class F>
+    void zip(O *out, const A *a, const B *b, size_t n, F fn);
+
+    // Fold the n elements of a grid, converted to the type of init, with fn.
+    // fn must be associative and init its identity, as elements are folded in
+    // several lanes and threads whose results are then folded together.
+    template <class T, class R, class F>
+    R reduce(const T *in, size_t n, R init, F fn);
+
+    // Common kernels, built on the ones above
+    template <class O, class A, class B>
+    void add(O *out, const A *a, const B *b, size_t n);
+
+    template <class O, class I, class S>
+    void scale(O *out, const I *in, size_t n, S factor);
+
+    template <class O, class I>
+    void clamp(O *out, const I *in, size_t n, I low, I high);
+
+    // Stores 1 where in[i] >= level and 0 elsewhere
+    template <class O, class I>
+    void threshold(O *out, const I *in, size_t n, I level);
+
+    template <class T>
+    hdf5_udf_accumulator<T> sum(const T *in, size_t n);
+
+    template <class T>
+    T min(const T *in, size_t n);
+
+    template <class T>
+    T max(const T *in, size_t n);
+
+private:
+    bool valid(int slot, size_t size) { return slot >= 0 && (size_t) slot < size; }
+
+    // Number of slices a kernel splits n elements into: one per thread, as
+    // long as each thread gets enough elements to pay off
+    size_t kernelSlices(size_t n);
+
+    // Call fn(slice, begin, end) for each slice of the range [0, n)
+    template <class F>
+    void kernelFor(size_t n, size_t slices, F fn);
+
+    std::vector<size_t> empty;
 };
 
-template <class T>
-T *UserDefinedLibrary::getData(std::string name)
+int UserDefinedLibrary::getSlot(std::string name)
 {
     for (size_t i=0; i<hdf5_udf_names.size(); ++i)
         if (name.compare(hdf5_udf_names[i]) == 0)
-            return static_cast<T *>(hdf5_udf_data[i]);
-    return NULL;
+            return i;
+    return -1;
+}
+
+template <class T>
+T *UserDefinedLibrary::getData(std::string name)
+{
+    return getData<T>(getSlot(name));
+}
+
+template <class T>
+T *UserDefinedLibrary::getData(int slot)
+{
+    return valid(slot, hdf5_udf_data.size()) ? static_cast<T *>(hdf5_udf_data[slot]) : NULL;
 }
 
 const char *UserDefinedLibrary::getType(std::string name)
 {
-    for (size_t i=0; i<hdf5_udf_names.size(); ++i)
-        if (name.compare(hdf5_udf_names[i]) == 0)
-            return hdf5_udf_types[i];
-    return NULL;
+    return getType(getSlot(name));
 }
 
-std::vector<size_t> UserDefinedLibrary::getDims(std::string name)
+const char *UserDefinedLibrary::getType(int slot)
 {
-    std::vector<size_t> dims;
-    for (size_t i=0; i<hdf5_udf_names.size(); ++i)
-        if (name.compare(hdf5_udf_names[i]) == 0)
-            return hdf5_udf_dims[i];
-    return dims;
+    return valid(slot, hdf5_udf_types.size()) ? hdf5_udf_types[slot] : NULL;
+}
+
+const std::vector<size_t> &UserDefinedLibrary::getDims(std::string name)
+{
+    return getDims(getSlot(name));
+}
+
+const std::vector<size_t> &UserDefinedLibrary::getDims(int slot)
+{
+    return valid(slot, hdf5_udf_dims.size()) ? hdf5_udf_dims[slot] : empty;
+}
+
+const std::vector<size_t> &UserDefinedLibrary::getOffset(std::string name)
+{
+    return getOffset(getSlot(name));
+}
+
+const std::vector<size_t> &UserDefinedLibrary::getOffset(int slot)
+{
+    return valid(slot, hdf5_udf_offsets.size()) ? hdf5_udf_offsets[slot] : empty;
+}
+
+template <class F>
+void UserDefinedLibrary::parallel_for(size_t n, F fn)
+{
+    size_t count = std::max((size_t) 1, std::min(hdf5_udf_threads, n));
+    std::vector<std::thread> threads;
+    for (size_t i=1; i<count; ++i)
+        threads.push_back(std::thread(fn, i * n / count, (i + 1) * n / count));
+    fn(0, n / count);
+    for (auto &thread: threads)
+        thread.join();
+}
+
+size_t UserDefinedLibrary::kernelSlices(size_t n)
+{
+    return std::max((size_t) 1, std::min(hdf5_udf_threads, n / hdf5_udf_kernel_grain));
+}
+
+template <class F>
+void UserDefinedLibrary::kernelFor(size_t n, size_t slices, F fn)
+{
+    if (slices == 1)
+        return fn(0, 0, n);
+    parallel_for(slices, [&](size_t first, size_t last) {
+        for (size_t slice=first; slice<last; ++slice)
+            fn(slice, slice * n / slices, (slice + 1) * n / slices);
+    });
+}
+
+template <class O, class I, class F>
+void UserDefinedLibrary::map(O *out, const I *in, size_t n, F fn)
+{
+    kernelFor(n, kernelSlices(n), [&](size_t, size_t begin, size_t end) {
+        #pragma omp simd
+        for (size_t i=begin; i<end; ++i)
+            out[i] = fn(in[i]);
+    });
+}
+
+template <class O, class A, class B, class F>
+void UserDefinedLibrary::zip(O *out, const A *a, const B *b, size_t n, F fn)
+{
+    kernelFor(n, kernelSlices(n), [&](size_t, size_t begin, size_t end) {
+        #pragma omp simd
+        for (size_t i=begin; i<end; ++i)
+            out[i] = fn(a[i], b[i]);
+    });
+}
+
+template <class T, class R, class F>
+R UserDefinedLibrary::reduce(const T *in, size_t n, R init, F fn)
+{
+    size_t slices = kernelSlices(n);
+    std::vector<R> partial(slices, init);
+    kernelFor(n, slices, [&](size_t slice, size_t begin, size_t end) {
+        // Independent lanes can be kept in vector registers, unlike a single accumulator
+        R acc[hdf5_udf_kernel_lanes];
+        std::fill(acc, acc + hdf5_udf_kernel_lanes, init);
+        size_t i = begin;
+        for (; i + hdf5_udf_kernel_lanes <= end; i += hdf5_udf_kernel_lanes)
+        {
+            #pragma omp simd
+            for (size_t lane=0; lane<hdf5_udf_kernel_lanes; ++lane)
+                acc[lane] = fn(acc[lane], static_cast<R>(in[i + lane]));
+        }
+        for (; i<end; ++i)
+            acc[0] = fn(acc[0], static_cast<R>(in[i]));
+        for (size_t lane=1; lane<hdf5_udf_kernel_lanes; ++lane)
+            acc[0] = fn(acc[0], acc[lane]);
+        partial[slice] = acc[0];
+    });
+
+    R result = init;
+    for (auto &value: partial)
+        result = fn(result, value);
+    return result;
+}
+
+template <class O, class A, class B>
+void UserDefinedLibrary::add(O *out, const A *a, const B *b, size_t n)
+{
+    zip(out, a, b, n, [](A x, B y) { return hdf5_udf_saturate<O>(x + y); });
+}
+
+template <class O, class I, class S>
+void UserDefinedLibrary::scale(O *out, const I *in, size_t n, S factor)
+{
+    map(out, in, n, [factor](I x) { return hdf5_udf_saturate<O>(x * factor); });
+}
+
+template <class O, class I>
+void UserDefinedLibrary::clamp(O *out, const I *in, size_t n, I low, I high)
+{
+    map(out, in, n, [low, high](I x) {
+        return hdf5_udf_saturate<O>(x < low ? low : (x > high ? high : x));
+    });
+}
+
+template <class O, class I>
+void UserDefinedLibrary::threshold(O *out, const I *in, size_t n, I level)
+{
+    map(out, in, n, [level](I x) { return static_cast<O>(x >= level ? 1 : 0); });
+}
+
+template <class T>
+hdf5_udf_accumulator<T> UserDefinedLibrary::sum(const T *in, size_t n)
+{
+    typedef hdf5_udf_accumulator<T> R;
+    return reduce(in, n, R(0), [](R x, R y) { return x + y; });
+}
+
+template <class T>
+T UserDefinedLibrary::min(const T *in, size_t n)
+{
+    T init = std::numeric_limits<T>::has_infinity ?
+        std::numeric_limits<T>::infinity() : std::numeric_limits<T>::max();
+    return reduce(in, n, init, [](T x, T y) { return y < x ? y : x; });
+}
+
+template <class T>
+T UserDefinedLibrary::max(const T *in, size_t n)
+{
+    T init = std::numeric_limits<T>::has_infinity ?
+        -std::numeric_limits<T>::infinity() : std::numeric_limits<T>::lowest();
+    return reduce(in, n, init, [](T x, T y) { return y > x ? y : x; });
 }
 
 UserDefinedLibrary lib;
@@ -0,0 +1,90 @@
+//
+// HDF5-UDF: User-Defined Functions for HDF5
+//
+// File: udf_template.cu
+//
+// Device-side interface with the CUDA API. The UDF is a kernel that the
+// filter launches over as many threads as the output grid has elements.
+//
+#include <stddef.h>
+
+// Limits of the dataset table, which lives in constant memory. The layout
+// of the table must match the one in cuda_backend.cpp.
+#define HDF5_UDF_MAX_DATASETS 64
+#define HDF5_UDF_MAX_RANK     8
+#define HDF5_UDF_NAME_LEN     116
+#define HDF5_UDF_TYPE_LEN     8
+
+struct hdf5_udf_dataset {
+    void *data;
+    unsigned long long dims[HDF5_UDF_MAX_RANK];
+    unsigned long long offsets[HDF5_UDF_MAX_RANK];
+    unsigned int rank;
+    char name[HDF5_UDF_NAME_LEN];
+    char type[HDF5_UDF_TYPE_LEN];
+};
+
+// The following variables are populated by our HDF5 filter, indexed by slot
+__constant__ hdf5_udf_dataset hdf5_udf_datasets[HDF5_UDF_MAX_DATASETS];
+__constant__ unsigned int hdf5_udf_count;
+
+// This is the API that user-defined-functions use to retrieve datasets
+// they depend on. Datasets are given as names or as slots, the indexes
+// assigned to them when the UDF was compiled: slots can be looked up once,
+// outside of inner loops, and then used to access the datasets in constant
+// time. Grids live in device memory.
+class UserDefinedLibrary
+{
+public:
+    __device__ int getSlot(const char *name);
+
+    template <class T>
+    __device__ T *getData(const char *name) { return getData<T>(getSlot(name)); }
+
+    template <class T>
+    __device__ T *getData(int slot) { return valid(slot) ? static_cast<T *>(hdf5_udf_datasets[slot].data) : NULL; }
+
+    __device__ const char *getType(const char *name) { return getType(getSlot(name)); }
+
+    __device__ const char *getType(int slot) { return valid(slot) ? hdf5_udf_datasets[slot].type : NULL; }
+
+    __device__ unsigned int getRank(const char *name) { return getRank(getSlot(name)); }
+
+    __device__ unsigned int getRank(int slot) { return valid(slot) ? hdf5_udf_datasets[slot].rank : 0; }
+
+    __device__ const unsigned long long *getDims(const char *name) { return getDims(getSlot(name)); }
+
+    __device__ const unsigned long long *getDims(int slot) { return valid(slot) ? hdf5_udf_datasets[slot].dims : NULL; }
+
+    __device__ const unsigned long long *getOffset(const char *name) { return getOffset(getSlot(name)); }
+
+    __device__ const unsigned long long *getOffset(int slot) { return valid(slot) ? hdf5_udf_datasets[slot].offsets : NULL; }
+
+    // Index of the calling thread and number of threads in the launch, for
+    // grid-stride loops: for (i=lib.index(); i<n; i+=lib.stride())
+    __device__ size_t index() { return (size_t) blockIdx.x * blockDim.x + threadIdx.x; }
+
+    __device__ size_t stride() { return (size_t) gridDim.x * blockDim.x; }
+
+private:
+    __device__ bool valid(int slot) { return slot >= 0 && (unsigned int) slot < hdf5_udf_count; }
+};
+
+__device__ int UserDefinedLibrary::getSlot(const char *name)
+{
+    for (unsigned int i=0; i<hdf5_udf_count; ++i)
+    {
+        const char *a = hdf5_udf_datasets[i].name, *b = name;
+        while (*a && *a == *b)
+            ++a, ++b;
+        if (*a == *b)
+            return i;
+    }
+    return -1;
+}
+
+__device__ UserDefinedLibrary lib;
+
+// User-Defined Function
+
+// user_callback_placeholder
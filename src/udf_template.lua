@@ -8,32 +8,159 @@
 
 local lib = {}
 
+-- Slots of the datasets, looked up by name only once. Slots are assigned
+-- when the UDF is compiled, so they remain valid across runs.
+local slots = {}
+
+-- Grids, dimensions, offsets and types of the datasets, indexed by slot.
+-- These are only valid during a single run of the UDF.
+local cache = {}
+
+-- Slots of the arrays returned by lib.getData() during this run, so that
+-- the kernels can be given the arrays rather than the dataset names
+local owners = {}
+
 function init(filterpath)
     local ffi = require("ffi")
     local filterlib = ffi.load(filterpath)
     ffi.cdef[[
-        void       *luaGetData(const char *);
-        const char *luaGetType(const char *);
-        const char *luaGetCast(const char *);
-        const char *luaGetDims(const char *);
+        int         luaGetSlot(const char *);
+        void       *luaGetDataAt(int);
+        const char *luaGetTypeAt(int);
+        const char *luaGetCastAt(int);
+        int         luaGetRankAt(int);
+        const unsigned long long *luaGetDimsAt(int);
+        const unsigned long long *luaGetOffsetAt(int);
+        int         luaForkSlices(size_t, size_t *, size_t *);
+        int         luaJoinSlices(int, int);
+        int         luaMapAt(int, int, const char *, double, double);
+        int         luaZipAt(int, int, int, const char *);
+        int         luaReduceAt(int, const char *, double *);
     ]]
 
+    local entry = function(name)
+        local slot = slots[name]
+        if slot == nil then
+            slot = filterlib.luaGetSlot(name)
+            slots[name] = slot
+        end
+        local e = cache[slot]
+        if e == nil then
+            e = {}
+            cache[slot] = e
+        end
+        return e, slot
+    end
+
+    local to_table = function(values, n)
+        local t = {}
+        for i=0, n-1 do
+            t[i+1] = tonumber(values[i])
+        end
+        return t
+    end
+
+    lib.getSlot = function(name)
+        local _, slot = entry(name)
+        return slot
+    end
+
     lib.getData = function(name)
-        return ffi.cast(ffi.string(filterlib.luaGetCast(name)), filterlib.luaGetData(name))
+        local e, slot = entry(name)
+        if e.data == nil then
+            e.data = ffi.cast(ffi.string(filterlib.luaGetCastAt(slot)), filterlib.luaGetDataAt(slot))
+            owners[e.data] = slot
+        end
+        return e.data
     end
 
     lib.getType = function(name)
-        return ffi.string(filterlib.luaGetType(name))
+        local e, slot = entry(name)
+        if e.type == nil then
+            e.type = ffi.string(filterlib.luaGetTypeAt(slot))
+        end
+        return e.type
     end
 
     lib.getDims = function(name)
-        local dims = ffi.string(filterlib.luaGetDims(name))
-        local t = {}
-        for dim in string.gmatch(dims, "([^x]+)") do
-            table.insert(t, dim)
+        local e, slot = entry(name)
+        if e.dims == nil then
+            e.dims = to_table(filterlib.luaGetDimsAt(slot), filterlib.luaGetRankAt(slot))
         end
-        return t
+        return e.dims
+    end
+
+    lib.getOffset = function(name)
+        local e, slot = entry(name)
+        if e.offset == nil then
+            e.offset = to_table(filterlib.luaGetOffsetAt(slot), filterlib.luaGetRankAt(slot))
+        end
+        return e.offset
+    end
+
+    -- Split the range [0, n) into disjoint slices and call fn(begin, end)
+    -- for each of them. Slices run in separate processes: only what they
+    -- write to the datasets is seen by the others.
+    lib.parallel_for = function(n, fn)
+        local bounds = ffi.new("size_t[2]")
+        local is_child = filterlib.luaForkSlices(n, bounds, bounds + 1)
+        local ok, err = pcall(fn, tonumber(bounds[0]), tonumber(bounds[1]))
+        if not ok and is_child ~= 0 then
+            print(err)
+        end
+        if filterlib.luaJoinSlices(is_child, ok and 1 or 0) == 0 then
+            error("lib.parallel_for: " .. (ok and "a worker process failed" or err))
+        end
+    end
+
+    -- Datasets are given to the kernels below by name or as the arrays
+    -- returned by lib.getData()
+    local slot_of = function(kernel, dataset)
+        local slot = type(dataset) == "string" and lib.getSlot(dataset) or owners[dataset]
+        if slot == nil or slot < 0 then
+            error(kernel .. ": argument is not a dataset")
+        end
+        return slot
+    end
+
+    -- Elementwise kernels, which run vectorized and multithreaded in the
+    -- filter. Grids must have the same type and size; out may be an input.
+    -- lib.map() supports "copy", "scale" (in*a), "offset" (in+a), "affine"
+    -- (in*a+b), "clamp" (to [a, b]) and "threshold" (1 where in >= a, else 0).
+    lib.map = function(out, input, op, a, b)
+        if filterlib.luaMapAt(slot_of("lib.map", out), slot_of("lib.map", input), op, a or 0, b or 0) == 0 then
+            error("lib.map: failed to apply " .. op)
+        end
+    end
+
+    -- Supports "add", "sub", "mul", "div", "min" and "max"
+    lib.zip = function(out, a, b, op)
+        if filterlib.luaZipAt(slot_of("lib.zip", out), slot_of("lib.zip", a), slot_of("lib.zip", b), op) == 0 then
+            error("lib.zip: failed to apply " .. op)
+        end
+    end
+
+    -- Supports "sum", "min" and "max"
+    lib.reduce = function(input, op)
+        local result = ffi.new("double[1]")
+        if filterlib.luaReduceAt(slot_of("lib.reduce", input), op, result) == 0 then
+            error("lib.reduce: failed to apply " .. op)
+        end
+        return result[0]
     end
+
+    lib.add = function(out, a, b) lib.zip(out, a, b, "add") end
+    lib.scale = function(out, input, factor) lib.map(out, input, "scale", factor) end
+    lib.clamp = function(out, input, low, high) lib.map(out, input, "clamp", low, high) end
+    lib.threshold = function(out, input, level) lib.map(out, input, "threshold", level) end
+    lib.sum = function(input) return lib.reduce(input, "sum") end
+    lib.min = function(input) return lib.reduce(input, "min") end
+    lib.max = function(input) return lib.reduce(input, "max") end
+end
+
+function hdf5_udf_reset()
+    cache = {}
+    owners = {}
 end
 
 -- User-Defined Function
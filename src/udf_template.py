@@ -7,35 +7,133 @@
 #
 
 import os
+import sys
+import traceback
 from cffi import FFI
 
+# NumPy is optional. It is only needed by getArray().
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+# NumPy equivalents of the dataset types that have a different name
+numpy_types = {"float": "float32", "double": "float64"}
+
 class PythonLib:
     def load(self, filterpath):
         self.ffi = FFI()
         self.ffi.cdef("""
-            void       *pythonGetData(const char *);
-            const char *pythonGetType(const char *);
-            const char *pythonGetCast(const char *);
-            const char *pythonGetDims(const char *);
+            int         pythonGetSlot(const char *);
+            void       *pythonGetDataAt(int);
+            const char *pythonGetTypeAt(int);
+            const char *pythonGetCastAt(int);
+            int         pythonGetRankAt(int);
+            const unsigned long long *pythonGetDimsAt(int);
+            const unsigned long long *pythonGetOffsetAt(int);
+            int         pythonForkSlices(size_t, size_t *, size_t *);
+            int         pythonJoinSlices(int, int);
             """)
         self.filterlib = self.ffi.dlopen(filterpath)
 
+        # Slots of the datasets, looked up by name only once. Slots are
+        # assigned when the UDF is compiled, so they remain valid across runs.
+        self.slots = {}
+
+        # Grids, dimensions, offsets and types of the datasets, indexed by
+        # slot. These are only valid during a single run of the UDF.
+        self.cache = {}
+
+    def reset(self):
+        self.cache = {}
+
+    def entry(self, name):
+        slot = self.slots.get(name)
+        if slot is None:
+            slot = self.filterlib.pythonGetSlot(name.encode("utf-8"))
+            self.slots[name] = slot
+        entry = self.cache.get(slot)
+        if entry is None:
+            entry = {}
+            self.cache[slot] = entry
+        return entry, slot
+
+    def getSlot(self, name):
+        return self.entry(name)[1]
+
     def getData(self, name):
-        name = self.ffi.new("char[]", name.encode("utf-8"))
-        cast = self.filterlib.pythonGetCast(name)
-        data = self.filterlib.pythonGetData(name)
-        ctype = self.ffi.string(cast).decode("utf-8")
-        return self.ffi.cast(ctype, data)
+        entry, slot = self.entry(name)
+        if "data" not in entry:
+            cast = self.filterlib.pythonGetCastAt(slot)
+            data = self.filterlib.pythonGetDataAt(slot)
+            if cast == self.ffi.NULL or data == self.ffi.NULL:
+                return None
+            ctype = self.ffi.string(cast).decode("utf-8")
+            entry["data"] = self.ffi.cast(ctype, data)
+        return entry["data"]
+
+    def getArray(self, name):
+        if numpy is None:
+            raise ImportError("lib.getArray() requires NumPy")
+        entry, slot = self.entry(name)
+        if "array" not in entry:
+            data = self.filterlib.pythonGetDataAt(slot)
+            if data == self.ffi.NULL:
+                return None
+
+            # Wrap the grid in an ndarray, without copying it, so that writes
+            # land straight in the memory shared with the filter
+            dims = self.getDims(name)
+            dtype = self.ffi.string(self.filterlib.pythonGetTypeAt(slot)).decode("utf-8")
+            dtype = numpy.dtype(numpy_types.get(dtype, dtype))
+            nbytes = dtype.itemsize
+            for dim in dims:
+                nbytes *= dim
+            buf = self.ffi.buffer(self.ffi.cast("char *", data), nbytes)
+            entry["array"] = numpy.frombuffer(buf, dtype=dtype).reshape(dims)
+        return entry["array"]
 
     def getType(self, name):
-        name = self.ffi.new("char[]", name.encode("utf-8"))
-        return self.ffi.string(self.filterlib.pythonGetType(name))
+        entry, slot = self.entry(name)
+        if "type" not in entry:
+            entry["type"] = self.ffi.string(self.filterlib.pythonGetTypeAt(slot))
+        return entry["type"]
 
     def getDims(self, name):
-        name = self.ffi.new("char[]", name.encode("utf-8"))
-        dims = self.filterlib.pythonGetDims(name)
-        dims = self.ffi.string(dims).decode("utf-8")
-        return tuple([int(dim) for dim in dims.split("x")])
+        entry, slot = self.entry(name)
+        if "dims" not in entry:
+            dims = self.filterlib.pythonGetDimsAt(slot)
+            rank = self.filterlib.pythonGetRankAt(slot)
+            entry["dims"] = tuple([int(dims[i]) for i in range(rank)])
+        return entry["dims"]
+
+    def getOffset(self, name):
+        entry, slot = self.entry(name)
+        if "offset" not in entry:
+            offset = self.filterlib.pythonGetOffsetAt(slot)
+            rank = self.filterlib.pythonGetRankAt(slot)
+            entry["offset"] = tuple([int(offset[i]) for i in range(rank)])
+        return entry["offset"]
+
+    def parallel_for(self, n, fn):
+        # Split the range [0, n) into disjoint slices and call fn(begin, end)
+        # for each of them. Slices run in separate processes: only what they
+        # write to the datasets is seen by the others.
+        bounds = self.ffi.new("size_t[2]")
+        is_child = self.filterlib.pythonForkSlices(n, bounds, bounds + 1)
+        try:
+            fn(int(bounds[0]), int(bounds[1]))
+            ok = True
+        except BaseException:
+            if not is_child:
+                self.filterlib.pythonJoinSlices(is_child, 0)
+                raise
+            traceback.print_exc()
+            ok = False
+        sys.stdout.flush()
+        sys.stderr.flush()
+        if not self.filterlib.pythonJoinSlices(is_child, 1 if ok else 0):
+            raise RuntimeError("lib.parallel_for: a worker process failed")
 
 lib = PythonLib()
 
@@ -0,0 +1,507 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: worker_pool.cpp
+ *
+ * Pool of long-lived processes that keep user-defined-functions loaded
+ * (and sandboxed) between consecutive reads of a dataset.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <memory>
+#include "worker_pool.h"
+#include "anon_mmap.h"
+#include "hash.h"
+#include "profiler.h"
+#include "json.hpp"
+#ifdef ENABLE_SANDBOX
+#include "sandbox.h"
+#endif
+
+using json = nlohmann::json;
+
+/*
+ * Default number of workers kept alive by the pool. UDF state (globals of
+ * the UDF and of its interpreter) persists between the jobs of a worker, so
+ * the pool is only used when requested through $HDF5_UDF_POOL_SIZE.
+ */
+#define DEFAULT_POOL_SIZE 0
+
+/* Upper limit of descriptors we pass in a single message (SCM_MAX_FD is 253) */
+#define MAX_JOB_FDS 250
+
+/* Upper limit of the size of a job description */
+#define MAX_JOB_SIZE 65536
+
+/* Message sent by workers once they are ready and whenever they complete a job */
+struct WorkerReply {
+    char status;
+    RemoteTimings timings;
+};
+
+/* Send a status message to the filter along with the phases profiled so far */
+static bool sendReply(int sock, char status)
+{
+    WorkerReply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.status = status;
+    profiler.exportTo(&reply.timings);
+    return send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) == sizeof(reply);
+}
+
+/* Receive a status message from a worker */
+static bool recvReply(int sock, char *status)
+{
+    WorkerReply reply;
+    if (recv(sock, &reply, sizeof(reply), 0) != sizeof(reply))
+        return false;
+    *status = reply.status;
+    profiler.importFrom(&reply.timings);
+    return true;
+}
+
+/* Send a message along with a list of file descriptors */
+static bool sendMessage(int sock, const std::string &msg, const std::vector<int> &fds)
+{
+    struct iovec iov;
+    iov.iov_base = (void *) msg.data();
+    iov.iov_len = msg.size();
+
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    if (fds.size())
+    {
+        hdr.msg_control = control.data();
+        hdr.msg_controllen = control.size();
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+    }
+    return sendmsg(sock, &hdr, MSG_NOSIGNAL) == (ssize_t) msg.size();
+}
+
+/* Receive a message along with the file descriptors attached to it */
+static bool recvMessage(int sock, std::string &msg, std::vector<int> &fds)
+{
+    msg.resize(MAX_JOB_SIZE);
+    struct iovec iov;
+    iov.iov_base = (void *) msg.data();
+    iov.iov_len = msg.size();
+
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * MAX_JOB_FDS));
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.data();
+    hdr.msg_controllen = control.size();
+
+    ssize_t n = recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC);
+    if (n <= 0)
+        return false;
+    msg.resize(n);
+
+    fds.clear();
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            size_t start = fds.size();
+            fds.resize(start + count);
+            memcpy(&fds[start], CMSG_DATA(cmsg), sizeof(int) * count);
+        }
+    return true;
+}
+
+/*
+ * Main loop of the worker processes. The UDF is loaded and the sandbox is
+ * configured only once; after that we wait for jobs describing the datasets
+ * the UDF should operate on. Input and output grids are shared memory files
+ * (or, for inputs mapped from the HDF5 file, the file itself) whose
+ * descriptors come attached to the job message.
+ */
+static void workerMain(Backend *backend, int sock, const std::string filterpath,
+    const char *udf_blob, size_t udf_blob_size)
+{
+    profiler.clear();
+    ProfileTimer load_timer;
+    char ready = backend->load(filterpath, udf_blob, udf_blob_size);
+    profiler.record("load", load_timer.elapsed(), udf_blob_size);
+#ifdef ENABLE_SANDBOX
+    ProfileTimer sandbox_timer;
+    Sandbox sandbox;
+    ready = ready && sandbox.init(filterpath,
+        SANDBOX_WORKER | (getParallelism() > 1 ? SANDBOX_PARALLEL : 0));
+    profiler.record("sandbox", sandbox_timer.elapsed());
+#endif
+    if (! sendReply(sock, ready) || ! ready)
+        _exit(1);
+
+    std::string msg;
+    std::vector<int> fds;
+    while (recvMessage(sock, msg, fds))
+    {
+        json job = json::parse(msg);
+        auto &entries = job["datasets"];
+        char status = entries.is_array() && entries.size() == fds.size();
+
+        std::vector<DatasetInfo> datasets;
+        std::vector<std::pair<void *, size_t>> maps;
+        for (size_t i=0; status && i<entries.size(); ++i)
+        {
+            auto &entry = entries[i];
+            DatasetInfo info(
+                entry["name"].get<std::string>(),
+                entry["dims"].get<std::vector<hsize_t>>(),
+                entry["datatype"].get<std::string>());
+            info.setExtent(info.dimensions, entry["offset"].get<std::vector<hsize_t>>());
+            info.hdf5_datatype = info.getHdf5Datatype();
+            info.slot = entry["slot"].get<int>();
+
+            /* Writes to grids mapped from the HDF5 file must not reach it */
+            size_t size = entry["size"].get<size_t>() + entry["shift"].get<size_t>();
+            off_t file_offset = entry["file_offset"].get<off_t>();
+            int flags = entry["shared"].get<bool>() ? MAP_SHARED : MAP_PRIVATE;
+            void *mm = mmap(NULL, size ? : 1, PROT_READ|PROT_WRITE, flags, fds[i], file_offset);
+            if (mm == MAP_FAILED)
+            {
+                status = 0;
+                break;
+            }
+            maps.push_back(std::make_pair(mm, size ? : 1));
+            info.data = (char *) mm + entry["shift"].get<size_t>();
+            datasets.push_back(info);
+        }
+
+        if (status)
+        {
+            ProfileTimer execute_timer;
+            status = backend->execute(datasets);
+            profiler.record("execute", execute_timer.elapsed(), entries[0]["size"].get<size_t>());
+        }
+#ifdef ENABLE_SANDBOX
+        sandbox.profile();
+#endif
+
+        for (auto &entry: maps)
+            munmap(entry.first, entry.second);
+        for (auto fd: fds)
+            close(fd);
+        if (! sendReply(sock, status))
+            break;
+    }
+
+    /* The pool has been shut down */
+    _exit(0);
+}
+
+WorkerPool::WorkerPool() :
+    sequence(0),
+    owner(getpid())
+{
+    const char *env = getenv("HDF5_UDF_POOL_SIZE");
+    max_workers = env ? strtoul(env, NULL, 10) : DEFAULT_POOL_SIZE;
+}
+
+WorkerPool::~WorkerPool()
+{
+    if (owner != getpid())
+        return;
+    while (workers.size())
+        release(&workers.front());
+}
+
+bool WorkerPool::enabled()
+{
+    return max_workers > 0;
+}
+
+/* Drop workers inherited from the parent process, as they belong to it */
+void WorkerPool::reset()
+{
+    for (auto &worker: workers)
+        close(worker.sock);
+    workers.clear();
+    owner = getpid();
+}
+
+/* Shut down a worker process */
+void WorkerPool::release(Worker *worker)
+{
+    if (worker->sock >= 0)
+        close(worker->sock);
+    waitpid(worker->pid, NULL, 0);
+    workers.remove_if([worker](const Worker &entry) { return &entry == worker; });
+}
+
+WorkerPool::Worker *WorkerPool::spawn(
+    Backend *backend,
+    const std::string filterpath,
+    const char *udf_blob,
+    size_t udf_blob_size,
+    uint64_t hash)
+{
+    if (! backend->preload(filterpath, udf_blob, udf_blob_size))
+        return NULL;
+#ifdef ENABLE_SANDBOX
+    if (! Sandbox::preload(filterpath))
+        return NULL;
+#endif
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+    {
+        fprintf(stderr, "Failed to create socket pair: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(sv[0]);
+        for (auto &worker: workers)
+            close(worker.sock);
+        workerMain(backend, sv[1], filterpath, udf_blob, udf_blob_size);
+    }
+    close(sv[1]);
+    if (pid < 0)
+    {
+        fprintf(stderr, "Failed to fork worker process: %s\n", strerror(errno));
+        close(sv[0]);
+        return NULL;
+    }
+
+    /* Wait until the UDF has been loaded */
+    char ready = 0;
+    if (! recvReply(sv[0], &ready) || ! ready)
+    {
+        fprintf(stderr, "Failed to initialize worker process\n");
+        close(sv[0]);
+        waitpid(pid, NULL, 0);
+        return NULL;
+    }
+
+    Worker worker;
+    worker.backend_name = backend->name();
+    worker.blob.assign(udf_blob, udf_blob_size);
+    worker.hash = hash;
+    worker.pid = pid;
+    worker.sock = sv[0];
+    worker.last_used = sequence;
+    worker.busy = true;
+    workers.push_back(worker);
+    return &workers.back();
+}
+
+WorkerPool::Worker *WorkerPool::getWorker(
+    Backend *backend,
+    const std::string filterpath,
+    const char *udf_blob,
+    size_t udf_blob_size)
+{
+    if (owner != getpid())
+        reset();
+
+    uint64_t hash = hash64(udf_blob, udf_blob_size);
+    for (auto it = workers.begin(); it != workers.end(); )
+    {
+        auto &worker = *it++;
+        if (worker.busy ||
+            worker.hash != hash ||
+            worker.backend_name.compare(backend->name()) != 0 ||
+            worker.blob.size() != udf_blob_size ||
+            memcmp(worker.blob.data(), udf_blob, udf_blob_size) != 0)
+            continue;
+
+        /* Workers that died while idle (e.g., killed by the OOM killer) are replaced */
+        if (waitpid(worker.pid, NULL, WNOHANG) == worker.pid)
+        {
+            release(&worker);
+            continue;
+        }
+        worker.busy = true;
+        return &worker;
+    }
+
+    /*
+     * Make room for the new worker by evicting the least recently used one.
+     * When all of them are busy, the caller falls back to a one-off process.
+     */
+    if (workers.size() >= max_workers)
+    {
+        Worker *lru = NULL;
+        for (auto &worker: workers)
+            if (! worker.busy && (! lru || worker.last_used < lru->last_used))
+                lru = &worker;
+        if (! lru)
+            return NULL;
+        release(lru);
+    }
+    return spawn(backend, filterpath, udf_blob, udf_blob_size, hash);
+}
+
+bool WorkerPool::run(
+    Backend *backend,
+    const std::string filterpath,
+    const std::vector<DatasetInfo> &input_datasets,
+    const DatasetInfo &output_dataset,
+    const char *udf_blob,
+    size_t udf_blob_size)
+{
+    /* Jobs that don't fit in a single message go through the regular path */
+    if (input_datasets.size() + 1 > MAX_JOB_FDS)
+    {
+        auto dtype = output_dataset.getCastDatatype();
+        return backend->run(
+            filterpath, input_datasets, output_dataset, dtype, udf_blob, udf_blob_size);
+    }
+
+    ProfileTimer worker_timer;
+    Worker *worker = NULL;
+    bool full = false;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        worker = getWorker(backend, filterpath, udf_blob, udf_blob_size);
+        if (worker)
+            worker->last_used = ++sequence;
+        else
+            full = workers.size() >= max_workers;
+    }
+    profiler.record("worker", worker_timer.elapsed());
+    if (! worker && full)
+    {
+        auto dtype = output_dataset.getCastDatatype();
+        return backend->run(
+            filterpath, input_datasets, output_dataset, dtype, udf_blob, udf_blob_size);
+    }
+    else if (! worker)
+        return false;
+    bool submitted = false;
+    bool ret = runJob(worker, input_datasets, output_dataset, &submitted);
+
+    /*
+     * A worker may also die between the check made by getWorker() and the
+     * submission of the job. Nothing has run yet, so retry with a new one.
+     */
+    if (! submitted && worker->sock < 0)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            release(worker);
+            worker = spawn(backend, filterpath, udf_blob, udf_blob_size, hash64(udf_blob, udf_blob_size));
+            if (worker)
+                worker->last_used = ++sequence;
+        }
+        if (! worker)
+            return false;
+        ret = runJob(worker, input_datasets, output_dataset, &submitted);
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (worker->sock < 0)
+        release(worker);
+    else
+        worker->busy = false;
+    return ret;
+}
+
+bool WorkerPool::runJob(
+    Worker *worker,
+    const std::vector<DatasetInfo> &input_datasets,
+    const DatasetInfo &output_dataset,
+    bool *submitted)
+{
+    /*
+     * The output grid is shared with the worker through a memory file, and
+     * copied to the output buffer once the worker is done.
+     */
+    *submitted = false;
+    size_t room_size = output_dataset.getGridSize() * output_dataset.getStorageSize();
+    auto mm = output_dataset.mapping ? output_dataset.mapping : createOutputMapping(output_dataset);
+    if (! mm)
+        return false;
+
+    DatasetInfo output_dataset_copy = output_dataset;
+    output_dataset_copy.data = mm->mm;
+    output_dataset_copy.mapping = mm;
+
+    std::vector<DatasetInfo> datasets;
+    datasets.push_back(output_dataset_copy);
+    datasets.insert(datasets.end(), input_datasets.begin(), input_datasets.end());
+
+    /* Describe the job */
+    json job;
+    std::vector<int> fds;
+    for (size_t i=0; i<datasets.size(); ++i)
+    {
+        auto &info = datasets[i];
+        size_t size = info.getGridSize() * info.getStorageSize();
+        if (! info.mapping)
+        {
+            /* Grids that don't live in shared memory have to be copied */
+            info.mapping = std::make_shared<AnonymousMemoryMap>(size);
+            if (! info.mapping->create())
+                return false;
+            memcpy(info.mapping->mm, info.data, size);
+        }
+
+        json entry;
+        entry["name"] = info.name;
+        entry["datatype"] = info.datatype;
+        entry["dims"] = info.dimensions;
+        entry["offset"] = info.offset;
+        entry["size"] = size;
+        entry["file_offset"] = info.mapping->offset;
+        entry["shift"] = info.mapping->shift;
+        entry["shared"] = info.mapping->shared;
+        entry["slot"] = info.slot;
+        job["datasets"].push_back(entry);
+        fds.push_back(info.mapping->fd);
+    }
+
+    std::string msg = job.dump();
+    if (msg.size() > MAX_JOB_SIZE)
+    {
+        fprintf(stderr, "Job description exceeds %d bytes\n", MAX_JOB_SIZE);
+        return false;
+    }
+
+    /* Submit the job and wait for its completion */
+    char status = 0;
+    if (! sendMessage(worker->sock, msg, fds))
+    {
+        /* The worker was gone before it got the job */
+        close(worker->sock);
+        worker->sock = -1;
+        return false;
+    }
+    *submitted = true;
+    if (! recvReply(worker->sock, &status))
+    {
+        /* The worker is gone (e.g., killed by seccomp) */
+        fprintf(stderr, "Worker process %d terminated unexpectedly\n", worker->pid);
+        close(worker->sock);
+        worker->sock = -1;
+        return false;
+    }
+    if (! status)
+        return false;
+
+    /* Update output HDF5 dataset with data from shared memory segment */
+    ProfileTimer output_timer;
+    bool ret = mm->transfer(output_dataset.data, room_size);
+    profiler.record("output", output_timer.elapsed(), room_size);
+    return ret;
+}
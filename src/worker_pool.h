@@ -0,0 +1,85 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: worker_pool.h
+ *
+ * Pool of long-lived processes that keep user-defined-functions loaded
+ * (and sandboxed) between consecutive reads of a dataset.
+ */
+#ifndef __worker_pool_h
+#define __worker_pool_h
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <vector>
+#include <list>
+#include <string>
+#include <mutex>
+#include "dataset.h"
+#include "backend.h"
+
+class WorkerPool {
+public:
+    WorkerPool();
+    ~WorkerPool();
+
+    // Whether the pool has been enabled through $HDF5_UDF_POOL_SIZE
+    bool enabled();
+
+    // Execute a user-defined-function in a worker process, spawning
+    // one if none has been loaded with the given blob yet. Safe to call
+    // from several threads: each job is handed to an idle worker.
+    bool run(
+        Backend *backend,
+        const std::string filterpath,
+        const std::vector<DatasetInfo> &input_datasets,
+        const DatasetInfo &output_dataset,
+        const char *udf_blob,
+        size_t udf_blob_size);
+
+private:
+    struct Worker {
+        std::string backend_name;   /* Backend that loaded the UDF */
+        std::string blob;           /* Copy of the UDF blob, to rule out hash collisions */
+        uint64_t hash;              /* Hash of the UDF blob */
+        pid_t pid;                  /* Worker process */
+        int sock;                   /* Our end of the socket pair */
+        uint64_t last_used;         /* Sequence number of the last job submitted */
+        bool busy;                  /* Whether a job has been handed to the worker */
+    };
+
+    Worker *getWorker(
+        Backend *backend,
+        const std::string filterpath,
+        const char *udf_blob,
+        size_t udf_blob_size);
+
+    Worker *spawn(
+        Backend *backend,
+        const std::string filterpath,
+        const char *udf_blob,
+        size_t udf_blob_size,
+        uint64_t hash);
+
+    // Hand a job to a worker and wait for its completion. Workers that are
+    // gone by then get their socket closed; submitted tells whether the
+    // worker was still alive when the job was handed over.
+    bool runJob(
+        Worker *worker,
+        const std::vector<DatasetInfo> &input_datasets,
+        const DatasetInfo &output_dataset,
+        bool *submitted);
+
+    void release(Worker *worker);
+
+    void reset();
+
+    // Workers are kept in a list so that they stay put while others come and go
+    std::list<Worker> workers;
+    std::mutex lock;
+    size_t max_workers;
+    uint64_t sequence;
+    pid_t owner;
+};
+
+#endif /* __worker_pool_h */